@@ -10,6 +10,10 @@
 #endif
 
 const DWORD BURN_CACHE_MAX_RECOMMENDED_VERIFY_TRYAGAIN_ATTEMPTS = 2;
+const DWORD BURN_CACHE_DEFAULT_ACQUISITION_THREADS = 4;
+const DWORD BURN_CACHE_MAX_ACQUISITION_THREADS = 16;
+const DWORD BURN_CACHE_DEFAULT_EXTRACTION_THREADS = 2;
+const DWORD BURN_CACHE_MAX_EXTRACTION_THREADS = 8;
 
 enum BURN_CACHE_PROGRESS_TYPE
 {
@@ -24,6 +28,40 @@ enum BURN_CACHE_PROGRESS_TYPE
 
 // structs
 
+typedef struct _BURN_CACHE_OVERALL_PROGRESS
+{
+    // payloads can be acquired on several threads at once, see ApplyCachePackagePayloads().
+    CRITICAL_SECTION cs;
+    DWORD64 qwTotalCacheSize;
+    DWORD64 qwSuccessfulCacheProgress;
+    DWORD dwReportedPercentage; // highest overall percentage sent to the BA, it never goes back down.
+} BURN_CACHE_OVERALL_PROGRESS;
+
+typedef struct _BURN_CACHE_EXTRACTION_ITEM
+{
+    BURN_CONTAINER* pContainer;
+    BOOL fStarted;
+    HANDLE hExtractedEvent; // set when a worker is done with the container.
+
+    // payloads to extract, indexed like BURN_PAYLOADS::rgPayloads. Selected before the workers start
+    // because the cache thread keeps updating cRemainingInstances while they extract.
+    BOOL* rgfExtractPayloads;
+} BURN_CACHE_EXTRACTION_ITEM;
+
+typedef struct _BURN_CACHE_EXTRACTION_POOL
+{
+    // containers are extracted ahead of the packages that need them, in plan order. The first payload that
+    // needs a container waits for its worker, or claims it and extracts it as usual when no worker got to it yet.
+    CRITICAL_SECTION cs;
+    BURN_CACHE_EXTRACTION_ITEM* rgItems;
+    DWORD cItems;
+    BOOL fAbort; // set when cache is done or an extraction failed so no more are started.
+
+    struct _BURN_CACHE_EXTRACTION_WORKER* rgWorkers;
+    HANDLE* rghThreads;
+    DWORD cThreads;
+} BURN_CACHE_EXTRACTION_POOL;
+
 typedef struct _BURN_CACHE_CONTEXT
 {
     BURN_CACHE* pCache;
@@ -32,8 +70,11 @@ typedef struct _BURN_CACHE_CONTEXT
     BURN_PAYLOADS* pPayloads;
     HANDLE hPipe;
     HANDLE hSourceEngineFile;
-    DWORD64 qwTotalCacheSize;
-    DWORD64 qwSuccessfulCacheProgress;
+    const BYTE* pbSourceEngineView;
+    DWORD64 cbSourceEngineView;
+    BURN_CACHE_OVERALL_PROGRESS* pOverallProgress;
+    BURN_CACHE_EXTRACTION_POOL* pExtractionPool;
+    DWORD cAcquisitionThreads;
     LPCWSTR wzLayoutDirectory;
     LPWSTR* rgSearchPaths;
     DWORD cSearchPaths;
@@ -54,6 +95,51 @@ typedef struct _BURN_CACHE_PROGRESS_CONTEXT
     HRESULT hrError;
 } BURN_CACHE_PROGRESS_CONTEXT;
 
+typedef struct _BURN_CACHE_ACQUISITION_ITEM
+{
+    BOOL fAcquired;
+    HRESULT hrAcquire;
+    LPWSTR sczLocalAcquisitionSourcePath; // kept until the payload is completed.
+    DWORD iNextInUnit;
+} BURN_CACHE_ACQUISITION_ITEM;
+
+typedef struct _BURN_CACHE_ACQUISITION_UNIT
+{
+    // payloads from the same container are acquired in order by one worker, so the container is only extracted once.
+    BURN_CONTAINER* pContainer;
+    DWORD iFirstItem;
+    DWORD iLastItem;
+    BOOL fStarted;
+} BURN_CACHE_ACQUISITION_UNIT;
+
+typedef struct _BURN_CACHE_ACQUISITION_SCHEDULER
+{
+    BURN_PACKAGE* pPackage;
+    BURN_CACHE_ACQUISITION_ITEM* rgItems; // one per payload group item of the package.
+    DWORD cScheduledItems;
+
+    CRITICAL_SECTION csUnits;
+    BURN_CACHE_ACQUISITION_UNIT* rgUnits;
+    DWORD cUnits;
+    BOOL fAbort; // set when an acquisition failed so no more are started.
+
+    HANDLE hCompleteSemaphore;
+    DWORD* rgdwCompletedItems;
+    DWORD cCompletedItems;
+} BURN_CACHE_ACQUISITION_SCHEDULER;
+
+typedef struct _BURN_CACHE_ACQUISITION_WORKER
+{
+    BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler;
+    BURN_CACHE_CONTEXT context; // copy of the package's context with its own search paths.
+} BURN_CACHE_ACQUISITION_WORKER;
+
+typedef struct _BURN_CACHE_EXTRACTION_WORKER
+{
+    BURN_CACHE_EXTRACTION_POOL* pPool;
+    BURN_CACHE_CONTEXT context; // copy of the cache context with its own search paths.
+} BURN_CACHE_EXTRACTION_WORKER;
+
 typedef struct _BURN_EXECUTE_CONTEXT
 {
     BURN_CACHE* pCache;
@@ -104,7 +190,8 @@ static void FinalizePayloadAcquisition(
     );
 static HRESULT ApplyExtractContainer(
     __in BURN_CACHE_CONTEXT* pContext,
-    __in BURN_CONTAINER* pContainer
+    __in BURN_CONTAINER* pContainer,
+    __in_opt const BOOL* rgfExtractPayloads
     );
 static HRESULT ApplyLayoutBundle(
     __in BURN_CACHE_CONTEXT* pContext,
@@ -117,12 +204,107 @@ static HRESULT ApplyLayoutContainer(
     __in BURN_CACHE_CONTEXT* pContext,
     __in BURN_CONTAINER* pContainer
     );
+static HRESULT ApplyCachePackagePayloads(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_PACKAGE* pPackage,
+    __in BOOL fVital
+    );
 static HRESULT ApplyProcessPayload(
     __in BURN_CACHE_CONTEXT* pContext,
     __in_opt BURN_PACKAGE* pPackage,
     __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
     __in BOOL fVital
     );
+static void ScheduleAcquisition(
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __in DWORD iItem
+    );
+static void AcquireScheduledPayloads(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler
+    );
+static HRESULT InitializeAcquisitionWorker(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __in BURN_CACHE_ACQUISITION_WORKER* pWorker
+    );
+static void UninitializeAcquisitionWorker(
+    __in BURN_CACHE_ACQUISITION_WORKER* pWorker
+    );
+static HRESULT InitializeWorkerContext(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_CONTEXT* pWorkerContext
+    );
+static void UninitializeWorkerContext(
+    __in BURN_CACHE_CONTEXT* pWorkerContext
+    );
+static DWORD WINAPI AcquisitionThreadProc(
+    __in LPVOID lpThreadParameter
+    );
+static BURN_CACHE_ACQUISITION_UNIT* ClaimAcquisitionUnit(
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler
+    );
+static void AcquireScheduledPayload(
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in DWORD iItem
+    );
+static void QueueAcquiredPayloadHashes(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __inout DWORD* piNextCompletedItem
+    );
+static void StartContainerExtraction(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_PLAN* pPlan,
+    __in DWORD cThreads,
+    __in BURN_CACHE_EXTRACTION_POOL* pPool
+    );
+static void StopContainerExtraction(
+    __in BURN_CACHE_EXTRACTION_POOL* pPool
+    );
+static BOOL IsPayloadAcquisitionNeeded(
+    __in BURN_CACHE* pCache,
+    __in BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD* pPayload
+    );
+static DWORD WINAPI ExtractionThreadProc(
+    __in LPVOID lpThreadParameter
+    );
+static BURN_CACHE_EXTRACTION_ITEM* ClaimContainerExtraction(
+    __in BURN_CACHE_EXTRACTION_POOL* pPool
+    );
+static void WaitForContainerExtraction(
+    __in BURN_CACHE_EXTRACTION_POOL* pPool,
+    __in BURN_CONTAINER* pContainer
+    );
+static HRESULT ApplyPreparePayloadAcquisition(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
+    __in BOOL fVital,
+    __out BOOL* pfAcquire
+    );
+static HRESULT ApplyAcquirePayload(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
+    __in BOOL fVital,
+    __out BOOL* pfAcquired
+    );
+static HRESULT ApplyCompletePayload(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem
+    );
+static void QueuePayloadHash(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD* pPayload
+    );
+static void ReleasePayloadHashes(
+    __in BURN_CACHE_CONTEXT* pContext
+    );
 static HRESULT ApplyCacheVerifyContainerOrPayload(
     __in BURN_CACHE_CONTEXT* pContext,
     __in_opt BURN_CONTAINER* pContainer,
@@ -131,7 +313,13 @@ static HRESULT ApplyCacheVerifyContainerOrPayload(
     );
 static HRESULT ExtractContainer(
     __in BURN_CACHE_CONTEXT* pContext,
-    __in BURN_CONTAINER* pContainer
+    __in BURN_CONTAINER* pContainer,
+    __in_opt const BOOL* rgfExtractPayloads
+    );
+static HRESULT SelectPayloadsToExtract(
+    __in BURN_PAYLOADS* pPayloads,
+    __in BURN_CONTAINER* pContainer,
+    __out BOOL** prgfExtractPayloads
     );
 static HRESULT LayoutBundle(
     __in BURN_CACHE_CONTEXT* pContext,
@@ -169,16 +357,37 @@ static HRESULT CopyPayload(
     __in BURN_CACHE_PROGRESS_CONTEXT* pProgress,
     __in HANDLE hSourceFile,
     __in_z LPCWSTR wzSourcePath,
-    __in_z LPCWSTR wzDestinationPath
+    __in_z LPCWSTR wzDestinationPath,
+    __in_opt BURN_ACQUIRED_DIGEST* pDigest
+    );
+static HRESULT CALLBACK HashCopiedData(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+static HRESULT RecordAcquiredDigest(
+    __in HANDLE hFile,
+    __in CRYP_HASH_HANDLE hHash,
+    __in BURN_ACQUIRED_DIGEST* pDigest
+    );
+static HRESULT ExtractPayload(
+    __in BURN_CONTAINER_CONTEXT* pContext,
+    __in BURN_PAYLOAD* pPayload
     );
 static HRESULT DownloadPayload(
     __in BURN_CACHE_PROGRESS_CONTEXT* pProgress,
-    __in_z LPCWSTR wzDestinationPath
+    __in_z LPCWSTR wzDestinationPath,
+    __in_opt BURN_ACQUIRED_DIGEST* pDigest
     );
 static HRESULT CALLBACK CacheMessageHandler(
     __in BURN_CACHE_MESSAGE* pMessage,
     __in LPVOID pvContext
     );
+static void CommitCacheProgress(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in DWORD64 qwCommitted,
+    __in DWORD64 qwUncommitted
+    );
 static HRESULT CompleteCacheProgress(
     __in BURN_CACHE_PROGRESS_CONTEXT* pContext,
     __in DWORD64 qwFileSize
@@ -566,7 +775,7 @@ LExit:
 }
 
 extern "C" HRESULT ApplyCache(
-    __in HANDLE hSourceEngineFile,
+    __in BURN_SECTION* pSection,
     __in BURN_USER_EXPERIENCE* pUX,
     __in BURN_VARIABLES* pVariables,
     __in BURN_PLAN* pPlan,
@@ -577,7 +786,14 @@ extern "C" HRESULT ApplyCache(
     HRESULT hr = S_OK;
     DWORD dwCheckpoint = 0;
     BURN_CACHE_CONTEXT cacheContext = { };
+    BURN_CACHE_OVERALL_PROGRESS overallProgress = { };
     BURN_PACKAGE* pPackage = NULL;
+    DWORD dwAcquisitionThreads = BURN_CACHE_DEFAULT_ACQUISITION_THREADS;
+    DWORD dwExtractionThreads = BURN_CACHE_DEFAULT_EXTRACTION_THREADS;
+    BURN_CACHE_EXTRACTION_POOL extractionPool = { };
+
+    ::InitializeCriticalSection(&overallProgress.cs);
+    ::InitializeCriticalSection(&extractionPool.cs);
 
     hr = BACallbackOnCacheBegin(pUX);
     ExitOnRootFailure(hr, "BA aborted cache.");
@@ -585,17 +801,33 @@ extern "C" HRESULT ApplyCache(
     hr = CacheEnsureAcquisitionFolder(pPlan->pCache);
     ExitOnFailure(hr, "Failed to ensure acquisition folder.");
 
-    cacheContext.hSourceEngineFile = hSourceEngineFile;
+    cacheContext.hSourceEngineFile = pSection->hSourceEngineFile;
+    cacheContext.pbSourceEngineView = pSection->pbSourceEngineView;
+    cacheContext.cbSourceEngineView = pSection->cbSourceEngineView;
     cacheContext.pCache = pPlan->pCache;
     cacheContext.pPayloads = pPlan->pPayloads;
     cacheContext.pUX = pUX;
     cacheContext.pVariables = pVariables;
-    cacheContext.qwTotalCacheSize = pPlan->qwCacheSizeTotal;
+    cacheContext.pOverallProgress = &overallProgress;
     cacheContext.wzLayoutDirectory = pPlan->sczLayoutDirectory;
 
+    overallProgress.qwTotalCacheSize = pPlan->qwCacheSizeTotal;
+
+    // Policy can limit how many payloads of a package are acquired at once, one or zero acquires them in order on this thread.
+    PolcReadNumber(POLICY_BURN_REGISTRY_PATH, L"CacheAcquisitionThreads", BURN_CACHE_DEFAULT_ACQUISITION_THREADS, &dwAcquisitionThreads);
+    cacheContext.cAcquisitionThreads = min(dwAcquisitionThreads, BURN_CACHE_MAX_ACQUISITION_THREADS);
+
     hr = MemAllocArray(reinterpret_cast<LPVOID*>(&cacheContext.rgSearchPaths), sizeof(LPWSTR), BURN_CACHE_MAX_SEARCH_PATHS);
     ExitOnNull(cacheContext.rgSearchPaths, hr, E_OUTOFMEMORY, "Failed to allocate cache search paths array.");
 
+    // Policy can limit how many containers are extracted ahead of the packages that need them, zero extracts each one when it is needed.
+    // Layout copies containers instead of extracting them.
+    PolcReadNumber(POLICY_BURN_REGISTRY_PATH, L"CacheExtractionThreads", BURN_CACHE_DEFAULT_EXTRACTION_THREADS, &dwExtractionThreads);
+    if (!cacheContext.wzLayoutDirectory && dwExtractionThreads)
+    {
+        StartContainerExtraction(&cacheContext, pPlan, min(dwExtractionThreads, BURN_CACHE_MAX_EXTRACTION_THREADS), &extractionPool);
+    }
+
     for (DWORD i = 0; i < pPlan->cCacheActions; ++i)
     {
         BURN_CACHE_ACTION* pCacheAction = pPlan->rgCacheActions + i;
@@ -664,6 +896,10 @@ extern "C" HRESULT ApplyCache(
     }
 
 LExit:
+    // The workers must be done with the working folder before it is cleaned up.
+    StopContainerExtraction(&extractionPool);
+    cacheContext.pExtractionPool = NULL;
+
     pContext->dwCacheCheckpoint = dwCheckpoint;
 
     // Clean up any remanents in the cache.
@@ -681,6 +917,9 @@ LExit:
     ReleaseMem(cacheContext.rgSearchPaths);
     ReleaseStr(cacheContext.sczLocalAcquisitionSourcePath);
 
+    ::DeleteCriticalSection(&extractionPool.cs);
+    ::DeleteCriticalSection(&overallProgress.cs);
+
     BACallbackOnCacheComplete(pUX, hr);
     return hr;
 }
@@ -990,16 +1229,7 @@ static HRESULT ApplyCachePackage(
         }
         else
         {
-            for (DWORD i = 0; i < pPackage->payloads.cItems; ++i)
-            {
-                BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem = pPackage->payloads.rgItems + i;
-
-                hr = ApplyProcessPayload(pContext, pPackage, pPayloadGroupItem, fVital);
-                if (FAILED(hr))
-                {
-                    break;
-                }
-            }
+            hr = ApplyCachePackagePayloads(pContext, pPackage, fVital);
         }
 
         pPackage->hrCacheResult = hr;
@@ -1024,7 +1254,7 @@ static HRESULT ApplyCachePackage(
 
                 if (pItem->qwCommittedCacheProgress)
                 {
-                    pContext->qwSuccessfulCacheProgress -= pItem->qwCommittedCacheProgress;
+                    CommitCacheProgress(pContext, 0, pItem->qwCommittedCacheProgress);
                     pItem->qwCommittedCacheProgress = 0;
                 }
             }
@@ -1057,6 +1287,7 @@ static void FinalizeContainerAcquisition(
     )
 {
     ReleaseNullStr(pContainer->sczFailedLocalAcquisitionPath);
+    memset(&pContainer->acquiredDigest, 0, sizeof(pContainer->acquiredDigest));
 
     if (fSuccess)
     {
@@ -1077,6 +1308,7 @@ static void FinalizePayloadAcquisition(
     )
 {
     ReleaseNullStr(pPayload->sczFailedLocalAcquisitionPath);
+    memset(&pPayload->acquiredDigest, 0, sizeof(pPayload->acquiredDigest));
 
     if (fSuccess)
     {
@@ -1092,20 +1324,21 @@ static void FinalizePayloadAcquisition(
 
 static HRESULT ApplyExtractContainer(
     __in BURN_CACHE_CONTEXT* pContext,
-    __in BURN_CONTAINER* pContainer
+    __in BURN_CONTAINER* pContainer,
+    __in_opt const BOOL* rgfExtractPayloads
     )
 {
     HRESULT hr = S_OK;
 
     if (pContainer->qwCommittedCacheProgress)
     {
-        pContext->qwSuccessfulCacheProgress -= pContainer->qwCommittedCacheProgress;
+        CommitCacheProgress(pContext, 0, pContainer->qwCommittedCacheProgress);
         pContainer->qwCommittedCacheProgress = 0;
     }
 
     if (pContainer->qwCommittedExtractProgress)
     {
-        pContext->qwSuccessfulCacheProgress -= pContainer->qwCommittedExtractProgress;
+        CommitCacheProgress(pContext, 0, pContainer->qwCommittedExtractProgress);
         pContainer->qwCommittedExtractProgress = 0;
     }
 
@@ -1115,7 +1348,7 @@ static HRESULT ApplyExtractContainer(
         LogExitOnFailure(hr, MSG_FAILED_ACQUIRE_CONTAINER, "Failed to acquire container: %ls to working path: %ls", pContainer->sczId, pContainer->sczUnverifiedPath);
     }
 
-    hr = ExtractContainer(pContext, pContainer);
+    hr = ExtractContainer(pContext, pContainer, rgfExtractPayloads);
     LogExitOnFailure(hr, MSG_FAILED_EXTRACT_CONTAINER, "Failed to extract payloads from container: %ls to working path: %ls", pContainer->sczId, pContainer->sczUnverifiedPath);
 
     if (pContext->sczLocalAcquisitionSourcePath)
@@ -1128,12 +1361,11 @@ static HRESULT ApplyExtractContainer(
     if (pContainer->qwExtractSizeTotal < pContainer->qwCommittedExtractProgress)
     {
         AssertSz(FALSE, "Container extracted more than planned.");
-        pContext->qwSuccessfulCacheProgress -= pContainer->qwCommittedExtractProgress;
-        pContext->qwSuccessfulCacheProgress += pContainer->qwExtractSizeTotal;
+        CommitCacheProgress(pContext, pContainer->qwExtractSizeTotal, pContainer->qwCommittedExtractProgress);
     }
     else
     {
-        pContext->qwSuccessfulCacheProgress += pContainer->qwExtractSizeTotal - pContainer->qwCommittedExtractProgress;
+        CommitCacheProgress(pContext, pContainer->qwExtractSizeTotal - pContainer->qwCommittedExtractProgress, 0);
     }
 
     pContainer->qwCommittedExtractProgress = pContainer->qwExtractSizeTotal;
@@ -1208,7 +1440,7 @@ static HRESULT ApplyLayoutContainer(
             }
 
             ++cTryAgainAttempts;
-            pContext->qwSuccessfulCacheProgress -= pContainer->qwCommittedCacheProgress;
+            CommitCacheProgress(pContext, 0, pContainer->qwCommittedCacheProgress);
             pContainer->qwCommittedCacheProgress = 0;
             FinalizeContainerAcquisition(pContext, pContainer, FALSE);
             LogErrorId(hr, MSG_CACHE_RETRYING_CONTAINER, pContainer->sczId, NULL, NULL);
@@ -1221,194 +1453,1083 @@ LExit:
     return hr;
 }
 
-static HRESULT ApplyProcessPayload(
+static HRESULT ApplyCachePackagePayloads(
     __in BURN_CACHE_CONTEXT* pContext,
-    __in_opt BURN_PACKAGE* pPackage,
-    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
+    __in BURN_PACKAGE* pPackage,
     __in BOOL fVital
     )
 {
     HRESULT hr = S_OK;
-    DWORD cTryAgainAttempts = 0;
-    BOOL fRetry = FALSE;
-    BOOTSTRAPPER_CACHEPACKAGENONVITALVALIDATIONFAILURE_ACTION action = BOOTSTRAPPER_CACHEPACKAGENONVITALVALIDATIONFAILURE_ACTION_NONE;
-    BURN_PAYLOAD* pPayload = pPayloadGroupItem->pPayload;
+    DWORD cItems = pPackage->payloads.cItems;
+    BURN_CACHE_ACQUISITION_SCHEDULER scheduler = { };
+    DWORD iFailedItem = cItems;
+    BOOL fAcquire = FALSE;
+    BOOL fAbandoned = FALSE;
 
-    Assert(pContext->pPayloads && pPackage || pContext->wzLayoutDirectory);
+    ::InitializeCriticalSection(&scheduler.csUnits);
+    scheduler.pPackage = pPackage;
 
-    if (pPayload->pContainer && pContext->wzLayoutDirectory)
+    if (!cItems)
     {
         ExitFunction();
     }
 
-    hr = ApplyCacheVerifyContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem);
-    if (SUCCEEDED(hr))
+    scheduler.rgItems = static_cast<BURN_CACHE_ACQUISITION_ITEM*>(MemAlloc(sizeof(BURN_CACHE_ACQUISITION_ITEM) * cItems, TRUE));
+    ExitOnNull(scheduler.rgItems, hr, E_OUTOFMEMORY, "Failed to allocate payload acquisitions.");
+
+    scheduler.rgUnits = static_cast<BURN_CACHE_ACQUISITION_UNIT*>(MemAlloc(sizeof(BURN_CACHE_ACQUISITION_UNIT) * cItems, TRUE));
+    ExitOnNull(scheduler.rgUnits, hr, E_OUTOFMEMORY, "Failed to allocate payload acquisition units.");
+
+    scheduler.rgdwCompletedItems = static_cast<DWORD*>(MemAlloc(sizeof(DWORD) * cItems, TRUE));
+    ExitOnNull(scheduler.rgdwCompletedItems, hr, E_OUTOFMEMORY, "Failed to allocate completed payload acquisitions.");
+
+    // Verify the payloads and let the BA decide about the non-vital ones in order, the payloads before a failure are still acquired.
+    for (DWORD i = 0; i < cItems; ++i)
     {
-        ExitFunction();
+        hr = ApplyPreparePayloadAcquisition(pContext, pPackage, pPackage->payloads.rgItems + i, fVital, &fAcquire);
+        if (FAILED(hr))
+        {
+            iFailedItem = i;
+            break;
+        }
+
+        if (fAcquire)
+        {
+            ScheduleAcquisition(&scheduler, i);
+        }
     }
-    else if (pPackage && !pPackage->fAcquireOptionalSource && !fVital)
+
+    // Acquire the rest, possibly several at once, and start hashing each one as soon as it is acquired.
+    if (scheduler.cUnits)
     {
-        HRESULT hrResponse = BACallbackOnCachePackageNonVitalValidationFailure(pContext->pUX, pPackage->sczId, hr, &action);
-        ExitOnRootFailure(hrResponse, "BA aborted cache package non-vital failure.");
+        AcquireScheduledPayloads(pContext, &scheduler);
+    }
 
-        if (BOOTSTRAPPER_CACHEPACKAGENONVITALVALIDATIONFAILURE_ACTION_ACQUIRE != action)
+    for (DWORD i = 0; i < iFailedItem; ++i)
+    {
+        if (FAILED(scheduler.rgItems[i].hrAcquire))
         {
-            ExitFunction();
+            hr = scheduler.rgItems[i].hrAcquire;
+            iFailedItem = i;
+            break;
         }
-
-        pPackage->fAcquireOptionalSource = TRUE;
     }
 
-    for (;;)
+    // Then verify and cache them in order, which joins their hashes. The BA callbacks and elevated process
+    // messages all stay on this thread. Payloads acquired before a failure are still completed, every one of
+    // them comes before the payload that failed so its error is only replaced by an earlier one.
+    for (DWORD i = 0; i < iFailedItem; ++i)
     {
-        fRetry = FALSE;
+        BURN_CACHE_ACQUISITION_ITEM* pItem = scheduler.rgItems + i;
 
-        hr = ApplyAcquireContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem);
-        LogExitOnFailure(hr, MSG_FAILED_ACQUIRE_PAYLOAD, "Failed to acquire payload: %ls to working path: %ls", pPayload->sczKey, pPayload->sczUnverifiedPath);
+        if (!pItem->fAcquired)
+        {
+            continue;
+        }
 
-        hr = LayoutOrCacheContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem, cTryAgainAttempts, &fRetry);
-        if (SUCCEEDED(hr))
+        pItem->fAcquired = FALSE;
+
+        ReleaseNullStr(pContext->sczLocalAcquisitionSourcePath);
+        pContext->sczLocalAcquisitionSourcePath = pItem->sczLocalAcquisitionSourcePath;
+        pItem->sczLocalAcquisitionSourcePath = NULL;
+
+        HRESULT hrComplete = ApplyCompletePayload(pContext, pPackage, pPackage->payloads.rgItems + i);
+        if (FAILED(hrComplete))
         {
+            hr = hrComplete;
             break;
         }
-        else
+    }
+
+LExit:
+    for (DWORD i = 0; scheduler.rgItems && i < cItems; ++i)
+    {
+        if (scheduler.rgItems[i].fAcquired)
         {
-            LogErrorId(hr, pContext->wzLayoutDirectory ? MSG_FAILED_LAYOUT_PAYLOAD : MSG_FAILED_CACHE_PAYLOAD, pPayload->sczKey, pContext->wzLayoutDirectory, pPayload->sczUnverifiedPath);
+            memset(&pPackage->payloads.rgItems[i].pPayload->acquiredDigest, 0, sizeof(BURN_ACQUIRED_DIGEST));
+            fAbandoned = TRUE;
+        }
 
-            if (!fRetry)
-            {
-                ExitFunction();
-            }
+        ReleaseStr(scheduler.rgItems[i].sczLocalAcquisitionSourcePath);
+    }
 
-            ++cTryAgainAttempts;
-            pContext->qwSuccessfulCacheProgress -= pPayloadGroupItem->qwCommittedCacheProgress;
-            pPayloadGroupItem->qwCommittedCacheProgress = 0;
-            FinalizePayloadAcquisition(pContext, pPayload, FALSE);
-            LogErrorId(hr, MSG_CACHE_RETRYING_PAYLOAD, pPayload->sczKey, NULL, NULL);
-        }
+    // Let go of the files still held for payloads that will not be completed, a retry may need to acquire them again.
+    if (fAbandoned)
+    {
+        ReleasePayloadHashes(pContext);
     }
 
-LExit:
-    FinalizePayloadAcquisition(pContext, pPayload, SUCCEEDED(hr));
+    ReleaseHandle(scheduler.hCompleteSemaphore);
+    ReleaseMem(scheduler.rgdwCompletedItems);
+    ReleaseMem(scheduler.rgUnits);
+    ReleaseMem(scheduler.rgItems);
+    ::DeleteCriticalSection(&scheduler.csUnits);
 
     return hr;
 }
 
-static HRESULT ApplyCacheVerifyContainerOrPayload(
-    __in BURN_CACHE_CONTEXT* pContext,
-    __in_opt BURN_CONTAINER* pContainer,
-    __in_opt BURN_PACKAGE* pPackage,
-    __in_opt BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem
+static void ScheduleAcquisition(
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __in DWORD iItem
     )
 {
-    AssertSz(pContainer || pPayloadGroupItem, "Must provide a container or a payload.");
-
-    HRESULT hr = S_OK;
-    BURN_CACHE_PROGRESS_CONTEXT progress = { };
-
-    progress.pCacheContext = pContext;
-    progress.pContainer = pContainer;
-    progress.pPackage = pPackage;
-    progress.pPayloadGroupItem = pPayloadGroupItem;
+    BURN_CONTAINER* pContainer = pScheduler->pPackage->payloads.rgItems[iItem].pPayload->pContainer;
+    BURN_CACHE_ACQUISITION_UNIT* pUnit = NULL;
 
-    if (pContainer)
+    for (DWORD i = 0; pContainer && i < pScheduler->cUnits; ++i)
     {
-        hr = CacheVerifyContainer(pContainer, pContext->wzLayoutDirectory, CacheMessageHandler, CacheProgressRoutine, &progress);
+        if (pScheduler->rgUnits[i].pContainer == pContainer)
+        {
+            pUnit = pScheduler->rgUnits + i;
+            break;
+        }
     }
-    else if (!pContext->wzLayoutDirectory && INVALID_HANDLE_VALUE != pContext->hPipe)
+
+    if (pUnit)
     {
-        hr = ElevationCacheVerifyPayload(pContext->hPipe, pPackage, pPayloadGroupItem->pPayload, CacheMessageHandler, CacheProgressRoutine, &progress);
+        pScheduler->rgItems[pUnit->iLastItem].iNextInUnit = iItem;
+        pUnit->iLastItem = iItem;
     }
     else
     {
-        hr = CacheVerifyPayload(pPayloadGroupItem->pPayload, pContext->wzLayoutDirectory ? pContext->wzLayoutDirectory : pPackage->sczCacheFolder, CacheMessageHandler, CacheProgressRoutine, &progress);
+        pUnit = pScheduler->rgUnits + pScheduler->cUnits;
+        pUnit->pContainer = pContainer;
+        pUnit->iFirstItem = iItem;
+        pUnit->iLastItem = iItem;
+        ++pScheduler->cUnits;
     }
 
-    return hr;
+    ++pScheduler->cScheduledItems;
 }
 
-static HRESULT ExtractContainer(
+static void AcquireScheduledPayloads(
     __in BURN_CACHE_CONTEXT* pContext,
-    __in BURN_CONTAINER* pContainer
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler
     )
 {
     HRESULT hr = S_OK;
-    BURN_CONTAINER_CONTEXT context = { };
-    HANDLE hContainerHandle = INVALID_HANDLE_VALUE;
-    LPWSTR sczStreamName = NULL;
-    BURN_PAYLOAD* pExtract = NULL;
-    BURN_CACHE_PROGRESS_CONTEXT progress = { };
-
-    progress.pCacheContext = pContext;
-    progress.pContainer = pContainer;
-    progress.type = BURN_CACHE_PROGRESS_TYPE_EXTRACT;
-
-    // If the container is actually attached, then it was planned to be acquired through hSourceEngineFile.
-    if (pContainer->fActuallyAttached)
-    {
-        hContainerHandle = pContext->hSourceEngineFile;
-    }
-
-    hr = ContainerOpen(&context, pContainer, hContainerHandle, pContainer->sczUnverifiedPath);
-    ExitOnFailure(hr, "Failed to open container: %ls.", pContainer->sczId);
+    DWORD cThreads = min(pContext->cAcquisitionThreads, pScheduler->cUnits);
+    BURN_CACHE_ACQUISITION_WORKER* rgWorkers = NULL;
+    HANDLE* rghThreads = NULL;
+    DWORD cStartedThreads = 0;
+    DWORD iNextCompletedItem = 0;
+    BURN_CACHE_ACQUISITION_UNIT* pUnit = NULL;
 
-    while (S_OK == (hr = ContainerNextStream(&context, &sczStreamName)))
+    if (1 < cThreads)
     {
-        BOOL fExtracted = FALSE;
+        pScheduler->hCompleteSemaphore = ::CreateSemaphoreW(NULL, 0, LONG_MAX, NULL);
+        rgWorkers = static_cast<BURN_CACHE_ACQUISITION_WORKER*>(MemAlloc(sizeof(BURN_CACHE_ACQUISITION_WORKER) * cThreads, TRUE));
+        rghThreads = static_cast<HANDLE*>(MemAlloc(sizeof(HANDLE) * cThreads, TRUE));
 
-        hr = PayloadFindEmbeddedBySourcePath(pContainer->sdhPayloads, sczStreamName, &pExtract);
-        if (E_NOTFOUND != hr)
+        // Units no worker picks up are acquired on this thread, so running short of threads is not fatal.
+        while (pScheduler->hCompleteSemaphore && rgWorkers && rghThreads && cStartedThreads < cThreads)
         {
-            ExitOnFailure(hr, "Failed to find embedded payload by source path: %ls container: %ls", sczStreamName, pContainer->sczId);
-
-            // Skip payloads that weren't planned or have already been cached.
-            if (pExtract->sczUnverifiedPath && pExtract->cRemainingInstances)
+            hr = InitializeAcquisitionWorker(pContext, pScheduler, rgWorkers + cStartedThreads);
+            if (SUCCEEDED(hr))
             {
-                progress.pPayload = pExtract;
-
-                hr = PreparePayloadDestinationPath(pExtract->sczUnverifiedPath);
-                ExitOnFailure(hr, "Failed to prepare payload destination path: %ls", pExtract->sczUnverifiedPath);
-
-                hr = BACallbackOnCachePayloadExtractBegin(pContext->pUX, pContainer->sczId, pExtract->sczKey);
-                if (FAILED(hr))
+                rghThreads[cStartedThreads] = ::CreateThread(NULL, 0, AcquisitionThreadProc, rgWorkers + cStartedThreads, 0, NULL);
+                if (!rghThreads[cStartedThreads])
                 {
-                    BACallbackOnCachePayloadExtractComplete(pContext->pUX, pContainer->sczId, pExtract->sczKey, hr);
-                    ExitOnRootFailure(hr, "BA aborted cache payload extract begin.");
-                }
-
-                // TODO: Send progress when extracting stream to file.
-                hr = ContainerStreamToFile(&context, pExtract->sczUnverifiedPath);
-                // Error handling happens after sending complete message to BA.
-
-                // If succeeded, send 100% complete here to make sure progress was sent to the BA.
-                if (SUCCEEDED(hr))
-                {
-                    hr = CompleteCacheProgress(&progress, pExtract->qwFileSize);
+                    hr = HRESULT_FROM_WIN32(::GetLastError());
                 }
+            }
 
-                BACallbackOnCachePayloadExtractComplete(pContext->pUX, pContainer->sczId, pExtract->sczKey, hr);
-                ExitOnFailure(hr, "Failed to extract payload: %ls from container: %ls", sczStreamName, pContainer->sczId);
-
-                fExtracted = TRUE;
+            if (FAILED(hr))
+            {
+                LogStringLine(REPORT_VERBOSE, "Failed to create cache acquisition thread, error: 0x%x", hr);
+                break;
             }
-        }
 
-        if (!fExtracted)
-        {
-            hr = ContainerSkipStream(&context);
-            ExitOnFailure(hr, "Failed to skip the extraction of payload: %ls from container: %ls", sczStreamName, pContainer->sczId);
+            ++cStartedThreads;
         }
     }
 
-    if (E_NOMOREITEMS == hr)
+    if (cStartedThreads)
     {
-        hr = S_OK;
-    }
-    ExitOnFailure(hr, "Failed to extract all payloads from container: %ls", pContainer->sczId);
+        // The workers keep claiming units until there are none left, so every scheduled payload completes.
+        for (DWORD i = 0; i < pScheduler->cScheduledItems; ++i)
+        {
+            ::WaitForSingleObject(pScheduler->hCompleteSemaphore, INFINITE);
 
-LExit:
-    ReleaseStr(sczStreamName);
-    ContainerClose(&context);
+            QueueAcquiredPayloadHashes(pContext, pScheduler, &iNextCompletedItem);
+        }
+
+        ::WaitForMultipleObjects(cStartedThreads, rghThreads, TRUE, INFINITE);
+    }
+    else
+    {
+        while (NULL != (pUnit = ClaimAcquisitionUnit(pScheduler)))
+        {
+            for (DWORD i = pUnit->iFirstItem; ; i = pScheduler->rgItems[i].iNextInUnit)
+            {
+                AcquireScheduledPayload(pScheduler, pContext, i);
+                QueueAcquiredPayloadHashes(pContext, pScheduler, &iNextCompletedItem);
+
+                if (i == pUnit->iLastItem)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    for (DWORD i = 0; i < cStartedThreads; ++i)
+    {
+        ReleaseHandle(rghThreads[i]);
+    }
+
+    for (DWORD i = 0; rgWorkers && i < cThreads; ++i)
+    {
+        UninitializeAcquisitionWorker(rgWorkers + i);
+    }
+
+    ReleaseMem(rghThreads);
+    ReleaseMem(rgWorkers);
+}
+
+static HRESULT InitializeAcquisitionWorker(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __in BURN_CACHE_ACQUISITION_WORKER* pWorker
+    )
+{
+    pWorker->pScheduler = pScheduler;
+
+    return InitializeWorkerContext(pContext, &pWorker->context);
+}
+
+static void UninitializeAcquisitionWorker(
+    __in BURN_CACHE_ACQUISITION_WORKER* pWorker
+    )
+{
+    UninitializeWorkerContext(&pWorker->context);
+
+    memset(pWorker, 0, sizeof(BURN_CACHE_ACQUISITION_WORKER));
+}
+
+static HRESULT InitializeWorkerContext(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_CONTEXT* pWorkerContext
+    )
+{
+    HRESULT hr = S_OK;
+
+    // Workers share everything but where they are looking for their payloads.
+    *pWorkerContext = *pContext;
+    pWorkerContext->rgSearchPaths = NULL;
+    pWorkerContext->cSearchPaths = 0;
+    pWorkerContext->cSearchPathsMax = 0;
+    pWorkerContext->sczLocalAcquisitionSourcePath = NULL;
+
+    hr = MemAllocArray(reinterpret_cast<LPVOID*>(&pWorkerContext->rgSearchPaths), sizeof(LPWSTR), BURN_CACHE_MAX_SEARCH_PATHS);
+    ExitOnNull(pWorkerContext->rgSearchPaths, hr, E_OUTOFMEMORY, "Failed to allocate cache worker search paths array.");
+
+LExit:
+    return hr;
+}
+
+static void UninitializeWorkerContext(
+    __in BURN_CACHE_CONTEXT* pWorkerContext
+    )
+{
+    for (DWORD i = 0; pWorkerContext->rgSearchPaths && i < pWorkerContext->cSearchPathsMax; ++i)
+    {
+        ReleaseNullStr(pWorkerContext->rgSearchPaths[i]);
+    }
+    ReleaseMem(pWorkerContext->rgSearchPaths);
+    ReleaseStr(pWorkerContext->sczLocalAcquisitionSourcePath);
+}
+
+static DWORD WINAPI AcquisitionThreadProc(
+    __in LPVOID lpThreadParameter
+    )
+{
+    BURN_CACHE_ACQUISITION_WORKER* pWorker = static_cast<BURN_CACHE_ACQUISITION_WORKER*>(lpThreadParameter);
+    BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler = pWorker->pScheduler;
+    BURN_CACHE_ACQUISITION_UNIT* pUnit = NULL;
+
+    while (NULL != (pUnit = ClaimAcquisitionUnit(pScheduler)))
+    {
+        for (DWORD i = pUnit->iFirstItem; ; i = pScheduler->rgItems[i].iNextInUnit)
+        {
+            AcquireScheduledPayload(pScheduler, &pWorker->context, i);
+
+            if (i == pUnit->iLastItem)
+            {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static BURN_CACHE_ACQUISITION_UNIT* ClaimAcquisitionUnit(
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler
+    )
+{
+    BURN_CACHE_ACQUISITION_UNIT* pUnit = NULL;
+
+    // Units are claimed even after a failure so each of their payloads is still marked completed.
+    ::EnterCriticalSection(&pScheduler->csUnits);
+
+    for (DWORD i = 0; i < pScheduler->cUnits; ++i)
+    {
+        if (!pScheduler->rgUnits[i].fStarted)
+        {
+            pUnit = pScheduler->rgUnits + i;
+            pUnit->fStarted = TRUE;
+            break;
+        }
+    }
+
+    ::LeaveCriticalSection(&pScheduler->csUnits);
+
+    return pUnit;
+}
+
+static void AcquireScheduledPayload(
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in DWORD iItem
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CACHE_ACQUISITION_ITEM* pItem = pScheduler->rgItems + iItem;
+    BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem = pScheduler->pPackage->payloads.rgItems + iItem;
+    BURN_PAYLOAD* pPayload = pPayloadGroupItem->pPayload;
+    BOOL fAbort = FALSE;
+
+    ::EnterCriticalSection(&pScheduler->csUnits);
+    fAbort = pScheduler->fAbort;
+    ::LeaveCriticalSection(&pScheduler->csUnits);
+
+    // The package is going to fail, don't bother acquiring anything else.
+    if (fAbort)
+    {
+        ExitFunction();
+    }
+
+    hr = ApplyAcquireContainerOrPayload(pContext, NULL, pScheduler->pPackage, pPayloadGroupItem);
+    LogExitOnFailure(hr, MSG_FAILED_ACQUIRE_PAYLOAD, "Failed to acquire payload: %ls to working path: %ls", pPayload->sczKey, pPayload->sczUnverifiedPath);
+
+    // Remember where the payload came from until it is completed.
+    pItem->sczLocalAcquisitionSourcePath = pContext->sczLocalAcquisitionSourcePath;
+    pContext->sczLocalAcquisitionSourcePath = NULL;
+    pItem->fAcquired = TRUE;
+
+LExit:
+    if (FAILED(hr))
+    {
+        FinalizePayloadAcquisition(pContext, pPayload, FALSE);
+    }
+
+    ::EnterCriticalSection(&pScheduler->csUnits);
+
+    pItem->hrAcquire = hr;
+    if (FAILED(hr))
+    {
+        pScheduler->fAbort = TRUE;
+    }
+    pScheduler->rgdwCompletedItems[pScheduler->cCompletedItems] = iItem;
+    ++pScheduler->cCompletedItems;
+
+    ::LeaveCriticalSection(&pScheduler->csUnits);
+
+    if (pScheduler->hCompleteSemaphore)
+    {
+        ::ReleaseSemaphore(pScheduler->hCompleteSemaphore, 1, NULL);
+    }
+}
+
+static void QueueAcquiredPayloadHashes(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CACHE_ACQUISITION_SCHEDULER* pScheduler,
+    __inout DWORD* piNextCompletedItem
+    )
+{
+    DWORD iItem = 0;
+    BOOL fCompleted = TRUE;
+
+    while (fCompleted)
+    {
+        ::EnterCriticalSection(&pScheduler->csUnits);
+
+        fCompleted = *piNextCompletedItem < pScheduler->cCompletedItems;
+        if (fCompleted)
+        {
+            iItem = pScheduler->rgdwCompletedItems[*piNextCompletedItem];
+            ++*piNextCompletedItem;
+        }
+
+        ::LeaveCriticalSection(&pScheduler->csUnits);
+
+        if (fCompleted && pScheduler->rgItems[iItem].fAcquired)
+        {
+            QueuePayloadHash(pContext, pScheduler->pPackage, pScheduler->pPackage->payloads.rgItems[iItem].pPayload);
+        }
+    }
+}
+
+static void StartContainerExtraction(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_PLAN* pPlan,
+    __in DWORD cThreads,
+    __in BURN_CACHE_EXTRACTION_POOL* pPool
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fListed = FALSE;
+
+    // Find the containers that will be extracted, in the order their packages are cached.
+    for (DWORD i = 0; i < pPlan->cCacheActions; ++i)
+    {
+        BURN_CACHE_ACTION* pCacheAction = pPlan->rgCacheActions + i;
+        BURN_PACKAGE* pPackage = BURN_CACHE_ACTION_TYPE_PACKAGE == pCacheAction->type ? pCacheAction->package.pPackage : NULL;
+
+        // The payloads of packages that are not vital to cache are only acquired when the BA asks for them.
+        if (!pPackage || !pPackage->fCacheVital)
+        {
+            continue;
+        }
+
+        for (DWORD j = 0; j < pPackage->payloads.cItems; ++j)
+        {
+            BURN_PAYLOAD* pPayload = pPackage->payloads.rgItems[j].pPayload;
+            BURN_CONTAINER* pContainer = pPayload->pContainer;
+
+            if (!pContainer || !pContainer->fPlanned || pContainer->fExtracted || !pContainer->qwExtractSizeTotal)
+            {
+                continue;
+            }
+
+            fListed = FALSE;
+            for (DWORD k = 0; !fListed && k < pPool->cItems; ++k)
+            {
+                fListed = pContainer == pPool->rgItems[k].pContainer;
+            }
+
+            if (fListed || !IsPayloadAcquisitionNeeded(pContext->pCache, pPackage, pPayload))
+            {
+                continue;
+            }
+
+            hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pPool->rgItems), pPool->cItems + 1, sizeof(BURN_CACHE_EXTRACTION_ITEM), 5);
+            ExitOnFailure(hr, "Failed to grow container extractions.");
+
+            BURN_CACHE_EXTRACTION_ITEM* pItem = pPool->rgItems + pPool->cItems;
+            memset(pItem, 0, sizeof(BURN_CACHE_EXTRACTION_ITEM));
+
+            pItem->pContainer = pContainer;
+            pItem->hExtractedEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+            ExitOnNullWithLastError(pItem->hExtractedEvent, hr, "Failed to create container extraction event.");
+
+            ++pPool->cItems;
+
+            hr = SelectPayloadsToExtract(pContext->pPayloads, pContainer, &pItem->rgfExtractPayloads);
+            ExitOnFailure(hr, "Failed to select payloads to extract from container: %ls", pContainer->sczId);
+        }
+    }
+
+    cThreads = min(cThreads, pPool->cItems);
+    if (!cThreads)
+    {
+        ExitFunction();
+    }
+
+    pPool->rgWorkers = static_cast<BURN_CACHE_EXTRACTION_WORKER*>(MemAlloc(sizeof(BURN_CACHE_EXTRACTION_WORKER) * cThreads, TRUE));
+    ExitOnNull(pPool->rgWorkers, hr, E_OUTOFMEMORY, "Failed to allocate container extraction workers.");
+
+    pPool->rghThreads = static_cast<HANDLE*>(MemAlloc(sizeof(HANDLE) * cThreads, TRUE));
+    ExitOnNull(pPool->rghThreads, hr, E_OUTOFMEMORY, "Failed to allocate container extraction threads.");
+
+    // Containers no worker picks up are extracted when they are needed, so running short of threads is not fatal.
+    while (pPool->cThreads < cThreads)
+    {
+        BURN_CACHE_EXTRACTION_WORKER* pWorker = pPool->rgWorkers + pPool->cThreads;
+
+        hr = InitializeWorkerContext(pContext, &pWorker->context);
+        if (SUCCEEDED(hr))
+        {
+            pWorker->pPool = pPool;
+            pWorker->context.hPipe = INVALID_HANDLE_VALUE; // extraction never needs the elevated process.
+
+            pPool->rghThreads[pPool->cThreads] = ::CreateThread(NULL, 0, ExtractionThreadProc, pWorker, 0, NULL);
+            if (!pPool->rghThreads[pPool->cThreads])
+            {
+                hr = HRESULT_FROM_WIN32(::GetLastError());
+                UninitializeWorkerContext(&pWorker->context);
+            }
+        }
+
+        if (FAILED(hr))
+        {
+            LogStringLine(REPORT_VERBOSE, "Failed to create container extraction thread, error: 0x%x", hr);
+            break;
+        }
+
+        ++pPool->cThreads;
+    }
+
+LExit:
+    // Payloads only wait for the containers once there are workers extracting them.
+    if (pPool->cThreads)
+    {
+        pContext->pExtractionPool = pPool;
+    }
+}
+
+static void StopContainerExtraction(
+    __in BURN_CACHE_EXTRACTION_POOL* pPool
+    )
+{
+    ::EnterCriticalSection(&pPool->cs);
+    pPool->fAbort = TRUE;
+    ::LeaveCriticalSection(&pPool->cs);
+
+    // Containers the workers already started are finished, cancel reaches them through their progress.
+    if (pPool->cThreads)
+    {
+        ::WaitForMultipleObjects(pPool->cThreads, pPool->rghThreads, TRUE, INFINITE);
+    }
+
+    for (DWORD i = 0; i < pPool->cThreads; ++i)
+    {
+        ReleaseHandle(pPool->rghThreads[i]);
+        UninitializeWorkerContext(&pPool->rgWorkers[i].context);
+    }
+
+    for (DWORD i = 0; i < pPool->cItems; ++i)
+    {
+        ReleaseHandle(pPool->rgItems[i].hExtractedEvent);
+        ReleaseMem(pPool->rgItems[i].rgfExtractPayloads);
+    }
+
+    ReleaseNullMem(pPool->rghThreads);
+    ReleaseNullMem(pPool->rgWorkers);
+    ReleaseNullMem(pPool->rgItems);
+    pPool->cThreads = 0;
+    pPool->cItems = 0;
+}
+
+static BOOL IsPayloadAcquisitionNeeded(
+    __in BURN_CACHE* pCache,
+    __in BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD* pPayload
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczCachedDirectory = NULL;
+    LPWSTR sczCachedPath = NULL;
+    BOOL fNeeded = TRUE;
+
+    // Only a quick look, the payload is verified when its package is cached.
+    hr = CacheGetCompletedPath(pCache, pPackage->fPerMachine, pPackage->sczCacheId, &sczCachedDirectory);
+    ExitOnFailure(hr, "Failed to get cached path for package: %ls", pPackage->sczId);
+
+    hr = PathConcatRelativeToFullyQualifiedBase(sczCachedDirectory, pPayload->sczFilePath, &sczCachedPath);
+    ExitOnFailure(hr, "Failed to concat complete cached path.");
+
+    fNeeded = !FileExistsEx(sczCachedPath, NULL) && (!pPayload->sczUnverifiedPath || !FileExistsEx(pPayload->sczUnverifiedPath, NULL));
+
+LExit:
+    ReleaseStr(sczCachedPath);
+    ReleaseStr(sczCachedDirectory);
+
+    return fNeeded;
+}
+
+static DWORD WINAPI ExtractionThreadProc(
+    __in LPVOID lpThreadParameter
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CACHE_EXTRACTION_WORKER* pWorker = static_cast<BURN_CACHE_EXTRACTION_WORKER*>(lpThreadParameter);
+    BURN_CACHE_EXTRACTION_POOL* pPool = pWorker->pPool;
+    BURN_CACHE_EXTRACTION_ITEM* pItem = NULL;
+
+    while (NULL != (pItem = ClaimContainerExtraction(pPool)))
+    {
+        hr = ApplyExtractContainer(&pWorker->context, pItem->pContainer, pItem->rgfExtractPayloads);
+        if (SUCCEEDED(hr))
+        {
+            pItem->pContainer->fExtracted = TRUE;
+        }
+        else
+        {
+            // The container is extracted again by the first payload that needs it, which reports the failure.
+            LogStringLine(REPORT_STANDARD, "Failed to extract container: %ls ahead of its packages, error: 0x%x", pItem->pContainer->sczId, hr);
+
+            ::EnterCriticalSection(&pPool->cs);
+            pPool->fAbort = TRUE;
+            ::LeaveCriticalSection(&pPool->cs);
+        }
+
+        ::SetEvent(pItem->hExtractedEvent);
+    }
+
+    return 0;
+}
+
+static BURN_CACHE_EXTRACTION_ITEM* ClaimContainerExtraction(
+    __in BURN_CACHE_EXTRACTION_POOL* pPool
+    )
+{
+    BURN_CACHE_EXTRACTION_ITEM* pItem = NULL;
+
+    ::EnterCriticalSection(&pPool->cs);
+
+    for (DWORD i = 0; !pPool->fAbort && i < pPool->cItems; ++i)
+    {
+        if (!pPool->rgItems[i].fStarted)
+        {
+            pItem = pPool->rgItems + i;
+            pItem->fStarted = TRUE;
+            break;
+        }
+    }
+
+    ::LeaveCriticalSection(&pPool->cs);
+
+    return pItem;
+}
+
+static void WaitForContainerExtraction(
+    __in BURN_CACHE_EXTRACTION_POOL* pPool,
+    __in BURN_CONTAINER* pContainer
+    )
+{
+    BURN_CACHE_EXTRACTION_ITEM* pItem = NULL;
+
+    ::EnterCriticalSection(&pPool->cs);
+
+    for (DWORD i = 0; i < pPool->cItems; ++i)
+    {
+        if (pContainer == pPool->rgItems[i].pContainer)
+        {
+            pItem = pPool->rgItems + i;
+
+            // No worker got to the container yet, take it from them so the caller extracts it as usual.
+            if (!pItem->fStarted)
+            {
+                pItem->fStarted = TRUE;
+                ::SetEvent(pItem->hExtractedEvent);
+            }
+            break;
+        }
+    }
+
+    ::LeaveCriticalSection(&pPool->cs);
+
+    if (pItem)
+    {
+        ::WaitForSingleObject(pItem->hExtractedEvent, INFINITE);
+    }
+}
+
+static HRESULT ApplyProcessPayload(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
+    __in BOOL fVital
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fAcquired = FALSE;
+
+    hr = ApplyAcquirePayload(pContext, pPackage, pPayloadGroupItem, fVital, &fAcquired);
+    if (SUCCEEDED(hr) && fAcquired)
+    {
+        hr = ApplyCompletePayload(pContext, pPackage, pPayloadGroupItem);
+    }
+
+    return hr;
+}
+
+static HRESULT ApplyPreparePayloadAcquisition(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
+    __in BOOL fVital,
+    __out BOOL* pfAcquire
+    )
+{
+    HRESULT hr = S_OK;
+    BOOTSTRAPPER_CACHEPACKAGENONVITALVALIDATIONFAILURE_ACTION action = BOOTSTRAPPER_CACHEPACKAGENONVITALVALIDATIONFAILURE_ACTION_NONE;
+    BURN_PAYLOAD* pPayload = pPayloadGroupItem->pPayload;
+
+    Assert(pContext->pPayloads && pPackage || pContext->wzLayoutDirectory);
+
+    *pfAcquire = FALSE;
+
+    if (pPayload->pContainer && pContext->wzLayoutDirectory)
+    {
+        ExitFunction();
+    }
+
+    hr = ApplyCacheVerifyContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem);
+    if (SUCCEEDED(hr))
+    {
+        ExitFunction();
+    }
+    else if (pPackage && !pPackage->fAcquireOptionalSource && !fVital)
+    {
+        HRESULT hrResponse = BACallbackOnCachePackageNonVitalValidationFailure(pContext->pUX, pPackage->sczId, hr, &action);
+        ExitOnRootFailure(hrResponse, "BA aborted cache package non-vital failure.");
+
+        if (BOOTSTRAPPER_CACHEPACKAGENONVITALVALIDATIONFAILURE_ACTION_ACQUIRE != action)
+        {
+            ExitFunction();
+        }
+
+        pPackage->fAcquireOptionalSource = TRUE;
+    }
+
+    hr = S_OK;
+    *pfAcquire = TRUE;
+
+LExit:
+    if (!*pfAcquire)
+    {
+        FinalizePayloadAcquisition(pContext, pPayload, SUCCEEDED(hr));
+    }
+
+    return hr;
+}
+
+static HRESULT ApplyAcquirePayload(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem,
+    __in BOOL fVital,
+    __out BOOL* pfAcquired
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fAcquire = FALSE;
+    BURN_PAYLOAD* pPayload = pPayloadGroupItem->pPayload;
+
+    *pfAcquired = FALSE;
+
+    hr = ApplyPreparePayloadAcquisition(pContext, pPackage, pPayloadGroupItem, fVital, &fAcquire);
+    if (FAILED(hr) || !fAcquire)
+    {
+        ExitFunction();
+    }
+
+    hr = ApplyAcquireContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem);
+    LogExitOnFailure(hr, MSG_FAILED_ACQUIRE_PAYLOAD, "Failed to acquire payload: %ls to working path: %ls", pPayload->sczKey, pPayload->sczUnverifiedPath);
+
+    *pfAcquired = TRUE;
+
+    QueuePayloadHash(pContext, pPackage, pPayload);
+
+LExit:
+    if (fAcquire && !*pfAcquired)
+    {
+        FinalizePayloadAcquisition(pContext, pPayload, FALSE);
+    }
+
+    return hr;
+}
+
+static HRESULT ApplyCompletePayload(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cTryAgainAttempts = 0;
+    BOOL fRetry = FALSE;
+    BURN_PAYLOAD* pPayload = pPayloadGroupItem->pPayload;
+
+    for (;;)
+    {
+        fRetry = FALSE;
+
+        hr = LayoutOrCacheContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem, cTryAgainAttempts, &fRetry);
+        if (SUCCEEDED(hr))
+        {
+            break;
+        }
+        else
+        {
+            LogErrorId(hr, pContext->wzLayoutDirectory ? MSG_FAILED_LAYOUT_PAYLOAD : MSG_FAILED_CACHE_PAYLOAD, pPayload->sczKey, pContext->wzLayoutDirectory, pPayload->sczUnverifiedPath);
+
+            if (!fRetry)
+            {
+                ExitFunction();
+            }
+
+            ++cTryAgainAttempts;
+            CommitCacheProgress(pContext, 0, pPayloadGroupItem->qwCommittedCacheProgress);
+            pPayloadGroupItem->qwCommittedCacheProgress = 0;
+            FinalizePayloadAcquisition(pContext, pPayload, FALSE);
+            LogErrorId(hr, MSG_CACHE_RETRYING_PAYLOAD, pPayload->sczKey, NULL, NULL);
+        }
+
+        hr = ApplyAcquireContainerOrPayload(pContext, NULL, pPackage, pPayloadGroupItem);
+        LogExitOnFailure(hr, MSG_FAILED_ACQUIRE_PAYLOAD, "Failed to acquire payload: %ls to working path: %ls", pPayload->sczKey, pPayload->sczUnverifiedPath);
+    }
+
+LExit:
+    FinalizePayloadAcquisition(pContext, pPayload, SUCCEEDED(hr));
+
+    return hr;
+}
+
+static void QueuePayloadHash(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD* pPayload
+    )
+{
+    HRESULT hr = S_OK;
+
+    // Layout verifies against the digest from acquisition, if there is one.
+    if (pContext->wzLayoutDirectory)
+    {
+        return;
+    }
+
+    if (INVALID_HANDLE_VALUE != pContext->hPipe)
+    {
+        hr = ElevationCacheQueuePayloadHash(pContext->hPipe, pPackage, pPayload, pPayload->sczUnverifiedPath);
+    }
+    else
+    {
+        hr = CacheQueuePayloadHash(pContext->pCache, pPayload, pPayload->sczUnverifiedPath);
+    }
+
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_VERBOSE, "Could not start hashing payload: %ls early, it will be hashed when it is verified, error: 0x%x", pPayload->sczKey, hr);
+    }
+}
+
+static void ReleasePayloadHashes(
+    __in BURN_CACHE_CONTEXT* pContext
+    )
+{
+    if (pContext->wzLayoutDirectory)
+    {
+        return;
+    }
+
+    if (INVALID_HANDLE_VALUE != pContext->hPipe)
+    {
+        ElevationCacheReleasePayloadHashes(pContext->hPipe);
+    }
+    else
+    {
+        CacheReleasePayloadHashes(pContext->pCache);
+    }
+}
+
+static HRESULT ApplyCacheVerifyContainerOrPayload(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in_opt BURN_CONTAINER* pContainer,
+    __in_opt BURN_PACKAGE* pPackage,
+    __in_opt BURN_PAYLOAD_GROUP_ITEM* pPayloadGroupItem
+    )
+{
+    AssertSz(pContainer || pPayloadGroupItem, "Must provide a container or a payload.");
+
+    HRESULT hr = S_OK;
+    BURN_CACHE_PROGRESS_CONTEXT progress = { };
+
+    progress.pCacheContext = pContext;
+    progress.pContainer = pContainer;
+    progress.pPackage = pPackage;
+    progress.pPayloadGroupItem = pPayloadGroupItem;
+
+    if (pContainer)
+    {
+        hr = CacheVerifyContainer(pContainer, pContext->wzLayoutDirectory, CacheMessageHandler, CacheProgressRoutine, &progress);
+    }
+    else if (!pContext->wzLayoutDirectory && INVALID_HANDLE_VALUE != pContext->hPipe)
+    {
+        hr = ElevationCacheVerifyPayload(pContext->hPipe, pPackage, pPayloadGroupItem->pPayload, CacheMessageHandler, CacheProgressRoutine, &progress);
+    }
+    else
+    {
+        hr = CacheVerifyPayload(pContext->wzLayoutDirectory ? NULL : pContext->pCache, pPackage->fPerMachine, pPayloadGroupItem->pPayload, pContext->wzLayoutDirectory ? pContext->wzLayoutDirectory : pPackage->sczCacheFolder, CacheMessageHandler, CacheProgressRoutine, &progress);
+    }
+
+    return hr;
+}
+
+static HRESULT ExtractContainer(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in BURN_CONTAINER* pContainer,
+    __in_opt const BOOL* rgfExtractPayloads
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL* rgfSelectedPayloads = NULL;
+    BURN_CONTAINER_CONTEXT context = { };
+    HANDLE hContainerHandle = INVALID_HANDLE_VALUE;
+    const BYTE* pbContainerView = NULL;
+    DWORD64 cbContainerView = 0;
+    LPWSTR sczStreamName = NULL;
+    BURN_PAYLOAD* pExtract = NULL;
+    BURN_CACHE_PROGRESS_CONTEXT progress = { };
+    DWORD cPlannedPayloads = 0;
+    DWORD cExtractedPayloads = 0;
+
+    progress.pCacheContext = pContext;
+    progress.pContainer = pContainer;
+    progress.type = BURN_CACHE_PROGRESS_TYPE_EXTRACT;
+
+    if (!rgfExtractPayloads)
+    {
+        hr = SelectPayloadsToExtract(pContext->pPayloads, pContainer, &rgfSelectedPayloads);
+        ExitOnFailure(hr, "Failed to select payloads to extract from container: %ls", pContainer->sczId);
+
+        rgfExtractPayloads = rgfSelectedPayloads;
+    }
+
+    // Once every planned payload is out, the rest of the container does not have to be read.
+    for (DWORD i = 0; i < pContext->pPayloads->cPayloads; ++i)
+    {
+        if (rgfExtractPayloads[i])
+        {
+            ++cPlannedPayloads;
+        }
+    }
+
+    // If the container is actually attached, then it was planned to be acquired through hSourceEngineFile.
+    if (pContainer->fActuallyAttached)
+    {
+        hContainerHandle = pContext->hSourceEngineFile;
+        pbContainerView = pContext->pbSourceEngineView;
+        cbContainerView = pContext->cbSourceEngineView;
+    }
+
+    hr = ContainerOpen(&context, pContainer, hContainerHandle, pbContainerView, cbContainerView, pContainer->sczUnverifiedPath);
+    ExitOnFailure(hr, "Failed to open container: %ls.", pContainer->sczId);
+
+    while (cExtractedPayloads < cPlannedPayloads && S_OK == (hr = ContainerNextStream(&context, &sczStreamName)))
+    {
+        BOOL fExtracted = FALSE;
+
+        hr = PayloadFindEmbeddedBySourcePath(pContainer->sdhPayloads, sczStreamName, &pExtract);
+        if (E_NOTFOUND != hr)
+        {
+            ExitOnFailure(hr, "Failed to find embedded payload by source path: %ls container: %ls", sczStreamName, pContainer->sczId);
+
+            // Skip payloads that weren't planned or have already been cached.
+            if (rgfExtractPayloads[pExtract - pContext->pPayloads->rgPayloads])
+            {
+                progress.pPayload = pExtract;
+
+                hr = PreparePayloadDestinationPath(pExtract->sczUnverifiedPath);
+                ExitOnFailure(hr, "Failed to prepare payload destination path: %ls", pExtract->sczUnverifiedPath);
+
+                hr = BACallbackOnCachePayloadExtractBegin(pContext->pUX, pContainer->sczId, pExtract->sczKey);
+                if (FAILED(hr))
+                {
+                    BACallbackOnCachePayloadExtractComplete(pContext->pUX, pContainer->sczId, pExtract->sczKey, hr);
+                    ExitOnRootFailure(hr, "BA aborted cache payload extract begin.");
+                }
+
+                // TODO: Send progress when extracting stream to file.
+                hr = ExtractPayload(&context, pExtract);
+                // Error handling happens after sending complete message to BA.
+
+                // If succeeded, send 100% complete here to make sure progress was sent to the BA.
+                if (SUCCEEDED(hr))
+                {
+                    hr = CompleteCacheProgress(&progress, pExtract->qwFileSize);
+                }
+
+                BACallbackOnCachePayloadExtractComplete(pContext->pUX, pContainer->sczId, pExtract->sczKey, hr);
+                ExitOnFailure(hr, "Failed to extract payload: %ls from container: %ls", sczStreamName, pContainer->sczId);
+
+                fExtracted = TRUE;
+                ++cExtractedPayloads;
+            }
+        }
+
+        if (!fExtracted)
+        {
+            hr = ContainerSkipStream(&context);
+            ExitOnFailure(hr, "Failed to skip the extraction of payload: %ls from container: %ls", sczStreamName, pContainer->sczId);
+        }
+    }
+
+    if (E_NOMOREITEMS == hr)
+    {
+        hr = S_OK;
+    }
+    ExitOnFailure(hr, "Failed to extract all payloads from container: %ls", pContainer->sczId);
+
+LExit:
+    ReleaseStr(sczStreamName);
+    ContainerClose(&context);
+    ReleaseMem(rgfSelectedPayloads);
+
+    return hr;
+}
+
+static HRESULT SelectPayloadsToExtract(
+    __in BURN_PAYLOADS* pPayloads,
+    __in BURN_CONTAINER* pContainer,
+    __out BOOL** prgfExtractPayloads
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL* rgfExtractPayloads = NULL;
+
+    rgfExtractPayloads = static_cast<BOOL*>(MemAlloc(sizeof(BOOL) * pPayloads->cPayloads, TRUE));
+    ExitOnNull(rgfExtractPayloads, hr, E_OUTOFMEMORY, "Failed to allocate payloads to extract.");
+
+    for (DWORD i = 0; i < pPayloads->cPayloads; ++i)
+    {
+        BURN_PAYLOAD* pPayload = pPayloads->rgPayloads + i;
+
+        rgfExtractPayloads[i] = pPayload->pContainer == pContainer && pPayload->sczUnverifiedPath && pPayload->cRemainingInstances;
+    }
+
+    *prgfExtractPayloads = rgfExtractPayloads;
+    rgfExtractPayloads = NULL;
+
+LExit:
+    ReleaseMem(rgfExtractPayloads);
+
+    return hr;
+}
+
+static HRESULT ExtractPayload(
+    __in BURN_CONTAINER_CONTEXT* pContext,
+    __in BURN_PAYLOAD* pPayload
+    )
+{
+    HRESULT hr = S_OK;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    CRYP_HASH_HANDLE hHash = NULL;
+
+    // Like a copy, the payload is hashed while it is written so verification does not have to read it again.
+    hFile = ::CreateFileW(pPayload->sczUnverifiedPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    ExitOnInvalidHandleWithLastError(hFile, hr, "Failed to create file: %ls", pPayload->sczUnverifiedPath);
+
+    hr = CrypHashCreate(PROV_RSA_AES, CALG_SHA_512, &hHash);
+    ExitOnFailure(hr, "Failed to create hash for extraction of payload: %ls", pPayload->sczKey);
+
+    hr = ContainerStreamToHandle(pContext, hFile, hHash);
+    ExitOnFailure(hr, "Failed to extract payload to file: %ls", pPayload->sczUnverifiedPath);
+
+    hr = RecordAcquiredDigest(hFile, hHash, &pPayload->acquiredDigest);
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_STANDARD, "Failed to record hash of extracted payload: %ls, it will be read again to verify it, error: 0x%x", pPayload->sczUnverifiedPath, hr);
+        hr = S_OK;
+    }
+
+LExit:
+    ReleaseCrypHash(hHash);
+    ReleaseFileHandle(hFile);
 
     return hr;
 }
@@ -1480,7 +2601,7 @@ static HRESULT LayoutBundle(
             }
             else
             {
-                hr = CopyPayload(&progress, pContext->hSourceEngineFile, sczBundlePath, wzUnverifiedPath);
+                hr = CopyPayload(&progress, pContext->hSourceEngineFile, sczBundlePath, wzUnverifiedPath, NULL);
                 // Error handling happens after sending complete message to BA.
 
                 // If succeeded, send 100% complete here to make sure progress was sent to the BA.
@@ -1537,7 +2658,7 @@ static HRESULT LayoutBundle(
 
         if (fRetry)
         {
-            pContext->qwSuccessfulCacheProgress -= qwBundleSize; // Acquire
+            CommitCacheProgress(pContext, 0, qwBundleSize); // Acquire
         }
     } while (fRetry);
     LogExitOnFailure(hr, MSG_FAILED_LAYOUT_BUNDLE, "Failed to layout bundle: %ls to layout directory: %ls", sczBundlePath, pContext->wzLayoutDirectory);
@@ -1637,6 +2758,18 @@ static HRESULT AcquireContainerOrPayload(
     *pfRetry = FALSE;
     pProgress->fCancel = FALSE;
 
+    // The payload's container may be extracting ahead on another thread, its payloads are found locally once it is done.
+    if (wzPayloadContainerId && pContext->pExtractionPool)
+    {
+        WaitForContainerExtraction(pContext->pExtractionPool, pPayload->pContainer);
+    }
+
+    // Only a copy or extraction made by this acquisition may skip rereading the file during verification.
+    if (!wzPayloadContainerId || !pPayload->pContainer->fExtracted)
+    {
+        memset(pContainer ? &pContainer->acquiredDigest : &pPayload->acquiredDigest, 0, sizeof(BURN_ACQUIRED_DIGEST));
+    }
+
     hr = BACallbackOnCacheAcquireBegin(pContext->pUX, wzPackageOrContainerId, wzPayloadId, pwzSourcePath, pwzDownloadUrl, wzPayloadContainerId, &cacheOperation);
     ExitOnRootFailure(hr, "BA aborted cache acquire begin.");
 
@@ -1767,7 +2900,7 @@ static HRESULT AcquireContainerOrPayload(
 
         if (!fPathEqual)
         {
-            hr = CopyPayload(pProgress, INVALID_HANDLE_VALUE, pContext->rgSearchPaths[dwChosenSearchPath], wzDestinationPath);
+            hr = CopyPayload(pProgress, INVALID_HANDLE_VALUE, pContext->rgSearchPaths[dwChosenSearchPath], wzDestinationPath, pContainer ? &pContainer->acquiredDigest : &pPayload->acquiredDigest);
             ExitOnFailure(hr, "Failed to copy payload: %ls", wzPayloadId);
 
             // Store the source path so it can be used as the LastUsedFolder if it passes verification.
@@ -1777,14 +2910,14 @@ static HRESULT AcquireContainerOrPayload(
 
         break;
     case BOOTSTRAPPER_CACHE_OPERATION_DOWNLOAD:
-        hr = DownloadPayload(pProgress, wzDestinationPath);
+        hr = DownloadPayload(pProgress, wzDestinationPath, pContainer ? &pContainer->acquiredDigest : &pPayload->acquiredDigest);
         ExitOnFailure(hr, "Failed to download payload: %ls", wzPayloadId);
 
         break;
     case BOOTSTRAPPER_CACHE_OPERATION_EXTRACT:
         Assert(pPayload && pPayload->pContainer);
 
-        hr = ApplyExtractContainer(pContext, pPayload->pContainer);
+        hr = ApplyExtractContainer(pContext, pPayload->pContainer, NULL);
         ExitOnFailure(hr, "Failed to extract container for payload: %ls", wzPayloadId);
 
         break;
@@ -1970,7 +3103,8 @@ static HRESULT CopyPayload(
     __in BURN_CACHE_PROGRESS_CONTEXT* pProgress,
     __in HANDLE hSourceFile,
     __in_z LPCWSTR wzSourcePath,
-    __in_z LPCWSTR wzDestinationPath
+    __in_z LPCWSTR wzDestinationPath,
+    __in_opt BURN_ACQUIRED_DIGEST* pDigest
     )
 {
     HRESULT hr = S_OK;
@@ -1978,6 +3112,7 @@ static HRESULT CopyPayload(
     LPCWSTR wzPayloadId = pProgress->pPayloadGroupItem ? pProgress->pPayloadGroupItem->pPayload->sczKey : L"";
     HANDLE hDestinationFile = INVALID_HANDLE_VALUE;
     HANDLE hSourceOpenedFile = INVALID_HANDLE_VALUE;
+    CRYP_HASH_HANDLE hHash = NULL;
 
     DWORD dwLogId = pProgress->pContainer ? MSG_ACQUIRE_CONTAINER : pProgress->pPackage ? MSG_ACQUIRE_PACKAGE_PAYLOAD : MSG_ACQUIRE_BUNDLE_PAYLOAD;
     LogId(REPORT_STANDARD, dwLogId, wzPackageOrContainerId, wzPayloadId, "copy", wzSourcePath);
@@ -2001,13 +3136,20 @@ static HRESULT CopyPayload(
         ExitOnRootFailure(hr, "Failed to read from start of source file to copy payload from: '%ls' to: %ls.", wzSourcePath, wzDestinationPath);
     }
 
-    hDestinationFile = ::CreateFileW(wzDestinationPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    // When hashing the copy, nobody else may write to the destination while the hash is being computed.
+    hDestinationFile = ::CreateFileW(wzDestinationPath, GENERIC_WRITE, FILE_SHARE_READ | (pDigest ? 0 : FILE_SHARE_WRITE) | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
     if (INVALID_HANDLE_VALUE == hDestinationFile)
     {
         ExitWithLastError(hr, "Failed to open destination file to copy payload from: '%ls' to: %ls.", wzSourcePath, wzDestinationPath);
     }
 
-    hr = FileCopyUsingHandlesWithProgress(hSourceFile, hDestinationFile, 0, CacheProgressRoutine, pProgress);
+    if (pDigest)
+    {
+        hr = CrypHashCreate(PROV_RSA_AES, CALG_SHA_512, &hHash);
+        ExitOnFailure(hr, "Failed to create hash for copy of payload from: '%ls' to: %ls.", wzSourcePath, wzDestinationPath);
+    }
+
+    hr = FileCopyUsingHandlesWithProgressEx(hSourceFile, hDestinationFile, 0, 0, hHash ? HashCopiedData : NULL, hHash, CacheProgressRoutine, pProgress);
     if (FAILED(hr))
     {
         if (pProgress->fCancel)
@@ -2021,16 +3163,80 @@ static HRESULT CopyPayload(
         }
     }
 
+    if (hHash)
+    {
+        // Not having the digest only means verification has to read the file again.
+        hr = RecordAcquiredDigest(hDestinationFile, hHash, pDigest);
+        if (FAILED(hr))
+        {
+            LogStringLine(REPORT_STANDARD, "Failed to record hash of copied payload: %ls, it will be read again to verify it, error: 0x%x", wzDestinationPath, hr);
+            hr = S_OK;
+        }
+    }
+
 LExit:
+    ReleaseCrypHash(hHash);
     ReleaseFileHandle(hDestinationFile);
     ReleaseFileHandle(hSourceOpenedFile);
 
     return hr;
 }
 
+static HRESULT CALLBACK HashCopiedData(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    return CrypHashUpdate(static_cast<CRYP_HASH_HANDLE>(pvContext), pbData, cbData);
+}
+
+static HRESULT RecordAcquiredDigest(
+    __in HANDLE hFile,
+    __in CRYP_HASH_HANDLE hHash,
+    __in BURN_ACQUIRED_DIGEST* pDigest
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD64 qwBytesHashed = 0;
+    FILETIME ftNow = { };
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+
+    hr = CrypHashGetValue(hHash, pDigest->rgbHash, sizeof(pDigest->rgbHash), &qwBytesHashed);
+    ExitOnFailure(hr, "Failed to get hash value.");
+
+    // Set the last write time explicitly so closing the handle does not change it afterwards.
+    ::GetSystemTimeAsFileTime(&ftNow);
+    if (!::SetFileTime(hFile, NULL, NULL, &ftNow))
+    {
+        ExitWithLastError(hr, "Failed to set last write time.");
+    }
+
+    if (!::GetFileInformationByHandle(hFile, &fileInformation))
+    {
+        ExitWithLastError(hr, "Failed to get file information.");
+    }
+
+    pDigest->qwFileSize = (static_cast<DWORD64>(fileInformation.nFileSizeHigh) << 32) | fileInformation.nFileSizeLow;
+    if (pDigest->qwFileSize != qwBytesHashed)
+    {
+        ExitFunction1(hr = E_UNEXPECTED); // something else wrote to the file.
+    }
+
+    pDigest->dwVolumeSerialNumber = fileInformation.dwVolumeSerialNumber;
+    pDigest->dwFileIndexHigh = fileInformation.nFileIndexHigh;
+    pDigest->dwFileIndexLow = fileInformation.nFileIndexLow;
+    pDigest->ftLastWriteTime = fileInformation.ftLastWriteTime;
+    pDigest->fValid = TRUE;
+
+LExit:
+    return hr;
+}
+
 static HRESULT DownloadPayload(
     __in BURN_CACHE_PROGRESS_CONTEXT* pProgress,
-    __in_z LPCWSTR wzDestinationPath
+    __in_z LPCWSTR wzDestinationPath,
+    __in_opt BURN_ACQUIRED_DIGEST* pDigest
     )
 {
     HRESULT hr = S_OK;
@@ -2041,6 +3247,7 @@ static HRESULT DownloadPayload(
     DOWNLOAD_CACHE_CALLBACK cacheCallback = { };
     DOWNLOAD_AUTHENTICATION_CALLBACK authenticationCallback = { };
     APPLY_AUTHENTICATION_REQUIRED_DATA authenticationData = { };
+    DOWNLOAD_HASH downloadHash = { };
 
     DWORD dwLogId = pProgress->pContainer ? MSG_ACQUIRE_CONTAINER : pProgress->pPackage ? MSG_ACQUIRE_PACKAGE_PAYLOAD : MSG_ACQUIRE_BUNDLE_PAYLOAD;
     LogId(REPORT_STANDARD, dwLogId, wzPackageOrContainerId, wzPayloadId, "download", pDownloadSource->sczUrl);
@@ -2058,9 +3265,27 @@ static HRESULT DownloadPayload(
     authenticationCallback.pv =  static_cast<LPVOID>(&authenticationData);
     authenticationCallback.pfnAuthenticate = &AuthenticationRequired;
 
-    hr = DownloadUrl(pDownloadSource, qwDownloadSize, wzDestinationPath, &cacheCallback, &authenticationCallback);
+    if (pDigest)
+    {
+        downloadHash.dwProvType = PROV_RSA_AES;
+        downloadHash.algid = CALG_SHA_512;
+        downloadHash.pbHash = pDigest->rgbHash;
+        downloadHash.cbHash = sizeof(pDigest->rgbHash);
+    }
+
+    hr = DownloadUrlEx(pDownloadSource, qwDownloadSize, wzDestinationPath, &cacheCallback, &authenticationCallback, pDigest ? &downloadHash : NULL);
     ExitOnFailure(hr, "Failed attempt to download URL: '%ls' to: '%ls'", pDownloadSource->sczUrl, wzDestinationPath);
 
+    if (downloadHash.fHashed)
+    {
+        pDigest->qwFileSize = (static_cast<DWORD64>(downloadHash.fileInformation.nFileSizeHigh) << 32) | downloadHash.fileInformation.nFileSizeLow;
+        pDigest->dwVolumeSerialNumber = downloadHash.fileInformation.dwVolumeSerialNumber;
+        pDigest->dwFileIndexHigh = downloadHash.fileInformation.nFileIndexHigh;
+        pDigest->dwFileIndexLow = downloadHash.fileInformation.nFileIndexLow;
+        pDigest->ftLastWriteTime = downloadHash.fileInformation.ftLastWriteTime;
+        pDigest->fValid = TRUE;
+    }
+
 LExit:
     return hr;
 }
@@ -2197,6 +3422,22 @@ static HRESULT CALLBACK CacheMessageHandler(
     return hr;
 }
 
+static void CommitCacheProgress(
+    __in BURN_CACHE_CONTEXT* pContext,
+    __in DWORD64 qwCommitted,
+    __in DWORD64 qwUncommitted
+    )
+{
+    BURN_CACHE_OVERALL_PROGRESS* pOverallProgress = pContext->pOverallProgress;
+
+    ::EnterCriticalSection(&pOverallProgress->cs);
+
+    pOverallProgress->qwSuccessfulCacheProgress += qwCommitted;
+    pOverallProgress->qwSuccessfulCacheProgress -= qwUncommitted;
+
+    ::LeaveCriticalSection(&pOverallProgress->cs);
+}
+
 static HRESULT CompleteCacheProgress(
     __in BURN_CACHE_PROGRESS_CONTEXT* pContext,
     __in DWORD64 qwFileSize
@@ -2210,6 +3451,9 @@ static HRESULT CompleteCacheProgress(
 
     liContainerOrPayloadSize.QuadPart = qwFileSize;
 
+    // Hold the overall progress so the progress sent below includes what this commits.
+    ::EnterCriticalSection(&pContext->pCacheContext->pOverallProgress->cs);
+
     // Need to commit the steps that were skipped.
     if (BURN_CACHE_PROGRESS_TYPE_CONTAINER_OR_PAYLOAD_VERIFY == pContext->type || BURN_CACHE_PROGRESS_TYPE_PAYLOAD_VERIFY == pContext->type)
     {
@@ -2217,7 +3461,7 @@ static HRESULT CompleteCacheProgress(
 
         qwCommitSize = qwFileSize * (pContext->pCacheContext->wzLayoutDirectory ? 2 : 3); // Acquire (+ Stage) + Hash + Finalize - 1 (that's added later)
 
-        pContext->pCacheContext->qwSuccessfulCacheProgress += qwCommitSize;
+        CommitCacheProgress(pContext->pCacheContext, qwCommitSize, 0);
 
         if (pContext->pContainer)
         {
@@ -2233,7 +3477,7 @@ static HRESULT CompleteCacheProgress(
 
     if (PROGRESS_CONTINUE == dwResult)
     {
-        pContext->pCacheContext->qwSuccessfulCacheProgress += qwFileSize;
+        CommitCacheProgress(pContext->pCacheContext, qwFileSize, 0);
 
         if (pContext->pPayload)
         {
@@ -2268,7 +3512,7 @@ static HRESULT CompleteCacheProgress(
 
         if (qwCommitSize)
         {
-            pContext->pCacheContext->qwSuccessfulCacheProgress -= qwCommitSize;
+            CommitCacheProgress(pContext->pCacheContext, 0, qwCommitSize);
 
             if (pContext->pContainer)
             {
@@ -2281,6 +3525,8 @@ static HRESULT CompleteCacheProgress(
         }
     }
 
+    ::LeaveCriticalSection(&pContext->pCacheContext->pOverallProgress->cs);
+
     return hr;
 }
 
@@ -2299,15 +3545,29 @@ static DWORD CALLBACK CacheProgressRoutine(
     HRESULT hr = S_OK;
     DWORD dwResult = PROGRESS_CONTINUE;
     BURN_CACHE_PROGRESS_CONTEXT* pProgress = static_cast<BURN_CACHE_PROGRESS_CONTEXT*>(lpData);
+    BURN_CACHE_OVERALL_PROGRESS* pOverallProgress = pProgress->pCacheContext->pOverallProgress;
     LPCWSTR wzPackageOrContainerId = pProgress->pContainer ? pProgress->pContainer->sczId : pProgress->pPackage ? pProgress->pPackage->sczId : NULL;
     LPCWSTR wzPayloadId = pProgress->pPayloadGroupItem ? pProgress->pPayloadGroupItem->pPayload->sczKey : pProgress->pPayload ? pProgress->pPayload->sczKey : NULL;
-    DWORD64 qwCacheProgress = pProgress->pCacheContext->qwSuccessfulCacheProgress + TotalBytesTransferred.QuadPart;
-    if (qwCacheProgress > pProgress->pCacheContext->qwTotalCacheSize)
+    DWORD64 qwCacheProgress = 0;
+    DWORD dwOverallPercentage = 0;
+
+    // Stay in here while the BA is told, so progress from other threads cannot reach it out of order.
+    ::EnterCriticalSection(&pOverallProgress->cs);
+
+    qwCacheProgress = pOverallProgress->qwSuccessfulCacheProgress + TotalBytesTransferred.QuadPart;
+    if (qwCacheProgress > pOverallProgress->qwTotalCacheSize)
     {
         //AssertSz(FALSE, "Apply has cached more than Plan envisioned.");
-        qwCacheProgress = pProgress->pCacheContext->qwTotalCacheSize;
+        qwCacheProgress = pOverallProgress->qwTotalCacheSize;
     }
-    DWORD dwOverallPercentage = pProgress->pCacheContext->qwTotalCacheSize ? static_cast<DWORD>(qwCacheProgress * 100 / pProgress->pCacheContext->qwTotalCacheSize) : 0;
+    dwOverallPercentage = pOverallProgress->qwTotalCacheSize ? static_cast<DWORD>(qwCacheProgress * 100 / pOverallProgress->qwTotalCacheSize) : 0;
+
+    // Concurrent acquisitions and retries each only know part of the progress, never report less than before.
+    if (dwOverallPercentage < pOverallProgress->dwReportedPercentage)
+    {
+        dwOverallPercentage = pOverallProgress->dwReportedPercentage;
+    }
+    pOverallProgress->dwReportedPercentage = dwOverallPercentage;
 
     switch (pProgress->type)
     {
@@ -2342,6 +3602,8 @@ static DWORD CALLBACK CacheProgressRoutine(
     }
 
 LExit:
+    ::LeaveCriticalSection(&pOverallProgress->cs);
+
     if (HRESULT_FROM_WIN32(ERROR_INSTALL_USEREXIT) == hr)
     {
         dwResult = PROGRESS_CANCEL;
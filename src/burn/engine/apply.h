@@ -83,7 +83,7 @@ HRESULT ApplyUnregister(
     __in BOOTSTRAPPER_APPLY_RESTART restart
     );
 HRESULT ApplyCache(
-    __in HANDLE hSourceEngineFile,
+    __in BURN_SECTION* pSection,
     __in BURN_USER_EXPERIENCE* pUX,
     __in BURN_VARIABLES* pVariables,
     __in BURN_PLAN* pPlan,
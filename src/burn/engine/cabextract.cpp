@@ -40,6 +40,38 @@ static HRESULT BeginAndWaitForOperation(
 static HRESULT WaitForOperation(
     __in BURN_CONTAINER_CONTEXT* pContext
     );
+static HRESULT StartExtractThread(
+    __in BURN_CONTAINER_CONTEXT* pContext
+    );
+static HRESULT FallBackToCabinetDll(
+    __in BURN_CONTAINER_CONTEXT* pContext
+    );
+static HRESULT ReaderStreamToHandle(
+    __in BURN_CONTAINER_CONTEXT* pContext,
+    __in HANDLE hFile,
+    __in_opt CRYP_HASH_HANDLE hHash
+    );
+static HRESULT ReaderStreamToBuffer(
+    __in BURN_CONTAINER_CONTEXT* pContext,
+    __out BYTE** ppbBuffer,
+    __out SIZE_T* pcbBuffer
+    );
+static HRESULT CALLBACK ReadCabinet(
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) BYTE* pbBuffer,
+    __in DWORD cbBuffer,
+    __in_opt LPVOID pvContext
+    );
+static HRESULT CALLBACK WriteToTarget(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+static HRESULT CALLBACK CopyToTargetBuffer(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
 static DWORD WINAPI ExtractThreadProc(
     __in LPVOID lpThreadParameter
     );
@@ -60,7 +92,8 @@ static HRESULT PrepareTargetFile(
     __in HANDLE hFile
     );
 static void BestEffortSetFileTime(
-    __in FDINOTIFICATION* pFDINotify,
+    __in USHORT usDate,
+    __in USHORT usTime,
     __in HANDLE hFile
     );
 static LPVOID DIAMONDAPI CabAlloc(
@@ -100,7 +133,8 @@ static HRESULT AddVirtualFilePointer(
 static HRESULT ReadIfVirtualFilePointer(
     __in BURN_CONTAINER_CONTEXT_CABINET* pCabinetContext,
     __in HANDLE hFile,
-    __in DWORD cbRead
+    __in DWORD cbRead,
+    __out LARGE_INTEGER* pliPosition
     );
 static BOOL SetIfVirtualFilePointer(
     __in BURN_CONTAINER_CONTEXT_CABINET* pCabinetContext,
@@ -143,20 +177,20 @@ extern "C" HRESULT CabExtractOpen(
     hr = StrAllocString(&pContext->Cabinet.sczFile, wzFilePath, 0);
     ExitOnFailure(hr, "Failed to copy file name.");
 
-    // create events
-    pContext->Cabinet.hBeginOperationEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
-    ExitOnNullWithLastError(pContext->Cabinet.hBeginOperationEvent, hr, "Failed to create begin operation event.");
-
-    pContext->Cabinet.hOperationCompleteEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
-    ExitOnNullWithLastError(pContext->Cabinet.hOperationCompleteEvent, hr, "Failed to create operation complete event.");
+    // Prefer decoding the cabinet on the caller's thread, decompressed blocks are then written and hashed
+    // straight from the decoder. cabinet.dll handles the cabinets the reader does not support, and the
+    // rest of the cabinet when the reader fails to decode a stream.
+    hr = CabReaderOpen(&pContext->Cabinet.reader, ReadCabinet, pContext, pContext->qwSize);
+    if (SUCCEEDED(hr))
+    {
+        pContext->Cabinet.fReader = TRUE;
+        ExitFunction();
+    }
 
-    // create extraction thread
-    pContext->Cabinet.hThread = ::CreateThread(NULL, 0, ExtractThreadProc, pContext, 0, NULL);
-    ExitOnNullWithLastError(pContext->Cabinet.hThread, hr, "Failed to create extraction thread.");
+    LogStringLine(REPORT_VERBOSE, "Extracting cabinet: %ls with cabinet.dll, error: 0x%x", wzFilePath, hr);
 
-    // wait for operation to complete
-    hr = WaitForOperation(pContext);
-    ExitOnFailure(hr, "Failed to wait for operation complete.");
+    hr = StartExtractThread(pContext);
+    ExitOnFailure(hr, "Failed to start extraction thread.");
 
 LExit:
     return hr;
@@ -169,12 +203,24 @@ extern "C" HRESULT CabExtractNextStream(
 {
     HRESULT hr = S_OK;
 
-    // set operation to move to next stream
-    pContext->Cabinet.operation = BURN_CAB_OPERATION_NEXT_STREAM;
-    pContext->Cabinet.psczStreamName = psczStreamName;
+    if (pContext->Cabinet.fReader)
+    {
+        hr = CabReaderNextFile(&pContext->Cabinet.reader, &pContext->Cabinet.pReaderFile);
+        if (S_OK == hr)
+        {
+            hr = StrAllocString(psczStreamName, pContext->Cabinet.pReaderFile->sczName, 0);
+        }
+    }
+    else
+    {
+        // set operation to move to next stream
+        pContext->Cabinet.operation = BURN_CAB_OPERATION_NEXT_STREAM;
+        pContext->Cabinet.psczStreamName = psczStreamName;
+
+        // begin operation and wait
+        hr = BeginAndWaitForOperation(pContext);
+    }
 
-    // begin operation and wait
-    hr = BeginAndWaitForOperation(pContext);
     if (E_ABORT != hr && E_NOMOREITEMS != hr)
     {
         ExitOnFailure(hr, "Failed to begin and wait for operation.");
@@ -190,6 +236,18 @@ extern "C" HRESULT CabExtractStreamToFile(
     )
 {
     HRESULT hr = S_OK;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+
+    if (pContext->Cabinet.fReader)
+    {
+        hFile = ::CreateFileW(wzFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        ExitOnInvalidHandleWithLastError(hFile, hr, "Failed to create file: %ls", wzFileName);
+
+        hr = ReaderStreamToHandle(pContext, hFile, NULL);
+        ExitOnFailure(hr, "Failed to write extracted stream to file: %ls", wzFileName);
+
+        ExitFunction();
+    }
 
     // set operation to move to next stream
     pContext->Cabinet.operation = BURN_CAB_OPERATION_STREAM_TO_FILE;
@@ -203,6 +261,8 @@ extern "C" HRESULT CabExtractStreamToFile(
     pContext->Cabinet.wzTargetFile = NULL;
 
 LExit:
+    ReleaseFile(hFile);
+
     return hr;
 }
 
@@ -214,6 +274,14 @@ extern "C" HRESULT CabExtractStreamToBuffer(
 {
     HRESULT hr = S_OK;
 
+    if (pContext->Cabinet.fReader)
+    {
+        hr = ReaderStreamToBuffer(pContext, ppbBuffer, pcbBuffer);
+        ExitOnFailure(hr, "Failed to extract stream to buffer.");
+
+        ExitFunction();
+    }
+
     // set operation to move to next stream
     pContext->Cabinet.operation = BURN_CAB_OPERATION_STREAM_TO_BUFFER;
 
@@ -236,14 +304,24 @@ LExit:
 
 extern "C" HRESULT CabExtractStreamToHandle(
     __in BURN_CONTAINER_CONTEXT* pContext,
-    __in HANDLE hFile
+    __in HANDLE hFile,
+    __in_opt CRYP_HASH_HANDLE hHash
     )
 {
     HRESULT hr = S_OK;
 
+    if (pContext->Cabinet.fReader)
+    {
+        hr = ReaderStreamToHandle(pContext, hFile, hHash);
+        ExitOnFailure(hr, "Failed to write extracted stream to handle.");
+
+        ExitFunction();
+    }
+
     // set operation to move to next stream
     pContext->Cabinet.operation = BURN_CAB_OPERATION_STREAM_TO_HANDLE;
     pContext->Cabinet.hTargetFile = hFile;
+    pContext->Cabinet.hTargetHash = hHash;
 
     // begin operation and wait
     hr = BeginAndWaitForOperation(pContext);
@@ -251,6 +329,7 @@ extern "C" HRESULT CabExtractStreamToHandle(
 
     // clear file handle
     pContext->Cabinet.hTargetFile = INVALID_HANDLE_VALUE;
+    pContext->Cabinet.hTargetHash = NULL;
 
 LExit:
     return hr;
@@ -262,6 +341,13 @@ extern "C" HRESULT CabExtractSkipStream(
 {
     HRESULT hr = S_OK;
 
+    // The reader skips a stream by not decoding it.
+    if (pContext->Cabinet.fReader)
+    {
+        pContext->Cabinet.pReaderFile = NULL;
+        ExitFunction();
+    }
+
     // set operation to move to next stream
     pContext->Cabinet.operation = BURN_CAB_OPERATION_SKIP_STREAM;
 
@@ -297,6 +383,12 @@ extern "C" HRESULT CabExtractClose(
     }
 
 LExit:
+    if (pContext->Cabinet.fReader)
+    {
+        CabReaderClose(&pContext->Cabinet.reader);
+        pContext->Cabinet.fReader = FALSE;
+    }
+
     ReleaseHandle(pContext->Cabinet.hThread);
     ReleaseHandle(pContext->Cabinet.hBeginOperationEvent);
     ReleaseHandle(pContext->Cabinet.hOperationCompleteEvent);
@@ -309,6 +401,65 @@ LExit:
 
 // internal helper functions
 
+static HRESULT StartExtractThread(
+    __in BURN_CONTAINER_CONTEXT* pContext
+    )
+{
+    HRESULT hr = S_OK;
+
+    // create events
+    pContext->Cabinet.hBeginOperationEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    ExitOnNullWithLastError(pContext->Cabinet.hBeginOperationEvent, hr, "Failed to create begin operation event.");
+
+    pContext->Cabinet.hOperationCompleteEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    ExitOnNullWithLastError(pContext->Cabinet.hOperationCompleteEvent, hr, "Failed to create operation complete event.");
+
+    // create extraction thread
+    pContext->Cabinet.hThread = ::CreateThread(NULL, 0, ExtractThreadProc, pContext, 0, NULL);
+    ExitOnNullWithLastError(pContext->Cabinet.hThread, hr, "Failed to create extraction thread.");
+
+    // wait for operation to complete
+    hr = WaitForOperation(pContext);
+    ExitOnFailure(hr, "Failed to wait for operation complete.");
+
+LExit:
+    return hr;
+}
+
+static HRESULT FallBackToCabinetDll(
+    __in BURN_CONTAINER_CONTEXT* pContext
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iFile = pContext->Cabinet.reader.iNextFile - 1;
+    LPWSTR sczStreamName = NULL;
+
+    CabReaderClose(&pContext->Cabinet.reader);
+    pContext->Cabinet.fReader = FALSE;
+    pContext->Cabinet.pReaderFile = NULL;
+
+    hr = StartExtractThread(pContext);
+    ExitOnFailure(hr, "Failed to start extraction thread.");
+
+    // cabinet.dll starts at the beginning of the cabinet, skip to the stream the reader failed on.
+    for (DWORD i = 0; i <= iFile; ++i)
+    {
+        hr = CabExtractNextStream(pContext, &sczStreamName);
+        ExitOnFailure(hr, "Failed to move to stream: %u", i);
+
+        if (i < iFile)
+        {
+            hr = CabExtractSkipStream(pContext);
+            ExitOnFailure(hr, "Failed to skip stream: %ls", sczStreamName);
+        }
+    }
+
+LExit:
+    ReleaseStr(sczStreamName);
+
+    return hr;
+}
+
 static HRESULT BeginAndWaitForOperation(
     __in BURN_CONTAINER_CONTEXT* pContext
     )
@@ -368,6 +519,195 @@ LExit:
     return hr;
 }
 
+static HRESULT ReaderStreamToHandle(
+    __in BURN_CONTAINER_CONTEXT* pContext,
+    __in HANDLE hFile,
+    __in_opt CRYP_HASH_HANDLE hHash
+    )
+{
+    HRESULT hr = S_OK;
+    const CAB_READER_FILE* pFile = pContext->Cabinet.pReaderFile;
+
+    ExitOnNull(pFile, hr, E_INVALIDSTATE, "No stream to extract.");
+
+    hr = PrepareTargetFile(static_cast<long>(pFile->cbFile), hFile);
+    ExitOnFailure(hr, "Failed to prepare target file.");
+
+    pContext->Cabinet.hTargetFile = hFile;
+    pContext->Cabinet.hTargetHash = hHash;
+    pContext->Cabinet.hrError = S_OK;
+
+    hr = CabReaderReadFile(&pContext->Cabinet.reader, WriteToTarget, pContext);
+    if (FAILED(hr) && SUCCEEDED(pContext->Cabinet.hrError))
+    {
+        LogStringLine(REPORT_WARNING, "Failed to decode stream: %ls, extracting it with cabinet.dll instead, error: 0x%x", pFile->sczName, hr);
+
+        hr = FallBackToCabinetDll(pContext);
+        ExitOnFailure(hr, "Failed to fall back to cabinet.dll.");
+
+        // The hash already holds part of the stream. It is not updated again, so its byte count does not match
+        // the file and the file is read again when it is verified.
+        hr = CabExtractStreamToHandle(pContext, hFile, NULL);
+        ExitOnFailure(hr, "Failed to extract stream with cabinet.dll.");
+
+        ExitFunction();
+    }
+    ExitOnFailure(hr, "Failed to extract stream: %ls", pFile->sczName);
+
+    BestEffortSetFileTime(pFile->wDate, pFile->wTime, hFile);
+
+LExit:
+    pContext->Cabinet.hTargetFile = INVALID_HANDLE_VALUE;
+    pContext->Cabinet.hTargetHash = NULL;
+    pContext->Cabinet.pReaderFile = NULL;
+
+    return hr;
+}
+
+static HRESULT ReaderStreamToBuffer(
+    __in BURN_CONTAINER_CONTEXT* pContext,
+    __out BYTE** ppbBuffer,
+    __out SIZE_T* pcbBuffer
+    )
+{
+    HRESULT hr = S_OK;
+    const CAB_READER_FILE* pFile = pContext->Cabinet.pReaderFile;
+
+    ExitOnNull(pFile, hr, E_INVALIDSTATE, "No stream to extract.");
+
+    pContext->Cabinet.pbTargetBuffer = static_cast<BYTE*>(MemAlloc(pFile->cbFile, FALSE));
+    ExitOnNull(pContext->Cabinet.pbTargetBuffer, hr, E_OUTOFMEMORY, "Failed to allocate buffer for stream.");
+
+    pContext->Cabinet.cbTargetBuffer = pFile->cbFile;
+    pContext->Cabinet.iTargetBuffer = 0;
+    pContext->Cabinet.hrError = S_OK;
+
+    hr = CabReaderReadFile(&pContext->Cabinet.reader, CopyToTargetBuffer, pContext);
+    if (FAILED(hr) && SUCCEEDED(pContext->Cabinet.hrError))
+    {
+        LogStringLine(REPORT_WARNING, "Failed to decode stream: %ls, extracting it with cabinet.dll instead, error: 0x%x", pFile->sczName, hr);
+
+        ReleaseNullMem(pContext->Cabinet.pbTargetBuffer);
+
+        hr = FallBackToCabinetDll(pContext);
+        ExitOnFailure(hr, "Failed to fall back to cabinet.dll.");
+
+        hr = CabExtractStreamToBuffer(pContext, ppbBuffer, pcbBuffer);
+        ExitOnFailure(hr, "Failed to extract stream with cabinet.dll.");
+
+        ExitFunction();
+    }
+    ExitOnFailure(hr, "Failed to extract stream: %ls", pFile->sczName);
+
+    *ppbBuffer = pContext->Cabinet.pbTargetBuffer;
+    *pcbBuffer = pContext->Cabinet.cbTargetBuffer;
+    pContext->Cabinet.pbTargetBuffer = NULL;
+
+LExit:
+    ReleaseNullMem(pContext->Cabinet.pbTargetBuffer);
+    pContext->Cabinet.cbTargetBuffer = 0;
+    pContext->Cabinet.iTargetBuffer = 0;
+    pContext->Cabinet.pReaderFile = NULL;
+
+    return hr;
+}
+
+static HRESULT CALLBACK ReadCabinet(
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) BYTE* pbBuffer,
+    __in DWORD cbBuffer,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONTAINER_CONTEXT* pContext = static_cast<BURN_CONTAINER_CONTEXT*>(pvContext);
+    ULARGE_INTEGER uliPosition = { };
+    OVERLAPPED overlapped = { };
+    DWORD cbRead = 0;
+
+    if (pContext->qwSize && (qwOffset > pContext->qwSize || cbBuffer > pContext->qwSize - qwOffset))
+    {
+        ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "Failed to read past the end of the cabinet.");
+    }
+
+    if (pContext->pbFileView)
+    {
+        hr = SectionReadView(pContext->pbFileView, pContext->cbFileView, pContext->qwOffset + qwOffset, pbBuffer, cbBuffer);
+        ExitOnFailure(hr, "Failed to read cabinet from view.");
+
+        ExitFunction();
+    }
+
+    // Read at an explicit offset, like CabRead(). ReadFile still moves the file pointer shared by the duplicated
+    // handles, so nothing may rely on where it is left.
+    while (cbBuffer)
+    {
+        uliPosition.QuadPart = pContext->qwOffset + qwOffset;
+        overlapped.Offset = uliPosition.LowPart;
+        overlapped.OffsetHigh = uliPosition.HighPart;
+
+        if (!::ReadFile(pContext->hFile, pbBuffer, cbBuffer, &cbRead, &overlapped))
+        {
+            ExitWithLastError(hr, "Failed to read cabinet.");
+        }
+        else if (!cbRead)
+        {
+            ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "Unexpected end of cabinet.");
+        }
+
+        pbBuffer += cbRead;
+        cbBuffer -= cbRead;
+        qwOffset += cbRead;
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT CALLBACK WriteToTarget(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONTAINER_CONTEXT* pContext = static_cast<BURN_CONTAINER_CONTEXT*>(pvContext);
+
+    hr = FileWriteHandle(pContext->Cabinet.hTargetFile, pbData, cbData);
+    ExitOnFailure(hr, "Failed to write during cabinet extraction.");
+
+    if (pContext->Cabinet.hTargetHash)
+    {
+        hr = CrypHashUpdate(pContext->Cabinet.hTargetHash, pbData, cbData);
+        ExitOnFailure(hr, "Failed to hash during cabinet extraction.");
+    }
+
+LExit:
+    pContext->Cabinet.hrError = hr; // tells write failures apart from decoding failures.
+    return hr;
+}
+
+static HRESULT CALLBACK CopyToTargetBuffer(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONTAINER_CONTEXT* pContext = static_cast<BURN_CONTAINER_CONTEXT*>(pvContext);
+
+    if (memcpy_s(pContext->Cabinet.pbTargetBuffer + pContext->Cabinet.iTargetBuffer, pContext->Cabinet.cbTargetBuffer - pContext->Cabinet.iTargetBuffer, pbData, cbData))
+    {
+        ExitWithRootFailure(hr, E_INSUFFICIENT_BUFFER, "Failed to copy data to target buffer during cabinet extraction.");
+    }
+
+    pContext->Cabinet.iTargetBuffer += cbData;
+
+LExit:
+    pContext->Cabinet.hrError = hr;
+    return hr;
+}
+
 static DWORD WINAPI ExtractThreadProc(
     __in LPVOID lpThreadParameter
     )
@@ -646,14 +986,14 @@ static INT_PTR CloseFileInfoCallback(
     switch (pContext->Cabinet.operation)
     {
     case BURN_CAB_OPERATION_STREAM_TO_FILE:
-        BestEffortSetFileTime(pFDINotify, pContext->Cabinet.hTargetFile);
+        BestEffortSetFileTime(pFDINotify->date, pFDINotify->time, pContext->Cabinet.hTargetFile);
 
         // close file
         ReleaseFile(pContext->Cabinet.hTargetFile);
         break;
 
     case BURN_CAB_OPERATION_STREAM_TO_HANDLE:
-        BestEffortSetFileTime(pFDINotify, pContext->Cabinet.hTargetFile);
+        BestEffortSetFileTime(pFDINotify->date, pFDINotify->time, pContext->Cabinet.hTargetFile);
 
         // Do NOT close file.
         pContext->Cabinet.hTargetFile = INVALID_HANDLE_VALUE;
@@ -721,7 +1061,8 @@ LExit:
 }
 
 static void BestEffortSetFileTime(
-    __in FDINOTIFICATION* pFDINotify,
+    __in USHORT usDate,
+    __in USHORT usTime,
     __in HANDLE hFile
     )
 {
@@ -730,7 +1071,7 @@ static void BestEffortSetFileTime(
 
     // Make a best effort to set the time on the new file before
     // we close it.
-    if (::DosDateTimeToFileTime(pFDINotify->date, pFDINotify->time, &ftLocal))
+    if (::DosDateTimeToFileTime(usDate, usTime, &ftLocal))
     {
         if (::LocalFileTimeToFileTime(&ftLocal, &ft))
         {
@@ -797,12 +1138,29 @@ static UINT FAR DIAMONDAPI CabRead(
     BURN_CONTAINER_CONTEXT* pContext = vpContext;
     HANDLE hFile = (HANDLE)hf;
     DWORD cbRead = 0;
+    LARGE_INTEGER liPosition = { };
+    OVERLAPPED overlapped = { };
+    LPOVERLAPPED pOverlapped = NULL;
+
+    // Read at the virtual file pointer's offset instead of at the file pointer. The file pointer is shared with the
+    // other containers in the bundle which may be extracted on other threads at the same time, and ReadFile still
+    // moves it, so only the explicit offset says where the read happens.
+    if (S_OK == ReadIfVirtualFilePointer(&pContext->Cabinet, hFile, cb, &liPosition))
+    {
+        overlapped.Offset = liPosition.LowPart;
+        overlapped.OffsetHigh = liPosition.HighPart;
+        pOverlapped = &overlapped;
+    }
 
-    ReadIfVirtualFilePointer(&pContext->Cabinet, hFile, cb);
-
-    if (!::ReadFile(hFile, pv, cb, &cbRead, NULL))
+    if (!::ReadFile(hFile, pv, cb, &cbRead, pOverlapped))
     {
-        ExitWithLastError(hr, "Failed to read during cabinet extraction.");
+        // Reading at an offset past the end of the file fails instead of reading nothing.
+        if (!pOverlapped || ERROR_HANDLE_EOF != ::GetLastError())
+        {
+            ExitWithLastError(hr, "Failed to read during cabinet extraction.");
+        }
+
+        cbRead = 0;
     }
 
 LExit:
@@ -829,6 +1187,12 @@ static UINT FAR DIAMONDAPI CabWrite(
         {
             ExitWithLastError(hr, "Failed to write during cabinet extraction.");
         }
+
+        if (pContext->Cabinet.hTargetHash)
+        {
+            hr = CrypHashUpdate(pContext->Cabinet.hTargetHash, static_cast<BYTE*>(pv), cbWrite);
+            ExitOnFailure(hr, "Failed to hash during cabinet extraction.");
+        }
         break;
 
     case BURN_CAB_OPERATION_STREAM_TO_BUFFER:
@@ -942,7 +1306,8 @@ LExit:
 static HRESULT ReadIfVirtualFilePointer(
     __in BURN_CONTAINER_CONTEXT_CABINET* pCabinetContext,
     __in HANDLE hFile,
-    __in DWORD cbRead
+    __in DWORD cbRead,
+    __out LARGE_INTEGER* pliPosition
     )
 {
     HRESULT hr = E_NOTFOUND;
@@ -950,17 +1315,13 @@ static HRESULT ReadIfVirtualFilePointer(
     BURN_CONTAINER_CONTEXT_CABINET_VIRTUAL_FILE_POINTER* pVfp = GetVirtualFilePointer(pCabinetContext, hFile);
     if (pVfp)
     {
-        // Set the file handle to the virtual file pointer.
-        if (!::SetFilePointerEx(hFile, pVfp->liPosition, NULL, FILE_BEGIN))
-        {
-            ExitWithLastError(hr, "Failed to move to virtual file pointer.");
-        }
+        // Return where to read from the virtual file pointer.
+        *pliPosition = pVfp->liPosition;
 
         pVfp->liPosition.QuadPart += cbRead; // add the amount that will be read to advance the pointer.
         hr = S_OK;
     }
 
-LExit:
     return hr;
 }
 
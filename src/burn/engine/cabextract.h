@@ -29,7 +29,8 @@ HRESULT CabExtractStreamToBuffer(
     );
 HRESULT CabExtractStreamToHandle(
     __in BURN_CONTAINER_CONTEXT* pContext,
-    __in HANDLE hFile
+    __in HANDLE hFile,
+    __in_opt CRYP_HASH_HANDLE hHash
     );
 HRESULT CabExtractSkipStream(
     __in BURN_CONTAINER_CONTEXT* pContext
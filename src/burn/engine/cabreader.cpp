@@ -0,0 +1,1731 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+#include "precomp.h"
+
+// Reads cabinets without cabinet.dll so decompressed blocks can be handed straight to the caller.
+// Only what Burn containers need is supported: uncompressed, MSZIP and LZX folders in a single cabinet.
+
+#define CAB_E_CORRUPT HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT)
+
+static const DWORD CAB_SIGNATURE = 0x4643534D; // "MSCF"
+static const DWORD CAB_HEADER_SIZE = 36;
+static const DWORD CAB_HEADER_RESERVE_SIZE = 4;
+static const DWORD CAB_FOLDER_SIZE = 8;
+static const DWORD CAB_FILE_SIZE = 16;
+static const DWORD CAB_DATA_SIZE = 8;
+static const DWORD CAB_MAX_RESERVE_SIZE = 255;
+static const DWORD CAB_MAX_DATA_SIZE = 0xFFFF;
+static const DWORD CAB_MAX_BLOCK_SIZE = 32768;
+static const DWORD CAB_MAX_NAME_SIZE = 256;
+
+static const WORD CAB_FLAG_PREV_CABINET = 0x0001;
+static const WORD CAB_FLAG_NEXT_CABINET = 0x0002;
+static const WORD CAB_FLAG_RESERVE_PRESENT = 0x0004;
+static const WORD CAB_FOLDER_CONTINUED = 0xFFFD; // and above, the file continues from or into another cabinet.
+
+static const WORD CAB_COMPRESSION_MASK = 0x000F;
+static const WORD CAB_COMPRESSION_NONE = 0;
+static const WORD CAB_COMPRESSION_MSZIP = 1;
+static const WORD CAB_COMPRESSION_LZX = 3;
+
+#define HUFFMAN_MAX_BITS 16
+#define HUFFMAN_FAST_BITS 10
+#define HUFFMAN_MAX_SYMBOLS (LZX_NUM_CHARS + LZX_MAX_POSITION_SLOTS * 8)
+
+// MSZIP is a deflate stream per block prefixed with "CK", sharing the history of the folder.
+#define MSZIP_HISTORY_SIZE 32768
+#define MSZIP_WINDOW_SIZE (4 * MSZIP_HISTORY_SIZE)
+#define MSZIP_LITERAL_SYMBOLS 288
+#define MSZIP_DISTANCE_SYMBOLS 32
+#define MSZIP_LENGTH_SYMBOLS 19
+
+#define LZX_MIN_WINDOW_BITS 15
+#define LZX_MAX_WINDOW_BITS 21
+#define LZX_NUM_CHARS 256
+#define LZX_MAX_POSITION_SLOTS 50
+#define LZX_NUM_PRIMARY_LENGTHS 7
+#define LZX_NUM_SECONDARY_LENGTHS 249
+#define LZX_MIN_MATCH 2
+#define LZX_PRETREE_SYMBOLS 20
+#define LZX_ALIGNED_SYMBOLS 8
+#define LZX_LENGTH_SAFETY 64 // like other decoders, tolerate runs of lengths past the end of a tree.
+#define LZX_BLOCK_VERBATIM 1
+#define LZX_BLOCK_ALIGNED 2
+#define LZX_BLOCK_UNCOMPRESSED 3
+#define LZX_E8_MAX_FRAMES 32768
+#define LZX_E8_MIN_FRAME_SIZE 10
+
+
+// structs
+
+typedef struct _CAB_BITS
+{
+    const BYTE* pbInput;
+    DWORD cbInput;
+    DWORD iInput;
+    DWORD dwBits;
+    DWORD cBits;
+} CAB_BITS;
+
+typedef struct _CAB_HUFFMAN
+{
+    WORD rgwFast[1 << HUFFMAN_FAST_BITS]; // symbol << 5 | code length, zero for longer codes.
+    WORD rgcCodes[HUFFMAN_MAX_BITS + 1]; // number of codes of each length.
+    WORD rgwSymbols[HUFFMAN_MAX_SYMBOLS]; // symbols in code order.
+} CAB_HUFFMAN;
+
+typedef struct _CAB_MSZIP
+{
+    CAB_HUFFMAN literals;
+    CAB_HUFFMAN distances;
+    CAB_HUFFMAN lengths;
+    BOOL fFixedTables;
+    CAB_HUFFMAN fixedLiterals;
+    CAB_HUFFMAN fixedDistances;
+
+    DWORD iWindow;
+    BYTE rgbWindow[MSZIP_WINDOW_SIZE];
+} CAB_MSZIP;
+
+typedef struct _CAB_LZX
+{
+    DWORD cPositionSlots;
+    DWORD rgdwPositionBase[LZX_MAX_POSITION_SLOTS];
+    BYTE rgbExtraBits[LZX_MAX_POSITION_SLOTS];
+
+    DWORD iWindow;
+    BOOL fWrapped;
+    DWORD rgdwRecent[3];
+
+    BOOL fHeaderRead;
+    DWORD dwTranslationSize;
+    DWORD dwTranslationPosition;
+    DWORD cFrames;
+
+    DWORD dwBlockType;
+    DWORD cbBlock;
+    DWORD cbBlockRemaining;
+
+    BYTE rgbMainLengths[HUFFMAN_MAX_SYMBOLS + LZX_LENGTH_SAFETY];
+    BYTE rgbLengthLengths[LZX_NUM_SECONDARY_LENGTHS + LZX_LENGTH_SAFETY];
+    CAB_HUFFMAN main;
+    CAB_HUFFMAN length;
+    CAB_HUFFMAN aligned;
+    CAB_HUFFMAN pretree;
+
+    BYTE rgbTranslated[CAB_MAX_BLOCK_SIZE];
+} CAB_LZX;
+
+typedef struct _CAB_READER_DECODER
+{
+    WORD wCompression;
+
+    BYTE* pbLzxWindow;
+    DWORD cbLzxWindow;
+
+    union
+    {
+        CAB_MSZIP mszip;
+        CAB_LZX lzx;
+    };
+} CAB_READER_DECODER;
+
+
+// internal function declarations
+
+static HRESULT ReadFolders(
+    __in CAB_READER* pReader,
+    __in DWORD64 qwOffset,
+    __in DWORD cbFolderReserve
+    );
+static HRESULT ReadFiles(
+    __in CAB_READER* pReader,
+    __in DWORD64 qwOffset,
+    __in DWORD64 qwEnd
+    );
+static HRESULT BeginFolder(
+    __in CAB_READER* pReader,
+    __in DWORD iFolder
+    );
+static HRESULT DecodeNextBlock(
+    __in CAB_READER* pReader
+    );
+static HRESULT SkipStoredBlocks(
+    __in CAB_READER* pReader,
+    __in DWORD64 qwOffset
+    );
+static WORD ReadWord(
+    __in_bcount(2) const BYTE* pb
+    );
+static DWORD ReadDword(
+    __in_bcount(4) const BYTE* pb
+    );
+static DWORD Checksum(
+    __in_bcount(cb) const BYTE* pb,
+    __in DWORD cb,
+    __in DWORD dwSeed
+    );
+static HRESULT BuildHuffman(
+    __in CAB_HUFFMAN* pHuffman,
+    __in_ecount(cSymbols) const BYTE* rgbLengths,
+    __in DWORD cSymbols,
+    __in BOOL fLsbFirst
+    );
+static HRESULT DecodeSlow(
+    __in const CAB_HUFFMAN* pHuffman,
+    __in DWORD dwPeek,
+    __in BOOL fLsbFirst,
+    __out DWORD* pdwSymbol,
+    __out DWORD* pcBits
+    );
+static HRESULT MszipDecode(
+    __in CAB_MSZIP* pMszip,
+    __in_bcount(cbInput) const BYTE* pbInput,
+    __in DWORD cbInput,
+    __in DWORD cbOutput,
+    __out const BYTE** ppbOutput
+    );
+static HRESULT MszipReadTables(
+    __in CAB_MSZIP* pMszip,
+    __in CAB_BITS* pBits
+    );
+static HRESULT MszipInflate(
+    __in CAB_BITS* pBits,
+    __in const CAB_HUFFMAN* pLiterals,
+    __in const CAB_HUFFMAN* pDistances,
+    __in_bcount(cbOutput) BYTE* pbOutput,
+    __in DWORD cbOutput,
+    __in DWORD cbHistory,
+    __inout DWORD* piOutput
+    );
+static void LzxReset(
+    __in CAB_LZX* pLzx,
+    __in DWORD dwWindowBits
+    );
+static HRESULT LzxDecode(
+    __in CAB_LZX* pLzx,
+    __in BYTE* pbWindow,
+    __in DWORD cbWindow,
+    __in_bcount(cbInput) const BYTE* pbInput,
+    __in DWORD cbInput,
+    __in DWORD cbOutput,
+    __out const BYTE** ppbOutput
+    );
+static HRESULT LzxReadBlockHeader(
+    __in CAB_LZX* pLzx,
+    __in CAB_BITS* pBits
+    );
+static HRESULT LzxReadLengths(
+    __in CAB_LZX* pLzx,
+    __in CAB_BITS* pBits,
+    __in BYTE* rgbLengths,
+    __in DWORD iFirst,
+    __in DWORD iLast
+    );
+static void LzxTranslateE8(
+    __in_bcount(cb) BYTE* pb,
+    __in DWORD cb,
+    __in DWORD dwPosition,
+    __in DWORD dwTranslationSize
+    );
+
+
+// function definitions
+
+extern "C" HRESULT CabReaderOpen(
+    __in CAB_READER* pReader,
+    __in PFN_CAB_READER_READ pfnRead,
+    __in_opt LPVOID pvReadContext,
+    __in DWORD64 qwSize
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE rgbHeader[CAB_HEADER_SIZE + CAB_HEADER_RESERVE_SIZE] = { };
+    DWORD cbCabinet = 0;
+    DWORD dwFilesOffset = 0;
+    WORD cFolders = 0;
+    WORD cFiles = 0;
+    WORD wFlags = 0;
+    DWORD64 qwOffset = CAB_HEADER_SIZE;
+    DWORD cbFolderReserve = 0;
+    DWORD64 qwFilesEnd = 0;
+
+    memset(pReader, 0, sizeof(CAB_READER));
+    pReader->pfnRead = pfnRead;
+    pReader->pvReadContext = pvReadContext;
+
+    hr = pfnRead(0, rgbHeader, CAB_HEADER_SIZE, pvReadContext);
+    ExitOnFailure(hr, "Failed to read cabinet header.");
+
+    cbCabinet = ReadDword(rgbHeader + 8);
+    dwFilesOffset = ReadDword(rgbHeader + 16);
+    cFolders = ReadWord(rgbHeader + 26);
+    cFiles = ReadWord(rgbHeader + 28);
+    wFlags = ReadWord(rgbHeader + 30);
+
+    if (CAB_SIGNATURE != ReadDword(rgbHeader) || 1 != rgbHeader[25])
+    {
+        ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION), "Not a supported cabinet.");
+    }
+    else if (wFlags & (CAB_FLAG_PREV_CABINET | CAB_FLAG_NEXT_CABINET))
+    {
+        ExitFunction1(hr = E_NOTIMPL);
+    }
+    else if ((qwSize && cbCabinet > qwSize) || dwFilesOffset > cbCabinet)
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Cabinet size: %u does not fit in container size: %llu.", cbCabinet, qwSize);
+    }
+
+    if (wFlags & CAB_FLAG_RESERVE_PRESENT)
+    {
+        hr = pfnRead(qwOffset, rgbHeader + CAB_HEADER_SIZE, CAB_HEADER_RESERVE_SIZE, pvReadContext);
+        ExitOnFailure(hr, "Failed to read cabinet reserve sizes.");
+
+        qwOffset += CAB_HEADER_RESERVE_SIZE + ReadWord(rgbHeader + CAB_HEADER_SIZE);
+        cbFolderReserve = rgbHeader[CAB_HEADER_SIZE + 2];
+        pReader->cbDataReserve = rgbHeader[CAB_HEADER_SIZE + 3];
+    }
+
+    pReader->cFolders = cFolders;
+    pReader->cFiles = cFiles;
+
+    hr = ReadFolders(pReader, qwOffset, cbFolderReserve);
+    ExitOnFailure(hr, "Failed to read cabinet folders.");
+
+    // The file entries end where the first data block starts.
+    qwFilesEnd = cbCabinet;
+    for (DWORD i = 0; i < pReader->cFolders; ++i)
+    {
+        if (pReader->rgFolders[i].cData && pReader->rgFolders[i].dwDataOffset < qwFilesEnd)
+        {
+            qwFilesEnd = pReader->rgFolders[i].dwDataOffset;
+        }
+    }
+
+    hr = ReadFiles(pReader, dwFilesOffset, qwFilesEnd);
+    ExitOnFailure(hr, "Failed to read cabinet files.");
+
+    pReader->pbInput = static_cast<BYTE*>(MemAlloc(CAB_DATA_SIZE + CAB_MAX_RESERVE_SIZE + CAB_MAX_DATA_SIZE, FALSE));
+    ExitOnNull(pReader->pbInput, hr, E_OUTOFMEMORY, "Failed to allocate cabinet data block.");
+
+    pReader->iFolder = pReader->cFolders;
+
+LExit:
+    if (FAILED(hr))
+    {
+        CabReaderClose(pReader);
+    }
+
+    return hr;
+}
+
+extern "C" HRESULT CabReaderNextFile(
+    __in CAB_READER* pReader,
+    __out const CAB_READER_FILE** ppFile
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (pReader->iNextFile >= pReader->cFiles)
+    {
+        ExitFunction1(hr = E_NOMOREITEMS);
+    }
+
+    *ppFile = pReader->rgFiles + pReader->iNextFile;
+    ++pReader->iNextFile;
+
+LExit:
+    return hr;
+}
+
+extern "C" HRESULT CabReaderReadFile(
+    __in CAB_READER* pReader,
+    __in PFN_CAB_READER_WRITE pfnWrite,
+    __in_opt LPVOID pvWriteContext
+    )
+{
+    HRESULT hr = S_OK;
+    const CAB_READER_FILE* pFile = NULL;
+    DWORD64 qwOffset = 0;
+    DWORD64 qwEnd = 0;
+
+    if (!pReader->iNextFile)
+    {
+        ExitWithRootFailure(hr, E_INVALIDSTATE, "No cabinet file to read.");
+    }
+
+    pFile = pReader->rgFiles + pReader->iNextFile - 1;
+    qwOffset = pFile->dwFolderOffset;
+    qwEnd = qwOffset + pFile->cbFile;
+
+    // Decoding only moves forward, a file before the current block restarts its folder.
+    if (pFile->iFolder != pReader->iFolder || qwOffset < pReader->qwPosition)
+    {
+        hr = BeginFolder(pReader, pFile->iFolder);
+        ExitOnFailure(hr, "Failed to begin cabinet folder: %u", pFile->iFolder);
+    }
+
+    if (CAB_COMPRESSION_NONE == (pReader->rgFolders[pReader->iFolder].wCompression & CAB_COMPRESSION_MASK))
+    {
+        hr = SkipStoredBlocks(pReader, qwOffset);
+        ExitOnFailure(hr, "Failed to skip to cabinet file: %ls", pFile->sczName);
+    }
+
+    while (qwOffset < qwEnd)
+    {
+        if (qwOffset >= pReader->qwPosition + pReader->cbBlock)
+        {
+            hr = DecodeNextBlock(pReader);
+            ExitOnFailure(hr, "Failed to decode cabinet data block: %u in folder: %u", pReader->iData, pReader->iFolder);
+
+            continue;
+        }
+
+        DWORD iBlock = static_cast<DWORD>(qwOffset - pReader->qwPosition);
+        DWORD cbWrite = static_cast<DWORD>(min(pReader->cbBlock - iBlock, qwEnd - qwOffset));
+
+        hr = pfnWrite(pReader->pbBlock + iBlock, cbWrite, pvWriteContext);
+        ExitOnFailure(hr, "Failed to write decompressed cabinet data.");
+
+        qwOffset += cbWrite;
+    }
+
+LExit:
+    return hr;
+}
+
+extern "C" void CabReaderClose(
+    __in CAB_READER* pReader
+    )
+{
+    for (DWORD i = 0; pReader->rgFiles && i < pReader->cFiles; ++i)
+    {
+        ReleaseStr(pReader->rgFiles[i].sczName);
+    }
+
+    if (pReader->pDecoder)
+    {
+        ReleaseMem(pReader->pDecoder->pbLzxWindow);
+        MemFree(pReader->pDecoder);
+    }
+
+    ReleaseMem(pReader->rgFiles);
+    ReleaseMem(pReader->rgFolders);
+    ReleaseMem(pReader->pbInput);
+
+    memset(pReader, 0, sizeof(CAB_READER));
+}
+
+
+// internal helper functions
+
+static HRESULT ReadFolders(
+    __in CAB_READER* pReader,
+    __in DWORD64 qwOffset,
+    __in DWORD cbFolderReserve
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbEntry = CAB_FOLDER_SIZE + cbFolderReserve;
+    BYTE* pbFolders = NULL;
+
+    if (!pReader->cFolders)
+    {
+        ExitFunction();
+    }
+
+    pbFolders = static_cast<BYTE*>(MemAlloc(cbEntry * pReader->cFolders, FALSE));
+    ExitOnNull(pbFolders, hr, E_OUTOFMEMORY, "Failed to allocate cabinet folder entries.");
+
+    pReader->rgFolders = static_cast<CAB_READER_FOLDER*>(MemAlloc(sizeof(CAB_READER_FOLDER) * pReader->cFolders, TRUE));
+    ExitOnNull(pReader->rgFolders, hr, E_OUTOFMEMORY, "Failed to allocate cabinet folders.");
+
+    hr = pReader->pfnRead(qwOffset, pbFolders, cbEntry * pReader->cFolders, pReader->pvReadContext);
+    ExitOnFailure(hr, "Failed to read cabinet folder entries.");
+
+    for (DWORD i = 0; i < pReader->cFolders; ++i)
+    {
+        const BYTE* pbEntry = pbFolders + cbEntry * i;
+        CAB_READER_FOLDER* pFolder = pReader->rgFolders + i;
+        DWORD dwWindowBits = 0;
+
+        pFolder->dwDataOffset = ReadDword(pbEntry);
+        pFolder->cData = ReadWord(pbEntry + 4);
+        pFolder->wCompression = ReadWord(pbEntry + 6);
+
+        switch (pFolder->wCompression & CAB_COMPRESSION_MASK)
+        {
+        case CAB_COMPRESSION_NONE: __fallthrough;
+        case CAB_COMPRESSION_MSZIP:
+            break;
+
+        case CAB_COMPRESSION_LZX:
+            dwWindowBits = (pFolder->wCompression >> 8) & 0x1F;
+            if (LZX_MIN_WINDOW_BITS > dwWindowBits || LZX_MAX_WINDOW_BITS < dwWindowBits)
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid LZX window size: %u", dwWindowBits);
+            }
+            break;
+
+        default: // Quantum is left to cabinet.dll.
+            ExitFunction1(hr = E_NOTIMPL);
+        }
+    }
+
+LExit:
+    ReleaseMem(pbFolders);
+
+    return hr;
+}
+
+static HRESULT ReadFiles(
+    __in CAB_READER* pReader,
+    __in DWORD64 qwOffset,
+    __in DWORD64 qwEnd
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE* pbFiles = NULL;
+    DWORD cbFiles = 0;
+    DWORD iEntry = 0;
+
+    if (!pReader->cFiles)
+    {
+        ExitFunction();
+    }
+    else if (qwEnd < qwOffset || qwEnd - qwOffset > pReader->cFiles * (CAB_FILE_SIZE + CAB_MAX_NAME_SIZE))
+    {
+        qwEnd = qwOffset + pReader->cFiles * (CAB_FILE_SIZE + CAB_MAX_NAME_SIZE);
+    }
+
+    cbFiles = static_cast<DWORD>(qwEnd - qwOffset);
+
+    pbFiles = static_cast<BYTE*>(MemAlloc(cbFiles, FALSE));
+    ExitOnNull(pbFiles, hr, E_OUTOFMEMORY, "Failed to allocate cabinet file entries.");
+
+    pReader->rgFiles = static_cast<CAB_READER_FILE*>(MemAlloc(sizeof(CAB_READER_FILE) * pReader->cFiles, TRUE));
+    ExitOnNull(pReader->rgFiles, hr, E_OUTOFMEMORY, "Failed to allocate cabinet files.");
+
+    hr = pReader->pfnRead(qwOffset, pbFiles, cbFiles, pReader->pvReadContext);
+    ExitOnFailure(hr, "Failed to read cabinet file entries.");
+
+    for (DWORD i = 0; i < pReader->cFiles; ++i)
+    {
+        CAB_READER_FILE* pFile = pReader->rgFiles + i;
+        const BYTE* pbEntry = pbFiles + iEntry;
+        const BYTE* pbName = pbEntry + CAB_FILE_SIZE;
+        const BYTE* pbNameEnd = NULL;
+        WORD wFolder = 0;
+
+        if (cbFiles - iEntry <= CAB_FILE_SIZE || !(pbNameEnd = static_cast<const BYTE*>(memchr(pbName, 0, cbFiles - iEntry - CAB_FILE_SIZE))))
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Cabinet file entry: %u is truncated.", i);
+        }
+
+        pFile->cbFile = ReadDword(pbEntry);
+        pFile->dwFolderOffset = ReadDword(pbEntry + 4);
+        wFolder = ReadWord(pbEntry + 8);
+        pFile->wDate = ReadWord(pbEntry + 10);
+        pFile->wTime = ReadWord(pbEntry + 12);
+        pFile->wAttributes = ReadWord(pbEntry + 14);
+        pFile->iFolder = wFolder;
+
+        if (CAB_FOLDER_CONTINUED <= wFolder)
+        {
+            ExitFunction1(hr = E_NOTIMPL);
+        }
+        else if (wFolder >= pReader->cFolders)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Cabinet file entry: %u is in invalid folder: %u", i, wFolder);
+        }
+
+        hr = StrAllocStringAnsi(&pFile->sczName, reinterpret_cast<LPCSTR>(pbName), 0, CP_UTF8);
+        ExitOnFailure(hr, "Failed to copy cabinet file name.");
+
+        iEntry += CAB_FILE_SIZE + static_cast<DWORD>(pbNameEnd - pbName) + 1;
+    }
+
+LExit:
+    ReleaseMem(pbFiles);
+
+    return hr;
+}
+
+static HRESULT BeginFolder(
+    __in CAB_READER* pReader,
+    __in DWORD iFolder
+    )
+{
+    HRESULT hr = S_OK;
+    CAB_READER_FOLDER* pFolder = pReader->rgFolders + iFolder;
+    CAB_READER_DECODER* pDecoder = pReader->pDecoder;
+    DWORD dwWindowBits = 0;
+
+    if (!pDecoder)
+    {
+        pDecoder = static_cast<CAB_READER_DECODER*>(MemAlloc(sizeof(CAB_READER_DECODER), TRUE));
+        ExitOnNull(pDecoder, hr, E_OUTOFMEMORY, "Failed to allocate cabinet decoder.");
+
+        pReader->pDecoder = pDecoder;
+    }
+
+    switch (pFolder->wCompression & CAB_COMPRESSION_MASK)
+    {
+    case CAB_COMPRESSION_MSZIP:
+        if (pDecoder->wCompression != pFolder->wCompression)
+        {
+            memset(&pDecoder->mszip, 0, sizeof(pDecoder->mszip));
+        }
+
+        pDecoder->mszip.iWindow = 0;
+        break;
+
+    case CAB_COMPRESSION_LZX:
+        dwWindowBits = (pFolder->wCompression >> 8) & 0x1F;
+
+        if (pDecoder->cbLzxWindow != (1UL << dwWindowBits))
+        {
+            ReleaseNullMem(pDecoder->pbLzxWindow);
+            pDecoder->cbLzxWindow = 0;
+
+            pDecoder->pbLzxWindow = static_cast<BYTE*>(MemAlloc(1UL << dwWindowBits, FALSE));
+            ExitOnNull(pDecoder->pbLzxWindow, hr, E_OUTOFMEMORY, "Failed to allocate LZX window.");
+
+            pDecoder->cbLzxWindow = 1UL << dwWindowBits;
+        }
+
+        LzxReset(&pDecoder->lzx, dwWindowBits);
+        break;
+    }
+
+    pDecoder->wCompression = pFolder->wCompression;
+
+    pReader->iFolder = iFolder;
+    pReader->iData = 0;
+    pReader->qwDataOffset = pFolder->dwDataOffset;
+    pReader->qwPosition = 0;
+    pReader->pbBlock = NULL;
+    pReader->cbBlock = 0;
+
+LExit:
+    if (FAILED(hr))
+    {
+        pReader->iFolder = pReader->cFolders;
+    }
+
+    return hr;
+}
+
+static HRESULT DecodeNextBlock(
+    __in CAB_READER* pReader
+    )
+{
+    HRESULT hr = S_OK;
+    CAB_READER_FOLDER* pFolder = pReader->rgFolders + pReader->iFolder;
+    CAB_READER_DECODER* pDecoder = pReader->pDecoder;
+    DWORD cbHeader = CAB_DATA_SIZE + pReader->cbDataReserve;
+    BYTE* pbData = pReader->pbInput + cbHeader;
+    DWORD dwChecksum = 0;
+    WORD cbData = 0;
+    WORD cbUncompressed = 0;
+
+    // Any failure leaves the folder to be restarted by the next read.
+    pReader->qwPosition += pReader->cbBlock;
+    pReader->pbBlock = NULL;
+    pReader->cbBlock = 0;
+
+    if (pReader->iData >= pFolder->cData)
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Cabinet file extends past the end of its folder.");
+    }
+
+    hr = pReader->pfnRead(pReader->qwDataOffset, pReader->pbInput, cbHeader, pReader->pvReadContext);
+    ExitOnFailure(hr, "Failed to read cabinet data block header.");
+
+    dwChecksum = ReadDword(pReader->pbInput);
+    cbData = ReadWord(pReader->pbInput + 4);
+    cbUncompressed = ReadWord(pReader->pbInput + 6);
+
+    if (!cbUncompressed || CAB_MAX_BLOCK_SIZE < cbUncompressed)
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid cabinet data block size: %u", cbUncompressed);
+    }
+
+    hr = pReader->pfnRead(pReader->qwDataOffset + cbHeader, pbData, cbData, pReader->pvReadContext);
+    ExitOnFailure(hr, "Failed to read cabinet data block.");
+
+    if (dwChecksum && dwChecksum != Checksum(pReader->pbInput + 4, 4, Checksum(pbData, cbData, 0)))
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Cabinet data block checksum mismatch.");
+    }
+
+    switch (pFolder->wCompression & CAB_COMPRESSION_MASK)
+    {
+    case CAB_COMPRESSION_NONE:
+        if (cbData != cbUncompressed)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Uncompressed cabinet data block size mismatch.");
+        }
+
+        pReader->pbBlock = pbData;
+        break;
+
+    case CAB_COMPRESSION_MSZIP:
+        hr = MszipDecode(&pDecoder->mszip, pbData, cbData, cbUncompressed, &pReader->pbBlock);
+        ExitOnFailure(hr, "Failed to decode MSZIP data block.");
+        break;
+
+    case CAB_COMPRESSION_LZX:
+        hr = LzxDecode(&pDecoder->lzx, pDecoder->pbLzxWindow, pDecoder->cbLzxWindow, pbData, cbData, cbUncompressed, &pReader->pbBlock);
+        ExitOnFailure(hr, "Failed to decode LZX data block.");
+        break;
+    }
+
+    pReader->cbBlock = cbUncompressed;
+    pReader->qwDataOffset += cbHeader + cbData;
+    ++pReader->iData;
+
+LExit:
+    if (FAILED(hr))
+    {
+        pReader->iFolder = pReader->cFolders;
+    }
+
+    return hr;
+}
+
+// Compressed blocks depend on the blocks before them, stored blocks can be stepped over by their headers alone.
+static HRESULT SkipStoredBlocks(
+    __in CAB_READER* pReader,
+    __in DWORD64 qwOffset
+    )
+{
+    HRESULT hr = S_OK;
+    CAB_READER_FOLDER* pFolder = pReader->rgFolders + pReader->iFolder;
+    BYTE rgbHeader[CAB_DATA_SIZE] = { };
+    WORD cbData = 0;
+
+    while (qwOffset >= pReader->qwPosition + pReader->cbBlock && pReader->iData < pFolder->cData)
+    {
+        hr = pReader->pfnRead(pReader->qwDataOffset, rgbHeader, sizeof(rgbHeader), pReader->pvReadContext);
+        ExitOnFailure(hr, "Failed to read cabinet data block header.");
+
+        cbData = ReadWord(rgbHeader + 4);
+        if (cbData != ReadWord(rgbHeader + 6) || !cbData || CAB_MAX_BLOCK_SIZE < cbData)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid uncompressed cabinet data block size: %u", cbData);
+        }
+        else if (qwOffset < pReader->qwPosition + pReader->cbBlock + cbData)
+        {
+            break; // the block holds the start of the file.
+        }
+
+        // Leave no current block, a later file inside a skipped block restarts the folder.
+        pReader->qwPosition += pReader->cbBlock + cbData;
+        pReader->pbBlock = NULL;
+        pReader->cbBlock = 0;
+        pReader->qwDataOffset += CAB_DATA_SIZE + pReader->cbDataReserve + cbData;
+        ++pReader->iData;
+    }
+
+LExit:
+    if (FAILED(hr))
+    {
+        pReader->iFolder = pReader->cFolders;
+    }
+
+    return hr;
+}
+
+// Cabinet fields are little-endian and not aligned.
+static WORD ReadWord(
+    __in_bcount(2) const BYTE* pb
+    )
+{
+    return static_cast<WORD>(pb[0] | (pb[1] << 8));
+}
+
+static DWORD ReadDword(
+    __in_bcount(4) const BYTE* pb
+    )
+{
+    return pb[0] | (pb[1] << 8) | (pb[2] << 16) | (static_cast<DWORD>(pb[3]) << 24);
+}
+
+static DWORD Checksum(
+    __in_bcount(cb) const BYTE* pb,
+    __in DWORD cb,
+    __in DWORD dwSeed
+    )
+{
+    DWORD dwChecksum = dwSeed;
+    DWORD dwTail = 0;
+
+    for (DWORD i = 0; i < cb / 4; ++i, pb += 4)
+    {
+        dwChecksum ^= ReadDword(pb);
+    }
+
+    switch (cb % 4)
+    {
+    case 3:
+        dwTail |= *pb++ << 16;
+        __fallthrough;
+    case 2:
+        dwTail |= *pb++ << 8;
+        __fallthrough;
+    case 1:
+        dwTail |= *pb;
+    }
+
+    return dwChecksum ^ dwTail;
+}
+
+// Deflate packs bits from the least significant bit of each byte.
+static inline DWORD PeekLsb(
+    __in CAB_BITS* pBits,
+    __in DWORD cBits
+    )
+{
+    while (pBits->cBits < cBits)
+    {
+        DWORD dwByte = pBits->iInput < pBits->cbInput ? pBits->pbInput[pBits->iInput] : 0;
+
+        ++pBits->iInput;
+        pBits->dwBits |= dwByte << pBits->cBits;
+        pBits->cBits += 8;
+    }
+
+    return pBits->dwBits & ((1UL << cBits) - 1);
+}
+
+static inline void SkipLsb(
+    __in CAB_BITS* pBits,
+    __in DWORD cBits
+    )
+{
+    pBits->dwBits >>= cBits;
+    pBits->cBits -= cBits;
+}
+
+static inline DWORD ReadLsb(
+    __in CAB_BITS* pBits,
+    __in DWORD cBits
+    )
+{
+    DWORD dwValue = PeekLsb(pBits, cBits);
+
+    SkipLsb(pBits, cBits);
+
+    return dwValue;
+}
+
+static inline HRESULT DecodeLsb(
+    __in CAB_BITS* pBits,
+    __in const CAB_HUFFMAN* pHuffman,
+    __out DWORD* pdwSymbol
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD dwPeek = PeekLsb(pBits, HUFFMAN_MAX_BITS);
+    WORD wEntry = pHuffman->rgwFast[dwPeek & ((1 << HUFFMAN_FAST_BITS) - 1)];
+    DWORD cBits = wEntry & 0x1F;
+
+    if (wEntry)
+    {
+        *pdwSymbol = wEntry >> 5;
+    }
+    else
+    {
+        hr = DecodeSlow(pHuffman, dwPeek, TRUE, pdwSymbol, &cBits);
+    }
+
+    SkipLsb(pBits, cBits);
+
+    return hr;
+}
+
+// LZX reads 16-bit little-endian words from their most significant bit.
+static inline DWORD PeekMsb(
+    __in CAB_BITS* pBits,
+    __in DWORD cBits
+    )
+{
+    while (pBits->cBits < cBits)
+    {
+        DWORD dwWord = pBits->iInput + 1 < pBits->cbInput ? pBits->pbInput[pBits->iInput] | (pBits->pbInput[pBits->iInput + 1] << 8) : 0;
+
+        pBits->iInput += 2;
+        pBits->dwBits |= dwWord << (16 - pBits->cBits);
+        pBits->cBits += 16;
+    }
+
+    return cBits ? pBits->dwBits >> (32 - cBits) : 0;
+}
+
+static inline void SkipMsb(
+    __in CAB_BITS* pBits,
+    __in DWORD cBits
+    )
+{
+    pBits->dwBits = cBits < 32 ? pBits->dwBits << cBits : 0;
+    pBits->cBits -= cBits;
+}
+
+static inline DWORD ReadMsb(
+    __in CAB_BITS* pBits,
+    __in DWORD cBits
+    )
+{
+    DWORD dwValue = PeekMsb(pBits, cBits);
+
+    SkipMsb(pBits, cBits);
+
+    return dwValue;
+}
+
+static inline HRESULT DecodeMsb(
+    __in CAB_BITS* pBits,
+    __in const CAB_HUFFMAN* pHuffman,
+    __out DWORD* pdwSymbol
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD dwPeek = PeekMsb(pBits, HUFFMAN_MAX_BITS);
+    WORD wEntry = pHuffman->rgwFast[dwPeek >> (HUFFMAN_MAX_BITS - HUFFMAN_FAST_BITS)];
+    DWORD cBits = wEntry & 0x1F;
+
+    if (wEntry)
+    {
+        *pdwSymbol = wEntry >> 5;
+    }
+    else
+    {
+        hr = DecodeSlow(pHuffman, dwPeek, FALSE, pdwSymbol, &cBits);
+    }
+
+    SkipMsb(pBits, cBits);
+
+    return hr;
+}
+
+// True when the bits consumed so far fit in the input, reads past the end produce zeros until this is checked.
+static inline BOOL IsInputConsumed(
+    __in const CAB_BITS* pBits
+    )
+{
+    return 8ULL * pBits->iInput - pBits->cBits <= 8ULL * pBits->cbInput;
+}
+
+static HRESULT BuildHuffman(
+    __in CAB_HUFFMAN* pHuffman,
+    __in_ecount(cSymbols) const BYTE* rgbLengths,
+    __in DWORD cSymbols,
+    __in BOOL fLsbFirst
+    )
+{
+    HRESULT hr = S_OK;
+    WORD rgiOffsets[HUFFMAN_MAX_BITS + 1] = { };
+    LONG lAvailable = 1;
+    DWORD dwCode = 0;
+    DWORD iSymbol = 0;
+
+    memset(pHuffman->rgcCodes, 0, sizeof(pHuffman->rgcCodes));
+    memset(pHuffman->rgwFast, 0, sizeof(pHuffman->rgwFast));
+
+    for (DWORD i = 0; i < cSymbols; ++i)
+    {
+        if (HUFFMAN_MAX_BITS < rgbLengths[i])
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid Huffman code length: %u", rgbLengths[i]);
+        }
+
+        ++pHuffman->rgcCodes[rgbLengths[i]];
+    }
+
+    pHuffman->rgcCodes[0] = 0;
+
+    // Incomplete codes are allowed, only decoding a missing code fails.
+    for (DWORD cBits = 1; cBits <= HUFFMAN_MAX_BITS; ++cBits)
+    {
+        lAvailable = (lAvailable << 1) - pHuffman->rgcCodes[cBits];
+        if (0 > lAvailable)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Huffman code is over-subscribed.");
+        }
+
+        if (cBits < HUFFMAN_MAX_BITS)
+        {
+            rgiOffsets[cBits + 1] = rgiOffsets[cBits] + pHuffman->rgcCodes[cBits];
+        }
+    }
+
+    for (DWORD i = 0; i < cSymbols; ++i)
+    {
+        if (rgbLengths[i])
+        {
+            pHuffman->rgwSymbols[rgiOffsets[rgbLengths[i]]++] = static_cast<WORD>(i);
+        }
+    }
+
+    // Codes are canonical, so the codes short enough for the lookup table are the first ones in code order.
+    for (DWORD cBits = 1; cBits <= HUFFMAN_FAST_BITS; ++cBits, dwCode <<= 1)
+    {
+        for (DWORD i = 0; i < pHuffman->rgcCodes[cBits]; ++i, ++dwCode, ++iSymbol)
+        {
+            WORD wEntry = static_cast<WORD>((pHuffman->rgwSymbols[iSymbol] << 5) | cBits);
+            DWORD cFill = 1UL << (HUFFMAN_FAST_BITS - cBits);
+
+            if (fLsbFirst)
+            {
+                DWORD dwReversed = 0;
+
+                for (DWORD j = 0; j < cBits; ++j)
+                {
+                    dwReversed |= ((dwCode >> j) & 1) << (cBits - 1 - j);
+                }
+
+                for (DWORD j = 0; j < cFill; ++j)
+                {
+                    pHuffman->rgwFast[dwReversed | (j << cBits)] = wEntry;
+                }
+            }
+            else
+            {
+                for (DWORD j = 0; j < cFill; ++j)
+                {
+                    pHuffman->rgwFast[(dwCode << (HUFFMAN_FAST_BITS - cBits)) | j] = wEntry;
+                }
+            }
+        }
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT DecodeSlow(
+    __in const CAB_HUFFMAN* pHuffman,
+    __in DWORD dwPeek,
+    __in BOOL fLsbFirst,
+    __out DWORD* pdwSymbol,
+    __out DWORD* pcBits
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD dwCode = 0;
+    DWORD dwFirst = 0;
+    DWORD iSymbol = 0;
+
+    for (DWORD cBits = 1; cBits <= HUFFMAN_MAX_BITS; ++cBits)
+    {
+        DWORD cCodes = pHuffman->rgcCodes[cBits];
+
+        dwCode |= fLsbFirst ? (dwPeek >> (cBits - 1)) & 1 : (dwPeek >> (HUFFMAN_MAX_BITS - cBits)) & 1;
+
+        if (dwCode < dwFirst + cCodes)
+        {
+            *pdwSymbol = pHuffman->rgwSymbols[iSymbol + dwCode - dwFirst];
+            *pcBits = cBits;
+            ExitFunction();
+        }
+
+        iSymbol += cCodes;
+        dwFirst = (dwFirst + cCodes) << 1;
+        dwCode <<= 1;
+    }
+
+    *pcBits = 0;
+    ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid Huffman code.");
+
+LExit:
+    return hr;
+}
+
+static HRESULT MszipDecode(
+    __in CAB_MSZIP* pMszip,
+    __in_bcount(cbInput) const BYTE* pbInput,
+    __in DWORD cbInput,
+    __in DWORD cbOutput,
+    __out const BYTE** ppbOutput
+    )
+{
+    HRESULT hr = S_OK;
+    CAB_BITS bits = { };
+    BYTE* pbOutput = NULL;
+    DWORD iOutput = 0;
+    BOOL fFinal = FALSE;
+
+    if (2 > cbInput || 'C' != pbInput[0] || 'K' != pbInput[1])
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Missing MSZIP signature.");
+    }
+
+    // Keep the last 32K as history when the next block may not fit.
+    if (pMszip->iWindow + CAB_MAX_BLOCK_SIZE > MSZIP_WINDOW_SIZE)
+    {
+        memmove(pMszip->rgbWindow, pMszip->rgbWindow + pMszip->iWindow - MSZIP_HISTORY_SIZE, MSZIP_HISTORY_SIZE);
+        pMszip->iWindow = MSZIP_HISTORY_SIZE;
+    }
+
+    pbOutput = pMszip->rgbWindow + pMszip->iWindow;
+
+    bits.pbInput = pbInput + 2;
+    bits.cbInput = cbInput - 2;
+
+    do
+    {
+        fFinal = ReadLsb(&bits, 1);
+
+        switch (ReadLsb(&bits, 2))
+        {
+        case 0: // stored
+        {
+            DWORD cbStored = 0;
+
+            SkipLsb(&bits, bits.cBits % 8);
+
+            cbStored = ReadLsb(&bits, 16);
+            if ((cbStored ^ 0xFFFF) != ReadLsb(&bits, 16))
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid MSZIP stored block length.");
+            }
+            else if (cbStored > cbOutput - iOutput)
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP stored block is larger than its data block.");
+            }
+
+            for (; cbStored && bits.cBits; --cbStored)
+            {
+                pbOutput[iOutput++] = static_cast<BYTE>(ReadLsb(&bits, 8));
+            }
+
+            if (cbStored > bits.cbInput - min(bits.iInput, bits.cbInput))
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP stored block is truncated.");
+            }
+
+            memcpy(pbOutput + iOutput, bits.pbInput + bits.iInput, cbStored);
+            bits.iInput += cbStored;
+            iOutput += cbStored;
+            break;
+        }
+
+        case 1: // fixed Huffman codes
+            if (!pMszip->fFixedTables)
+            {
+                BYTE rgbLengths[MSZIP_LITERAL_SYMBOLS] = { };
+
+                memset(rgbLengths, 8, 144);
+                memset(rgbLengths + 144, 9, 256 - 144);
+                memset(rgbLengths + 256, 7, 280 - 256);
+                memset(rgbLengths + 280, 8, MSZIP_LITERAL_SYMBOLS - 280);
+
+                hr = BuildHuffman(&pMszip->fixedLiterals, rgbLengths, MSZIP_LITERAL_SYMBOLS, TRUE);
+                ExitOnFailure(hr, "Failed to build fixed MSZIP literal codes.");
+
+                memset(rgbLengths, 5, MSZIP_DISTANCE_SYMBOLS);
+
+                hr = BuildHuffman(&pMszip->fixedDistances, rgbLengths, MSZIP_DISTANCE_SYMBOLS, TRUE);
+                ExitOnFailure(hr, "Failed to build fixed MSZIP distance codes.");
+
+                pMszip->fFixedTables = TRUE;
+            }
+
+            hr = MszipInflate(&bits, &pMszip->fixedLiterals, &pMszip->fixedDistances, pbOutput, cbOutput, pMszip->iWindow, &iOutput);
+            ExitOnFailure(hr, "Failed to inflate MSZIP block with fixed codes.");
+            break;
+
+        case 2: // dynamic Huffman codes
+            hr = MszipReadTables(pMszip, &bits);
+            ExitOnFailure(hr, "Failed to read MSZIP codes.");
+
+            hr = MszipInflate(&bits, &pMszip->literals, &pMszip->distances, pbOutput, cbOutput, pMszip->iWindow, &iOutput);
+            ExitOnFailure(hr, "Failed to inflate MSZIP block with dynamic codes.");
+            break;
+
+        default:
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid MSZIP block type.");
+        }
+    } while (!fFinal);
+
+    if (iOutput != cbOutput || !IsInputConsumed(&bits))
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP block decoded to: %u bytes, expected: %u", iOutput, cbOutput);
+    }
+
+    pMszip->iWindow += cbOutput;
+    *ppbOutput = pbOutput;
+
+LExit:
+    return hr;
+}
+
+static HRESULT MszipReadTables(
+    __in CAB_MSZIP* pMszip,
+    __in CAB_BITS* pBits
+    )
+{
+    static const BYTE rgbLengthOrder[MSZIP_LENGTH_SYMBOLS] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    HRESULT hr = S_OK;
+    BYTE rgbLengths[MSZIP_LITERAL_SYMBOLS + MSZIP_DISTANCE_SYMBOLS] = { };
+    DWORD cLiterals = ReadLsb(pBits, 5) + 257;
+    DWORD cDistances = ReadLsb(pBits, 5) + 1;
+    DWORD cLengths = ReadLsb(pBits, 4) + 4;
+
+    if (286 < cLiterals || 30 < cDistances)
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid MSZIP code counts.");
+    }
+
+    for (DWORD i = 0; i < cLengths; ++i)
+    {
+        rgbLengths[rgbLengthOrder[i]] = static_cast<BYTE>(ReadLsb(pBits, 3));
+    }
+
+    hr = BuildHuffman(&pMszip->lengths, rgbLengths, MSZIP_LENGTH_SYMBOLS, TRUE);
+    ExitOnFailure(hr, "Failed to build MSZIP code length codes.");
+
+    memset(rgbLengths, 0, MSZIP_LENGTH_SYMBOLS);
+
+    for (DWORD i = 0; i < cLiterals + cDistances;)
+    {
+        DWORD dwSymbol = 0;
+        DWORD cRepeat = 0;
+        BYTE bLength = 0;
+
+        hr = DecodeLsb(pBits, &pMszip->lengths, &dwSymbol);
+        ExitOnFailure(hr, "Failed to decode MSZIP code length.");
+
+        if (16 > dwSymbol)
+        {
+            rgbLengths[i++] = static_cast<BYTE>(dwSymbol);
+            continue;
+        }
+        else if (16 == dwSymbol)
+        {
+            if (!i)
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP code lengths repeat without a previous length.");
+            }
+
+            bLength = rgbLengths[i - 1];
+            cRepeat = 3 + ReadLsb(pBits, 2);
+        }
+        else if (17 == dwSymbol)
+        {
+            cRepeat = 3 + ReadLsb(pBits, 3);
+        }
+        else
+        {
+            cRepeat = 11 + ReadLsb(pBits, 7);
+        }
+
+        if (cRepeat > cLiterals + cDistances - i)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP code lengths repeat past the end of the codes.");
+        }
+
+        memset(rgbLengths + i, bLength, cRepeat);
+        i += cRepeat;
+    }
+
+    if (!rgbLengths[256])
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP codes are missing the end of block code.");
+    }
+
+    hr = BuildHuffman(&pMszip->literals, rgbLengths, cLiterals, TRUE);
+    ExitOnFailure(hr, "Failed to build MSZIP literal codes.");
+
+    hr = BuildHuffman(&pMszip->distances, rgbLengths + cLiterals, cDistances, TRUE);
+    ExitOnFailure(hr, "Failed to build MSZIP distance codes.");
+
+LExit:
+    return hr;
+}
+
+static HRESULT MszipInflate(
+    __in CAB_BITS* pBits,
+    __in const CAB_HUFFMAN* pLiterals,
+    __in const CAB_HUFFMAN* pDistances,
+    __in_bcount(cbOutput) BYTE* pbOutput,
+    __in DWORD cbOutput,
+    __in DWORD cbHistory,
+    __inout DWORD* piOutput
+    )
+{
+    static const WORD rgwLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const BYTE rgbLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const WORD rgwDistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const BYTE rgbDistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    HRESULT hr = S_OK;
+    DWORD iOutput = *piOutput;
+
+    for (;;)
+    {
+        DWORD dwSymbol = 0;
+        DWORD cbMatch = 0;
+        DWORD dwDistance = 0;
+
+        hr = DecodeLsb(pBits, pLiterals, &dwSymbol);
+        ExitOnFailure(hr, "Failed to decode MSZIP literal.");
+
+        if (256 > dwSymbol)
+        {
+            if (iOutput >= cbOutput)
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "MSZIP block decodes past the end of its data block.");
+            }
+
+            pbOutput[iOutput++] = static_cast<BYTE>(dwSymbol);
+            continue;
+        }
+        else if (256 == dwSymbol)
+        {
+            break;
+        }
+        else if (285 < dwSymbol)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid MSZIP length code: %u", dwSymbol);
+        }
+
+        dwSymbol -= 257;
+        cbMatch = rgwLengthBase[dwSymbol] + ReadLsb(pBits, rgbLengthExtra[dwSymbol]);
+
+        hr = DecodeLsb(pBits, pDistances, &dwSymbol);
+        ExitOnFailure(hr, "Failed to decode MSZIP distance.");
+
+        if (30 <= dwSymbol)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid MSZIP distance code: %u", dwSymbol);
+        }
+
+        dwDistance = rgwDistanceBase[dwSymbol] + ReadLsb(pBits, rgbDistanceExtra[dwSymbol]);
+
+        if (dwDistance > cbHistory + iOutput || cbMatch > cbOutput - iOutput)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid MSZIP match, distance: %u length: %u", dwDistance, cbMatch);
+        }
+
+        // Matches may overlap the bytes they produce, so copy forward one byte at a time.
+        for (const BYTE* pbSource = pbOutput + iOutput - dwDistance; cbMatch; --cbMatch)
+        {
+            pbOutput[iOutput++] = *pbSource++;
+        }
+    }
+
+    *piOutput = iOutput;
+
+LExit:
+    return hr;
+}
+
+static void LzxReset(
+    __in CAB_LZX* pLzx,
+    __in DWORD dwWindowBits
+    )
+{
+    static const BYTE rgcPositionSlots[LZX_MAX_WINDOW_BITS - LZX_MIN_WINDOW_BITS + 1] = { 30, 32, 34, 36, 38, 42, 50 };
+    DWORD dwBase = 0;
+
+    memset(pLzx, 0, sizeof(CAB_LZX));
+
+    pLzx->cPositionSlots = rgcPositionSlots[dwWindowBits - LZX_MIN_WINDOW_BITS];
+    pLzx->rgdwRecent[0] = pLzx->rgdwRecent[1] = pLzx->rgdwRecent[2] = 1;
+
+    // Extra bits are 0, 0, 0, 0, 1, 1, 2, 2, ... up to 17, each position base follows the range of the previous slot.
+    for (DWORD i = 0; i < LZX_MAX_POSITION_SLOTS; ++i)
+    {
+        pLzx->rgbExtraBits[i] = static_cast<BYTE>(4 > i ? 0 : min(17, i / 2 - 1));
+        pLzx->rgdwPositionBase[i] = dwBase;
+        dwBase += 1UL << pLzx->rgbExtraBits[i];
+    }
+}
+
+static HRESULT LzxDecode(
+    __in CAB_LZX* pLzx,
+    __in BYTE* pbWindow,
+    __in DWORD cbWindow,
+    __in_bcount(cbInput) const BYTE* pbInput,
+    __in DWORD cbInput,
+    __in DWORD cbOutput,
+    __out const BYTE** ppbOutput
+    )
+{
+    HRESULT hr = S_OK;
+    CAB_BITS bits = { };
+    DWORD iFrame = 0;
+    DWORD cbRemaining = cbOutput;
+    DWORD iWindow = 0;
+
+    // Each data block is one frame whose input starts on a fresh bit stream.
+    bits.pbInput = pbInput;
+    bits.cbInput = cbInput;
+
+    if (!pLzx->fHeaderRead)
+    {
+        pLzx->fHeaderRead = TRUE;
+
+        if (ReadMsb(&bits, 1))
+        {
+            DWORD dwHigh = ReadMsb(&bits, 16);
+            pLzx->dwTranslationSize = (dwHigh << 16) | ReadMsb(&bits, 16);
+        }
+    }
+
+    if (pLzx->iWindow == cbWindow)
+    {
+        pLzx->iWindow = 0;
+        pLzx->fWrapped = TRUE;
+    }
+
+    iWindow = iFrame = pLzx->iWindow;
+
+    if (cbOutput > cbWindow - iWindow)
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "LZX frame does not fit in the window.");
+    }
+
+    while (cbRemaining)
+    {
+        LONG lRun = 0;
+
+        if (!pLzx->cbBlockRemaining)
+        {
+            hr = LzxReadBlockHeader(pLzx, &bits);
+            ExitOnFailure(hr, "Failed to read LZX block header.");
+        }
+
+        lRun = static_cast<LONG>(min(pLzx->cbBlockRemaining, cbRemaining));
+        cbRemaining -= lRun;
+        pLzx->cbBlockRemaining -= lRun;
+
+        if (LZX_BLOCK_UNCOMPRESSED == pLzx->dwBlockType)
+        {
+            if (static_cast<DWORD>(lRun) > bits.cbInput - min(bits.iInput, bits.cbInput))
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "LZX uncompressed block is truncated.");
+            }
+
+            memcpy(pbWindow + iWindow, bits.pbInput + bits.iInput, lRun);
+            bits.iInput += lRun;
+            iWindow += lRun;
+
+            // Odd sized blocks are padded to keep the input aligned.
+            if (!pLzx->cbBlockRemaining && (pLzx->cbBlock & 1) && bits.iInput < bits.cbInput)
+            {
+                ++bits.iInput;
+            }
+
+            continue;
+        }
+
+        while (0 < lRun)
+        {
+            DWORD dwMain = 0;
+            DWORD cbMatch = 0;
+            DWORD dwSlot = 0;
+            DWORD dwOffset = 0;
+
+            hr = DecodeMsb(&bits, &pLzx->main, &dwMain);
+            ExitOnFailure(hr, "Failed to decode LZX main element.");
+
+            if (LZX_NUM_CHARS > dwMain)
+            {
+                pbWindow[iWindow++] = static_cast<BYTE>(dwMain);
+                --lRun;
+                continue;
+            }
+
+            dwMain -= LZX_NUM_CHARS;
+            cbMatch = dwMain & LZX_NUM_PRIMARY_LENGTHS;
+            dwSlot = dwMain >> 3;
+
+            if (LZX_NUM_PRIMARY_LENGTHS == cbMatch)
+            {
+                DWORD dwLength = 0;
+
+                hr = DecodeMsb(&bits, &pLzx->length, &dwLength);
+                ExitOnFailure(hr, "Failed to decode LZX match length.");
+
+                cbMatch += dwLength;
+            }
+
+            cbMatch += LZX_MIN_MATCH;
+
+            if (3 > dwSlot)
+            {
+                // Repeated offsets move to the front of the list.
+                dwOffset = pLzx->rgdwRecent[dwSlot];
+                pLzx->rgdwRecent[dwSlot] = pLzx->rgdwRecent[0];
+                pLzx->rgdwRecent[0] = dwOffset;
+            }
+            else
+            {
+                DWORD cExtraBits = pLzx->rgbExtraBits[dwSlot];
+
+                dwOffset = pLzx->rgdwPositionBase[dwSlot] - 2;
+
+                if (LZX_BLOCK_ALIGNED == pLzx->dwBlockType && 3 <= cExtraBits)
+                {
+                    DWORD dwAligned = 0;
+
+                    dwOffset += ReadMsb(&bits, cExtraBits - 3) << 3;
+
+                    hr = DecodeMsb(&bits, &pLzx->aligned, &dwAligned);
+                    ExitOnFailure(hr, "Failed to decode LZX aligned offset.");
+
+                    dwOffset += dwAligned;
+                }
+                else
+                {
+                    dwOffset += ReadMsb(&bits, cExtraBits);
+                }
+
+                pLzx->rgdwRecent[2] = pLzx->rgdwRecent[1];
+                pLzx->rgdwRecent[1] = pLzx->rgdwRecent[0];
+                pLzx->rgdwRecent[0] = dwOffset;
+            }
+
+            if (!dwOffset || dwOffset > (pLzx->fWrapped ? cbWindow : iWindow) || cbMatch > cbWindow - iWindow)
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid LZX match, offset: %u length: %u", dwOffset, cbMatch);
+            }
+
+            // Matches may overlap the bytes they produce and may start before the window wrapped.
+            for (DWORD iSource = (iWindow + cbWindow - dwOffset) & (cbWindow - 1), i = 0; i < cbMatch; ++i)
+            {
+                pbWindow[iWindow++] = pbWindow[iSource];
+                iSource = (iSource + 1) & (cbWindow - 1);
+            }
+
+            lRun -= cbMatch;
+        }
+
+        // A match may run into the next block of the same frame.
+        if (0 > lRun)
+        {
+            if (static_cast<DWORD>(-lRun) > pLzx->cbBlockRemaining)
+            {
+                ExitWithRootFailure(hr, CAB_E_CORRUPT, "LZX match runs past the end of its block.");
+            }
+
+            pLzx->cbBlockRemaining -= -lRun;
+        }
+    }
+
+    if (iWindow - iFrame != cbOutput || !IsInputConsumed(&bits))
+    {
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "LZX frame decoded to: %u bytes, expected: %u", iWindow - iFrame, cbOutput);
+    }
+
+    pLzx->iWindow = iWindow;
+
+    if (pLzx->dwTranslationSize && LZX_E8_MAX_FRAMES > pLzx->cFrames && LZX_E8_MIN_FRAME_SIZE < cbOutput)
+    {
+        memcpy(pLzx->rgbTranslated, pbWindow + iFrame, cbOutput);
+        LzxTranslateE8(pLzx->rgbTranslated, cbOutput, pLzx->dwTranslationPosition, pLzx->dwTranslationSize);
+
+        *ppbOutput = pLzx->rgbTranslated;
+    }
+    else
+    {
+        *ppbOutput = pbWindow + iFrame;
+    }
+
+    pLzx->dwTranslationPosition += cbOutput;
+    ++pLzx->cFrames;
+
+LExit:
+    return hr;
+}
+
+static HRESULT LzxReadBlockHeader(
+    __in CAB_LZX* pLzx,
+    __in CAB_BITS* pBits
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE rgbAlignedLengths[LZX_ALIGNED_SYMBOLS] = { };
+    DWORD dwHigh = 0;
+
+    pLzx->dwBlockType = ReadMsb(pBits, 3);
+    dwHigh = ReadMsb(pBits, 16);
+    pLzx->cbBlock = (dwHigh << 8) | ReadMsb(pBits, 8);
+    pLzx->cbBlockRemaining = pLzx->cbBlock;
+
+    switch (pLzx->dwBlockType)
+    {
+    case LZX_BLOCK_ALIGNED:
+        for (DWORD i = 0; i < LZX_ALIGNED_SYMBOLS; ++i)
+        {
+            rgbAlignedLengths[i] = static_cast<BYTE>(ReadMsb(pBits, 3));
+        }
+
+        hr = BuildHuffman(&pLzx->aligned, rgbAlignedLengths, LZX_ALIGNED_SYMBOLS, FALSE);
+        ExitOnFailure(hr, "Failed to build LZX aligned offset codes.");
+        __fallthrough;
+
+    case LZX_BLOCK_VERBATIM:
+        hr = LzxReadLengths(pLzx, pBits, pLzx->rgbMainLengths, 0, LZX_NUM_CHARS);
+        ExitOnFailure(hr, "Failed to read LZX literal lengths.");
+
+        hr = LzxReadLengths(pLzx, pBits, pLzx->rgbMainLengths, LZX_NUM_CHARS, LZX_NUM_CHARS + pLzx->cPositionSlots * 8);
+        ExitOnFailure(hr, "Failed to read LZX match lengths.");
+
+        hr = BuildHuffman(&pLzx->main, pLzx->rgbMainLengths, LZX_NUM_CHARS + pLzx->cPositionSlots * 8, FALSE);
+        ExitOnFailure(hr, "Failed to build LZX main codes.");
+
+        hr = LzxReadLengths(pLzx, pBits, pLzx->rgbLengthLengths, 0, LZX_NUM_SECONDARY_LENGTHS);
+        ExitOnFailure(hr, "Failed to read LZX length lengths.");
+
+        hr = BuildHuffman(&pLzx->length, pLzx->rgbLengthLengths, LZX_NUM_SECONDARY_LENGTHS, FALSE);
+        ExitOnFailure(hr, "Failed to build LZX length codes.");
+        break;
+
+    case LZX_BLOCK_UNCOMPRESSED:
+    {
+        // The block starts at the next 16-bit boundary, which is a whole word away when the input is already aligned.
+        DWORD cWords = pBits->cBits / 16;
+
+        if (pBits->cBits % 16)
+        {
+            pBits->iInput -= 2 * cWords;
+        }
+        else if (cWords)
+        {
+            pBits->iInput -= 2 * (cWords - 1);
+        }
+        else
+        {
+            pBits->iInput += 2;
+        }
+
+        pBits->dwBits = 0;
+        pBits->cBits = 0;
+
+        if (12 > pBits->cbInput - min(pBits->iInput, pBits->cbInput))
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "LZX uncompressed block header is truncated.");
+        }
+
+        for (DWORD i = 0; i < countof(pLzx->rgdwRecent); ++i, pBits->iInput += 4)
+        {
+            pLzx->rgdwRecent[i] = ReadDword(pBits->pbInput + pBits->iInput);
+        }
+        break;
+    }
+
+    default:
+        ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid LZX block type: %u", pLzx->dwBlockType);
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT LzxReadLengths(
+    __in CAB_LZX* pLzx,
+    __in CAB_BITS* pBits,
+    __in BYTE* rgbLengths,
+    __in DWORD iFirst,
+    __in DWORD iLast
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE rgbPretreeLengths[LZX_PRETREE_SYMBOLS] = { };
+
+    for (DWORD i = 0; i < LZX_PRETREE_SYMBOLS; ++i)
+    {
+        rgbPretreeLengths[i] = static_cast<BYTE>(ReadMsb(pBits, 4));
+    }
+
+    hr = BuildHuffman(&pLzx->pretree, rgbPretreeLengths, LZX_PRETREE_SYMBOLS, FALSE);
+    ExitOnFailure(hr, "Failed to build LZX pretree.");
+
+    // Lengths are deltas from the lengths of the previous block, modulo 17.
+    for (DWORD i = iFirst; i < iLast;)
+    {
+        DWORD dwSymbol = 0;
+        DWORD cRun = 1;
+        BYTE bLength = 0;
+
+        hr = DecodeMsb(pBits, &pLzx->pretree, &dwSymbol);
+        ExitOnFailure(hr, "Failed to decode LZX pretree element.");
+
+        if (17 == dwSymbol)
+        {
+            cRun = 4 + ReadMsb(pBits, 4);
+        }
+        else if (18 == dwSymbol)
+        {
+            cRun = 20 + ReadMsb(pBits, 5);
+        }
+        else
+        {
+            if (19 == dwSymbol)
+            {
+                cRun = 4 + ReadMsb(pBits, 1);
+
+                hr = DecodeMsb(pBits, &pLzx->pretree, &dwSymbol);
+                ExitOnFailure(hr, "Failed to decode LZX pretree element.");
+
+                if (16 < dwSymbol)
+                {
+                    ExitWithRootFailure(hr, CAB_E_CORRUPT, "Invalid LZX pretree delta: %u", dwSymbol);
+                }
+            }
+
+            bLength = static_cast<BYTE>((rgbLengths[i] + 17 - dwSymbol) % 17);
+        }
+
+        if (cRun > iLast + LZX_LENGTH_SAFETY - i)
+        {
+            ExitWithRootFailure(hr, CAB_E_CORRUPT, "LZX lengths run past the end of the tree.");
+        }
+
+        memset(rgbLengths + i, bLength, cRun);
+        i += cRun;
+    }
+
+LExit:
+    return hr;
+}
+
+static void LzxTranslateE8(
+    __in_bcount(cb) BYTE* pb,
+    __in DWORD cb,
+    __in DWORD dwPosition,
+    __in DWORD dwTranslationSize
+    )
+{
+    LONG lPosition = static_cast<LONG>(dwPosition);
+    LONG lSize = static_cast<LONG>(dwTranslationSize);
+
+    // Undo the encoder turning the relative targets of x86 CALL instructions into absolute ones.
+    for (DWORD i = 0; i < cb - LZX_E8_MIN_FRAME_SIZE;)
+    {
+        if (0xE8 != pb[i])
+        {
+            ++i;
+            ++lPosition;
+            continue;
+        }
+
+        LONG lAbsolute = static_cast<LONG>(ReadDword(pb + i + 1));
+
+        if (lAbsolute >= -lPosition && lAbsolute < lSize)
+        {
+            DWORD dwRelative = static_cast<DWORD>(0 <= lAbsolute ? lAbsolute - lPosition : lAbsolute + lSize);
+
+            pb[i + 1] = static_cast<BYTE>(dwRelative);
+            pb[i + 2] = static_cast<BYTE>(dwRelative >> 8);
+            pb[i + 3] = static_cast<BYTE>(dwRelative >> 16);
+            pb[i + 4] = static_cast<BYTE>(dwRelative >> 24);
+        }
+
+        i += 5;
+        lPosition += 5;
+    }
+}
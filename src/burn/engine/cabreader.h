@@ -0,0 +1,117 @@
+#pragma once
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+// typedefs
+
+// Reads exactly cbBuffer bytes at qwOffset from the start of the cabinet.
+typedef HRESULT(CALLBACK *PFN_CAB_READER_READ)(
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) BYTE* pbBuffer,
+    __in DWORD cbBuffer,
+    __in_opt LPVOID pvContext
+    );
+
+// Receives the decompressed data of a file, pbData points into the decoder and is only valid during the call.
+typedef HRESULT(CALLBACK *PFN_CAB_READER_WRITE)(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+
+
+// structs
+
+typedef struct _CAB_READER_FOLDER
+{
+    DWORD dwDataOffset;     // offset of the first CFDATA block.
+    DWORD cData;
+    WORD wCompression;
+} CAB_READER_FOLDER;
+
+typedef struct _CAB_READER_FILE
+{
+    LPWSTR sczName;
+    DWORD cbFile;
+    DWORD dwFolderOffset;   // offset of the file in the uncompressed folder.
+    DWORD iFolder;
+    WORD wDate;
+    WORD wTime;
+    WORD wAttributes;
+} CAB_READER_FILE;
+
+typedef struct _CAB_READER
+{
+    PFN_CAB_READER_READ pfnRead;
+    LPVOID pvReadContext;
+
+    DWORD cbDataReserve;
+    CAB_READER_FOLDER* rgFolders;
+    DWORD cFolders;
+    CAB_READER_FILE* rgFiles;
+    DWORD cFiles;
+    DWORD iNextFile;
+
+    // decoding state of the current folder.
+    DWORD iFolder;          // cFolders when no folder is being decoded.
+    DWORD iData;            // next CFDATA block of the folder.
+    DWORD64 qwDataOffset;   // offset of the next CFDATA block.
+    DWORD64 qwPosition;     // folder offset of the first byte in pbBlock, or of the next block without one.
+    BYTE* pbInput;          // compressed CFDATA block.
+    const BYTE* pbBlock;    // decompressed CFDATA block, points into pbInput or the decoder.
+    DWORD cbBlock;
+    struct _CAB_READER_DECODER* pDecoder;
+} CAB_READER;
+
+
+// function declarations
+
+/********************************************************************
+ CabReaderOpen - reads the headers of a cabinet. Returns E_NOTIMPL for
+                 cabinets the reader cannot decode, which are Quantum
+                 compressed or span multiple cabinets.
+
+*********************************************************************/
+HRESULT CabReaderOpen(
+    __in CAB_READER* pReader,
+    __in PFN_CAB_READER_READ pfnRead,
+    __in_opt LPVOID pvReadContext,
+    __in DWORD64 qwSize
+    );
+
+/********************************************************************
+ CabReaderNextFile - returns the next file in the cabinet, or
+                     E_NOMOREITEMS. Files that are not read are
+                     skipped.
+
+*********************************************************************/
+HRESULT CabReaderNextFile(
+    __in CAB_READER* pReader,
+    __out const CAB_READER_FILE** ppFile
+    );
+
+/********************************************************************
+ CabReaderReadFile - decompresses the file last returned by
+                     CabReaderNextFile and passes each decompressed
+                     block to pfnWrite without copying it.
+
+*********************************************************************/
+HRESULT CabReaderReadFile(
+    __in CAB_READER* pReader,
+    __in PFN_CAB_READER_WRITE pfnWrite,
+    __in_opt LPVOID pvWriteContext
+    );
+
+void CabReaderClose(
+    __in CAB_READER* pReader
+    );
+
+
+#if defined(__cplusplus)
+}
+#endif
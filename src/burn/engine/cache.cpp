@@ -4,11 +4,17 @@
 
 static const LPCWSTR BUNDLE_WORKING_FOLDER_NAME = L".be";
 static const LPCWSTR UNVERIFIED_CACHE_FOLDER_NAME = L".unverified";
+static const LPCWSTR VERIFIED_INDEX_FILE_NAME = L".verified";
+static const DWORD VERIFIED_INDEX_VERSION = 1;
+static const DWORD VERIFIED_INDEX_MAX_ENTRIES = 64 * 1024;
+static const LPCWSTR CONTENT_STORE_FOLDER_NAME = L".content";
+static const LPCWSTR TOMBSTONE_FOLDER_NAME = L".tombstones";
 static const LPCWSTR PACKAGE_CACHE_FOLDER_NAME = L"Package Cache";
 static const DWORD FILE_OPERATION_RETRY_COUNT = 3;
 static const DWORD FILE_OPERATION_RETRY_WAIT = 2000;
 
 static HRESULT CacheVerifyPayloadSignature(
+    __in_opt BURN_CACHE* pCache,
     __in BURN_PAYLOAD* pPayload,
     __in_z LPCWSTR wzUnverifiedPayloadPath,
     __in HANDLE hFile,
@@ -90,9 +96,12 @@ static HRESULT VerifyFileAgainstContainer(
     __in LPVOID pContext
     );
 static HRESULT VerifyFileAgainstPayload(
+    __in_opt BURN_CACHE* pCache,
     __in BURN_PAYLOAD* pPayload,
     __in_z LPCWSTR wzVerifyPath,
     __in BOOL fAlreadyCached,
+    __in_opt BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in_opt const BURN_ACQUIRED_DIGEST* pDigest,
     __in BURN_CACHE_STEP cacheStep,
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
     __in LPPROGRESS_ROUTINE pfnProgress,
@@ -141,15 +150,163 @@ static HRESULT VerifyHash(
     __in BOOL fVerifyFileSize,
     __in_z LPCWSTR wzUnverifiedPayloadPath,
     __in HANDLE hFile,
+    __in_opt const BURN_ACQUIRED_DIGEST* pDigest,
     __in BURN_CACHE_STEP cacheStep,
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
     __in LPPROGRESS_ROUTINE pfnProgress,
     __in LPVOID pContext
     );
+static BOOL IsAcquiredDigestCurrent(
+    __in const BURN_ACQUIRED_DIGEST* pDigest,
+    __in HANDLE hFile
+    );
+static BURN_CACHE_VERIFIED_INDEX* GetVerifiedIndex(
+    __in_opt BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    );
+static __callback int __cdecl CompareVerifiedIndexEntries(
+    __in void* pvContext,
+    __in const void* pvLeft,
+    __in const void* pvRight
+    );
+static HRESULT LoadVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    );
+static HRESULT SaveVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    );
+static BOOL FindVerifiedIndexEntry(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in const BY_HANDLE_FILE_INFORMATION* pFileInformation,
+    __out DWORD* piEntry
+    );
+static void LookupVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in HANDLE hFile,
+    __out BURN_ACQUIRED_DIGEST* pDigest
+    );
+static HRESULT UpdateVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in HANDLE hFile,
+    __in_bcount(cbHash) const BYTE* pbHash,
+    __in DWORD cbHash
+    );
+static void RecordVerifiedPayload(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzCachedPath
+    );
+static void RemoveFromVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in_z LPCWSTR wzPath
+    );
+static void RemoveFolderFromVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in_z LPCWSTR wzFolder
+    );
+static void SaveOrDeleteVerifiedIndex(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    );
+static BOOL IsCacheRootUnused(
+    __in_z LPCWSTR wzRootPath
+    );
+static void InitializeVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    );
+static void UninitializeVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    );
+static HRESULT GetContentStorePath(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
+    __in BURN_PAYLOAD* pPayload,
+    __out_z LPWSTR* psczStorePath
+    );
+static BOOL LinkFromContentStore(
+    __in_z LPCWSTR wzCachedPath,
+    __in_z LPCWSTR wzStorePath
+    );
+static void AddToContentStore(
+    __in BOOL fPerMachine,
+    __in_z LPCWSTR wzStorePath,
+    __in_z LPCWSTR wzCachedPath
+    );
+static void PruneContentStore(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    );
+static HRESULT VerifyCachedPayload(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzCachedPath,
+    __in BURN_CACHE_STEP cacheStep,
+    __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
+    __in LPPROGRESS_ROUTINE pfnProgress,
+    __in LPVOID pContext
+    );
+static HRESULT EnsureHashPool(
+    __in BURN_CACHE_HASH_POOL* pPool
+    );
+static DWORD WINAPI HashPoolThreadProc(
+    __in LPVOID lpThreadParameter
+    );
+static void HashPayloadJob(
+    __in BURN_CACHE_HASH_JOB* pJob
+    );
+static BURN_CACHE_HASH_JOB* TakePayloadHashJob(
+    __in BURN_CACHE_HASH_POOL* pPool,
+    __in BURN_PAYLOAD* pPayload,
+    __in BOOL fComplete
+    );
+static void ReleasePayloadHashJob(
+    __in BURN_CACHE_HASH_JOB* pJob
+    );
+static void UninitializeHashPool(
+    __in BURN_CACHE_HASH_POOL* pPool
+    );
+static HRESULT EnsureDeletionQueue(
+    __in BURN_CACHE* pCache
+    );
+static HRESULT QueueCacheDeletion(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
+    __in_z LPCWSTR wzDirectory
+    );
+static HRESULT EnqueueTombstone(
+    __in BURN_CACHE_DELETION_QUEUE* pQueue,
+    __in BOOL fPerMachine,
+    __deref_inout_z LPWSTR* psczTombstone
+    );
+static void RecoverTombstones(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    );
+static DWORD WINAPI DeletionQueueThreadProc(
+    __in LPVOID lpThreadParameter
+    );
+static void DeleteTombstone(
+    __in BURN_CACHE* pCache,
+    __in BURN_CACHE_TOMBSTONE* pTombstone
+    );
+static void UninitializeDeletionQueue(
+    __in BURN_CACHE_DELETION_QUEUE* pQueue
+    );
 static HRESULT VerifyPayloadAgainstCertChain(
     __in BURN_PAYLOAD* pPayload,
     __in PCCERT_CHAIN_CONTEXT pChainContext
     );
+static BOOL IsSignedByVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in_opt CRYPT_PROVIDER_DATA* pProviderData
+    );
+static BOOL IsVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in_bcount(SHA1_HASH_LEN) const BYTE* pbLeafThumbprint
+    );
 static HRESULT SendCacheBeginMessage(
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
     __in LPVOID pContext,
@@ -181,6 +338,10 @@ extern "C" HRESULT CacheInitialize(
     HRESULT hr = S_OK;
     LPWSTR sczAppData = NULL;
     BOOL fPathEqual = FALSE;
+    DWORD dwFullVerification = 0;
+
+    InitializeVerifiedIndex(&pCache->userVerifiedIndex);
+    InitializeVerifiedIndex(&pCache->machineVerifiedIndex);
 
     // Cache paths are initialized once so they cannot be changed while the engine is caching payloads.
     // Always construct the default machine package cache path so we can determine if we're redirected.
@@ -232,6 +393,10 @@ extern "C" HRESULT CacheInitialize(
 
     hr = CalculateWorkingFolders(pCache, pInternalCommand);
 
+    // Policy can require every cached payload to be rehashed instead of trusting the verified index.
+    PolcReadNumber(POLICY_BURN_REGISTRY_PATH, L"FullCacheVerification", 0, &dwFullVerification);
+    pCache->fFullVerification = 0 != dwFullVerification;
+
     pCache->fInitializedCache = TRUE;
 
 LExit:
@@ -1121,6 +1286,113 @@ LExit:
     return hr;
 }
 
+extern "C" HRESULT CacheQueuePayloadHash(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzUnverifiedPayloadPath
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CACHE_HASH_POOL* pPool = &pCache->hashPool;
+    BURN_CACHE_HASH_JOB* pJob = NULL;
+    BOOL fLocked = FALSE;
+
+    // Only payloads verified by hash can use a precomputed digest.
+    if (BURN_PAYLOAD_VERIFICATION_HASH != pPayload->verification)
+    {
+        ExitFunction();
+    }
+
+    hr = EnsureHashPool(pPool);
+    ExitOnFailure(hr, "Failed to start payload hash pool.");
+
+    // Drop an earlier job for the same payload, the file was acquired again.
+    pJob = TakePayloadHashJob(pPool, pPayload, FALSE);
+    if (pJob)
+    {
+        ReleasePayloadHashJob(pJob);
+    }
+
+    pJob = static_cast<BURN_CACHE_HASH_JOB*>(MemAlloc(sizeof(BURN_CACHE_HASH_JOB), TRUE));
+    ExitOnNull(pJob, hr, E_OUTOFMEMORY, "Failed to allocate payload hash job.");
+
+    pJob->pPayload = pPayload;
+
+    // Deny writers for as long as the job is held, so the file cannot change after it was hashed.
+    // If someone is still writing the file this fails and the payload is simply hashed when it is verified.
+    pJob->hFile = ::CreateFileW(wzUnverifiedPayloadPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == pJob->hFile)
+    {
+        ExitWithLastError(hr, "Failed to open payload to hash: %ls", wzUnverifiedPayloadPath);
+    }
+
+    pJob->hComplete = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    ExitOnNullWithLastError(pJob->hComplete, hr, "Failed to create payload hash completion event.");
+
+    ::EnterCriticalSection(&pPool->csJobs);
+    fLocked = TRUE;
+
+    hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pPool->rgpJobs), pPool->cJobs, 1, sizeof(BURN_CACHE_HASH_JOB*), 8);
+    ExitOnFailure(hr, "Failed to grow payload hash jobs.");
+
+    pPool->rgpJobs[pPool->cJobs] = pJob;
+    ++pPool->cJobs;
+    pJob = NULL;
+
+    ::LeaveCriticalSection(&pPool->csJobs);
+    fLocked = FALSE;
+
+    if (!::ReleaseSemaphore(pPool->hWorkSemaphore, 1, NULL))
+    {
+        // The job stays queued and is hashed by CacheCompletePayload when it takes it.
+        LogStringLine(REPORT_VERBOSE, "Failed to signal payload hash pool, error: 0x%x", HRESULT_FROM_WIN32(::GetLastError()));
+    }
+
+LExit:
+    if (fLocked)
+    {
+        ::LeaveCriticalSection(&pPool->csJobs);
+    }
+
+    if (pJob)
+    {
+        ReleasePayloadHashJob(pJob);
+    }
+
+    return hr;
+}
+
+extern "C" void CacheReleasePayloadHashes(
+    __in BURN_CACHE* pCache
+    )
+{
+    BURN_CACHE_HASH_POOL* pPool = &pCache->hashPool;
+    BURN_CACHE_HASH_JOB** rgpJobs = NULL;
+    DWORD cJobs = 0;
+
+    if (!pPool->fInitialized)
+    {
+        return;
+    }
+
+    ::EnterCriticalSection(&pPool->csJobs);
+
+    rgpJobs = pPool->rgpJobs;
+    cJobs = pPool->cJobs;
+    pPool->rgpJobs = NULL;
+    pPool->cJobs = 0;
+
+    // Jobs no worker picked up yet are never started once they are off the list.
+    ::LeaveCriticalSection(&pPool->csJobs);
+
+    for (DWORD i = 0; i < cJobs; ++i)
+    {
+        ReleasePayloadHashJob(rgpJobs[i]);
+    }
+
+    ReleaseMem(rgpJobs);
+}
+
 extern "C" HRESULT CacheCompletePayload(
     __in BURN_CACHE* pCache,
     __in BOOL fPerMachine,
@@ -1136,12 +1408,23 @@ extern "C" HRESULT CacheCompletePayload(
     HRESULT hr = S_OK;
     LPWSTR sczCachedPath = NULL;
     LPWSTR sczUnverifiedPayloadPath = NULL;
+    LPWSTR sczStorePath = NULL;
+    BURN_CACHE_VERIFIED_INDEX* pIndex = NULL;
+    BURN_CACHE_HASH_JOB* pHashJob = NULL;
+
+    // Always take the background hash, if there is one, so its handle does not outlive this payload.
+    if (pCache->hashPool.fInitialized)
+    {
+        pHashJob = TakePayloadHashJob(&pCache->hashPool, pPayload, TRUE);
+    }
 
     hr = CreateCompletedPath(pCache, fPerMachine, wzCacheId, pPayload->sczFilePath, &sczCachedPath);
     ExitOnFailure(hr, "Failed to get cached path for package with cache id: %ls", wzCacheId);
 
-    // If the cached file matches what we expected, we're good.
-    hr = VerifyFileAgainstPayload(pPayload, sczCachedPath, TRUE, BURN_CACHE_STEP_HASH_TO_SKIP_VERIFY, pfnCacheMessageHandler, pfnProgress, pContext);
+    pIndex = GetVerifiedIndex(pCache, fPerMachine);
+
+    // If the cached file matches what we expected, or the same content is already in the store, we're good.
+    hr = VerifyCachedPayload(pCache, fPerMachine, pPayload, sczCachedPath, BURN_CACHE_STEP_HASH_TO_SKIP_VERIFY, pfnCacheMessageHandler, pfnProgress, pContext);
     if (SUCCEEDED(hr))
     {
         ExitFunction();
@@ -1175,17 +1458,45 @@ extern "C" HRESULT CacheCompletePayload(
     hr = ResetPathPermissions(fPerMachine, sczUnverifiedPayloadPath);
     ExitOnFailure(hr, "Failed to reset permissions on unverified cached payload: %ls", pPayload->sczKey);
 
-    hr = VerifyFileAgainstPayload(pPayload, sczUnverifiedPayloadPath, FALSE, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
+    hr = VerifyFileAgainstPayload(pCache, pPayload, sczUnverifiedPayloadPath, FALSE, NULL, pHashJob && SUCCEEDED(pHashJob->hrHash) ? &pHashJob->digest : NULL, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
     LogExitOnFailure(hr, MSG_FAILED_VERIFY_PAYLOAD, "Failed to verify payload: %ls at path: %ls", pPayload->sczKey, sczUnverifiedPayloadPath, NULL);
 
+    ReleasePayloadHashJob(pHashJob);
+    pHashJob = NULL;
+
     LogId(REPORT_STANDARD, MSG_VERIFIED_ACQUIRED_PAYLOAD, pPayload->sczKey, sczUnverifiedPayloadPath, fMove ? "moving" : "copying", sczCachedPath);
 
+    // The file that failed verification is about to be replaced.
+    if (pIndex)
+    {
+        RemoveFromVerifiedIndex(pIndex, sczCachedPath);
+    }
+
     hr = CacheTransferFileWithRetry(sczUnverifiedPayloadPath, sczCachedPath, TRUE, BURN_CACHE_STEP_FINALIZE, pPayload->qwFileSize, pfnCacheMessageHandler, pfnProgress, pContext);
     ExitOnFailure(hr, "Failed to move verified file to complete payload path: %ls", sczCachedPath);
 
     ::DecryptFileW(sczCachedPath, 0);  // Let's try to make sure it's not encrypted.
 
+    if (pIndex)
+    {
+        RecordVerifiedPayload(pIndex, pPayload, sczCachedPath);
+    }
+
+    hr = GetContentStorePath(pCache, fPerMachine, pPayload, &sczStorePath);
+    ExitOnFailure(hr, "Failed to get content store path for payload: %ls", pPayload->sczKey);
+
+    if (sczStorePath)
+    {
+        AddToContentStore(fPerMachine, sczStorePath, sczCachedPath);
+    }
+
 LExit:
+    if (pHashJob)
+    {
+        ReleasePayloadHashJob(pHashJob);
+    }
+
+    ReleaseStr(sczStorePath);
     ReleaseStr(sczUnverifiedPayloadPath);
     ReleaseStr(sczCachedPath);
 
@@ -1215,6 +1526,8 @@ LExit:
 }
 
 extern "C" HRESULT CacheVerifyPayload(
+    __in_opt BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
     __in BURN_PAYLOAD* pPayload,
     __in_z LPCWSTR wzCachedDirectory,
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
@@ -1228,7 +1541,14 @@ extern "C" HRESULT CacheVerifyPayload(
     hr = PathConcatRelativeToFullyQualifiedBase(wzCachedDirectory, pPayload->sczFilePath, &sczCachedPath);
     ExitOnFailure(hr, "Failed to concat complete cached path.");
 
-    hr = VerifyFileAgainstPayload(pPayload, sczCachedPath, TRUE, BURN_CACHE_STEP_HASH_TO_SKIP_ACQUIRE, pfnCacheMessageHandler, pfnProgress, pContext);
+    if (pCache)
+    {
+        hr = VerifyCachedPayload(pCache, fPerMachine, pPayload, sczCachedPath, BURN_CACHE_STEP_HASH_TO_SKIP_ACQUIRE, pfnCacheMessageHandler, pfnProgress, pContext);
+    }
+    else
+    {
+        hr = VerifyFileAgainstPayload(NULL, pPayload, sczCachedPath, TRUE, NULL, NULL, BURN_CACHE_STEP_HASH_TO_SKIP_ACQUIRE, pfnCacheMessageHandler, pfnProgress, pContext);
+    }
 
 LExit:
     ReleaseStr(sczCachedPath);
@@ -1289,6 +1609,7 @@ LExit:
 }
 
 static HRESULT CacheVerifyPayloadSignature(
+    __in_opt BURN_CACHE* pCache,
     __in BURN_PAYLOAD* pPayload,
     __in_z LPCWSTR wzUnverifiedPayloadPath,
     __in HANDLE hFile,
@@ -1301,6 +1622,7 @@ static HRESULT CacheVerifyPayloadSignature(
     HRESULT hr = S_OK;
     LONG er = ERROR_SUCCESS;
     BOOL fFailedVerification = FALSE;
+    BOOL fVerifiedSigner = FALSE;
 
     GUID guidAuthenticode = WINTRUST_ACTION_GENERIC_VERIFY_V2;
     WINTRUST_FILE_INFO wfi = { };
@@ -1313,7 +1635,6 @@ static HRESULT CacheVerifyPayloadSignature(
 
     fFailedVerification = TRUE;
 
-    // Verify the payload assuming online.
     wfi.cbStruct = sizeof(wfi);
     wfi.pcwszFilePath = wzUnverifiedPayloadPath;
     wfi.hFile = hFile;
@@ -1322,33 +1643,74 @@ static HRESULT CacheVerifyPayloadSignature(
     wtd.dwUnionChoice = WTD_CHOICE_FILE;
     wtd.pFile = &wfi;
     wtd.dwStateAction = WTD_STATEACTION_VERIFY;
-    wtd.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT;
     wtd.dwUIChoice = WTD_UI_NONE;
 
-    er = ::WinVerifyTrust(static_cast<HWND>(INVALID_HANDLE_VALUE), &guidAuthenticode, &wtd);
-    if (er)
+    // If the same certificate already signed a payload with the same expectations, its chain was built, checked
+    // for revocation and matched against the expected root during this run. Then this file only needs its own
+    // signature checked, and the certificate that made that signature is taken from the same verification.
+    if (pCache && pCache->cVerifiedSigners)
     {
-        // Verify the payload assuming offline.
-        wtd.dwProvFlags |= WTD_CACHE_ONLY_URL_RETRIEVAL;
+        wtd.dwProvFlags = WTD_HASH_ONLY_FLAG;
 
         er = ::WinVerifyTrust(static_cast<HWND>(INVALID_HANDLE_VALUE), &guidAuthenticode, &wtd);
-        ExitOnWin32Error(er, hr, "Failed authenticode verification of payload: %ls", wzUnverifiedPayloadPath);
+        if (ERROR_SUCCESS == er)
+        {
+            fVerifiedSigner = IsSignedByVerifiedSigner(pCache, pPayload, ::WTHelperProvDataFromStateData(wtd.hWVTStateData));
+        }
+
+        // Release the state so the full verification below can start over.
+        wtd.dwStateAction = WTD_STATEACTION_CLOSE;
+        ::WinVerifyTrust(static_cast<HWND>(INVALID_HANDLE_VALUE), &guidAuthenticode, &wtd);
+        wtd.hWVTStateData = NULL;
+        wtd.dwStateAction = WTD_STATEACTION_VERIFY;
+    }
+
+    if (fVerifiedSigner)
+    {
+        ++pCache->cVerifiedSignerHits;
     }
+    else
+    {
+        // Verify the payload assuming online.
+        wtd.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT;
 
-    pProviderData = ::WTHelperProvDataFromStateData(wtd.hWVTStateData);
-    ExitOnNullWithLastError(pProviderData, hr, "Failed to get provider state from authenticode certificate.");
+        er = ::WinVerifyTrust(static_cast<HWND>(INVALID_HANDLE_VALUE), &guidAuthenticode, &wtd);
+        if (er)
+        {
+            // Verify the payload assuming offline.
+            wtd.dwProvFlags |= WTD_CACHE_ONLY_URL_RETRIEVAL;
+
+            er = ::WinVerifyTrust(static_cast<HWND>(INVALID_HANDLE_VALUE), &guidAuthenticode, &wtd);
+            ExitOnWin32Error(er, hr, "Failed authenticode verification of payload: %ls", wzUnverifiedPayloadPath);
+        }
 
-    pSigner = ::WTHelperGetProvSignerFromChain(pProviderData, 0, FALSE, 0);
-    ExitOnNullWithLastError(pSigner, hr, "Failed to get signer chain from authenticode certificate.");
+        pProviderData = ::WTHelperProvDataFromStateData(wtd.hWVTStateData);
+        ExitOnNullWithLastError(pProviderData, hr, "Failed to get provider state from authenticode certificate.");
 
-    hr = VerifyPayloadAgainstCertChain(pPayload, pSigner->pChainContext);
-    ExitOnFailure(hr, "Failed to verify expected payload against actual certificate chain.");
+        pSigner = ::WTHelperGetProvSignerFromChain(pProviderData, 0, FALSE, 0);
+        ExitOnNullWithLastError(pSigner, hr, "Failed to get signer chain from authenticode certificate.");
+
+        hr = VerifyPayloadAgainstCertChain(pPayload, pSigner->pChainContext);
+        ExitOnFailure(hr, "Failed to verify expected payload against actual certificate chain.");
+
+        if (pCache)
+        {
+            hr = CacheRecordVerifiedSigner(pCache, pPayload, pSigner->pChainContext->rgpChain[0]->rgpElement[0]->pCertContext);
+            ExitOnFailure(hr, "Failed to record verified signer of payload: %ls", pPayload->sczKey);
+        }
+    }
 
     fFailedVerification = FALSE;
 
     hr = SendCacheSuccessMessage(pfnCacheMessageHandler, pContext, pPayload->qwFileSize);
 
 LExit:
+    if (wtd.hWVTStateData)
+    {
+        wtd.dwStateAction = WTD_STATEACTION_CLOSE;
+        ::WinVerifyTrust(static_cast<HWND>(INVALID_HANDLE_VALUE), &guidAuthenticode, &wtd);
+    }
+
     if (fFailedVerification)
     {
         // Make sure the BA process marks this payload as having failed verification.
@@ -1360,6 +1722,83 @@ LExit:
     return hr;
 }
 
+extern "C" BOOL CacheIsVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in PCCERT_CONTEXT pCertContext
+    )
+{
+    BYTE rgbLeafThumbprint[SHA1_HASH_LEN] = { };
+    DWORD cbLeafThumbprint = sizeof(rgbLeafThumbprint);
+
+    // The certificate must be valid now since its chain decision is reused without the timestamp of the file.
+    return 0 == ::CertVerifyTimeValidity(NULL, pCertContext->pCertInfo) &&
+           ::CertGetCertificateContextProperty(pCertContext, CERT_SHA1_HASH_PROP_ID, rgbLeafThumbprint, &cbLeafThumbprint) &&
+           IsVerifiedSigner(pCache, pPayload, rgbLeafThumbprint);
+}
+
+extern "C" HRESULT CacheRecordVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in PCCERT_CONTEXT pCertContext
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE rgbLeafThumbprint[SHA1_HASH_LEN] = { };
+    DWORD cbLeafThumbprint = sizeof(rgbLeafThumbprint);
+    BURN_CACHE_SIGNER* pSigner = NULL;
+
+    // Expectations that do not fit are simply not remembered, the next payload gets the full verification.
+    if (sizeof(pSigner->rgbRootPublicKeyIdentifier) < pPayload->cbCertificateRootPublicKeyIdentifier ||
+        (pPayload->pbCertificateRootThumbprint && sizeof(pSigner->rgbRootThumbprint) < pPayload->cbCertificateRootThumbprint))
+    {
+        ExitFunction();
+    }
+
+    if (!::CertGetCertificateContextProperty(pCertContext, CERT_SHA1_HASH_PROP_ID, rgbLeafThumbprint, &cbLeafThumbprint))
+    {
+        ExitWithLastError(hr, "Failed to read signing certificate thumbprint.");
+    }
+
+    if (IsVerifiedSigner(pCache, pPayload, rgbLeafThumbprint))
+    {
+        ExitFunction();
+    }
+
+    hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pCache->rgVerifiedSigners), pCache->cVerifiedSigners, 1, sizeof(BURN_CACHE_SIGNER), 4);
+    ExitOnFailure(hr, "Failed to grow verified signers.");
+
+    pSigner = pCache->rgVerifiedSigners + pCache->cVerifiedSigners;
+    memcpy(pSigner->rgbLeafThumbprint, rgbLeafThumbprint, sizeof(pSigner->rgbLeafThumbprint));
+
+    pSigner->cbRootPublicKeyIdentifier = pPayload->cbCertificateRootPublicKeyIdentifier;
+    memcpy(pSigner->rgbRootPublicKeyIdentifier, pPayload->pbCertificateRootPublicKeyIdentifier, pSigner->cbRootPublicKeyIdentifier);
+
+    if (pPayload->pbCertificateRootThumbprint)
+    {
+        pSigner->cbRootThumbprint = pPayload->cbCertificateRootThumbprint;
+        memcpy(pSigner->rgbRootThumbprint, pPayload->pbCertificateRootThumbprint, pSigner->cbRootThumbprint);
+    }
+
+    ++pCache->cVerifiedSigners;
+
+LExit:
+    return hr;
+}
+
+extern "C" void CacheSaveVerifiedIndexes(
+    __in BURN_CACHE* pCache
+    )
+{
+    if (!pCache->fInitializedCache)
+    {
+        return;
+    }
+
+    SaveOrDeleteVerifiedIndex(pCache, FALSE);
+    SaveOrDeleteVerifiedIndex(pCache, TRUE);
+}
+
 extern "C" void CacheCleanup(
     __in BOOL fPerMachine,
     __in BURN_CACHE* pCache
@@ -1375,10 +1814,21 @@ extern "C" void CacheCleanup(
     WIN32_FIND_DATAW wfd = { };
     size_t cchFileName = 0;
 
+    // Close the files held by hashes that were never taken before deleting them.
+    CacheReleasePayloadHashes(pCache);
+
     hr = CacheGetCompletedPath(pCache, fPerMachine, UNVERIFIED_CACHE_FOLDER_NAME, &sczFolder);
     if (SUCCEEDED(hr))
     {
-        hr = DirEnsureDeleteEx(sczFolder, DIR_DELETE_FILES | DIR_DELETE_RECURSE | DIR_DELETE_SCHEDULE);
+        hr = QueueCacheDeletion(pCache, fPerMachine, sczFolder);
+        if (SUCCEEDED(hr))
+        {
+            pCache->fUnverifiedCacheFolderCreated = FALSE;
+        }
+        else if (E_PATHNOTFOUND != hr)
+        {
+            hr = DirEnsureDeleteEx(sczFolder, DIR_DELETE_FILES | DIR_DELETE_RECURSE | DIR_DELETE_SCHEDULE);
+        }
     }
 
     if (!fPerMachine)
@@ -1432,6 +1882,9 @@ extern "C" void CacheUninitialize(
     __in BURN_CACHE* pCache
     )
 {
+    // Finish the background deletions first since they use the cache roots.
+    UninitializeDeletionQueue(&pCache->deletionQueue);
+
     ReleaseStrArray(pCache->rgsczPotentialBaseWorkingFolders, pCache->cPotentialBaseWorkingFolders);
     ReleaseStr(pCache->sczCurrentMachinePackageCache);
     ReleaseStr(pCache->sczDefaultMachinePackageCache);
@@ -1441,6 +1894,10 @@ extern "C" void CacheUninitialize(
     ReleaseStr(pCache->sczSourceProcessFolder);
     ReleaseStr(pCache->sczBundleEngineWorkingPath);
     ReleaseFileHandle(pCache->hBundleEngineWorkingFile);
+    UninitializeHashPool(&pCache->hashPool);
+    UninitializeVerifiedIndex(&pCache->userVerifiedIndex);
+    UninitializeVerifiedIndex(&pCache->machineVerifiedIndex);
+    ReleaseMem(pCache->rgVerifiedSigners);
 
     memset(pCache, 0, sizeof(BURN_CACHE));
 }
@@ -1764,7 +2221,7 @@ static HRESULT VerifyThenTransferContainer(
     switch (pContainer->verification)
     {
     case BURN_CONTAINER_VERIFICATION_HASH:
-        hr = VerifyHash(pContainer->pbHash, pContainer->cbHash, pContainer->qwFileSize, TRUE, wzUnverifiedContainerPath, hFile, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
+        hr = VerifyHash(pContainer->pbHash, pContainer->cbHash, pContainer->qwFileSize, TRUE, wzUnverifiedContainerPath, hFile, &pContainer->acquiredDigest, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
         ExitOnFailure(hr, "Failed to verify container hash: %ls", wzCachedPath);
         break;
     default:
@@ -1805,11 +2262,11 @@ static HRESULT VerifyThenTransferPayload(
     switch (pPayload->verification)
     {
     case BURN_PAYLOAD_VERIFICATION_AUTHENTICODE:
-        hr = CacheVerifyPayloadSignature(pPayload, wzUnverifiedPayloadPath, hFile, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
+        hr = CacheVerifyPayloadSignature(NULL, pPayload, wzUnverifiedPayloadPath, hFile, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
         ExitOnFailure(hr, "Failed to verify payload signature: %ls", wzCachedPath);
         break;
     case BURN_PAYLOAD_VERIFICATION_HASH:
-        hr = VerifyHash(pPayload->pbHash, pPayload->cbHash, pPayload->qwFileSize, TRUE, wzUnverifiedPayloadPath, hFile, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
+        hr = VerifyHash(pPayload->pbHash, pPayload->cbHash, pPayload->qwFileSize, TRUE, wzUnverifiedPayloadPath, hFile, &pPayload->acquiredDigest, BURN_CACHE_STEP_HASH, pfnCacheMessageHandler, pfnProgress, pContext);
         ExitOnFailure(hr, "Failed to verify payload hash: %ls", wzCachedPath);
         break;
     case BURN_PAYLOAD_VERIFICATION_UPDATE_BUNDLE: __fallthrough;
@@ -1892,7 +2349,7 @@ static HRESULT VerifyFileAgainstContainer(
     switch (pContainer->verification)
     {
     case BURN_CONTAINER_VERIFICATION_HASH:
-        hr = VerifyHash(pContainer->pbHash, pContainer->cbHash, pContainer->qwFileSize, TRUE, wzVerifyPath, hFile, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
+        hr = VerifyHash(pContainer->pbHash, pContainer->cbHash, pContainer->qwFileSize, TRUE, wzVerifyPath, hFile, NULL, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
         ExitOnFailure(hr, "Failed to verify hash of container: %ls", pContainer->sczId);
         break;
     default:
@@ -1923,9 +2380,12 @@ LExit:
 }
 
 static HRESULT VerifyFileAgainstPayload(
+    __in_opt BURN_CACHE* pCache,
     __in BURN_PAYLOAD* pPayload,
     __in_z LPCWSTR wzVerifyPath,
     __in BOOL fAlreadyCached,
+    __in_opt BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in_opt const BURN_ACQUIRED_DIGEST* pDigest,
     __in BURN_CACHE_STEP cacheStep,
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
     __in LPPROGRESS_ROUTINE pfnProgress,
@@ -1935,6 +2395,7 @@ static HRESULT VerifyFileAgainstPayload(
     HRESULT hr = S_OK;
     HANDLE hFile = INVALID_HANDLE_VALUE;
     BOOL fVerifyFileSize = FALSE;
+    BURN_ACQUIRED_DIGEST indexedDigest = { };
 
     // Get the payload on disk actual hash.
     hFile = ::CreateFileW(wzVerifyPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
@@ -1951,22 +2412,38 @@ static HRESULT VerifyFileAgainstPayload(
     switch (pPayload->verification)
     {
     case BURN_PAYLOAD_VERIFICATION_AUTHENTICODE:
-        hr = CacheVerifyPayloadSignature(pPayload, wzVerifyPath, hFile, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
+        hr = CacheVerifyPayloadSignature(pCache, pPayload, wzVerifyPath, hFile, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
         ExitOnFailure(hr, "Failed to verify signature of payload: %ls", pPayload->sczKey);
         break;
     case BURN_PAYLOAD_VERIFICATION_HASH:
         fVerifyFileSize = TRUE;
 
-        hr = VerifyHash(pPayload->pbHash, pPayload->cbHash, pPayload->qwFileSize, fVerifyFileSize, wzVerifyPath, hFile, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
+        if (pIndex)
+        {
+            LookupVerifiedIndex(pIndex, hFile, &indexedDigest);
+        }
+
+        hr = VerifyHash(pPayload->pbHash, pPayload->cbHash, pPayload->qwFileSize, fVerifyFileSize, wzVerifyPath, hFile, indexedDigest.fValid ? &indexedDigest : pDigest, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
         ExitOnFailure(hr, "Failed to verify hash of payload: %ls", pPayload->sczKey);
 
+        // Remember the file was verified so the next time it is only rehashed if it changed.
+        if (pIndex && !indexedDigest.fValid)
+        {
+            hr = UpdateVerifiedIndex(pIndex, hFile, pPayload->pbHash, pPayload->cbHash);
+            if (FAILED(hr))
+            {
+                LogStringLine(REPORT_VERBOSE, "Failed to update verified index for path: %ls, error: 0x%x", wzVerifyPath, hr);
+                hr = S_OK;
+            }
+        }
+
         break;
     case BURN_PAYLOAD_VERIFICATION_UPDATE_BUNDLE:
         fVerifyFileSize = 0 != pPayload->qwFileSize;
 
         if (pPayload->pbHash)
         {
-            hr = VerifyHash(pPayload->pbHash, pPayload->cbHash, pPayload->qwFileSize, fVerifyFileSize, wzVerifyPath, hFile, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
+            hr = VerifyHash(pPayload->pbHash, pPayload->cbHash, pPayload->qwFileSize, fVerifyFileSize, wzVerifyPath, hFile, NULL, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
             ExitOnFailure(hr, "Failed to verify hash of payload: %ls", pPayload->sczKey);
         }
         else if (fVerifyFileSize)
@@ -2264,13 +2741,40 @@ static HRESULT RemoveBundleOrPackage(
     HRESULT hr = S_OK;
     LPWSTR sczRootCacheDirectory = NULL;
     LPWSTR sczDirectory = NULL;
+    BURN_CACHE_VERIFIED_INDEX* pIndex = NULL;
 
     hr = CacheGetCompletedPath(pCache, fPerMachine, wzCacheId, &sczDirectory);
     ExitOnFailure(hr, "Failed to calculate cache path.");
 
     LogId(REPORT_STANDARD, fBundle ? MSG_UNCACHE_BUNDLE : MSG_UNCACHE_PACKAGE, wzBundleOrPackageId, sczDirectory);
 
-    // Try really hard to remove the cache directory.
+    // Forget the files of the package while they can still be opened.
+    pIndex = GetVerifiedIndex(pCache, fPerMachine);
+    if (pIndex)
+    {
+        RemoveFolderFromVerifiedIndex(pIndex, sczDirectory);
+    }
+
+    pIndex = fPerMachine ? &pCache->machineVerifiedIndex : &pCache->userVerifiedIndex;
+    if (pIndex->fInitialized)
+    {
+        ::EnterCriticalSection(&pIndex->csIndex);
+        pIndex->fPackageRemoved = TRUE;
+        ::LeaveCriticalSection(&pIndex->csIndex);
+    }
+
+    // Move the directory out of the way so it is deleted in the background instead of holding up apply.
+    hr = QueueCacheDeletion(pCache, fPerMachine, sczDirectory);
+    if (SUCCEEDED(hr))
+    {
+        ExitFunction();
+    }
+    else if (E_PATHNOTFOUND != hr)
+    {
+        LogStringLine(REPORT_VERBOSE, "Failed to move cache directory: %ls for background deletion, error: 0x%x", sczDirectory, hr);
+    }
+
+    // Otherwise try really hard to remove the cache directory.
     hr = E_FAIL;
     for (DWORD iRetry = 0; FAILED(hr) && iRetry < FILE_OPERATION_RETRY_COUNT; ++iRetry)
     {
@@ -2293,6 +2797,9 @@ static HRESULT RemoveBundleOrPackage(
     }
     else
     {
+        // Drop the content this package was the last to reference.
+        PruneContentStore(pCache, fPerMachine);
+
         // Try to remove root package cache in the off chance it is now empty.
         hr = GetRootPath(pCache, fPerMachine, TRUE, &sczRootCacheDirectory);
         ExitOnFailure(hr, "Failed to get %hs package cache root directory.", fPerMachine ? "per-machine" : "per-user");
@@ -2342,6 +2849,7 @@ static HRESULT VerifyHash(
     __in BOOL fVerifyFileSize,
     __in_z LPCWSTR wzUnverifiedPayloadPath,
     __in HANDLE hFile,
+    __in_opt const BURN_ACQUIRED_DIGEST* pDigest,
     __in BURN_CACHE_STEP cacheStep,
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
     __in LPPROGRESS_ROUTINE /*pfnProgress*/,
@@ -2366,9 +2874,19 @@ static HRESULT VerifyHash(
         ExitOnFailure(hr, "Failed to verify file size for path: %ls", wzUnverifiedPayloadPath);
     }
 
-    // TODO: create a cryp hash file that sends progress.
-    hr = CrypHashFileHandle(hFile, PROV_RSA_AES, CALG_SHA_512, rgbActualHash, sizeof(rgbActualHash), &qwHashedBytes);
-    ExitOnFailure(hr, "Failed to calculate hash for path: %ls", wzUnverifiedPayloadPath);
+    // The file was already hashed when it was acquired or last verified, so only read it again if it changed since.
+    if (pDigest && IsAcquiredDigestCurrent(pDigest, hFile))
+    {
+        LogStringLine(REPORT_VERBOSE, "Using previously computed hash for path: %ls", wzUnverifiedPayloadPath);
+
+        memcpy_s(rgbActualHash, sizeof(rgbActualHash), pDigest->rgbHash, sizeof(pDigest->rgbHash));
+    }
+    else
+    {
+        // TODO: create a cryp hash file that sends progress.
+        hr = CrypHashFileHandle(hFile, PROV_RSA_AES, CALG_SHA_512, rgbActualHash, sizeof(rgbActualHash), &qwHashedBytes);
+        ExitOnFailure(hr, "Failed to calculate hash for path: %ls", wzUnverifiedPayloadPath);
+    }
 
     // Compare hashes.
     if (cbHash != sizeof(rgbActualHash) || 0 != memcmp(pbHash, rgbActualHash, sizeof(rgbActualHash)))
@@ -2406,23 +2924,1442 @@ LExit:
     return hr;
 }
 
-static HRESULT VerifyPayloadAgainstCertChain(
-    __in BURN_PAYLOAD* pPayload,
-    __in PCCERT_CHAIN_CONTEXT pChainContext
+static BOOL IsAcquiredDigestCurrent(
+    __in const BURN_ACQUIRED_DIGEST* pDigest,
+    __in HANDLE hFile
     )
 {
-    HRESULT hr = S_OK;
-    PCCERT_CONTEXT pChainElementCertContext = NULL;
-
-    BYTE rgbPublicKeyIdentifier[SHA1_HASH_LEN] = { };
-    DWORD cbPublicKeyIdentifier = sizeof(rgbPublicKeyIdentifier);
-    BYTE* pbThumbprint = NULL;
-    DWORD cbThumbprint = 0;
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
 
-    // Walk up the chain looking for a certificate in the chain that matches our expected public key identifier
-    // and thumbprint (if a thumbprint was provided).
-    HRESULT hrChainVerification = E_NOTFOUND; // assume we won't find a match.
-    for (DWORD i = 0; i < pChainContext->rgpChain[0]->cElement; ++i)
+    if (!pDigest->fValid || !::GetFileInformationByHandle(hFile, &fileInformation))
+    {
+        return FALSE;
+    }
+
+    return pDigest->dwVolumeSerialNumber == fileInformation.dwVolumeSerialNumber &&
+           pDigest->dwFileIndexHigh == fileInformation.nFileIndexHigh &&
+           pDigest->dwFileIndexLow == fileInformation.nFileIndexLow &&
+           pDigest->qwFileSize == ((static_cast<DWORD64>(fileInformation.nFileSizeHigh) << 32) | fileInformation.nFileSizeLow) &&
+           0 == ::CompareFileTime(&pDigest->ftLastWriteTime, &fileInformation.ftLastWriteTime);
+}
+
+static BURN_CACHE_VERIFIED_INDEX* GetVerifiedIndex(
+    __in_opt BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CACHE_VERIFIED_INDEX* pIndex = NULL;
+    LPWSTR sczRootPath = NULL;
+
+    if (!pCache || !pCache->fInitializedCache || pCache->fFullVerification)
+    {
+        ExitFunction();
+    }
+
+    pIndex = fPerMachine ? &pCache->machineVerifiedIndex : &pCache->userVerifiedIndex;
+
+    ::EnterCriticalSection(&pIndex->csIndex);
+
+    if (!pIndex->fLoaded)
+    {
+        pIndex->fLoaded = TRUE;
+
+        hr = GetRootPath(pCache, fPerMachine, TRUE, &sczRootPath);
+        ExitOnFailure(hr, "Failed to get %hs package cache root directory.", fPerMachine ? "per-machine" : "per-user");
+
+        hr = PathConcat(sczRootPath, VERIFIED_INDEX_FILE_NAME, &pIndex->sczPath);
+        ExitOnFailure(hr, "Failed to construct verified index path.");
+
+        // Start with an empty index when it is missing or unreadable.
+        hr = LoadVerifiedIndex(pIndex);
+        if (FAILED(hr))
+        {
+            LogStringLine(REPORT_VERBOSE, "Ignoring verified index: %ls, error: 0x%x", pIndex->sczPath, hr);
+
+            ReleaseNullMem(pIndex->rgEntries);
+            pIndex->cEntries = 0;
+            hr = S_OK;
+        }
+    }
+
+LExit:
+    if (pIndex)
+    {
+        ::LeaveCriticalSection(&pIndex->csIndex);
+
+        if (!pIndex->sczPath)
+        {
+            pIndex = NULL;
+        }
+    }
+
+    ReleaseStr(sczRootPath);
+
+    return SUCCEEDED(hr) ? pIndex : NULL;
+}
+
+static __callback int __cdecl CompareVerifiedIndexEntries(
+    __in void* /*pvContext*/,
+    __in const void* pvLeft,
+    __in const void* pvRight
+    )
+{
+    const BURN_ACQUIRED_DIGEST* pLeft = static_cast<const BURN_ACQUIRED_DIGEST*>(pvLeft);
+    const BURN_ACQUIRED_DIGEST* pRight = static_cast<const BURN_ACQUIRED_DIGEST*>(pvRight);
+    ULARGE_INTEGER uliLeft = { pLeft->dwFileIndexLow, pLeft->dwFileIndexHigh };
+    ULARGE_INTEGER uliRight = { pRight->dwFileIndexLow, pRight->dwFileIndexHigh };
+
+    if (pLeft->dwVolumeSerialNumber != pRight->dwVolumeSerialNumber)
+    {
+        return pLeft->dwVolumeSerialNumber < pRight->dwVolumeSerialNumber ? -1 : 1;
+    }
+
+    return uliLeft.QuadPart < uliRight.QuadPart ? -1 : uliLeft.QuadPart > uliRight.QuadPart ? 1 : 0;
+}
+
+static HRESULT LoadVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE* pbBuffer = NULL;
+    SIZE_T cbBuffer = 0;
+    SIZE_T iBuffer = 0;
+    DWORD dwVersion = 0;
+    DWORD cEntries = 0;
+    BYTE* pbHash = NULL;
+    SIZE_T cbHash = 0;
+
+    hr = FileRead(&pbBuffer, &cbBuffer, pIndex->sczPath);
+    if (E_FILENOTFOUND == hr || E_PATHNOTFOUND == hr)
+    {
+        ExitFunction1(hr = S_OK);
+    }
+    ExitOnFailure(hr, "Failed to read verified index: %ls", pIndex->sczPath);
+
+    hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &dwVersion);
+    ExitOnFailure(hr, "Failed to read verified index version.");
+
+    if (VERIFIED_INDEX_VERSION != dwVersion)
+    {
+        ExitFunction1(hr = S_OK); // written by a different engine, it will be replaced on the next update.
+    }
+
+    hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &cEntries);
+    ExitOnFailure(hr, "Failed to read verified index entry count.");
+
+    if (VERIFIED_INDEX_MAX_ENTRIES < cEntries)
+    {
+        ExitOnRootFailure(hr = E_INVALIDDATA, "Verified index has too many entries: %u", cEntries);
+    }
+
+    if (cEntries)
+    {
+        pIndex->rgEntries = static_cast<BURN_ACQUIRED_DIGEST*>(MemAlloc(sizeof(BURN_ACQUIRED_DIGEST) * cEntries, TRUE));
+        ExitOnNull(pIndex->rgEntries, hr, E_OUTOFMEMORY, "Failed to allocate verified index entries.");
+    }
+
+    for (DWORD i = 0; i < cEntries; ++i)
+    {
+        BURN_ACQUIRED_DIGEST* pEntry = pIndex->rgEntries + i;
+
+        hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &pEntry->dwVolumeSerialNumber);
+        ExitOnFailure(hr, "Failed to read verified index volume serial number.");
+
+        hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &pEntry->dwFileIndexHigh);
+        ExitOnFailure(hr, "Failed to read verified index file index.");
+
+        hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &pEntry->dwFileIndexLow);
+        ExitOnFailure(hr, "Failed to read verified index file index.");
+
+        hr = BuffReadNumber64(pbBuffer, cbBuffer, &iBuffer, &pEntry->qwFileSize);
+        ExitOnFailure(hr, "Failed to read verified index file size.");
+
+        hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &pEntry->ftLastWriteTime.dwHighDateTime);
+        ExitOnFailure(hr, "Failed to read verified index last write time.");
+
+        hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &pEntry->ftLastWriteTime.dwLowDateTime);
+        ExitOnFailure(hr, "Failed to read verified index last write time.");
+
+        hr = BuffReadStream(pbBuffer, cbBuffer, &iBuffer, &pbHash, &cbHash);
+        ExitOnFailure(hr, "Failed to read verified index hash.");
+
+        if (sizeof(pEntry->rgbHash) != cbHash)
+        {
+            ExitOnRootFailure(hr = E_INVALIDDATA, "Verified index hash has invalid size: %u", cbHash);
+        }
+
+        memcpy_s(pEntry->rgbHash, sizeof(pEntry->rgbHash), pbHash, cbHash);
+        pEntry->fValid = TRUE;
+    }
+
+    pIndex->cEntries = cEntries;
+
+    qsort_s(pIndex->rgEntries, pIndex->cEntries, sizeof(BURN_ACQUIRED_DIGEST), CompareVerifiedIndexEntries, NULL);
+
+LExit:
+    ReleaseMem(pbHash);
+    ReleaseMem(pbBuffer);
+
+    return hr;
+}
+
+static HRESULT SaveVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE* pbBuffer = NULL;
+    SIZE_T cbBuffer = 0;
+
+    hr = BuffWriteNumber(&pbBuffer, &cbBuffer, VERIFIED_INDEX_VERSION);
+    ExitOnFailure(hr, "Failed to write verified index version.");
+
+    hr = BuffWriteNumber(&pbBuffer, &cbBuffer, pIndex->cEntries);
+    ExitOnFailure(hr, "Failed to write verified index entry count.");
+
+    for (DWORD i = 0; i < pIndex->cEntries; ++i)
+    {
+        const BURN_ACQUIRED_DIGEST* pEntry = pIndex->rgEntries + i;
+
+        hr = BuffWriteNumber(&pbBuffer, &cbBuffer, pEntry->dwVolumeSerialNumber);
+        ExitOnFailure(hr, "Failed to write verified index volume serial number.");
+
+        hr = BuffWriteNumber(&pbBuffer, &cbBuffer, pEntry->dwFileIndexHigh);
+        ExitOnFailure(hr, "Failed to write verified index file index.");
+
+        hr = BuffWriteNumber(&pbBuffer, &cbBuffer, pEntry->dwFileIndexLow);
+        ExitOnFailure(hr, "Failed to write verified index file index.");
+
+        hr = BuffWriteNumber64(&pbBuffer, &cbBuffer, pEntry->qwFileSize);
+        ExitOnFailure(hr, "Failed to write verified index file size.");
+
+        hr = BuffWriteNumber(&pbBuffer, &cbBuffer, pEntry->ftLastWriteTime.dwHighDateTime);
+        ExitOnFailure(hr, "Failed to write verified index last write time.");
+
+        hr = BuffWriteNumber(&pbBuffer, &cbBuffer, pEntry->ftLastWriteTime.dwLowDateTime);
+        ExitOnFailure(hr, "Failed to write verified index last write time.");
+
+        hr = BuffWriteStream(&pbBuffer, &cbBuffer, pEntry->rgbHash, sizeof(pEntry->rgbHash));
+        ExitOnFailure(hr, "Failed to write verified index hash.");
+    }
+
+    // A partially written index fails to load and is only a reason to rehash.
+    hr = FileWrite(pIndex->sczPath, FILE_ATTRIBUTE_HIDDEN, pbBuffer, cbBuffer, NULL);
+    ExitOnFailure(hr, "Failed to write verified index: %ls", pIndex->sczPath);
+
+LExit:
+    ReleaseMem(pbBuffer);
+
+    return hr;
+}
+
+static BOOL FindVerifiedIndexEntry(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in const BY_HANDLE_FILE_INFORMATION* pFileInformation,
+    __out DWORD* piEntry
+    )
+{
+    BURN_ACQUIRED_DIGEST key = { };
+    DWORD iLow = 0;
+    DWORD iHigh = pIndex->cEntries;
+
+    key.dwVolumeSerialNumber = pFileInformation->dwVolumeSerialNumber;
+    key.dwFileIndexHigh = pFileInformation->nFileIndexHigh;
+    key.dwFileIndexLow = pFileInformation->nFileIndexLow;
+
+    // Binary search for the entry, or where it would be inserted.
+    while (iLow < iHigh)
+    {
+        DWORD iMiddle = iLow + (iHigh - iLow) / 2;
+        int nCompare = CompareVerifiedIndexEntries(NULL, pIndex->rgEntries + iMiddle, &key);
+
+        if (0 == nCompare)
+        {
+            *piEntry = iMiddle;
+            return TRUE;
+        }
+        else if (0 > nCompare)
+        {
+            iLow = iMiddle + 1;
+        }
+        else
+        {
+            iHigh = iMiddle;
+        }
+    }
+
+    *piEntry = iLow;
+    return FALSE;
+}
+
+static void LookupVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in HANDLE hFile,
+    __out BURN_ACQUIRED_DIGEST* pDigest
+    )
+{
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+    DWORD iEntry = 0;
+
+    memset(pDigest, 0, sizeof(BURN_ACQUIRED_DIGEST));
+
+    if (!::GetFileInformationByHandle(hFile, &fileInformation))
+    {
+        return;
+    }
+
+    ::EnterCriticalSection(&pIndex->csIndex);
+
+    if (FindVerifiedIndexEntry(pIndex, &fileInformation, &iEntry))
+    {
+        // Any change to the size or last write time means the file must be hashed again.
+        if (IsAcquiredDigestCurrent(pIndex->rgEntries + iEntry, hFile))
+        {
+            *pDigest = pIndex->rgEntries[iEntry];
+            ++pIndex->cHits;
+        }
+    }
+
+    ::LeaveCriticalSection(&pIndex->csIndex);
+}
+
+static HRESULT UpdateVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in HANDLE hFile,
+    __in_bcount(cbHash) const BYTE* pbHash,
+    __in DWORD cbHash
+    )
+{
+    HRESULT hr = S_OK;
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+    BURN_ACQUIRED_DIGEST entry = { };
+    DWORD iEntry = 0;
+    BOOL fLocked = FALSE;
+
+    if (SHA512_HASH_LEN != cbHash)
+    {
+        ExitFunction();
+    }
+
+    if (!::GetFileInformationByHandle(hFile, &fileInformation))
+    {
+        ExitWithLastError(hr, "Failed to get file information.");
+    }
+
+    entry.fValid = TRUE;
+    memcpy_s(entry.rgbHash, sizeof(entry.rgbHash), pbHash, cbHash);
+    entry.qwFileSize = (static_cast<DWORD64>(fileInformation.nFileSizeHigh) << 32) | fileInformation.nFileSizeLow;
+    entry.dwVolumeSerialNumber = fileInformation.dwVolumeSerialNumber;
+    entry.dwFileIndexHigh = fileInformation.nFileIndexHigh;
+    entry.dwFileIndexLow = fileInformation.nFileIndexLow;
+    entry.ftLastWriteTime = fileInformation.ftLastWriteTime;
+
+    ::EnterCriticalSection(&pIndex->csIndex);
+    fLocked = TRUE;
+
+    if (FindVerifiedIndexEntry(pIndex, &fileInformation, &iEntry))
+    {
+        const BURN_ACQUIRED_DIGEST* pExisting = pIndex->rgEntries + iEntry;
+
+        if (pExisting->qwFileSize == entry.qwFileSize && 0 == ::CompareFileTime(&pExisting->ftLastWriteTime, &entry.ftLastWriteTime) &&
+            0 == memcmp(pExisting->rgbHash, entry.rgbHash, sizeof(entry.rgbHash)))
+        {
+            ExitFunction(); // already up to date.
+        }
+
+        pIndex->rgEntries[iEntry] = entry;
+    }
+    else
+    {
+        // Entries are only removed when Burn removes the file, so start over when the index gets too big.
+        if (VERIFIED_INDEX_MAX_ENTRIES <= pIndex->cEntries)
+        {
+            pIndex->cEntries = 0;
+            iEntry = 0;
+        }
+
+        hr = MemInsertIntoArray(reinterpret_cast<LPVOID*>(&pIndex->rgEntries), iEntry, 1, pIndex->cEntries, sizeof(BURN_ACQUIRED_DIGEST), 16);
+        ExitOnFailure(hr, "Failed to grow verified index.");
+
+        pIndex->rgEntries[iEntry] = entry;
+        ++pIndex->cEntries;
+    }
+
+    // Written once at the end of the apply by CacheSaveVerifiedIndexes.
+    pIndex->fDirty = TRUE;
+
+LExit:
+    if (fLocked)
+    {
+        ::LeaveCriticalSection(&pIndex->csIndex);
+    }
+
+    return hr;
+}
+
+static void RecordVerifiedPayload(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzCachedPath
+    )
+{
+    HRESULT hr = S_OK;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+
+    if (BURN_PAYLOAD_VERIFICATION_HASH != pPayload->verification)
+    {
+        ExitFunction();
+    }
+
+    hFile = ::CreateFileW(wzCachedPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    ExitOnInvalidHandleWithLastError(hFile, hr, "Failed to open cached payload: %ls", wzCachedPath);
+
+    hr = UpdateVerifiedIndex(pIndex, hFile, pPayload->pbHash, pPayload->cbHash);
+
+LExit:
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_VERBOSE, "Failed to update verified index for path: %ls, error: 0x%x", wzCachedPath, hr);
+    }
+
+    ReleaseFileHandle(hFile);
+}
+
+static void RemoveFromVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in_z LPCWSTR wzPath
+    )
+{
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+    DWORD iEntry = 0;
+
+    hFile = ::CreateFileW(wzPath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile || !::GetFileInformationByHandle(hFile, &fileInformation))
+    {
+        ExitFunction(); // nothing can be indexed for a file that cannot be opened.
+    }
+
+    // Content shared through the content store is still there under another name.
+    if (1 < fileInformation.nNumberOfLinks)
+    {
+        ExitFunction();
+    }
+
+    ::EnterCriticalSection(&pIndex->csIndex);
+
+    if (FindVerifiedIndexEntry(pIndex, &fileInformation, &iEntry))
+    {
+        MemRemoveFromArray(pIndex->rgEntries, iEntry, 1, pIndex->cEntries, sizeof(BURN_ACQUIRED_DIGEST), TRUE);
+        --pIndex->cEntries;
+
+        pIndex->fDirty = TRUE;
+    }
+
+    ::LeaveCriticalSection(&pIndex->csIndex);
+
+LExit:
+    ReleaseFileHandle(hFile);
+}
+
+static void RemoveFolderFromVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex,
+    __in_z LPCWSTR wzFolder
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczSearch = NULL;
+    LPWSTR sczPath = NULL;
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAW wfd = { };
+
+    hr = PathConcat(wzFolder, L"*", &sczSearch);
+    ExitOnFailure(hr, "Failed to construct search path for: %ls", wzFolder);
+
+    hFind = ::FindFirstFileW(sczSearch, &wfd);
+    if (INVALID_HANDLE_VALUE == hFind)
+    {
+        ExitFunction();
+    }
+
+    do
+    {
+        if (L'.' == wfd.cFileName[0] && (L'\0' == wfd.cFileName[1] || (L'.' == wfd.cFileName[1] && L'\0' == wfd.cFileName[2])))
+        {
+            continue;
+        }
+
+        hr = PathConcat(wzFolder, wfd.cFileName, &sczPath);
+        ExitOnFailure(hr, "Failed to construct path for: %ls", wfd.cFileName);
+
+        if (FILE_ATTRIBUTE_DIRECTORY & wfd.dwFileAttributes)
+        {
+            // Do not follow junctions out of the cache.
+            if (!(FILE_ATTRIBUTE_REPARSE_POINT & wfd.dwFileAttributes))
+            {
+                RemoveFolderFromVerifiedIndex(pIndex, sczPath);
+            }
+        }
+        else
+        {
+            RemoveFromVerifiedIndex(pIndex, sczPath);
+        }
+    } while (::FindNextFileW(hFind, &wfd));
+
+LExit:
+    if (INVALID_HANDLE_VALUE != hFind)
+    {
+        ::FindClose(hFind);
+    }
+
+    ReleaseStr(sczPath);
+    ReleaseStr(sczSearch);
+}
+
+static void SaveOrDeleteVerifiedIndex(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CACHE_VERIFIED_INDEX* pIndex = fPerMachine ? &pCache->machineVerifiedIndex : &pCache->userVerifiedIndex;
+    LPWSTR sczRootPath = NULL;
+    LPWSTR sczIndexPath = NULL;
+    LPWSTR sczContentPath = NULL;
+
+    if (!pIndex->fInitialized)
+    {
+        return;
+    }
+
+    ::EnterCriticalSection(&pIndex->csIndex);
+
+    if (pIndex->fPackageRemoved)
+    {
+        pIndex->fPackageRemoved = FALSE;
+
+        hr = GetRootPath(pCache, fPerMachine, TRUE, &sczRootPath);
+        ExitOnFailure(hr, "Failed to get %hs package cache root directory.", fPerMachine ? "per-machine" : "per-user");
+
+        // Once the last package is gone, the index and the content store only take up space.
+        if (IsCacheRootUnused(sczRootPath))
+        {
+            hr = PathConcat(sczRootPath, VERIFIED_INDEX_FILE_NAME, &sczIndexPath);
+            ExitOnFailure(hr, "Failed to construct verified index path.");
+
+            hr = PathConcat(sczRootPath, CONTENT_STORE_FOLDER_NAME, &sczContentPath);
+            ExitOnFailure(hr, "Failed to construct content store path.");
+
+            LogStringLine(REPORT_STANDARD, "Removing unused verified index and content store from package cache: %ls", sczRootPath);
+
+            hr = FileEnsureDelete(sczIndexPath);
+            ExitOnFailure(hr, "Failed to delete verified index: %ls", sczIndexPath);
+
+            hr = DirEnsureDeleteEx(sczContentPath, DIR_DELETE_FILES | DIR_DELETE_RECURSE | DIR_DELETE_SCHEDULE);
+            ExitOnFailure(hr, "Failed to delete content store: %ls", sczContentPath);
+
+            // The tombstones folder may still be in use by the background deletion, the root is removed after it.
+            DirEnsureDeleteEx(sczRootPath, DIR_DELETE_SCHEDULE);
+
+            ReleaseNullMem(pIndex->rgEntries);
+            pIndex->cEntries = 0;
+            pIndex->fDirty = FALSE;
+        }
+    }
+
+    if (pIndex->fDirty && pIndex->sczPath)
+    {
+        pIndex->fDirty = FALSE;
+
+        hr = SaveVerifiedIndex(pIndex);
+        ExitOnFailure(hr, "Failed to save verified index: %ls", pIndex->sczPath);
+    }
+
+LExit:
+    ::LeaveCriticalSection(&pIndex->csIndex);
+
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_VERBOSE, "Ignoring failure to update %hs verified index, error: 0x%x", fPerMachine ? "per-machine" : "per-user", hr);
+    }
+
+    ReleaseStr(sczContentPath);
+    ReleaseStr(sczIndexPath);
+    ReleaseStr(sczRootPath);
+}
+
+static BOOL IsCacheRootUnused(
+    __in_z LPCWSTR wzRootPath
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fUnused = FALSE;
+    LPWSTR sczSearch = NULL;
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAW wfd = { };
+
+    hr = PathConcat(wzRootPath, L"*", &sczSearch);
+    ExitOnFailure(hr, "Failed to construct search path for: %ls", wzRootPath);
+
+    hFind = ::FindFirstFileW(sczSearch, &wfd);
+    if (INVALID_HANDLE_VALUE == hFind)
+    {
+        ExitFunction();
+    }
+
+    fUnused = TRUE;
+
+    do
+    {
+        if (CSTR_EQUAL != ::CompareStringW(LOCALE_NEUTRAL, NORM_IGNORECASE, wfd.cFileName, -1, L".", -1) &&
+            CSTR_EQUAL != ::CompareStringW(LOCALE_NEUTRAL, NORM_IGNORECASE, wfd.cFileName, -1, L"..", -1) &&
+            CSTR_EQUAL != ::CompareStringW(LOCALE_NEUTRAL, NORM_IGNORECASE, wfd.cFileName, -1, VERIFIED_INDEX_FILE_NAME, -1) &&
+            CSTR_EQUAL != ::CompareStringW(LOCALE_NEUTRAL, NORM_IGNORECASE, wfd.cFileName, -1, CONTENT_STORE_FOLDER_NAME, -1) &&
+            CSTR_EQUAL != ::CompareStringW(LOCALE_NEUTRAL, NORM_IGNORECASE, wfd.cFileName, -1, UNVERIFIED_CACHE_FOLDER_NAME, -1) &&
+            CSTR_EQUAL != ::CompareStringW(LOCALE_NEUTRAL, NORM_IGNORECASE, wfd.cFileName, -1, TOMBSTONE_FOLDER_NAME, -1))
+        {
+            fUnused = FALSE;
+            break;
+        }
+    } while (::FindNextFileW(hFind, &wfd));
+
+LExit:
+    if (INVALID_HANDLE_VALUE != hFind)
+    {
+        ::FindClose(hFind);
+    }
+
+    ReleaseStr(sczSearch);
+
+    return fUnused;
+}
+
+static void InitializeVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    )
+{
+    ::InitializeCriticalSection(&pIndex->csIndex);
+    pIndex->fInitialized = TRUE;
+}
+
+static void UninitializeVerifiedIndex(
+    __in BURN_CACHE_VERIFIED_INDEX* pIndex
+    )
+{
+    if (pIndex->fInitialized)
+    {
+        ::DeleteCriticalSection(&pIndex->csIndex);
+    }
+
+    ReleaseMem(pIndex->rgEntries);
+    ReleaseStr(pIndex->sczPath);
+
+    memset(pIndex, 0, sizeof(BURN_CACHE_VERIFIED_INDEX));
+}
+
+static HRESULT GetContentStorePath(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
+    __in BURN_PAYLOAD* pPayload,
+    __out_z LPWSTR* psczStorePath
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczStoreFolder = NULL;
+    LPWSTR sczHash = NULL;
+
+    // Only content identified by its SHA-512 hash can be shared, leave the path unset for anything else.
+    if (BURN_PAYLOAD_VERIFICATION_HASH != pPayload->verification || SHA512_HASH_LEN != pPayload->cbHash)
+    {
+        ExitFunction();
+    }
+
+    hr = CacheGetCompletedPath(pCache, fPerMachine, CONTENT_STORE_FOLDER_NAME, &sczStoreFolder);
+    ExitOnFailure(hr, "Failed to get content store folder.");
+
+    hr = StrAllocHexEncode(pPayload->pbHash, pPayload->cbHash, &sczHash);
+    ExitOnFailure(hr, "Failed to encode payload hash.");
+
+    hr = PathConcat(sczStoreFolder, sczHash, psczStorePath);
+    ExitOnFailure(hr, "Failed to concat content store path.");
+
+LExit:
+    ReleaseStr(sczHash);
+    ReleaseStr(sczStoreFolder);
+
+    return hr;
+}
+
+static BOOL LinkFromContentStore(
+    __in_z LPCWSTR wzCachedPath,
+    __in_z LPCWSTR wzStorePath
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczDirectory = NULL;
+    BOOL fLinked = FALSE;
+
+    if (!FileExistsEx(wzStorePath, NULL))
+    {
+        ExitFunction();
+    }
+
+    hr = PathGetParentPath(wzCachedPath, &sczDirectory, NULL);
+    ExitOnFailure(hr, "Failed to get parent directory of cached payload: %ls", wzCachedPath);
+
+    hr = DirEnsureExists(sczDirectory, NULL);
+    ExitOnFailure(hr, "Failed to create cache directory: %ls", sczDirectory);
+
+    if (!::CreateHardLinkW(wzCachedPath, wzStorePath, NULL))
+    {
+        ExitWithLastError(hr, "Failed to link cached payload: %ls", wzCachedPath);
+    }
+
+    LogStringLine(REPORT_VERBOSE, "Linked cached payload: %ls from content store: %ls", wzCachedPath, wzStorePath);
+    fLinked = TRUE;
+
+LExit:
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_VERBOSE, "Failed to link cached payload: %ls from content store: %ls, error: 0x%x", wzCachedPath, wzStorePath, hr);
+    }
+
+    ReleaseStr(sczDirectory);
+
+    return fLinked;
+}
+
+static void AddToContentStore(
+    __in BOOL fPerMachine,
+    __in_z LPCWSTR wzStorePath,
+    __in_z LPCWSTR wzCachedPath
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczStoreFolder = NULL;
+
+    if (FileExistsEx(wzStorePath, NULL))
+    {
+        ExitFunction();
+    }
+
+    hr = PathGetParentPath(wzStorePath, &sczStoreFolder, NULL);
+    ExitOnFailure(hr, "Failed to get content store folder.");
+
+    if (!DirExists(sczStoreFolder, NULL))
+    {
+        hr = DirEnsureExists(sczStoreFolder, NULL);
+        ExitOnFailure(hr, "Failed to create content store folder: %ls", sczStoreFolder);
+
+        ResetPathPermissions(fPerMachine, sczStoreFolder);
+    }
+
+    // The store entry is another link to the cached file, so the link count tracks how many packages reference it.
+    if (!::CreateHardLinkW(wzStorePath, wzCachedPath, NULL))
+    {
+        ExitWithLastError(hr, "Failed to add cached payload to content store: %ls", wzStorePath);
+    }
+
+LExit:
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_VERBOSE, "Failed to add cached payload: %ls to content store, error: 0x%x", wzCachedPath, hr);
+    }
+
+    ReleaseStr(sczStoreFolder);
+}
+
+static void PruneContentStore(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczStoreFolder = NULL;
+    LPWSTR sczFiles = NULL;
+    LPWSTR sczEntry = NULL;
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAW wfd = { };
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+
+    hr = CacheGetCompletedPath(pCache, fPerMachine, CONTENT_STORE_FOLDER_NAME, &sczStoreFolder);
+    ExitOnFailure(hr, "Failed to get content store folder.");
+
+    hr = PathConcat(sczStoreFolder, L"*", &sczFiles);
+    ExitOnFailure(hr, "Failed to concat content store search path.");
+
+    hFind = ::FindFirstFileW(sczFiles, &wfd);
+    if (INVALID_HANDLE_VALUE == hFind)
+    {
+        ExitFunction();
+    }
+
+    do
+    {
+        if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            continue;
+        }
+
+        hr = PathConcat(sczStoreFolder, wfd.cFileName, &sczEntry);
+        ExitOnFailure(hr, "Failed to concat content store entry path.");
+
+        hFile = ::CreateFileW(sczEntry, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            continue;
+        }
+
+        // An entry with no other links is no longer referenced by any package.
+        if (::GetFileInformationByHandle(hFile, &fileInformation) && 1 >= fileInformation.nNumberOfLinks)
+        {
+            ReleaseFileHandle(hFile);
+
+            hr = FileEnsureDelete(sczEntry);
+            if (FAILED(hr))
+            {
+                LogStringLine(REPORT_VERBOSE, "Failed to remove unreferenced content store entry: %ls, error: 0x%x", sczEntry, hr);
+                hr = S_OK;
+            }
+        }
+
+        ReleaseFileHandle(hFile);
+    } while (::FindNextFileW(hFind, &wfd));
+
+    ::FindClose(hFind);
+    hFind = INVALID_HANDLE_VALUE;
+
+    // Try to remove the store in the off chance it is now empty.
+    DirEnsureDeleteEx(sczStoreFolder, DIR_DELETE_SCHEDULE);
+
+LExit:
+    if (INVALID_HANDLE_VALUE != hFind)
+    {
+        ::FindClose(hFind);
+    }
+
+    ReleaseFileHandle(hFile);
+    ReleaseStr(sczEntry);
+    ReleaseStr(sczFiles);
+    ReleaseStr(sczStoreFolder);
+}
+
+static HRESULT VerifyCachedPayload(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzCachedPath,
+    __in BURN_CACHE_STEP cacheStep,
+    __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
+    __in LPPROGRESS_ROUTINE pfnProgress,
+    __in LPVOID pContext
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczStorePath = NULL;
+    BOOL fLinked = FALSE;
+
+    hr = GetContentStorePath(pCache, fPerMachine, pPayload, &sczStorePath);
+    ExitOnFailure(hr, "Failed to get content store path for payload: %ls", pPayload->sczKey);
+
+    // A payload missing from its package folder may already be cached for another package.
+    if (sczStorePath && !FileExistsEx(wzCachedPath, NULL))
+    {
+        fLinked = LinkFromContentStore(wzCachedPath, sczStorePath);
+    }
+
+    hr = VerifyFileAgainstPayload(pCache, pPayload, wzCachedPath, TRUE, GetVerifiedIndex(pCache, fPerMachine), NULL, cacheStep, pfnCacheMessageHandler, pfnProgress, pContext);
+    if (FAILED(hr))
+    {
+        // The linked file did not verify so the store entry is bad too.
+        if (fLinked)
+        {
+            FileEnsureDelete(sczStorePath);
+        }
+    }
+    else if (sczStorePath && !fLinked)
+    {
+        AddToContentStore(fPerMachine, sczStorePath, wzCachedPath);
+    }
+
+LExit:
+    ReleaseStr(sczStorePath);
+
+    return hr;
+}
+
+static HRESULT EnsureHashPool(
+    __in BURN_CACHE_HASH_POOL* pPool
+    )
+{
+    HRESULT hr = S_OK;
+    SYSTEM_INFO systemInfo = { };
+    DWORD cThreads = 0;
+
+    if (pPool->fInitialized)
+    {
+        ExitFunction();
+    }
+
+    pPool->hWorkSemaphore = ::CreateSemaphoreW(NULL, 0, LONG_MAX, NULL);
+    ExitOnNullWithLastError(pPool->hWorkSemaphore, hr, "Failed to create payload hash pool semaphore.");
+
+    ::InitializeCriticalSection(&pPool->csJobs);
+    pPool->fInitialized = TRUE;
+
+    ::GetSystemInfo(&systemInfo);
+    cThreads = min(systemInfo.dwNumberOfProcessors, BURN_CACHE_MAX_HASH_THREADS);
+    if (!cThreads)
+    {
+        cThreads = 1;
+    }
+
+    pPool->rghThreads = static_cast<HANDLE*>(MemAlloc(sizeof(HANDLE) * cThreads, TRUE));
+    ExitOnNull(pPool->rghThreads, hr, E_OUTOFMEMORY, "Failed to allocate payload hash threads.");
+
+    // Jobs that no worker picks up are hashed when they are taken, so running short of threads is not fatal.
+    for (DWORD i = 0; i < cThreads; ++i)
+    {
+        pPool->rghThreads[pPool->cThreads] = ::CreateThread(NULL, 0, HashPoolThreadProc, pPool, 0, NULL);
+        if (!pPool->rghThreads[pPool->cThreads])
+        {
+            LogStringLine(REPORT_VERBOSE, "Failed to create payload hash thread, error: 0x%x", HRESULT_FROM_WIN32(::GetLastError()));
+            break;
+        }
+
+        ++pPool->cThreads;
+    }
+
+LExit:
+    return hr;
+}
+
+static DWORD WINAPI HashPoolThreadProc(
+    __in LPVOID lpThreadParameter
+    )
+{
+    BURN_CACHE_HASH_POOL* pPool = static_cast<BURN_CACHE_HASH_POOL*>(lpThreadParameter);
+    BURN_CACHE_HASH_JOB* pJob = NULL;
+    BOOL fShutdown = FALSE;
+
+    while (!fShutdown)
+    {
+        if (WAIT_OBJECT_0 != ::WaitForSingleObject(pPool->hWorkSemaphore, INFINITE))
+        {
+            break;
+        }
+
+        pJob = NULL;
+
+        ::EnterCriticalSection(&pPool->csJobs);
+
+        fShutdown = pPool->fShutdown;
+
+        for (DWORD i = 0; !fShutdown && i < pPool->cJobs; ++i)
+        {
+            if (!pPool->rgpJobs[i]->fStarted)
+            {
+                pJob = pPool->rgpJobs[i];
+                pJob->fStarted = TRUE;
+                break;
+            }
+        }
+
+        ::LeaveCriticalSection(&pPool->csJobs);
+
+        if (pJob)
+        {
+            HashPayloadJob(pJob);
+            ::SetEvent(pJob->hComplete);
+        }
+    }
+
+    return 0;
+}
+
+static void HashPayloadJob(
+    __in BURN_CACHE_HASH_JOB* pJob
+    )
+{
+    HRESULT hr = S_OK;
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+    DWORD64 qwHashedBytes = 0;
+
+    hr = CrypHashFileHandle(pJob->hFile, PROV_RSA_AES, CALG_SHA_512, pJob->digest.rgbHash, sizeof(pJob->digest.rgbHash), &qwHashedBytes);
+    ExitOnFailure(hr, "Failed to calculate hash for payload: %ls", pJob->pPayload->sczKey);
+
+    if (!::GetFileInformationByHandle(pJob->hFile, &fileInformation))
+    {
+        ExitWithLastError(hr, "Failed to get file information for payload: %ls", pJob->pPayload->sczKey);
+    }
+
+    pJob->digest.qwFileSize = (static_cast<DWORD64>(fileInformation.nFileSizeHigh) << 32) | fileInformation.nFileSizeLow;
+    if (pJob->digest.qwFileSize != qwHashedBytes)
+    {
+        ExitWithRootFailure(hr, E_UNEXPECTED, "Hashed %llu bytes of payload: %ls but the file is %llu bytes.", qwHashedBytes, pJob->pPayload->sczKey, pJob->digest.qwFileSize);
+    }
+
+    pJob->digest.dwVolumeSerialNumber = fileInformation.dwVolumeSerialNumber;
+    pJob->digest.dwFileIndexHigh = fileInformation.nFileIndexHigh;
+    pJob->digest.dwFileIndexLow = fileInformation.nFileIndexLow;
+    pJob->digest.ftLastWriteTime = fileInformation.ftLastWriteTime;
+    pJob->digest.fValid = TRUE;
+
+LExit:
+    pJob->hrHash = hr;
+}
+
+static BURN_CACHE_HASH_JOB* TakePayloadHashJob(
+    __in BURN_CACHE_HASH_POOL* pPool,
+    __in BURN_PAYLOAD* pPayload,
+    __in BOOL fComplete
+    )
+{
+    BURN_CACHE_HASH_JOB* pJob = NULL;
+    BOOL fHashHere = FALSE;
+
+    ::EnterCriticalSection(&pPool->csJobs);
+
+    for (DWORD i = 0; i < pPool->cJobs; ++i)
+    {
+        if (pPayload == pPool->rgpJobs[i]->pPayload)
+        {
+            pJob = pPool->rgpJobs[i];
+            MemRemoveFromArray(pPool->rgpJobs, i, 1, pPool->cJobs, sizeof(BURN_CACHE_HASH_JOB*), TRUE);
+            --pPool->cJobs;
+
+            // No worker got to it yet, so hash it here rather than wait behind the other jobs.
+            if (fComplete && !pJob->fStarted)
+            {
+                pJob->fStarted = TRUE;
+                fHashHere = TRUE;
+            }
+
+            break;
+        }
+    }
+
+    ::LeaveCriticalSection(&pPool->csJobs);
+
+    if (fHashHere)
+    {
+        HashPayloadJob(pJob);
+        ::SetEvent(pJob->hComplete);
+    }
+    else if (fComplete && pJob)
+    {
+        ::WaitForSingleObject(pJob->hComplete, INFINITE);
+    }
+
+    return pJob;
+}
+
+static void ReleasePayloadHashJob(
+    __in BURN_CACHE_HASH_JOB* pJob
+    )
+{
+    // The job is off the list, so only a worker that already started it can still be using it.
+    if (pJob->fStarted && pJob->hComplete)
+    {
+        ::WaitForSingleObject(pJob->hComplete, INFINITE);
+    }
+
+    ReleaseFileHandle(pJob->hFile);
+    ReleaseHandle(pJob->hComplete);
+    MemFree(pJob);
+}
+
+static void UninitializeHashPool(
+    __in BURN_CACHE_HASH_POOL* pPool
+    )
+{
+    if (!pPool->fInitialized)
+    {
+        return;
+    }
+
+    ::EnterCriticalSection(&pPool->csJobs);
+    pPool->fShutdown = TRUE;
+    ::LeaveCriticalSection(&pPool->csJobs);
+
+    if (pPool->cThreads)
+    {
+        ::ReleaseSemaphore(pPool->hWorkSemaphore, pPool->cThreads, NULL);
+        ::WaitForMultipleObjects(pPool->cThreads, pPool->rghThreads, TRUE, INFINITE);
+    }
+
+    for (DWORD i = 0; i < pPool->cThreads; ++i)
+    {
+        ReleaseHandle(pPool->rghThreads[i]);
+    }
+
+    for (DWORD i = 0; i < pPool->cJobs; ++i)
+    {
+        ReleasePayloadHashJob(pPool->rgpJobs[i]);
+    }
+
+    ReleaseMem(pPool->rgpJobs);
+    ReleaseMem(pPool->rghThreads);
+    ReleaseHandle(pPool->hWorkSemaphore);
+    ::DeleteCriticalSection(&pPool->csJobs);
+
+    memset(pPool, 0, sizeof(BURN_CACHE_HASH_POOL));
+}
+
+static HRESULT EnsureDeletionQueue(
+    __in BURN_CACHE* pCache
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CACHE_DELETION_QUEUE* pQueue = &pCache->deletionQueue;
+
+    if (pQueue->fInitialized)
+    {
+        ExitFunction();
+    }
+
+    pQueue->hWorkSemaphore = ::CreateSemaphoreW(NULL, 0, LONG_MAX, NULL);
+    ExitOnNullWithLastError(pQueue->hWorkSemaphore, hr, "Failed to create cache deletion semaphore.");
+
+    ::InitializeCriticalSection(&pQueue->csTombstones);
+
+    pQueue->hThread = ::CreateThread(NULL, 0, DeletionQueueThreadProc, pCache, 0, NULL);
+    if (!pQueue->hThread)
+    {
+        hr = HRESULT_FROM_WIN32(::GetLastError());
+        ::DeleteCriticalSection(&pQueue->csTombstones);
+        ReleaseHandle(pQueue->hWorkSemaphore);
+        ExitOnRootFailure(hr, "Failed to create cache deletion thread.");
+    }
+
+    pQueue->fInitialized = TRUE;
+
+LExit:
+    return hr;
+}
+
+static HRESULT QueueCacheDeletion(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
+    __in_z LPCWSTR wzDirectory
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczSource = NULL;
+    LPWSTR sczParent = NULL;
+    LPWSTR sczTombstoneFolder = NULL;
+    LPWSTR sczTombstone = NULL;
+    size_t cchSource = 0;
+
+    hr = EnsureDeletionQueue(pCache);
+    ExitOnFailure(hr, "Failed to initialize cache deletion queue.");
+
+    RecoverTombstones(pCache, fPerMachine);
+
+    if (!DirExists(wzDirectory, NULL))
+    {
+        ExitFunction1(hr = E_PATHNOTFOUND);
+    }
+
+    hr = StrAllocString(&sczSource, wzDirectory, 0);
+    ExitOnFailure(hr, "Failed to copy cache directory.");
+
+    hr = ::StringCchLengthW(sczSource, STRSAFE_MAX_CCH, &cchSource);
+    ExitOnRootFailure(hr, "Failed to get length of cache directory.");
+
+    while (cchSource && L'\\' == sczSource[cchSource - 1])
+    {
+        sczSource[--cchSource] = L'\0';
+    }
+
+    // The tombstone is a sibling so the move is a rename on the same volume.
+    hr = PathGetParentPath(sczSource, &sczParent, NULL);
+    ExitOnFailure(hr, "Failed to get parent of cache directory: %ls", sczSource);
+
+    hr = PathConcat(sczParent, TOMBSTONE_FOLDER_NAME, &sczTombstoneFolder);
+    ExitOnFailure(hr, "Failed to concat tombstone folder.");
+
+    hr = DirEnsureExists(sczTombstoneFolder, NULL);
+    ExitOnFailure(hr, "Failed to create tombstone folder: %ls", sczTombstoneFolder);
+
+    hr = StrAllocFormatted(&sczTombstone, L"%ls\\%.*ls.%u", sczTombstoneFolder, GUID_STRING_LENGTH - 1, pCache->wzGuid, ::InterlockedIncrement(&pCache->deletionQueue.cCreated));
+    ExitOnFailure(hr, "Failed to format tombstone path.");
+
+    if (!::MoveFileExW(sczSource, sczTombstone, 0))
+    {
+        ExitFunction1(hr = HRESULT_FROM_WIN32(::GetLastError()));
+    }
+
+    LogStringLine(REPORT_VERBOSE, "Moved cache directory: %ls to: %ls for deletion.", sczSource, sczTombstone);
+
+    hr = EnqueueTombstone(&pCache->deletionQueue, fPerMachine, &sczTombstone);
+    ExitOnFailure(hr, "Failed to queue tombstone for deletion.");
+
+LExit:
+    ReleaseStr(sczTombstone);
+    ReleaseStr(sczTombstoneFolder);
+    ReleaseStr(sczParent);
+    ReleaseStr(sczSource);
+
+    return hr;
+}
+
+static HRESULT EnqueueTombstone(
+    __in BURN_CACHE_DELETION_QUEUE* pQueue,
+    __in BOOL fPerMachine,
+    __deref_inout_z LPWSTR* psczTombstone
+    )
+{
+    HRESULT hr = S_OK;
+
+    ::EnterCriticalSection(&pQueue->csTombstones);
+
+    hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pQueue->rgTombstones), pQueue->cTombstones, 1, sizeof(BURN_CACHE_TOMBSTONE), 5);
+    if (SUCCEEDED(hr))
+    {
+        pQueue->rgTombstones[pQueue->cTombstones].sczPath = *psczTombstone;
+        pQueue->rgTombstones[pQueue->cTombstones].fPerMachine = fPerMachine;
+        ++pQueue->cTombstones;
+
+        *psczTombstone = NULL;
+    }
+
+    ::LeaveCriticalSection(&pQueue->csTombstones);
+    ExitOnFailure(hr, "Failed to grow tombstone array.");
+
+    ::ReleaseSemaphore(pQueue->hWorkSemaphore, 1, NULL);
+
+LExit:
+    return hr;
+}
+
+static void RecoverTombstones(
+    __in BURN_CACHE* pCache,
+    __in BOOL fPerMachine
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL* pfRecovered = fPerMachine ? &pCache->deletionQueue.fMachineRecovered : &pCache->deletionQueue.fUserRecovered;
+    BOOL fRedirected = FALSE;
+    LPWSTR sczRootPath = NULL;
+    LPWSTR sczTombstoneFolder = NULL;
+    LPWSTR sczFiles = NULL;
+    LPWSTR sczTombstone = NULL;
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAW wfd = { };
+
+    if (*pfRecovered)
+    {
+        ExitFunction();
+    }
+
+    *pfRecovered = TRUE;
+
+    // Tombstones that an earlier engine did not finish deleting are in the current root or, when redirected, the old one.
+    for (DWORD iRoot = 0; iRoot < 2; ++iRoot)
+    {
+        hr = GetRootPath(pCache, fPerMachine, 0 == iRoot, &sczRootPath);
+        ExitOnFailure(hr, "Failed to get %hs package cache root directory.", fPerMachine ? "per-machine" : "per-user");
+
+        if (0 == iRoot)
+        {
+            fRedirected = S_FALSE == hr;
+        }
+
+        hr = PathConcat(sczRootPath, TOMBSTONE_FOLDER_NAME, &sczTombstoneFolder);
+        ExitOnFailure(hr, "Failed to concat tombstone folder.");
+
+        hr = PathConcat(sczTombstoneFolder, L"*", &sczFiles);
+        ExitOnFailure(hr, "Failed to concat tombstone search path.");
+
+        hFind = ::FindFirstFileW(sczFiles, &wfd);
+        if (INVALID_HANDLE_VALUE != hFind)
+        {
+            do
+            {
+                if (!(wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || L'.' == wfd.cFileName[0])
+                {
+                    continue;
+                }
+
+                hr = PathConcat(sczTombstoneFolder, wfd.cFileName, &sczTombstone);
+                ExitOnFailure(hr, "Failed to concat tombstone path.");
+
+                LogStringLine(REPORT_VERBOSE, "Recovered cache tombstone: %ls", sczTombstone);
+
+                hr = EnqueueTombstone(&pCache->deletionQueue, fPerMachine, &sczTombstone);
+                ExitOnFailure(hr, "Failed to queue recovered tombstone for deletion.");
+            } while (::FindNextFileW(hFind, &wfd));
+
+            ::FindClose(hFind);
+            hFind = INVALID_HANDLE_VALUE;
+        }
+
+        if (!fRedirected)
+        {
+            break;
+        }
+    }
+
+LExit:
+    if (INVALID_HANDLE_VALUE != hFind)
+    {
+        ::FindClose(hFind);
+    }
+
+    ReleaseStr(sczTombstone);
+    ReleaseStr(sczFiles);
+    ReleaseStr(sczTombstoneFolder);
+    ReleaseStr(sczRootPath);
+}
+
+static DWORD WINAPI DeletionQueueThreadProc(
+    __in LPVOID lpThreadParameter
+    )
+{
+    BURN_CACHE* pCache = static_cast<BURN_CACHE*>(lpThreadParameter);
+    BURN_CACHE_DELETION_QUEUE* pQueue = &pCache->deletionQueue;
+    BURN_CACHE_TOMBSTONE tombstone = { };
+    BOOL fDone = FALSE;
+
+    // Lowers the I/O priority too, so the deletes stay out of the way of the rest of the engine.
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    while (!fDone)
+    {
+        if (WAIT_OBJECT_0 != ::WaitForSingleObject(pQueue->hWorkSemaphore, INFINITE))
+        {
+            break;
+        }
+
+        memset(&tombstone, 0, sizeof(tombstone));
+
+        ::EnterCriticalSection(&pQueue->csTombstones);
+
+        if (pQueue->cTombstones)
+        {
+            tombstone = pQueue->rgTombstones[0];
+
+            --pQueue->cTombstones;
+            memmove(pQueue->rgTombstones, pQueue->rgTombstones + 1, sizeof(BURN_CACHE_TOMBSTONE) * pQueue->cTombstones);
+        }
+        else
+        {
+            fDone = pQueue->fShutdown;
+        }
+
+        ::LeaveCriticalSection(&pQueue->csTombstones);
+
+        if (tombstone.sczPath)
+        {
+            DeleteTombstone(pCache, &tombstone);
+            ReleaseStr(tombstone.sczPath);
+        }
+    }
+
+    return 0;
+}
+
+static void DeleteTombstone(
+    __in BURN_CACHE* pCache,
+    __in BURN_CACHE_TOMBSTONE* pTombstone
+    )
+{
+    HRESULT hr = E_FAIL;
+    LPWSTR sczTombstoneFolder = NULL;
+    LPWSTR sczRootPath = NULL;
+
+    for (DWORD iRetry = 0; FAILED(hr) && iRetry < FILE_OPERATION_RETRY_COUNT; ++iRetry)
+    {
+        if (0 < iRetry)
+        {
+            ::Sleep(FILE_OPERATION_RETRY_WAIT);
+        }
+
+        hr = DirEnsureDeleteEx(pTombstone->sczPath, DIR_DELETE_FILES | DIR_DELETE_RECURSE | DIR_DELETE_SCHEDULE);
+        if (E_PATHNOTFOUND == hr)
+        {
+            hr = S_OK;
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        // Left for the next engine to recover.
+        LogStringLine(REPORT_VERBOSE, "Failed to delete cache tombstone: %ls, error: 0x%x", pTombstone->sczPath, hr);
+        ExitFunction();
+    }
+
+    // Drop the content the removed folder was the last to reference.
+    PruneContentStore(pCache, pTombstone->fPerMachine);
+
+    // Try to remove the tombstone folder and the package cache root in the off chance they are now empty.
+    hr = PathGetParentPath(pTombstone->sczPath, &sczTombstoneFolder, NULL);
+    ExitOnFailure(hr, "Failed to get tombstone folder.");
+
+    hr = PathGetParentPath(sczTombstoneFolder, &sczRootPath, NULL);
+    ExitOnFailure(hr, "Failed to get package cache root directory.");
+
+    if (::RemoveDirectoryW(sczTombstoneFolder))
+    {
+        ::RemoveDirectoryW(sczRootPath);
+    }
+
+LExit:
+    ReleaseStr(sczRootPath);
+    ReleaseStr(sczTombstoneFolder);
+}
+
+static void UninitializeDeletionQueue(
+    __in BURN_CACHE_DELETION_QUEUE* pQueue
+    )
+{
+    if (!pQueue->fInitialized)
+    {
+        return;
+    }
+
+    // The thread drains the queue before it exits.
+    ::EnterCriticalSection(&pQueue->csTombstones);
+    pQueue->fShutdown = TRUE;
+    ::LeaveCriticalSection(&pQueue->csTombstones);
+
+    ::ReleaseSemaphore(pQueue->hWorkSemaphore, 1, NULL);
+    ::WaitForSingleObject(pQueue->hThread, INFINITE);
+
+    for (DWORD i = 0; i < pQueue->cTombstones; ++i)
+    {
+        ReleaseStr(pQueue->rgTombstones[i].sczPath);
+    }
+
+    ReleaseMem(pQueue->rgTombstones);
+    ReleaseHandle(pQueue->hThread);
+    ReleaseHandle(pQueue->hWorkSemaphore);
+    ::DeleteCriticalSection(&pQueue->csTombstones);
+
+    memset(pQueue, 0, sizeof(BURN_CACHE_DELETION_QUEUE));
+}
+
+static HRESULT VerifyPayloadAgainstCertChain(
+    __in BURN_PAYLOAD* pPayload,
+    __in PCCERT_CHAIN_CONTEXT pChainContext
+    )
+{
+    HRESULT hr = S_OK;
+    PCCERT_CONTEXT pChainElementCertContext = NULL;
+
+    BYTE rgbPublicKeyIdentifier[SHA1_HASH_LEN] = { };
+    DWORD cbPublicKeyIdentifier = sizeof(rgbPublicKeyIdentifier);
+    BYTE* pbThumbprint = NULL;
+    DWORD cbThumbprint = 0;
+
+    // Walk up the chain looking for a certificate in the chain that matches our expected public key identifier
+    // and thumbprint (if a thumbprint was provided).
+    HRESULT hrChainVerification = E_NOTFOUND; // assume we won't find a match.
+    for (DWORD i = 0; i < pChainContext->rgpChain[0]->cElement; ++i)
     {
         pChainElementCertContext = pChainContext->rgpChain[0]->rgpElement[i]->pCertContext;
 
@@ -2470,6 +4407,55 @@ LExit:
     return hr;
 }
 
+static BOOL IsSignedByVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in_opt CRYPT_PROVIDER_DATA* pProviderData
+    )
+{
+    BOOL fVerified = FALSE;
+    PCCERT_CONTEXT pSignerCertContext = NULL;
+    DWORD dwSignerIndex = 0;
+
+    // Hash only trust does not say who signed the file. Verify the primary signature of the message the trust
+    // provider loaded from the file handle, which also returns the certificate that made it.
+    if (pProviderData && pProviderData->hMsg &&
+        ::CryptMsgGetAndVerifySigner(pProviderData->hMsg, 0, NULL, CMSG_USE_SIGNER_INDEX_FLAG, &pSignerCertContext, &dwSignerIndex))
+    {
+        fVerified = CacheIsVerifiedSigner(pCache, pPayload, pSignerCertContext);
+    }
+
+    if (pSignerCertContext)
+    {
+        ::CertFreeCertificateContext(pSignerCertContext);
+    }
+
+    return fVerified;
+}
+
+static BOOL IsVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in_bcount(SHA1_HASH_LEN) const BYTE* pbLeafThumbprint
+    )
+{
+    for (DWORD i = 0; i < pCache->cVerifiedSigners; ++i)
+    {
+        const BURN_CACHE_SIGNER* pSigner = pCache->rgVerifiedSigners + i;
+
+        if (0 == memcmp(pSigner->rgbLeafThumbprint, pbLeafThumbprint, SHA1_HASH_LEN) &&
+            pSigner->cbRootPublicKeyIdentifier == pPayload->cbCertificateRootPublicKeyIdentifier &&
+            0 == memcmp(pSigner->rgbRootPublicKeyIdentifier, pPayload->pbCertificateRootPublicKeyIdentifier, pSigner->cbRootPublicKeyIdentifier) &&
+            pSigner->cbRootThumbprint == (pPayload->pbCertificateRootThumbprint ? pPayload->cbCertificateRootThumbprint : 0) &&
+            (!pSigner->cbRootThumbprint || 0 == memcmp(pSigner->rgbRootThumbprint, pPayload->pbCertificateRootThumbprint, pSigner->cbRootThumbprint)))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 static HRESULT SendCacheBeginMessage(
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
     __in LPVOID pContext,
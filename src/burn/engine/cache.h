@@ -2,6 +2,7 @@
 // Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
 
 #define BURN_CACHE_MAX_SEARCH_PATHS 7
+#define BURN_CACHE_MAX_HASH_THREADS 8
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,6 +26,82 @@ enum BURN_CACHE_STEP
     BURN_CACHE_STEP_FINALIZE,
 };
 
+typedef struct _BURN_CACHE_VERIFIED_INDEX
+{
+    BOOL fInitialized;
+    CRITICAL_SECTION csIndex; // caching and removing packages can happen at the same time.
+
+    BOOL fLoaded;
+    LPWSTR sczPath;
+
+    // files whose hash was verified, sorted by volume serial number and file index.
+    BURN_ACQUIRED_DIGEST* rgEntries;
+    DWORD cEntries;
+    DWORD cHits;
+
+    BOOL fDirty; // written by CacheSaveVerifiedIndexes, once per apply.
+    BOOL fPackageRemoved; // the index and content store are deleted when no package is left in the root.
+} BURN_CACHE_VERIFIED_INDEX;
+
+typedef struct _BURN_CACHE_HASH_JOB
+{
+    BURN_PAYLOAD* pPayload;
+    HANDLE hFile; // denies writers until the job is released, so the digest cannot go stale.
+    HANDLE hComplete;
+    BOOL fStarted;
+    HRESULT hrHash;
+    BURN_ACQUIRED_DIGEST digest;
+} BURN_CACHE_HASH_JOB;
+
+typedef struct _BURN_CACHE_HASH_POOL
+{
+    BOOL fInitialized;
+    CRITICAL_SECTION csJobs;
+    HANDLE hWorkSemaphore; // released once per queued job.
+    BOOL fShutdown;
+    HANDLE* rghThreads;
+    DWORD cThreads;
+
+    // jobs that were queued but not taken by CacheCompletePayload yet.
+    BURN_CACHE_HASH_JOB** rgpJobs;
+    DWORD cJobs;
+} BURN_CACHE_HASH_POOL;
+
+typedef struct _BURN_CACHE_TOMBSTONE
+{
+    LPWSTR sczPath;
+    BOOL fPerMachine;
+} BURN_CACHE_TOMBSTONE;
+
+typedef struct _BURN_CACHE_DELETION_QUEUE
+{
+    BOOL fInitialized;
+    CRITICAL_SECTION csTombstones;
+    HANDLE hWorkSemaphore; // released once per queued tombstone.
+    BOOL fShutdown; // nothing more will be queued, the thread exits once the queue is empty.
+    HANDLE hThread;
+    LONG volatile cCreated; // makes tombstone names unique within this engine.
+
+    // folders moved out of the package cache that still need to be deleted.
+    BURN_CACHE_TOMBSTONE* rgTombstones;
+    DWORD cTombstones;
+
+    // set once the tombstones left behind by earlier engines were queued.
+    BOOL fUserRecovered;
+    BOOL fMachineRecovered;
+} BURN_CACHE_DELETION_QUEUE;
+
+typedef struct _BURN_CACHE_SIGNER
+{
+    BYTE rgbLeafThumbprint[SHA1_HASH_LEN];
+
+    // the payload expectations the signer's certificate chain was found to satisfy.
+    BYTE rgbRootPublicKeyIdentifier[SHA1_HASH_LEN];
+    DWORD cbRootPublicKeyIdentifier;
+    BYTE rgbRootThumbprint[SHA1_HASH_LEN];
+    DWORD cbRootThumbprint; // zero when the payload did not require a thumbprint.
+} BURN_CACHE_SIGNER;
+
 typedef struct _BURN_CACHE
 {
     BOOL fInitializedCache;
@@ -53,6 +130,22 @@ typedef struct _BURN_CACHE
     // Only valid after CacheBundleToWorkingDirectory
     LPWSTR sczBundleEngineWorkingPath;
     HANDLE hBundleEngineWorkingFile;
+
+    // Indices of cached payloads that were already verified, so they are not rehashed unless they changed.
+    BOOL fFullVerification; // set by policy to always rehash cached payloads.
+    BURN_CACHE_VERIFIED_INDEX userVerifiedIndex;
+    BURN_CACHE_VERIFIED_INDEX machineVerifiedIndex;
+
+    // Hashes acquired payloads in the background while the next payload is acquired, see CacheQueuePayloadHash.
+    BURN_CACHE_HASH_POOL hashPool;
+
+    // Deletes removed package cache folders in the background, see CacheRemovePackage.
+    BURN_CACHE_DELETION_QUEUE deletionQueue;
+
+    // Signers whose certificate chain was already verified, so later payloads only check their own signature.
+    BURN_CACHE_SIGNER* rgVerifiedSigners;
+    DWORD cVerifiedSigners;
+    DWORD cVerifiedSignerHits;
 } BURN_CACHE;
 
 typedef struct _BURN_CACHE_MESSAGE
@@ -218,6 +311,14 @@ HRESULT CacheLayoutPayload(
     __in LPPROGRESS_ROUTINE pfnProgress,
     __in LPVOID pContext
     );
+HRESULT CacheQueuePayloadHash(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzUnverifiedPayloadPath
+    );
+void CacheReleasePayloadHashes(
+    __in BURN_CACHE* pCache
+    );
 HRESULT CacheCompletePayload(
     __in BURN_CACHE* pCache,
     __in BOOL fPerMachine,
@@ -237,6 +338,8 @@ HRESULT CacheVerifyContainer(
     __in LPVOID pContext
     );
 HRESULT CacheVerifyPayload(
+    __in_opt BURN_CACHE* pCache,
+    __in BOOL fPerMachine,
     __in BURN_PAYLOAD* pPayload,
     __in_z LPCWSTR wzCachedDirectory,
     __in PFN_BURNCACHEMESSAGEHANDLER pfnCacheMessageHandler,
@@ -257,6 +360,19 @@ HRESULT CacheRemovePackage(
     __in_z LPCWSTR wzPackageId,
     __in_z LPCWSTR wzCacheId
     );
+BOOL CacheIsVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in PCCERT_CONTEXT pCertContext
+    );
+HRESULT CacheRecordVerifiedSigner(
+    __in BURN_CACHE* pCache,
+    __in BURN_PAYLOAD* pPayload,
+    __in PCCERT_CONTEXT pCertContext
+    );
+void CacheSaveVerifiedIndexes(
+    __in BURN_CACHE* pCache
+    );
 void CacheCleanup(
     __in BOOL fPerMachine,
     __in BURN_CACHE* pCache
@@ -13,6 +13,10 @@
 // boolean-term         boolean-factor | boolean-factor AND boolean-term
 // expression           boolean-term | boolean-term OR expression
 //
+// A condition is parsed once into a postfix program that is cached per condition string,
+// evaluating it only looks up the variables it references. The result is reused until one
+// of those variables changes.
+//
 
 
 // constants
@@ -20,6 +24,9 @@
 #define COMPARISON  0x00010000
 #define INSENSITIVE 0x00020000
 
+const DWORD BURN_CONDITION_CACHE_MAX = 1024;
+const DWORD BURN_CONDITION_INLINE_STACK = 16;
+
 enum BURN_SYMBOL_TYPE
 {
     // terminals
@@ -54,6 +61,17 @@ enum BURN_SYMBOL_TYPE
     BURN_SYMBOL_TYPE_VERSION    = 19,
 };
 
+enum BURN_CONDITION_OPCODE
+{
+    BURN_CONDITION_OPCODE_LITERAL,  // pushes the literal operand.
+    BURN_CONDITION_OPCODE_VARIABLE, // pushes the value of the named variable as an operand.
+    BURN_CONDITION_OPCODE_TEST,     // pops an operand, pushes whether it has a value.
+    BURN_CONDITION_OPCODE_COMPARE,  // pops two operands, pushes the result of comparing them.
+    BURN_CONDITION_OPCODE_NOT,      // replaces the top result with its negation.
+    BURN_CONDITION_OPCODE_AND,      // pops two results, pushes whether both were true.
+    BURN_CONDITION_OPCODE_OR,       // pops two results, pushes whether either was true.
+};
+
 
 // structs
 
@@ -64,9 +82,32 @@ struct BURN_SYMBOL
     BURN_VARIANT Value;
 };
 
+struct BURN_CONDITION_INSTRUCTION
+{
+    BURN_CONDITION_OPCODE opcode;
+    BURN_SYMBOL_TYPE comparison; // for BURN_CONDITION_OPCODE_COMPARE.
+    BURN_VARIANT Value; // literal value, or the variable name for BURN_CONDITION_OPCODE_VARIABLE.
+};
+
+struct _BURN_CONDITION_PROGRAM
+{
+    LPWSTR sczCondition;
+    BURN_CONDITION_INSTRUCTION* rgInstructions;
+    DWORD cInstructions;
+    DWORD cMaxResults; // deepest the result stack gets while evaluating.
+
+    // last result, valid until one of the variables it read changes.
+    BOOL fMemoized;
+    BOOL fMemoizedResult;
+    BURN_VARIABLE_FORMAT_DEPENDENCIES memoDependencies;
+};
+
+typedef _BURN_CONDITION_PROGRAM BURN_CONDITION_PROGRAM;
+
 struct BURN_CONDITION_PARSE_CONTEXT
 {
-    BURN_VARIABLES* pVariables;
+    BURN_CONDITION_PROGRAM* pProgram;
+    DWORD cResults;
     LPCWSTR wzCondition;
     LPCWSTR wzRead;
     BURN_SYMBOL NextSymbol;
@@ -76,31 +117,63 @@ struct BURN_CONDITION_PARSE_CONTEXT
 struct BURN_CONDITION_OPERAND
 {
     BOOL fHidden;
+    BOOL fBorrowed; // Value belongs to the program, don't uninitialize it.
     BURN_VARIANT Value;
 };
 
 
 // internal function declarations
 
-static HRESULT ParseExpression(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
+static HRESULT GetConditionProgram(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzCondition,
+    __out BURN_CONDITION_PROGRAM** ppProgram,
+    __out BOOL* pfOwned
+    );
+static HRESULT CompileCondition(
+    __in_z LPCWSTR wzCondition,
+    __out BURN_CONDITION_PROGRAM** ppProgram
+    );
+static void UninitializeConditionProgram(
+    __in BURN_CONDITION_PROGRAM* pProgram
+    );
+static BOOL GetMemoizedResult(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_CONDITION_PROGRAM* pProgram,
     __out BOOL* pf
     );
+static void MemoizeResult(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_CONDITION_PROGRAM* pProgram,
+    __in BOOL f,
+    __in BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
+static HRESULT EvaluateConditionProgram(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_CONDITION_PROGRAM* pProgram,
+    __out BOOL* pf,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
+static HRESULT ParseExpression(
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
+    );
 static HRESULT ParseBooleanTerm(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BOOL* pf
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     );
 static HRESULT ParseBooleanFactor(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BOOL* pf
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     );
 static HRESULT ParseTerm(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BOOL* pf
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     );
 static HRESULT ParseOperand(
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
+    );
+static HRESULT EmitInstruction(
     __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BURN_CONDITION_OPERAND* pOperand
+    __in BURN_CONDITION_OPCODE opcode,
+    __in BURN_SYMBOL_TYPE comparison,
+    __in_opt BURN_VARIANT* pValue
     );
 static HRESULT Expect(
     __in BURN_CONDITION_PARSE_CONTEXT* pContext,
@@ -109,6 +182,13 @@ static HRESULT Expect(
 static HRESULT NextSymbol(
     __in BURN_CONDITION_PARSE_CONTEXT* pContext
     );
+static HRESULT TestOperand(
+    __in BURN_CONDITION_OPERAND* pOperand,
+    __out BOOL* pf
+    );
+static void ReleaseOperand(
+    __in BURN_CONDITION_OPERAND* pOperand
+    );
 static HRESULT CompareOperands(
     __in BURN_SYMBOL_TYPE comparison,
     __in BURN_CONDITION_OPERAND* pLeftOperand,
@@ -144,37 +224,63 @@ extern "C" HRESULT ConditionEvaluate(
     )
 {
     HRESULT hr = S_OK;
-    BURN_CONDITION_PARSE_CONTEXT context = { };
+    BURN_CONDITION_PROGRAM* pProgram = NULL;
+    BURN_VARIABLE_FORMAT_DEPENDENCIES dependencies = { };
+    BOOL fOwned = FALSE;
     BOOL f = FALSE;
 
-    context.pVariables = pVariables;
-    context.wzCondition = wzCondition;
-    context.wzRead = wzCondition;
-
-    hr = NextSymbol(&context);
-    ExitOnFailure(hr, "Failed to read next symbol.");
+    hr = GetConditionProgram(pVariables, wzCondition, &pProgram, &fOwned);
+    ExitOnFailure(hr, "Failed to parse condition.");
 
-    hr = ParseExpression(&context, &f);
-    ExitOnFailure(hr, "Failed to parse expression.");
+    // Only cached programs keep their result, the rest are freed below.
+    if (fOwned || !GetMemoizedResult(pVariables, pProgram, &f))
+    {
+        hr = EvaluateConditionProgram(pVariables, pProgram, &f, fOwned ? NULL : &dependencies);
+        ExitOnFailure(hr, "Failed to evaluate condition.");
 
-    hr = Expect(&context, BURN_SYMBOL_TYPE_END);
-    ExitOnFailure(hr, "Failed to expect end symbol.");
+        if (!fOwned)
+        {
+            MemoizeResult(pVariables, pProgram, f, &dependencies);
+        }
+    }
 
     LogId(REPORT_VERBOSE, MSG_CONDITION_RESULT, wzCondition, LoggingTrueFalseToString(f));
 
     *pf = f;
-    hr = S_OK;
 
 LExit:
-    if (context.fError)
+    if (fOwned && pProgram)
     {
-        Assert(FAILED(hr));
-        LogErrorId(hr, MSG_FAILED_PARSE_CONDITION, wzCondition, NULL, NULL);
+        UninitializeConditionProgram(pProgram);
+        MemFree(pProgram);
     }
 
+    ReleaseMem(dependencies.rgDependencies);
+
     return hr;
 }
 
+extern "C" void ConditionUninitializeCache(
+    __in BURN_VARIABLES* pVariables
+    )
+{
+    if (pVariables->rgpConditions)
+    {
+        for (DWORD i = 0; i < pVariables->cConditions; ++i)
+        {
+            UninitializeConditionProgram(pVariables->rgpConditions[i]);
+            MemFree(pVariables->rgpConditions[i]);
+        }
+        MemFree(pVariables->rgpConditions);
+    }
+
+    ReleaseDict(pVariables->sdhConditions);
+
+    pVariables->rgpConditions = NULL;
+    pVariables->cConditions = 0;
+    pVariables->sdhConditions = NULL;
+}
+
 extern "C" HRESULT ConditionGlobalCheck(
     __in BURN_VARIABLES* pVariables,
     __in BURN_CONDITION* pCondition,
@@ -250,16 +356,323 @@ LExit:
 
 // internal function definitions
 
-static HRESULT ParseExpression(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
+//
+// GetConditionProgram - finds the compiled condition in the cache, compiling it on first use.
+//                       The caller must free the program when *pfOwned is set.
+//
+static HRESULT GetConditionProgram(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzCondition,
+    __out BURN_CONDITION_PROGRAM** ppProgram,
+    __out BOOL* pfOwned
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONDITION_PROGRAM* pProgram = NULL;
+    BOOL fOwned = FALSE;
+
+    ::EnterCriticalSection(&pVariables->csCache);
+
+    if (pVariables->sdhConditions)
+    {
+        hr = DictGetValue(pVariables->sdhConditions, wzCondition, reinterpret_cast<void**>(&pProgram));
+        if (E_NOTFOUND != hr)
+        {
+            ExitOnFailure(hr, "Failed to find compiled condition.");
+        }
+    }
+
+    if (pProgram)
+    {
+        ++pVariables->cConditionHits;
+        ExitFunction1(hr = S_OK);
+    }
+
+    ++pVariables->cConditionMisses;
+
+    hr = CompileCondition(wzCondition, &pProgram);
+    ExitOnFailure(hr, "Failed to compile condition.");
+
+    fOwned = TRUE;
+
+    if (BURN_CONDITION_CACHE_MAX > pVariables->cConditions)
+    {
+        if (!pVariables->sdhConditions)
+        {
+            hr = DictCreateWithEmbeddedKey(&pVariables->sdhConditions, 0, NULL, offsetof(BURN_CONDITION_PROGRAM, sczCondition), DICT_FLAG_NONE);
+            ExitOnFailure(hr, "Failed to create compiled condition dictionary.");
+        }
+
+        hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pVariables->rgpConditions), pVariables->cConditions, 1, sizeof(BURN_CONDITION_PROGRAM*), 16);
+        ExitOnFailure(hr, "Failed to grow compiled condition array.");
+
+        hr = DictAddValue(pVariables->sdhConditions, pProgram);
+        ExitOnFailure(hr, "Failed to add compiled condition to dictionary.");
+
+        pVariables->rgpConditions[pVariables->cConditions] = pProgram;
+        ++pVariables->cConditions;
+
+        fOwned = FALSE;
+    }
+
+LExit:
+    ::LeaveCriticalSection(&pVariables->csCache);
+
+    if (FAILED(hr) && pProgram && fOwned)
+    {
+        UninitializeConditionProgram(pProgram);
+        MemFree(pProgram);
+        pProgram = NULL;
+        fOwned = FALSE;
+    }
+
+    *ppProgram = pProgram;
+    *pfOwned = fOwned;
+
+    return hr;
+}
+
+//
+// CompileCondition - parses a condition string into a postfix program.
+//
+static HRESULT CompileCondition(
+    __in_z LPCWSTR wzCondition,
+    __out BURN_CONDITION_PROGRAM** ppProgram
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONDITION_PARSE_CONTEXT context = { };
+
+    context.pProgram = static_cast<BURN_CONDITION_PROGRAM*>(MemAlloc(sizeof(BURN_CONDITION_PROGRAM), TRUE));
+    ExitOnNull(context.pProgram, hr, E_OUTOFMEMORY, "Failed to allocate compiled condition.");
+
+    hr = StrAllocString(&context.pProgram->sczCondition, wzCondition, 0);
+    ExitOnFailure(hr, "Failed to copy condition string.");
+
+    context.wzCondition = context.pProgram->sczCondition;
+    context.wzRead = context.pProgram->sczCondition;
+
+    hr = NextSymbol(&context);
+    ExitOnFailure(hr, "Failed to read next symbol.");
+
+    hr = ParseExpression(&context);
+    ExitOnFailure(hr, "Failed to parse expression.");
+
+    hr = Expect(&context, BURN_SYMBOL_TYPE_END);
+    ExitOnFailure(hr, "Failed to expect end symbol.");
+
+    Assert(1 == context.cResults);
+
+    *ppProgram = context.pProgram;
+    context.pProgram = NULL;
+
+LExit:
+    if (context.fError)
+    {
+        Assert(FAILED(hr));
+        LogErrorId(hr, MSG_FAILED_PARSE_CONDITION, wzCondition, NULL, NULL);
+    }
+
+    BVariantUninitialize(&context.NextSymbol.Value);
+
+    if (context.pProgram)
+    {
+        UninitializeConditionProgram(context.pProgram);
+        MemFree(context.pProgram);
+    }
+
+    return hr;
+}
+
+static void UninitializeConditionProgram(
+    __in BURN_CONDITION_PROGRAM* pProgram
+    )
+{
+    if (pProgram->rgInstructions)
+    {
+        for (DWORD i = 0; i < pProgram->cInstructions; ++i)
+        {
+            BVariantUninitialize(&pProgram->rgInstructions[i].Value);
+        }
+        MemFree(pProgram->rgInstructions);
+    }
+
+    ReleaseStr(pProgram->sczCondition);
+    ReleaseMem(pProgram->memoDependencies.rgDependencies);
+
+    memset(pProgram, 0, sizeof(BURN_CONDITION_PROGRAM));
+}
+
+//
+// GetMemoizedResult - returns the last result of a cached program if none of the variables it read have changed.
+//
+static BOOL GetMemoizedResult(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_CONDITION_PROGRAM* pProgram,
     __out BOOL* pf
     )
+{
+    BOOL fMemoized = FALSE;
+
+    // same order the variables take their locks in.
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+    ::EnterCriticalSection(&pVariables->csCache);
+
+    if (pProgram->fMemoized && VariableDependenciesCurrent(pVariables, &pProgram->memoDependencies))
+    {
+        ++pVariables->cConditionMemoHits;
+
+        *pf = pProgram->fMemoizedResult;
+        fMemoized = TRUE;
+    }
+
+    ::LeaveCriticalSection(&pVariables->csCache);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
+    return fMemoized;
+}
+
+//
+// MemoizeResult - keeps the result of a cached program along with the variables it read, taking ownership of the dependencies.
+//
+static void MemoizeResult(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_CONDITION_PROGRAM* pProgram,
+    __in BOOL f,
+    __in BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    )
+{
+    ::EnterCriticalSection(&pVariables->csCache);
+
+    // another evaluation may have got here first, last one wins.
+    ReleaseMem(pProgram->memoDependencies.rgDependencies);
+
+    pProgram->memoDependencies = *pDependencies;
+    memset(pDependencies, 0, sizeof(BURN_VARIABLE_FORMAT_DEPENDENCIES));
+
+    pProgram->fMemoizedResult = f;
+    pProgram->fMemoized = TRUE;
+
+    ::LeaveCriticalSection(&pVariables->csCache);
+}
+
+//
+// EvaluateConditionProgram - runs a compiled condition against the variables, recording the variables it read.
+//                            Every operand is evaluated, there is no short-circuiting.
+//
+static HRESULT EvaluateConditionProgram(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_CONDITION_PROGRAM* pProgram,
+    __out BOOL* pf,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONDITION_OPERAND rgOperands[2] = { };
+    DWORD cOperands = 0;
+    BOOL rgfInlineResults[BURN_CONDITION_INLINE_STACK] = { };
+    BOOL* rgfResults = rgfInlineResults;
+    DWORD cResults = 0;
+
+    if (countof(rgfInlineResults) < pProgram->cMaxResults)
+    {
+        rgfResults = static_cast<BOOL*>(MemAlloc(sizeof(BOOL) * pProgram->cMaxResults, TRUE));
+        ExitOnNull(rgfResults, hr, E_OUTOFMEMORY, "Failed to allocate condition result stack.");
+    }
+
+    for (DWORD i = 0; i < pProgram->cInstructions; ++i)
+    {
+        BURN_CONDITION_INSTRUCTION* pInstruction = &pProgram->rgInstructions[i];
+
+        switch (pInstruction->opcode)
+        {
+        case BURN_CONDITION_OPCODE_LITERAL:
+            Assert(countof(rgOperands) > cOperands);
+
+            // literals are immutable once compiled so they can be compared in place
+            rgOperands[cOperands].fHidden = FALSE;
+            rgOperands[cOperands].fBorrowed = TRUE;
+            memcpy_s(&rgOperands[cOperands].Value, sizeof(BURN_VARIANT), &pInstruction->Value, sizeof(BURN_VARIANT));
+            ++cOperands;
+            break;
+
+        case BURN_CONDITION_OPCODE_VARIABLE:
+            Assert(countof(rgOperands) > cOperands);
+
+            hr = VariableGetResolvedVariant(pVariables, pInstruction->Value.sczValue, &rgOperands[cOperands].Value, &rgOperands[cOperands].fHidden, pDependencies);
+            ++cOperands;
+            ExitOnRootFailure(hr, "Failed to get variable '%ls' for condition '%ls'", pInstruction->Value.sczValue, pProgram->sczCondition);
+            break;
+
+        case BURN_CONDITION_OPCODE_TEST:
+            Assert(1 <= cOperands && pProgram->cMaxResults > cResults);
+            --cOperands;
+
+            hr = TestOperand(&rgOperands[cOperands], &rgfResults[cResults]);
+            ReleaseOperand(&rgOperands[cOperands]);
+            ExitOnFailure(hr, "Failed to test operand.");
+
+            ++cResults;
+            break;
+
+        case BURN_CONDITION_OPCODE_COMPARE:
+            Assert(2 <= cOperands && pProgram->cMaxResults > cResults);
+            cOperands -= 2;
+
+            hr = CompareOperands(pInstruction->comparison, &rgOperands[cOperands], &rgOperands[cOperands + 1], &rgfResults[cResults]);
+            ReleaseOperand(&rgOperands[cOperands]);
+            ReleaseOperand(&rgOperands[cOperands + 1]);
+            ExitOnFailure(hr, "Failed to compare operands.");
+
+            ++cResults;
+            break;
+
+        case BURN_CONDITION_OPCODE_NOT:
+            Assert(1 <= cResults);
+            rgfResults[cResults - 1] = !rgfResults[cResults - 1];
+            break;
+
+        case BURN_CONDITION_OPCODE_AND:
+            Assert(2 <= cResults);
+            --cResults;
+            rgfResults[cResults - 1] = rgfResults[cResults - 1] && rgfResults[cResults];
+            break;
+
+        case BURN_CONDITION_OPCODE_OR:
+            Assert(2 <= cResults);
+            --cResults;
+            rgfResults[cResults - 1] = rgfResults[cResults - 1] || rgfResults[cResults];
+            break;
+
+        default:
+            ExitFunction1(hr = E_UNEXPECTED);
+        }
+    }
+
+    Assert(1 == cResults && 0 == cOperands);
+    *pf = rgfResults[0];
+
+LExit:
+    for (DWORD i = 0; i < cOperands; ++i)
+    {
+        ReleaseOperand(&rgOperands[i]);
+    }
+
+    if (rgfResults != rgfInlineResults)
+    {
+        ReleaseMem(rgfResults);
+    }
+
+    return hr;
+}
+
+static HRESULT ParseExpression(
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
+    )
 {
     HRESULT hr = S_OK;
-    BOOL fFirst = FALSE;
-    BOOL fSecond = FALSE;
 
-    hr = ParseBooleanTerm(pContext, &fFirst);
+    hr = ParseBooleanTerm(pContext);
     ExitOnFailure(hr, "Failed to parse boolean-term.");
 
     if (BURN_SYMBOL_TYPE_OR == pContext->NextSymbol.Type)
@@ -267,14 +680,11 @@ static HRESULT ParseExpression(
         hr = NextSymbol(pContext);
         ExitOnFailure(hr, "Failed to read next symbol.");
 
-        hr = ParseExpression(pContext, &fSecond);
+        hr = ParseExpression(pContext);
         ExitOnFailure(hr, "Failed to parse expression.");
 
-        *pf = fFirst || fSecond;
-    }
-    else
-    {
-        *pf = fFirst;
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_OR, BURN_SYMBOL_TYPE_NONE, NULL);
+        ExitOnFailure(hr, "Failed to emit OR.");
     }
 
 LExit:
@@ -282,15 +692,12 @@ LExit:
 }
 
 static HRESULT ParseBooleanTerm(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BOOL* pf
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     )
 {
     HRESULT hr = S_OK;
-    BOOL fFirst = FALSE;
-    BOOL fSecond = FALSE;
 
-    hr = ParseBooleanFactor(pContext, &fFirst);
+    hr = ParseBooleanFactor(pContext);
     ExitOnFailure(hr, "Failed to parse boolean-factor.");
 
     if (BURN_SYMBOL_TYPE_AND == pContext->NextSymbol.Type)
@@ -298,14 +705,11 @@ static HRESULT ParseBooleanTerm(
         hr = NextSymbol(pContext);
         ExitOnFailure(hr, "Failed to read next symbol.");
 
-        hr = ParseBooleanTerm(pContext, &fSecond);
+        hr = ParseBooleanTerm(pContext);
         ExitOnFailure(hr, "Failed to parse boolean-term.");
 
-        *pf = fFirst && fSecond;
-    }
-    else
-    {
-        *pf = fFirst;
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_AND, BURN_SYMBOL_TYPE_NONE, NULL);
+        ExitOnFailure(hr, "Failed to emit AND.");
     }
 
 LExit:
@@ -313,13 +717,11 @@ LExit:
 }
 
 static HRESULT ParseBooleanFactor(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BOOL* pf
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     )
 {
     HRESULT hr = S_OK;
     BOOL fNot = FALSE;
-    BOOL f = FALSE;
 
     if (BURN_SYMBOL_TYPE_NOT == pContext->NextSymbol.Type)
     {
@@ -329,30 +731,31 @@ static HRESULT ParseBooleanFactor(
         fNot = TRUE;
     }
 
-    hr = ParseTerm(pContext, &f);
+    hr = ParseTerm(pContext);
     ExitOnFailure(hr, "Failed to parse term.");
 
-    *pf = fNot ? !f : f;
+    if (fNot)
+    {
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_NOT, BURN_SYMBOL_TYPE_NONE, NULL);
+        ExitOnFailure(hr, "Failed to emit NOT.");
+    }
 
 LExit:
     return hr;
 }
 
 static HRESULT ParseTerm(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BOOL* pf
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     )
 {
     HRESULT hr = S_OK;
-    BURN_CONDITION_OPERAND firstOperand = { };
-    BURN_CONDITION_OPERAND secondOperand = { };
 
     if (BURN_SYMBOL_TYPE_LPAREN == pContext->NextSymbol.Type)
     {
         hr = NextSymbol(pContext);
         ExitOnFailure(hr, "Failed to read next symbol.");
 
-        hr = ParseExpression(pContext, pf);
+        hr = ParseExpression(pContext);
         ExitOnFailure(hr, "Failed to parse expression.");
 
         hr = Expect(pContext, BURN_SYMBOL_TYPE_RPAREN);
@@ -361,7 +764,7 @@ static HRESULT ParseTerm(
         ExitFunction1(hr = S_OK);
     }
 
-    hr = ParseOperand(pContext, &firstOperand);
+    hr = ParseOperand(pContext);
     ExitOnFailure(hr, "Failed to parse operand.");
 
     if (COMPARISON & pContext->NextSymbol.Type)
@@ -371,97 +774,42 @@ static HRESULT ParseTerm(
         hr = NextSymbol(pContext);
         ExitOnFailure(hr, "Failed to read next symbol.");
 
-        hr = ParseOperand(pContext, &secondOperand);
+        hr = ParseOperand(pContext);
         ExitOnFailure(hr, "Failed to parse operand.");
 
-        hr = CompareOperands(comparison, &firstOperand, &secondOperand, pf);
-        ExitOnFailure(hr, "Failed to compare operands.");
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_COMPARE, comparison, NULL);
+        ExitOnFailure(hr, "Failed to emit comparison.");
     }
     else
     {
-        LONGLONG llValue = 0;
-        LPWSTR sczValue = NULL;
-        VERUTIL_VERSION* pVersion = NULL;
-        switch (firstOperand.Value.Type)
-        {
-        case BURN_VARIANT_TYPE_NONE:
-            *pf = FALSE;
-            break;
-        case BURN_VARIANT_TYPE_STRING:
-            hr = BVariantGetString(&firstOperand.Value, &sczValue);
-            if (SUCCEEDED(hr))
-            {
-                *pf = sczValue && *sczValue;
-            }
-            StrSecureZeroFreeString(sczValue);
-            break;
-        case BURN_VARIANT_TYPE_NUMERIC:
-            hr = BVariantGetNumeric(&firstOperand.Value, &llValue);
-            if (SUCCEEDED(hr))
-            {
-                *pf = 0 != llValue;
-            }
-            SecureZeroMemory(&llValue, sizeof(llValue));
-            break;
-        case BURN_VARIANT_TYPE_VERSION:
-            hr = BVariantGetVersionHidden(&firstOperand.Value, firstOperand.fHidden, &pVersion);
-            if (SUCCEEDED(hr))
-            {
-                *pf = 0 != *pVersion->sczVersion;
-            }
-            ReleaseVerutilVersion(pVersion);
-            break;
-        default:
-            ExitFunction1(hr = E_UNEXPECTED);
-        }
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_TEST, BURN_SYMBOL_TYPE_NONE, NULL);
+        ExitOnFailure(hr, "Failed to emit test.");
     }
 
 LExit:
-    BVariantUninitialize(&firstOperand.Value);
-    BVariantUninitialize(&secondOperand.Value);
     return hr;
 }
 
 static HRESULT ParseOperand(
-    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
-    __out BURN_CONDITION_OPERAND* pOperand
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext
     )
 {
     HRESULT hr = S_OK;
-    LPWSTR sczFormatted = NULL;
 
     switch (pContext->NextSymbol.Type)
     {
     case BURN_SYMBOL_TYPE_IDENTIFIER:
         Assert(BURN_VARIANT_TYPE_STRING == pContext->NextSymbol.Value.Type);
 
-        // find variable
-        hr = VariableGetVariant(pContext->pVariables, pContext->NextSymbol.Value.sczValue, &pOperand->Value);
-        if (E_NOTFOUND != hr)
-        {
-            ExitOnRootFailure(hr, "Failed to find variable.");
-
-            hr = VariableIsHidden(pContext->pVariables, pContext->NextSymbol.Value.sczValue, &pOperand->fHidden);
-            ExitOnRootFailure(hr, "Failed to get if variable is hidden.");
-        }
-
-        if (BURN_VARIANT_TYPE_FORMATTED == pOperand->Value.Type)
-        {
-            hr = VariableGetFormatted(pContext->pVariables, pContext->NextSymbol.Value.sczValue, &sczFormatted, &pOperand->fHidden);
-            ExitOnRootFailure(hr, "Failed to format variable '%ls' for condition '%ls'", pContext->NextSymbol.Value.sczValue, pContext->wzCondition);
-
-            hr = BVariantSetString(&pOperand->Value, sczFormatted, 0, FALSE);
-            ExitOnRootFailure(hr, "Failed to store formatted value for variable '%ls' for condition '%ls'", pContext->NextSymbol.Value.sczValue, pContext->wzCondition);
-        }
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_VARIABLE, BURN_SYMBOL_TYPE_NONE, &pContext->NextSymbol.Value);
+        ExitOnFailure(hr, "Failed to emit variable operand.");
         break;
 
     case BURN_SYMBOL_TYPE_NUMBER: __fallthrough;
     case BURN_SYMBOL_TYPE_LITERAL: __fallthrough;
     case BURN_SYMBOL_TYPE_VERSION:
-        pOperand->fHidden = FALSE;
-        // steal value of symbol
-        memcpy_s(&pOperand->Value, sizeof(BURN_VARIANT), &pContext->NextSymbol.Value, sizeof(BURN_VARIANT));
-        memset(&pContext->NextSymbol.Value, 0, sizeof(BURN_VARIANT));
+        hr = EmitInstruction(pContext, BURN_CONDITION_OPCODE_LITERAL, BURN_SYMBOL_TYPE_NONE, &pContext->NextSymbol.Value);
+        ExitOnFailure(hr, "Failed to emit literal operand.");
         break;
 
     default:
@@ -475,8 +823,56 @@ static HRESULT ParseOperand(
     ExitOnFailure(hr, "Failed to read next symbol.");
 
 LExit:
-    StrSecureZeroFreeString(sczFormatted);
+    return hr;
+}
+
+//
+// EmitInstruction - appends an instruction to the program, taking ownership of the value.
+//
+static HRESULT EmitInstruction(
+    __in BURN_CONDITION_PARSE_CONTEXT* pContext,
+    __in BURN_CONDITION_OPCODE opcode,
+    __in BURN_SYMBOL_TYPE comparison,
+    __in_opt BURN_VARIANT* pValue
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_CONDITION_PROGRAM* pProgram = pContext->pProgram;
+    BURN_CONDITION_INSTRUCTION* pInstruction = NULL;
+
+    hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pProgram->rgInstructions), pProgram->cInstructions, 1, sizeof(BURN_CONDITION_INSTRUCTION), 8);
+    ExitOnFailure(hr, "Failed to grow condition instruction array.");
+
+    pInstruction = &pProgram->rgInstructions[pProgram->cInstructions];
+    ++pProgram->cInstructions;
+
+    pInstruction->opcode = opcode;
+    pInstruction->comparison = comparison;
+
+    if (pValue)
+    {
+        // steal value of symbol
+        memcpy_s(&pInstruction->Value, sizeof(BURN_VARIANT), pValue, sizeof(BURN_VARIANT));
+        memset(pValue, 0, sizeof(BURN_VARIANT));
+    }
 
+    // track how deep the result stack gets so evaluation can size it up front
+    switch (opcode)
+    {
+    case BURN_CONDITION_OPCODE_TEST: __fallthrough;
+    case BURN_CONDITION_OPCODE_COMPARE:
+        ++pContext->cResults;
+        pProgram->cMaxResults = max(pProgram->cMaxResults, pContext->cResults);
+        break;
+    case BURN_CONDITION_OPCODE_AND: __fallthrough;
+    case BURN_CONDITION_OPCODE_OR:
+        --pContext->cResults;
+        break;
+    default:
+        break;
+    }
+
+LExit:
     return hr;
 }
 
@@ -779,6 +1175,68 @@ LExit:
     return hr;
 }
 
+//
+// TestOperand - determines whether an operand used on its own is true.
+//
+static HRESULT TestOperand(
+    __in BURN_CONDITION_OPERAND* pOperand,
+    __out BOOL* pf
+    )
+{
+    HRESULT hr = S_OK;
+    LONGLONG llValue = 0;
+    LPWSTR sczValue = NULL;
+    VERUTIL_VERSION_STORAGE version = { };
+    VERUTIL_VERSION* pVersion = NULL;
+
+    switch (pOperand->Value.Type)
+    {
+    case BURN_VARIANT_TYPE_NONE:
+        *pf = FALSE;
+        break;
+    case BURN_VARIANT_TYPE_STRING:
+        hr = BVariantGetString(&pOperand->Value, &sczValue);
+        if (SUCCEEDED(hr))
+        {
+            *pf = sczValue && *sczValue;
+        }
+        StrSecureZeroFreeString(sczValue);
+        break;
+    case BURN_VARIANT_TYPE_NUMERIC:
+        hr = BVariantGetNumeric(&pOperand->Value, &llValue);
+        if (SUCCEEDED(hr))
+        {
+            *pf = 0 != llValue;
+        }
+        SecureZeroMemory(&llValue, sizeof(llValue));
+        break;
+    case BURN_VARIANT_TYPE_VERSION:
+        hr = BVariantGetVersionInPlace(&pOperand->Value, pOperand->fHidden, &version, &pVersion);
+        if (SUCCEEDED(hr))
+        {
+            *pf = 0 != *pVersion->sczVersion;
+        }
+        VerUninitializeVersionStorage(&version);
+        break;
+    default:
+        hr = E_UNEXPECTED;
+    }
+
+    return hr;
+}
+
+static void ReleaseOperand(
+    __in BURN_CONDITION_OPERAND* pOperand
+    )
+{
+    if (!pOperand->fBorrowed)
+    {
+        BVariantUninitialize(&pOperand->Value);
+    }
+
+    memset(pOperand, 0, sizeof(BURN_CONDITION_OPERAND));
+}
+
 //
 // CompareOperands - compares two variant values using a given comparison.
 //
@@ -791,10 +1249,12 @@ static HRESULT CompareOperands(
 {
     HRESULT hr = S_OK;
     LONGLONG llLeft = 0;
-    VERUTIL_VERSION* pVersionLeft = 0;
+    VERUTIL_VERSION_STORAGE versionLeft = { };
+    VERUTIL_VERSION* pVersionLeft = NULL;
     LPWSTR sczLeft = NULL;
     LONGLONG llRight = 0;
-    VERUTIL_VERSION* pVersionRight = 0;
+    VERUTIL_VERSION_STORAGE versionRight = { };
+    VERUTIL_VERSION* pVersionRight = NULL;
     LPWSTR sczRight = NULL;
     BURN_VARIANT* pLeftValue = &pLeftOperand->Value;
     BURN_VARIANT* pRightValue = &pRightOperand->Value;
@@ -818,17 +1278,17 @@ static HRESULT CompareOperands(
     }
     else if (BURN_VARIANT_TYPE_VERSION == pLeftValue->Type && BURN_VARIANT_TYPE_VERSION == pRightValue->Type)
     {
-        hr = BVariantGetVersionHidden(pLeftValue, pLeftOperand->fHidden, &pVersionLeft);
+        hr = BVariantGetVersionInPlace(pLeftValue, pLeftOperand->fHidden, &versionLeft, &pVersionLeft);
         ExitOnFailure(hr, "Failed to get the left version");
-        hr = BVariantGetVersionHidden(pRightValue, pRightOperand->fHidden, &pVersionRight);
+        hr = BVariantGetVersionInPlace(pRightValue, pRightOperand->fHidden, &versionRight, &pVersionRight);
         ExitOnFailure(hr, "Failed to get the right version");
         hr = CompareVersionValues(comparison, pVersionLeft, pVersionRight, pfResult);
     }
     else if (BURN_VARIANT_TYPE_VERSION == pLeftValue->Type && BURN_VARIANT_TYPE_STRING == pRightValue->Type)
     {
-        hr = BVariantGetVersionHidden(pLeftValue, pLeftOperand->fHidden, &pVersionLeft);
+        hr = BVariantGetVersionInPlace(pLeftValue, pLeftOperand->fHidden, &versionLeft, &pVersionLeft);
         ExitOnFailure(hr, "Failed to get the left version");
-        hr = BVariantGetVersionHidden(pRightValue, pRightOperand->fHidden, &pVersionRight);
+        hr = BVariantGetVersionInPlace(pRightValue, pRightOperand->fHidden, &versionRight, &pVersionRight);
         if (FAILED(hr))
         {
             if (DISP_E_TYPEMISMATCH != hr)
@@ -845,9 +1305,9 @@ static HRESULT CompareOperands(
     }
     else if (BURN_VARIANT_TYPE_STRING == pLeftValue->Type && BURN_VARIANT_TYPE_VERSION == pRightValue->Type)
     {
-        hr = BVariantGetVersionHidden(pRightValue, pRightOperand->fHidden, &pVersionRight);
+        hr = BVariantGetVersionInPlace(pRightValue, pRightOperand->fHidden, &versionRight, &pVersionRight);
         ExitOnFailure(hr, "Failed to get the right version");
-        hr = BVariantGetVersionHidden(pLeftValue, pLeftOperand->fHidden, &pVersionLeft);
+        hr = BVariantGetVersionInPlace(pLeftValue, pLeftOperand->fHidden, &versionLeft, &pVersionLeft);
         if (FAILED(hr))
         {
             if (DISP_E_TYPEMISMATCH != hr)
@@ -907,10 +1367,10 @@ static HRESULT CompareOperands(
     }
 
 LExit:
-    ReleaseVerutilVersion(pVersionLeft);
+    VerUninitializeVersionStorage(&versionLeft);
     SecureZeroMemory(&llLeft, sizeof(LONGLONG));
     StrSecureZeroFreeString(sczLeft);
-    ReleaseVerutilVersion(pVersionRight);
+    VerUninitializeVersionStorage(&versionRight);
     SecureZeroMemory(&llRight, sizeof(LONGLONG));
     StrSecureZeroFreeString(sczRight);
 
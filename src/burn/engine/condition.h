@@ -21,6 +21,9 @@ HRESULT ConditionEvaluate(
     __in_z LPCWSTR wzCondition,
     __out BOOL* pf
     );
+void ConditionUninitializeCache(
+    __in BURN_VARIABLES* pVariables
+    );
 HRESULT ConditionGlobalCheck(
     __in BURN_VARIABLES* pVariables,
     __in BURN_CONDITION* pBlock,
@@ -205,7 +205,7 @@ extern "C" HRESULT ContainerOpenUX(
     hr = PathForCurrentProcess(&sczExecutablePath, NULL);
     ExitOnFailure(hr, "Failed to get path for executing module.");
 
-    hr = ContainerOpen(pContext, &container, pSection->hEngineFile, sczExecutablePath);
+    hr = ContainerOpen(pContext, &container, pSection->hEngineFile, pSection->pbEngineView, pSection->cbEngineView, sczExecutablePath);
     ExitOnFailure(hr, "Failed to open attached container.");
 
 LExit:
@@ -218,16 +218,19 @@ extern "C" HRESULT ContainerOpen(
     __in BURN_CONTAINER_CONTEXT* pContext,
     __in BURN_CONTAINER* pContainer,
     __in HANDLE hContainerFile,
+    __in_bcount_opt(cbContainerFileView) const BYTE* pbContainerFileView,
+    __in DWORD64 cbContainerFileView,
     __in_z LPCWSTR wzFilePath
     )
 {
     HRESULT hr = S_OK;
-    LARGE_INTEGER li = { };
 
     // initialize context
     pContext->type = pContainer->type;
     pContext->qwSize = pContainer->qwFileSize;
     pContext->qwOffset = pContainer->qwAttachedOffset;
+    pContext->pbFileView = pbContainerFileView;
+    pContext->cbFileView = cbContainerFileView;
 
     // If the handle to the container is not open already, open container file
     if (INVALID_HANDLE_VALUE == hContainerFile)
@@ -243,16 +246,8 @@ extern "C" HRESULT ContainerOpen(
         }
     }
 
-    // If it is a container attached to an executable, seek to the container offset.
-    if (pContainer->fAttached)
-    {
-        li.QuadPart = (LONGLONG)pContext->qwOffset;
-    }
-
-    if (!::SetFilePointerEx(pContext->hFile, li, NULL, FILE_BEGIN))
-    {
-        ExitWithLastError(hr, "Failed to move file pointer to container offset.");
-    }
+    // The container is read at offsets from qwOffset, the file pointer is shared with other duplicates of the handle
+    // so it is not moved here.
 
     // open the archive
     switch (pContext->type)
@@ -328,7 +323,8 @@ extern "C" HRESULT ContainerStreamToBuffer(
 
 extern "C" HRESULT ContainerStreamToHandle(
     __in BURN_CONTAINER_CONTEXT* pContext,
-    __in HANDLE hFile
+    __in HANDLE hFile,
+    __in_opt CRYP_HASH_HANDLE hHash
     )
 {
     HRESULT hr = S_OK;
@@ -336,7 +332,7 @@ extern "C" HRESULT ContainerStreamToHandle(
     switch (pContext->type)
     {
     case BURN_CONTAINER_TYPE_CABINET:
-        hr = CabExtractStreamToHandle(pContext, hFile);
+        hr = CabExtractStreamToHandle(pContext, hFile, hHash);
         break;
     }
 
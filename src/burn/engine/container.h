@@ -62,6 +62,19 @@ enum BURN_CONTAINER_VERIFICATION
 
 // structs
 
+// SHA-512 of an unverified file, computed while the file was written during acquisition. The file
+// identity and last write time are recorded so verification can tell whether the file changed since.
+typedef struct _BURN_ACQUIRED_DIGEST
+{
+    BOOL fValid;
+    BYTE rgbHash[SHA512_HASH_LEN];
+    DWORD64 qwFileSize;
+    DWORD dwVolumeSerialNumber;
+    DWORD dwFileIndexHigh;
+    DWORD dwFileIndexLow;
+    FILETIME ftLastWriteTime;
+} BURN_ACQUIRED_DIGEST;
+
 typedef struct _BURN_CONTAINER
 {
     LPWSTR sczId;
@@ -92,6 +105,7 @@ typedef struct _BURN_CONTAINER
     BOOL fExtracted;
     BOOL fFailedVerificationFromAcquisition;
     LPWSTR sczFailedLocalAcquisitionPath;
+    BURN_ACQUIRED_DIGEST acquiredDigest;
 } BURN_CONTAINER;
 
 typedef struct _BURN_CONTAINERS
@@ -126,6 +140,13 @@ typedef struct _BURN_CONTAINER_CONTEXT_CABINET
 
     BURN_CONTAINER_CONTEXT_CABINET_VIRTUAL_FILE_POINTER* rgVirtualFilePointers;
     DWORD cVirtualFilePointers;
+
+    // Set when the cabinet is decoded on the caller's thread without cabinet.dll, see CabExtractOpen.
+    BOOL fReader;
+    CAB_READER reader;
+    const CAB_READER_FILE* pReaderFile;
+
+    CRYP_HASH_HANDLE hTargetHash; // optional, hashes the stream written to hTargetFile.
 } BURN_CONTAINER_CONTEXT_CABINET;
 
 typedef struct _BURN_CONTAINER_CONTEXT
@@ -133,6 +154,8 @@ typedef struct _BURN_CONTAINER_CONTEXT
     HANDLE hFile;
     DWORD64 qwOffset;
     DWORD64 qwSize;
+    const BYTE* pbFileView; // optional view of the whole file, used instead of reading hFile.
+    DWORD64 cbFileView;
 
     //PFN_EXTRACTOPEN pfnExtractOpen;
     //PFN_EXTRACTNEXTSTREAM pfnExtractNextStream;
@@ -170,6 +193,8 @@ HRESULT ContainerOpen(
     __in BURN_CONTAINER_CONTEXT* pContext,
     __in BURN_CONTAINER* pContainer,
     __in HANDLE hContainerFile,
+    __in_bcount_opt(cbContainerFileView) const BYTE* pbContainerFileView,
+    __in DWORD64 cbContainerFileView,
     __in_z LPCWSTR wzFilePath
     );
 HRESULT ContainerNextStream(
@@ -187,7 +212,8 @@ HRESULT ContainerStreamToBuffer(
     );
 HRESULT ContainerStreamToHandle(
     __in BURN_CONTAINER_CONTEXT* pContext,
-    __in HANDLE hFile
+    __in HANDLE hFile,
+    __in_opt CRYP_HASH_HANDLE hHash
     );
 HRESULT ContainerSkipStream(
     __in BURN_CONTAINER_CONTEXT* pContext
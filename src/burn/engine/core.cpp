@@ -815,6 +815,9 @@ LExit:
         ApplyUnregister(pEngineState, FAILED(hr), fSuspend, restart);
     }
 
+    // The verified indexes are only written once per apply.
+    CacheSaveVerifiedIndexes(&pEngineState->cache);
+
     if (fElevated)
     {
         ElevationApplyUninitialize(pEngineState->companionConnection.hPipe);
@@ -2303,7 +2306,7 @@ static DWORD WINAPI CacheThreadProc(
     fComInitialized = TRUE;
 
     // cache packages
-    hr = ApplyCache(pEngineState->section.hSourceEngineFile, &pEngineState->userExperience, &pEngineState->variables, &pEngineState->plan, pEngineState->companionConnection.hCachePipe, pContext->pApplyContext);
+    hr = ApplyCache(&pEngineState->section, &pEngineState->userExperience, &pEngineState->variables, &pEngineState->plan, pEngineState->companionConnection.hCachePipe, pContext->pApplyContext);
 
 LExit:
     BootstrapperApplicationExecutePhaseComplete(&pEngineState->userExperience, hr); // signal that cache completed.
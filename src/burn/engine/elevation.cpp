@@ -16,6 +16,8 @@ typedef enum _BURN_ELEVATION_MESSAGE_TYPE
     BURN_ELEVATION_MESSAGE_TYPE_CACHE_PREPARE_PACKAGE,
     BURN_ELEVATION_MESSAGE_TYPE_CACHE_COMPLETE_PAYLOAD,
     BURN_ELEVATION_MESSAGE_TYPE_CACHE_VERIFY_PAYLOAD,
+    BURN_ELEVATION_MESSAGE_TYPE_CACHE_QUEUE_PAYLOAD_HASH,
+    BURN_ELEVATION_MESSAGE_TYPE_CACHE_RELEASE_PAYLOAD_HASHES,
     BURN_ELEVATION_MESSAGE_TYPE_CACHE_CLEANUP,
     BURN_ELEVATION_MESSAGE_TYPE_PROCESS_DEPENDENT_REGISTRATION,
     BURN_ELEVATION_MESSAGE_TYPE_EXECUTE_RELATED_BUNDLE,
@@ -192,6 +194,7 @@ static HRESULT ElevatedProcessDetect(
     __in BURN_PACKAGES* pPackages
     );
 static HRESULT OnApplyUninitialize(
+    __in BURN_CACHE* pCache,
     __in HANDLE* phLock,
     __in BOOL* pfApplying,
     __in BOOL* pfDisabledAutomaticUpdates
@@ -232,11 +235,22 @@ static HRESULT OnCacheCompletePayload(
     );
 static HRESULT OnCacheVerifyPayload(
     __in HANDLE hPipe,
+    __in BURN_CACHE* pCache,
+    __in BURN_PACKAGES* pPackages,
+    __in BURN_PAYLOADS* pPayloads,
+    __in BYTE* pbData,
+    __in SIZE_T cbData
+    );
+static HRESULT OnCacheQueuePayloadHash(
+    __in BURN_CACHE* pCache,
     __in BURN_PACKAGES* pPackages,
     __in BURN_PAYLOADS* pPayloads,
     __in BYTE* pbData,
     __in SIZE_T cbData
     );
+static void OnCacheReleasePayloadHashes(
+    __in BURN_CACHE* pCache
+    );
 static void OnCacheCleanup(
     __in BURN_CACHE* pCache
     );
@@ -449,6 +463,9 @@ extern "C" HRESULT ElevationElevate(
             ExitOnFailure(hr, "Failed to connect to elevated child process.");
 
             LogId(REPORT_STANDARD, MSG_CONNECT_TO_ELEVATED_ENGINE_SUCCESS);
+
+            // The new elevated process has none of our variables yet so the next message sends all of them.
+            VariableResetSerializedChanges(&pEngineState->variables);
         }
         else if (HRESULT_FROM_WIN32(ERROR_CANCELLED) == hr)
         {
@@ -485,6 +502,7 @@ extern "C" HRESULT ElevationApplyInitialize(
     BYTE* pbData = NULL;
     SIZE_T cbData = 0;
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
     BURN_ELEVATION_APPLY_INITIALIZE_MESSAGE_CONTEXT context = { };
 
     context.pBA = pBA;
@@ -499,7 +517,7 @@ extern "C" HRESULT ElevationApplyInitialize(
     hr = BuffWriteNumber(&pbData, &cbData, (DWORD)!pPlan->pInternalCommand->fDisableSystemRestore);
     ExitOnFailure(hr, "Failed to write system restore point action to message buffer.");
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     // send message
@@ -508,6 +526,12 @@ extern "C" HRESULT ElevationApplyInitialize(
 
     hr = (HRESULT)dwResult;
 
+    // A failed message may not have applied the variables, they are sent again with the next one.
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     // Best effort to keep the sequence of BA events sane.
     if (context.fPauseCompleteNeeded)
     {
@@ -565,6 +589,7 @@ extern "C" HRESULT ElevationSessionBegin(
     BYTE* pbData = NULL;
     SIZE_T cbData = 0;
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteString(&pbData, &cbData, wzEngineWorkingPath);
@@ -588,7 +613,7 @@ extern "C" HRESULT ElevationSessionBegin(
     hr = BuffWriteNumber(&pbData, &cbData, (DWORD)registrationType);
     ExitOnFailure(hr, "Failed to write registration type to message buffer.");
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     // send message
@@ -597,6 +622,11 @@ extern "C" HRESULT ElevationSessionBegin(
 
     hr = (HRESULT)dwResult;
 
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
 LExit:
     ReleaseMem(pbData);
 
@@ -786,6 +816,67 @@ LExit:
     return hr;
 }
 
+/*******************************************************************
+ ElevationCacheQueuePayloadHash - starts hashing an acquired payload
+   in the per-machine process while the next payload is acquired.
+
+*******************************************************************/
+extern "C" HRESULT ElevationCacheQueuePayloadHash(
+    __in HANDLE hPipe,
+    __in BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzUnverifiedPath
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE* pbData = NULL;
+    SIZE_T cbData = 0;
+    DWORD dwResult = 0;
+
+    // serialize message data
+    hr = BuffWriteString(&pbData, &cbData, pPackage->sczId);
+    ExitOnFailure(hr, "Failed to write package id to message buffer.");
+
+    hr = BuffWriteString(&pbData, &cbData, pPayload->sczKey);
+    ExitOnFailure(hr, "Failed to write payload id to message buffer.");
+
+    hr = BuffWriteString(&pbData, &cbData, wzUnverifiedPath);
+    ExitOnFailure(hr, "Failed to write unverified path to message buffer.");
+
+    // send message
+    hr = BurnPipeSendMessage(hPipe, BURN_ELEVATION_MESSAGE_TYPE_CACHE_QUEUE_PAYLOAD_HASH, pbData, cbData, NULL, NULL, &dwResult);
+    ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_CACHE_QUEUE_PAYLOAD_HASH message to per-machine process.");
+
+    hr = (HRESULT)dwResult;
+
+LExit:
+    ReleaseMem(pbData);
+
+    return hr;
+}
+
+/*******************************************************************
+ ElevationCacheReleasePayloadHashes - drops the payload hashes that
+   the per-machine process will not be asked to complete.
+
+*******************************************************************/
+extern "C" HRESULT ElevationCacheReleasePayloadHashes(
+    __in HANDLE hPipe
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD dwResult = 0;
+
+    // send message
+    hr = BurnPipeSendMessage(hPipe, BURN_ELEVATION_MESSAGE_TYPE_CACHE_RELEASE_PAYLOAD_HASHES, NULL, 0, NULL, NULL, &dwResult);
+    ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_CACHE_RELEASE_PAYLOAD_HASHES message to per-machine process.");
+
+    hr = (HRESULT)dwResult;
+
+LExit:
+    return hr;
+}
+
 /*******************************************************************
  ElevationCacheCleanup -
 
@@ -858,6 +949,7 @@ extern "C" HRESULT ElevationExecuteRelatedBundle(
     SIZE_T cbData = 0;
     BURN_ELEVATION_GENERIC_MESSAGE_CONTEXT context = { };
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->relatedBundle.pRelatedBundle->package.sczId);
@@ -881,7 +973,7 @@ extern "C" HRESULT ElevationExecuteRelatedBundle(
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->relatedBundle.sczEngineWorkingDirectory);
     ExitOnFailure(hr, "Failed to write the custom working directory to the message buffer.");
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     // send message
@@ -892,6 +984,12 @@ extern "C" HRESULT ElevationExecuteRelatedBundle(
     ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_EXECUTE_RELATED_BUNDLE message to per-machine process.");
 
     hr = static_cast<HRESULT>(dwResult);
+
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     *pRestart = context.restart;
 
 LExit:
@@ -919,6 +1017,7 @@ extern "C" HRESULT ElevationExecuteBundlePackage(
     SIZE_T cbData = 0;
     BURN_ELEVATION_GENERIC_MESSAGE_CONTEXT context = { };
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->bundlePackage.pPackage->sczId);
@@ -945,7 +1044,7 @@ extern "C" HRESULT ElevationExecuteBundlePackage(
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->bundlePackage.sczEngineWorkingDirectory);
     ExitOnFailure(hr, "Failed to write the custom working directory to the message buffer.");
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     // send message
@@ -956,6 +1055,12 @@ extern "C" HRESULT ElevationExecuteBundlePackage(
     ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_EXECUTE_BUNDLE_PACKAGE message to per-machine process.");
 
     hr = static_cast<HRESULT>(dwResult);
+
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     *pRestart = context.restart;
 
 LExit:
@@ -983,6 +1088,7 @@ extern "C" HRESULT ElevationExecuteExePackage(
     SIZE_T cbData = 0;
     BURN_ELEVATION_GENERIC_MESSAGE_CONTEXT context = { };
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->exePackage.pPackage->sczId);
@@ -1000,7 +1106,7 @@ extern "C" HRESULT ElevationExecuteExePackage(
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->exePackage.sczEngineWorkingDirectory);
     ExitOnFailure(hr, "Failed to write the custom working directory to the message buffer.");
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     // send message
@@ -1011,6 +1117,12 @@ extern "C" HRESULT ElevationExecuteExePackage(
     ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_EXECUTE_EXE_PACKAGE message to per-machine process.");
 
     hr = static_cast<HRESULT>(dwResult);
+
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     *pRestart = context.restart;
 
 LExit:
@@ -1143,6 +1255,7 @@ extern "C" HRESULT ElevationExecuteMsiPackage(
     SIZE_T cbData = 0;
     BURN_ELEVATION_MSI_MESSAGE_CONTEXT context = { };
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteNumber(&pbData, &cbData, (DWORD)fRollback);
@@ -1188,7 +1301,7 @@ extern "C" HRESULT ElevationExecuteMsiPackage(
         ExitOnFailure(hr, "Failed to write slipstream patch action to message buffer.");
     }
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     // send message
@@ -1199,6 +1312,12 @@ extern "C" HRESULT ElevationExecuteMsiPackage(
     ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_EXECUTE_MSI_PACKAGE message to per-machine process.");
 
     hr = static_cast<HRESULT>(dwResult);
+
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     *pRestart = context.restart;
 
 LExit:
@@ -1227,6 +1346,7 @@ extern "C" HRESULT ElevationExecuteMspPackage(
     SIZE_T cbData = 0;
     BURN_ELEVATION_MSI_MESSAGE_CONTEXT context = { };
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->mspTarget.pPackage->sczId);
@@ -1265,7 +1385,7 @@ extern "C" HRESULT ElevationExecuteMspPackage(
         ExitOnFailure(hr, "Failed to write ordered patch id to message buffer.");
     }
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
     hr = BuffWriteNumber(&pbData, &cbData, (DWORD)fRollback);
@@ -1279,6 +1399,12 @@ extern "C" HRESULT ElevationExecuteMspPackage(
     ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_EXECUTE_MSP_PACKAGE message to per-machine process.");
 
     hr = static_cast<HRESULT>(dwResult);
+
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     *pRestart = context.restart;
 
 LExit:
@@ -1355,6 +1481,7 @@ extern "C" HRESULT ElevationUninstallMsiCompatiblePackage(
     SIZE_T cbData = 0;
     BURN_ELEVATION_MSI_MESSAGE_CONTEXT context = { };
     DWORD dwResult = 0;
+    DWORD64 qwVariablesGeneration = 0;
 
     // serialize message data
     hr = BuffWriteNumber(&pbData, &cbData, (DWORD)fRollback);
@@ -1372,7 +1499,7 @@ extern "C" HRESULT ElevationUninstallMsiCompatiblePackage(
     hr = BuffWriteString(&pbData, &cbData, pExecuteAction->uninstallMsiCompatiblePackage.sczLogPath);
     ExitOnFailure(hr, "Failed to write package log to message buffer.");
 
-    hr = VariableSerialize(pVariables, FALSE, &pbData, &cbData);
+    hr = VariableSerializeChanges(pVariables, &pbData, &cbData, &qwVariablesGeneration);
     ExitOnFailure(hr, "Failed to write variables.");
 
 
@@ -1384,6 +1511,12 @@ extern "C" HRESULT ElevationUninstallMsiCompatiblePackage(
     ExitOnFailure(hr, "Failed to send BURN_ELEVATION_MESSAGE_TYPE_UNINSTALL_MSI_COMPATIBLE_PACKAGE message to per-machine process.");
 
     hr = static_cast<HRESULT>(dwResult);
+
+    if (SUCCEEDED(hr))
+    {
+        VariableCommitSerializedChanges(pVariables, qwVariablesGeneration);
+    }
+
     *pRestart = context.restart;
 
 LExit:
@@ -2187,7 +2320,7 @@ static HRESULT ProcessElevatedChildMessage(
         break;
 
     case BURN_ELEVATION_MESSAGE_TYPE_APPLY_UNINITIALIZE:
-        hrResult = OnApplyUninitialize(pContext->phLock, pContext->pfApplying, pContext->pfDisabledAutomaticUpdates);
+        hrResult = OnApplyUninitialize(pContext->pCache, pContext->phLock, pContext->pfApplying, pContext->pfDisabledAutomaticUpdates);
         break;
 
     case BURN_ELEVATION_MESSAGE_TYPE_SESSION_BEGIN:
@@ -2298,7 +2431,16 @@ static HRESULT ProcessElevatedChildCacheMessage(
         break;
 
     case BURN_ELEVATION_MESSAGE_TYPE_CACHE_VERIFY_PAYLOAD:
-        hrResult = OnCacheVerifyPayload(pContext->hPipe, pContext->pPackages, pContext->pPayloads, (BYTE*)pMsg->pvData, pMsg->cbData);
+        hrResult = OnCacheVerifyPayload(pContext->hPipe, pContext->pCache, pContext->pPackages, pContext->pPayloads, (BYTE*)pMsg->pvData, pMsg->cbData);
+        break;
+
+    case BURN_ELEVATION_MESSAGE_TYPE_CACHE_QUEUE_PAYLOAD_HASH:
+        hrResult = OnCacheQueuePayloadHash(pContext->pCache, pContext->pPackages, pContext->pPayloads, (BYTE*)pMsg->pvData, pMsg->cbData);
+        break;
+
+    case BURN_ELEVATION_MESSAGE_TYPE_CACHE_RELEASE_PAYLOAD_HASHES:
+        OnCacheReleasePayloadHashes(pContext->pCache);
+        hrResult = S_OK;
         break;
 
     case BURN_ELEVATION_MESSAGE_TYPE_CACHE_CLEANUP:
@@ -2502,6 +2644,7 @@ LExit:
 }
 
 static HRESULT OnApplyUninitialize(
+    __in BURN_CACHE* pCache,
     __in HANDLE* phLock,
     __in BOOL* pfApplying,
     __in BOOL* pfDisabledAutomaticUpdates
@@ -2511,6 +2654,8 @@ static HRESULT OnApplyUninitialize(
 
     // TODO: end system restore point.
 
+    CacheSaveVerifiedIndexes(pCache);
+
     *pfApplying = FALSE;
 
     if (*pfDisabledAutomaticUpdates)
@@ -2743,6 +2888,7 @@ LExit:
 
 static HRESULT OnCacheVerifyPayload(
     __in HANDLE hPipe,
+    __in BURN_CACHE* pCache,
     __in BURN_PACKAGES* pPackages,
     __in BURN_PAYLOADS* pPayloads,
     __in BYTE* pbData,
@@ -2784,7 +2930,7 @@ static HRESULT OnCacheVerifyPayload(
             ExitOnRootFailure(hr, "Cache verify payload called without starting its package.");
         }
 
-        hr = CacheVerifyPayload(pPayload, pPackage->sczCacheFolder, BurnCacheMessageHandler, ElevatedProgressRoutine, hPipe);
+        hr = CacheVerifyPayload(pCache, TRUE/*fPerMachine*/, pPayload, pPackage->sczCacheFolder, BurnCacheMessageHandler, ElevatedProgressRoutine, hPipe);
     }
     else
     {
@@ -2799,6 +2945,68 @@ LExit:
     return hr;
 }
 
+static HRESULT OnCacheQueuePayloadHash(
+    __in BURN_CACHE* pCache,
+    __in BURN_PACKAGES* pPackages,
+    __in BURN_PAYLOADS* pPayloads,
+    __in BYTE* pbData,
+    __in SIZE_T cbData
+    )
+{
+    HRESULT hr = S_OK;
+    SIZE_T iData = 0;
+    LPWSTR scz = NULL;
+    BURN_PACKAGE* pPackage = NULL;
+    BURN_PAYLOAD* pPayload = NULL;
+    LPWSTR sczUnverifiedPath = NULL;
+
+    // Deserialize message data.
+    hr = BuffReadString(pbData, cbData, &iData, &scz);
+    ExitOnFailure(hr, "Failed to read package id.");
+
+    if (scz && *scz)
+    {
+        hr = PackageFindById(pPackages, scz, &pPackage);
+        ExitOnFailure(hr, "Failed to find package: %ls", scz);
+    }
+
+    hr = BuffReadString(pbData, cbData, &iData, &scz);
+    ExitOnFailure(hr, "Failed to read payload id.");
+
+    if (scz && *scz)
+    {
+        hr = PayloadFindById(pPayloads, scz, &pPayload);
+        ExitOnFailure(hr, "Failed to find payload: %ls", scz);
+    }
+
+    hr = BuffReadString(pbData, cbData, &iData, &sczUnverifiedPath);
+    ExitOnFailure(hr, "Failed to read unverified path.");
+
+    if (pPackage && pPayload)
+    {
+        // The hash is only ever used by this process, so the unelevated process cannot vouch for a file through it.
+        hr = CacheQueuePayloadHash(pCache, pPayload, sczUnverifiedPath);
+    }
+    else
+    {
+        hr = E_INVALIDARG;
+        ExitOnRootFailure(hr, "Invalid data passed to cache queue payload hash.");
+    }
+
+LExit:
+    ReleaseStr(sczUnverifiedPath);
+    ReleaseStr(scz);
+
+    return hr;
+}
+
+static void OnCacheReleasePayloadHashes(
+    __in BURN_CACHE* pCache
+    )
+{
+    CacheReleasePayloadHashes(pCache);
+}
+
 static void OnCacheCleanup(
     __in BURN_CACHE* pCache
     )
@@ -68,6 +68,15 @@ HRESULT ElevationCacheVerifyPayload(
     __in LPPROGRESS_ROUTINE pfnProgress,
     __in LPVOID pContext
     );
+HRESULT ElevationCacheQueuePayloadHash(
+    __in HANDLE hPipe,
+    __in BURN_PACKAGE* pPackage,
+    __in BURN_PAYLOAD* pPayload,
+    __in_z LPCWSTR wzUnverifiedPath
+    );
+HRESULT ElevationCacheReleasePayloadHashes(
+    __in HANDLE hPipe
+    );
 HRESULT ElevationCacheCleanup(
     __in HANDLE hPipe
     );
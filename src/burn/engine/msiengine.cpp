@@ -447,6 +447,7 @@ extern "C" HRESULT MsiEngineDetectPackage(
     INSTALLSTATE installState = INSTALLSTATE_UNKNOWN;
     BOOTSTRAPPER_RELATED_OPERATION relatedMsiOperation = BOOTSTRAPPER_RELATED_OPERATION_NONE;
     WCHAR wzProductCode[MAX_GUID_CHARS + 1] = { };
+    VERUTIL_VERSION_STORAGE installedVersion = { };
     VERUTIL_VERSION* pVersion = NULL;
     UINT uLcid = 0;
     BOOL fPerMachine = FALSE;
@@ -480,17 +481,17 @@ extern "C" HRESULT MsiEngineDetectPackage(
     {
         fDetectFeatures = TRUE;
 
-        hr = VerParseVersion(sczInstalledVersion, 0, FALSE, &pVersion);
+        hr = VerParseVersionInPlace(sczInstalledVersion, 0, FALSE, &installedVersion);
         ExitOnFailure(hr, "Failed to parse installed version: '%ls' for ProductCode: %ls", sczInstalledVersion, pPackage->Msi.sczProductCode);
 
-        if (pVersion->fInvalid)
+        if (installedVersion.version.fInvalid)
         {
             LogId(REPORT_WARNING, MSG_DETECTED_MSI_PACKAGE_INVALID_VERSION, pPackage->Msi.sczProductCode, sczInstalledVersion);
         }
 
         // compare versions
-        hr = VerCompareParsedVersions(pPackage->Msi.pVersion, pVersion, &nCompareResult);
-        ExitOnFailure(hr, "Failed to compare version '%ls' to installed version: '%ls'", pPackage->Msi.pVersion->sczVersion, pVersion->sczVersion);
+        hr = VerCompareParsedVersions(pPackage->Msi.pVersion, &installedVersion.version, &nCompareResult);
+        ExitOnFailure(hr, "Failed to compare version '%ls' to installed version: '%ls'", pPackage->Msi.pVersion->sczVersion, installedVersion.version.sczVersion);
 
         if (nCompareResult < 0)
         {
@@ -510,9 +511,9 @@ extern "C" HRESULT MsiEngineDetectPackage(
         // Report related MSI package to BA.
         if (BOOTSTRAPPER_RELATED_OPERATION_NONE != pPackage->Msi.operation)
         {
-            LogId(REPORT_STANDARD, MSG_DETECTED_RELATED_PACKAGE, pPackage->Msi.sczProductCode, LoggingPerMachineToString(pPackage->fPerMachine), pVersion->sczVersion, pPackage->Msi.dwLanguage, LoggingRelatedOperationToString(pPackage->Msi.operation));
+            LogId(REPORT_STANDARD, MSG_DETECTED_RELATED_PACKAGE, pPackage->Msi.sczProductCode, LoggingPerMachineToString(pPackage->fPerMachine), installedVersion.version.sczVersion, pPackage->Msi.dwLanguage, LoggingRelatedOperationToString(pPackage->Msi.operation));
 
-            hr = BACallbackOnDetectRelatedMsiPackage(pUserExperience, pPackage->sczId, pPackage->Msi.sczUpgradeCode, pPackage->Msi.sczProductCode, pPackage->fPerMachine, pVersion, pPackage->Msi.operation);
+            hr = BACallbackOnDetectRelatedMsiPackage(pUserExperience, pPackage->sczId, pPackage->Msi.sczUpgradeCode, pPackage->Msi.sczProductCode, pPackage->fPerMachine, &installedVersion.version, pPackage->Msi.operation);
             ExitOnRootFailure(hr, "BA aborted detect related MSI package.");
         }
     }
@@ -531,9 +532,6 @@ extern "C" HRESULT MsiEngineDetectPackage(
     {
         BURN_RELATED_MSI* pRelatedMsi = &pPackage->Msi.rgRelatedMsis[i];
 
-        ReleaseVerutilVersion(pVersion);
-        pVersion = NULL;
-
         for (DWORD iProduct = 0; ; ++iProduct)
         {
             // get product
@@ -573,10 +571,12 @@ extern "C" HRESULT MsiEngineDetectPackage(
                 }
             }
 
-            hr = VerParseVersion(sczInstalledVersion, 0, FALSE, &pVersion);
+            VerUninitializeVersionStorage(&installedVersion);
+
+            hr = VerParseVersionInPlace(sczInstalledVersion, 0, FALSE, &installedVersion);
             ExitOnFailure(hr, "Failed to parse related installed version: '%ls' for ProductCode: %ls", sczInstalledVersion, wzProductCode);
 
-            if (pVersion->fInvalid)
+            if (installedVersion.version.fInvalid)
             {
                 LogId(REPORT_WARNING, MSG_DETECTED_MSI_PACKAGE_INVALID_VERSION, wzProductCode, sczInstalledVersion);
             }
@@ -584,8 +584,8 @@ extern "C" HRESULT MsiEngineDetectPackage(
             // compare versions
             if (pRelatedMsi->fMinProvided)
             {
-                hr = VerCompareParsedVersions(pVersion, pRelatedMsi->pMinVersion, &nCompareResult);
-                ExitOnFailure(hr, "Failed to compare related installed version '%ls' to related min version: '%ls'", pVersion->sczVersion, pRelatedMsi->pMinVersion->sczVersion);
+                hr = VerCompareParsedVersions(&installedVersion.version, pRelatedMsi->pMinVersion, &nCompareResult);
+                ExitOnFailure(hr, "Failed to compare related installed version '%ls' to related min version: '%ls'", installedVersion.version.sczVersion, pRelatedMsi->pMinVersion->sczVersion);
 
                 if (pRelatedMsi->fMinInclusive ? (nCompareResult < 0) : (nCompareResult <= 0))
                 {
@@ -595,8 +595,8 @@ extern "C" HRESULT MsiEngineDetectPackage(
 
             if (pRelatedMsi->fMaxProvided)
             {
-                hr = VerCompareParsedVersions(pVersion, pRelatedMsi->pMaxVersion, &nCompareResult);
-                ExitOnFailure(hr, "Failed to compare related installed version '%ls' to related max version: '%ls'", pVersion->sczVersion, pRelatedMsi->pMaxVersion->sczVersion);
+                hr = VerCompareParsedVersions(&installedVersion.version, pRelatedMsi->pMaxVersion, &nCompareResult);
+                ExitOnFailure(hr, "Failed to compare related installed version '%ls' to related max version: '%ls'", installedVersion.version.sczVersion, pRelatedMsi->pMaxVersion->sczVersion);
 
                 if (pRelatedMsi->fMaxInclusive ? (nCompareResult > 0) : (nCompareResult >= 0))
                 {
@@ -671,10 +671,10 @@ extern "C" HRESULT MsiEngineDetectPackage(
                 pPackage->Msi.operation = BOOTSTRAPPER_RELATED_OPERATION_MAJOR_UPGRADE;
             }
 
-            LogId(REPORT_STANDARD, MSG_DETECTED_RELATED_PACKAGE, wzProductCode, LoggingPerMachineToString(fPerMachine), pVersion->sczVersion, uLcid, LoggingRelatedOperationToString(relatedMsiOperation));
+            LogId(REPORT_STANDARD, MSG_DETECTED_RELATED_PACKAGE, wzProductCode, LoggingPerMachineToString(fPerMachine), installedVersion.version.sczVersion, uLcid, LoggingRelatedOperationToString(relatedMsiOperation));
 
             // Pass to BA.
-            hr = BACallbackOnDetectRelatedMsiPackage(pUserExperience, pPackage->sczId, pRelatedMsi->sczUpgradeCode, wzProductCode, fPerMachine, pVersion, relatedMsiOperation);
+            hr = BACallbackOnDetectRelatedMsiPackage(pUserExperience, pPackage->sczId, pRelatedMsi->sczUpgradeCode, wzProductCode, fPerMachine, &installedVersion.version, relatedMsiOperation);
             ExitOnRootFailure(hr, "BA aborted detect related MSI package.");
         }
     }
@@ -779,6 +779,7 @@ extern "C" HRESULT MsiEngineDetectPackage(
 LExit:
     ReleaseStr(sczInstalledLanguage);
     ReleaseStr(sczInstalledVersion);
+    VerUninitializeVersionStorage(&installedVersion);
     ReleaseVerutilVersion(pVersion);
 
     return hr;
@@ -311,7 +311,7 @@ extern "C" HRESULT PayloadExtractUXContainer(
         hTargetFile = ::CreateFileW(pPayload->sczLocalFilePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
         ExitOnInvalidHandleWithLastError(hTargetFile, hr, "Failed to create file: %ls", pPayload->sczLocalFilePath);
 
-        hr = ContainerStreamToHandle(pContainerContext, hTargetFile);
+        hr = ContainerStreamToHandle(pContainerContext, hTargetFile, NULL);
         ExitOnFailure(hr, "Failed to extract file.");
 
         // Reopen the payload for read-only access to prevent the file from being removed or tampered with while the BA is running.
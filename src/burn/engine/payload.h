@@ -64,6 +64,7 @@ typedef struct _BURN_PAYLOAD
 
     BOOL fFailedVerificationFromAcquisition;
     LPWSTR sczFailedLocalAcquisitionPath;
+    BURN_ACQUIRED_DIGEST acquiredDigest; // only trusted by the process that acquired the file.
 } BURN_PAYLOAD;
 
 typedef struct _BURN_PAYLOADS
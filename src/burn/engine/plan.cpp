@@ -2233,6 +2233,7 @@ static void ResetPlannedContainerState(
     pContainer->fExtracted = FALSE;
     pContainer->fFailedVerificationFromAcquisition = FALSE;
     ReleaseNullStr(pContainer->sczFailedLocalAcquisitionPath);
+    memset(&pContainer->acquiredDigest, 0, sizeof(pContainer->acquiredDigest));
 }
 
 static void ResetPlannedPayloadsState(
@@ -2249,6 +2250,7 @@ static void ResetPlannedPayloadsState(
         ReleaseFileHandle(pPayload->hLocalFile);
         ReleaseNullStr(pPayload->sczLocalFilePath);
         ReleaseNullStr(pPayload->sczFailedLocalAcquisitionPath);
+        memset(&pPayload->acquiredDigest, 0, sizeof(pPayload->acquiredDigest));
     }
 }
 
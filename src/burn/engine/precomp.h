@@ -70,6 +70,7 @@
 #include "condition.h"
 #include "section.h"
 #include "approvedexe.h"
+#include "cabreader.h"
 #include "container.h"
 #include "payload.h"
 #include "cabextract.h"
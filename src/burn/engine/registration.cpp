@@ -955,7 +955,8 @@ extern "C" HRESULT RegistrationSaveState(
     }
     ExitOnFailure(hr, "Failed to write state to file: %ls", pRegistration->sczStateFile);
 
-    ::InitializeCriticalSection(&variables.csAccess);
+    ::InitializeSRWLock(&variables.srwAccess);
+    ::InitializeCriticalSection(&variables.csCache);
 
     hr = VariableDeserialize(&variables, TRUE, pbBuffer, cbBuffer, &iBuffer_Unused);
     ExitOnFailure(hr, "Failed to read variables.");
@@ -787,7 +787,7 @@ static HRESULT FileSearchVersion(
     HRESULT hr = S_OK;
     ULARGE_INTEGER uliVersion = { };
     LPWSTR sczPath = NULL;
-    VERUTIL_VERSION* pVersion = NULL;
+    VERUTIL_VERSION_STORAGE version = { };
 
 #if !defined(_WIN64)
     BURN_FILE_SEARCH bfs = { };
@@ -811,11 +811,11 @@ static HRESULT FileSearchVersion(
     }
     ExitOnFailure(hr, "Failed to get file version.");
 
-    hr = VerVersionFromQword(uliVersion.QuadPart, &pVersion);
+    hr = VerVersionFromQwordInPlace(uliVersion.QuadPart, &version);
     ExitOnFailure(hr, "Failed to create version from file version.");
 
-    // set variable
-    hr = VariableSetVersion(pVariables, pSearch->sczVariable, pVersion, FALSE);
+    // set variable, it keeps its own copy of the version
+    hr = VariableSetVersion(pVariables, pSearch->sczVariable, &version.version, FALSE);
     ExitOnFailure(hr, "Failed to set variable.");
 
 LExit:
@@ -824,7 +824,7 @@ LExit:
 #endif
 
     StrSecureZeroFreeString(sczPath);
-    ReleaseVerutilVersion(pVersion);
+    VerUninitializeVersionStorage(&version);
     return hr;
 }
 
@@ -21,9 +21,28 @@ typedef struct _BURN_SECTION_HEADER
     DWORD rgcbContainers[1];
 } BURN_SECTION_HEADER;
 
+// Without room in the address space for the view, larger files are read through their handles.
+#if defined(_WIN64)
+static const DWORD64 SECTION_MAX_VIEW_SIZE = MAXDWORD64;
+#else
+static const DWORD64 SECTION_MAX_VIEW_SIZE = 256 * 1024 * 1024;
+#endif
+
 static HRESULT VerifySectionMatchesMemoryPEHeader(
     __in REFGUID pSection
     );
+static void MapEngineFile(
+    __in HANDLE hFile,
+    __out HANDLE* phMapping,
+    __out const BYTE** ppbView,
+    __out DWORD64* pcbView
+    );
+static HRESULT ReadEngineFile(
+    __in BURN_SECTION* pSection,
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) LPVOID pvBuffer,
+    __in DWORD cbBuffer
+    );
 
 
 extern "C" HRESULT SectionInitialize(
@@ -33,39 +52,60 @@ extern "C" HRESULT SectionInitialize(
     )
 {
     HRESULT hr = S_OK;
-    DWORD cbRead = 0;
-    LARGE_INTEGER li = { };
+
+    pSection->hEngineFile = hEngineFile;
+    ExitOnInvalidHandleWithLastError(pSection->hEngineFile, hr, "Failed to open handle to engine process path.");
+
+    pSection->hSourceEngineFile = INVALID_HANDLE_VALUE == hSourceEngineFile ? hEngineFile : hSourceEngineFile;
+
+    // The headers, the UX container and attached containers are read from views of the files when possible,
+    // which saves a system call and a copy through the file cache for every read.
+    MapEngineFile(pSection->hEngineFile, &pSection->hEngineMapping, &pSection->pbEngineView, &pSection->cbEngineView);
+
+    if (pSection->hSourceEngineFile == pSection->hEngineFile)
+    {
+        pSection->pbSourceEngineView = pSection->pbEngineView;
+        pSection->cbSourceEngineView = pSection->cbEngineView;
+    }
+    else
+    {
+        MapEngineFile(pSection->hSourceEngineFile, &pSection->hSourceEngineMapping, &pSection->pbSourceEngineView, &pSection->cbSourceEngineView);
+    }
+
+    hr = SectionReadHeaders(pSection);
+
+LExit:
+    return hr;
+}
+
+extern "C" HRESULT SectionReadHeaders(
+    __in BURN_SECTION* pSection
+    )
+{
+    HRESULT hr = S_OK;
     LONGLONG llSize = 0;
+    LONGLONG llEngineSize = 0;
     IMAGE_DOS_HEADER dosHeader = { };
     IMAGE_NT_HEADERS ntHeader = { };
     DWORD dwChecksumOffset = 0;
     DWORD dwCertificateTableOffset = 0;
     DWORD dwSignatureOffset = 0;
     DWORD cbSignature = 0;
+    DWORD64 qwSectionHeaderOffset = 0;
     IMAGE_SECTION_HEADER sectionHeader = { };
     DWORD_PTR dwOriginalChecksumAndSignatureOffset = 0;
     BURN_SECTION_HEADER* pBurnSectionHeader = NULL;
     DWORD cMaxContainers = 0;
 
-    pSection->hEngineFile = hEngineFile;
-    ExitOnInvalidHandleWithLastError(pSection->hEngineFile, hr, "Failed to open handle to engine process path.");
-
-    pSection->hSourceEngineFile = INVALID_HANDLE_VALUE == hSourceEngineFile ? hEngineFile : hSourceEngineFile;
-
     //
     // First, make sure we have a valid DOS signature.
     //
-    if (!::SetFilePointerEx(pSection->hEngineFile, li, NULL, FILE_BEGIN))
-    {
-        ExitWithLastError(hr, "Failed to seek to start of file.");
-    }
 
     // read DOS header
-    if (!::ReadFile(pSection->hEngineFile, &dosHeader, sizeof(IMAGE_DOS_HEADER), &cbRead, NULL))
-    {
-        ExitWithLastError(hr, "Failed to read DOS header.");
-    }
-    else if (sizeof(IMAGE_DOS_HEADER) > cbRead || IMAGE_DOS_SIGNATURE != dosHeader.e_magic)
+    hr = ReadEngineFile(pSection, 0, &dosHeader, sizeof(IMAGE_DOS_HEADER));
+    ExitOnFailure(hr, "Failed to read DOS header.");
+
+    if (IMAGE_DOS_SIGNATURE != dosHeader.e_magic)
     {
         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
         ExitOnRootFailure(hr, "Failed to find valid DOS image header in buffer.");
@@ -75,19 +115,11 @@ extern "C" HRESULT SectionInitialize(
     // Now, make sure we have a valid NT signature.
     //
 
-    // seek to new header
-    li.QuadPart = dosHeader.e_lfanew;
-    if (!::SetFilePointerEx(pSection->hEngineFile, li, NULL, FILE_BEGIN))
-    {
-        ExitWithLastError(hr, "Failed to seek to NT header.");
-    }
-
     // read NT header
-    if (!::ReadFile(pSection->hEngineFile, &ntHeader, sizeof(IMAGE_NT_HEADERS) - sizeof(IMAGE_OPTIONAL_HEADER), &cbRead, NULL))
-    {
-        ExitWithLastError(hr, "Failed to read NT header.");
-    }
-    else if ((sizeof(IMAGE_NT_HEADERS) - sizeof(IMAGE_OPTIONAL_HEADER)) > cbRead || IMAGE_NT_SIGNATURE != ntHeader.Signature)
+    hr = ReadEngineFile(pSection, dosHeader.e_lfanew, &ntHeader, sizeof(IMAGE_NT_HEADERS) - sizeof(IMAGE_OPTIONAL_HEADER));
+    ExitOnFailure(hr, "Failed to read NT header.");
+
+    if (IMAGE_NT_SIGNATURE != ntHeader.Signature)
     {
         hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
         ExitOnRootFailure(hr, "Failed to find valid NT image header in buffer.");
@@ -97,46 +129,26 @@ extern "C" HRESULT SectionInitialize(
     dwChecksumOffset = dosHeader.e_lfanew + sizeof(IMAGE_NT_HEADERS) - sizeof(IMAGE_OPTIONAL_HEADER) + (sizeof(DWORD) * 16);
     dwCertificateTableOffset = dosHeader.e_lfanew + sizeof(IMAGE_NT_HEADERS) - (sizeof(IMAGE_DATA_DIRECTORY) * (IMAGE_NUMBEROF_DIRECTORY_ENTRIES - IMAGE_DIRECTORY_ENTRY_SECURITY));
 
-    // Seek into the certificate table to get the signature size.
-    li.QuadPart = dwCertificateTableOffset;
-    if (!::SetFilePointerEx(pSection->hEngineFile, li, NULL, FILE_BEGIN))
-    {
-        ExitWithLastError(hr, "Failed to seek to section info.");
-    }
-
-    if (!::ReadFile(pSection->hEngineFile, &dwSignatureOffset, sizeof(dwSignatureOffset), &cbRead, NULL))
-    {
-        ExitWithLastError(hr, "Failed to read signature offset.");
-    }
+    // Read the certificate table to get the signature size.
+    hr = ReadEngineFile(pSection, dwCertificateTableOffset, &dwSignatureOffset, sizeof(dwSignatureOffset));
+    ExitOnFailure(hr, "Failed to read signature offset.");
 
-    if (!::ReadFile(pSection->hEngineFile, &cbSignature, sizeof(cbSignature), &cbRead, NULL))
-    {
-        ExitWithLastError(hr, "Failed to read signature size.");
-    }
+    hr = ReadEngineFile(pSection, dwCertificateTableOffset + sizeof(dwSignatureOffset), &cbSignature, sizeof(cbSignature));
+    ExitOnFailure(hr, "Failed to read signature size.");
 
     //
     // Finally, get into the section table and look for the Burn section info.
     //
 
-    // seek past optional headers
-    li.QuadPart = dosHeader.e_lfanew + sizeof(IMAGE_NT_HEADERS) - sizeof(IMAGE_OPTIONAL_HEADER) + ntHeader.FileHeader.SizeOfOptionalHeader;
-    if (!::SetFilePointerEx(pSection->hEngineFile, li, NULL, FILE_BEGIN))
-    {
-        ExitWithLastError(hr, "Failed to seek past optional headers.");
-    }
+    // skip past optional headers
+    qwSectionHeaderOffset = dosHeader.e_lfanew + sizeof(IMAGE_NT_HEADERS) - sizeof(IMAGE_OPTIONAL_HEADER) + ntHeader.FileHeader.SizeOfOptionalHeader;
 
     // read sections one by one until we find our section
     for (DWORD i = 0; ; ++i)
     {
         // read section
-        if (!::ReadFile(pSection->hEngineFile, &sectionHeader, sizeof(IMAGE_SECTION_HEADER), &cbRead, NULL))
-        {
-            ExitWithLastError(hr, "Failed to read image section header, index: %u", i);
-        }
-        if (sizeof(IMAGE_SECTION_HEADER) > cbRead)
-        {
-            ExitWithRootFailure(hr, E_INVALIDDATA, "Failed to read complete image section header, index: %u", i);
-        }
+        hr = ReadEngineFile(pSection, qwSectionHeaderOffset + sizeof(IMAGE_SECTION_HEADER) * i, &sectionHeader, sizeof(IMAGE_SECTION_HEADER));
+        ExitOnFailure(hr, "Failed to read image section header, index: %u", i);
 
         // compare header name
         C_ASSERT(sizeof(sectionHeader.Name) == sizeof(BURN_SECTION_NAME) - 1);
@@ -162,29 +174,25 @@ extern "C" HRESULT SectionInitialize(
         ExitWithRootFailure(hr, E_INVALIDDATA, "Failed to read section info, data too short: %u", sectionHeader.SizeOfRawData);
     }
 
-    // allocate buffer for section info
-    pBurnSectionHeader = (BURN_SECTION_HEADER*)MemAlloc(sectionHeader.SizeOfRawData, TRUE);
-    ExitOnNull(pBurnSectionHeader, hr, E_OUTOFMEMORY, "Failed to allocate buffer for section info.");
+    // Make sure the section info is in the file before allocating room for it.
+    hr = FileSizeByHandle(pSection->hEngineFile, &llEngineSize);
+    ExitOnFailure(hr, "Failed to get size of engine file.");
 
-    // seek to section info
-    li.QuadPart = sectionHeader.PointerToRawData;
-    if (!::SetFilePointerEx(pSection->hEngineFile, li, NULL, FILE_BEGIN))
+    if (static_cast<DWORD64>(llEngineSize) < static_cast<DWORD64>(sectionHeader.PointerToRawData) + sectionHeader.SizeOfRawData)
     {
-        ExitWithLastError(hr, "Failed to seek to section info.");
+        ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "Failed to read section info past the end of the bundle, offset: %u, size: %u", sectionHeader.PointerToRawData, sectionHeader.SizeOfRawData);
     }
 
+    // allocate buffer for section info
+    pBurnSectionHeader = (BURN_SECTION_HEADER*)MemAlloc(sectionHeader.SizeOfRawData, TRUE);
+    ExitOnNull(pBurnSectionHeader, hr, E_OUTOFMEMORY, "Failed to allocate buffer for section info.");
+
     // Note the location of original checksum and signature information in the burn section header.
     dwOriginalChecksumAndSignatureOffset = sectionHeader.PointerToRawData + (reinterpret_cast<LPBYTE>(&pBurnSectionHeader->dwOriginalChecksum) - reinterpret_cast<LPBYTE>(pBurnSectionHeader));
 
     // read section info
-    if (!::ReadFile(pSection->hEngineFile, pBurnSectionHeader, sectionHeader.SizeOfRawData, &cbRead, NULL))
-    {
-        ExitWithLastError(hr, "Failed to read section info.");
-    }
-    else if (sectionHeader.SizeOfRawData > cbRead)
-    {
-        ExitWithRootFailure(hr, E_INVALIDDATA, "Failed to read complete section info.");
-    }
+    hr = ReadEngineFile(pSection, sectionHeader.PointerToRawData, pBurnSectionHeader, sectionHeader.SizeOfRawData);
+    ExitOnFailure(hr, "Failed to read section info.");
 
     // validate version of section info
     if (BURN_SECTION_VERSION != pBurnSectionHeader->dwVersion)
@@ -248,6 +256,18 @@ extern "C" void SectionUninitialize(
     __out BURN_SECTION* pSection
     )
 {
+    if (pSection->hSourceEngineMapping)
+    {
+        ::UnmapViewOfFile(pSection->pbSourceEngineView);
+        ::CloseHandle(pSection->hSourceEngineMapping);
+    }
+
+    if (pSection->hEngineMapping)
+    {
+        ::UnmapViewOfFile(pSection->pbEngineView);
+        ::CloseHandle(pSection->hEngineMapping);
+    }
+
     ReleaseMem(pSection->rgcbContainers);
     memset(pSection, 0, sizeof(BURN_SECTION));
 }
@@ -298,6 +318,36 @@ LExit:
     return hr;
 }
 
+extern "C" HRESULT SectionReadView(
+    __in_bcount(cbView) const BYTE* pbView,
+    __in DWORD64 cbView,
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) LPVOID pvBuffer,
+    __in DWORD cbBuffer
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (qwOffset > cbView || cbBuffer > cbView - qwOffset)
+    {
+        ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "Failed to read past the end of the bundle.");
+    }
+
+    // Errors reading the file are raised as exceptions when the view is touched.
+    __try
+    {
+        memcpy(pvBuffer, pbView + qwOffset, cbBuffer);
+    }
+    __except (EXCEPTION_IN_PAGE_ERROR == ::GetExceptionCode() ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+    }
+    ExitOnRootFailure(hr, "Failed to read from view of the bundle.");
+
+LExit:
+    return hr;
+}
+
 HRESULT VerifySectionMatchesMemoryPEHeader(
     __in REFGUID pBundleCode
     )
@@ -391,3 +441,86 @@ HRESULT VerifySectionMatchesMemoryPEHeader(
 LExit:
     return hr;
 }
+
+static void MapEngineFile(
+    __in HANDLE hFile,
+    __out HANDLE* phMapping,
+    __out const BYTE** ppbView,
+    __out DWORD64* pcbView
+    )
+{
+    HRESULT hr = S_OK;
+    LONGLONG llSize = 0;
+    HANDLE hMapping = NULL;
+    LPVOID pvView = NULL;
+
+    hr = FileSizeByHandle(hFile, &llSize);
+    ExitOnFailure(hr, "Failed to get size of engine file.");
+
+    if (!llSize || SECTION_MAX_VIEW_SIZE < static_cast<DWORD64>(llSize))
+    {
+        ExitFunction1(hr = E_NOTIMPL);
+    }
+
+    // CreateFileMapping() returns NULL on failure, not INVALID_HANDLE_VALUE
+    hMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    ExitOnNullWithLastError(hMapping, hr, "Failed to create mapping of engine file.");
+
+    pvView = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    ExitOnNullWithLastError(pvView, hr, "Failed to map view of engine file.");
+
+    *phMapping = hMapping;
+    hMapping = NULL;
+    *ppbView = static_cast<const BYTE*>(pvView);
+    *pcbView = static_cast<DWORD64>(llSize);
+
+LExit:
+    if (FAILED(hr))
+    {
+        LogStringLine(REPORT_VERBOSE, "Reading engine file through its handle, error: 0x%x", hr);
+    }
+
+    ReleaseHandle(hMapping);
+}
+
+static HRESULT ReadEngineFile(
+    __in BURN_SECTION* pSection,
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) LPVOID pvBuffer,
+    __in DWORD cbBuffer
+    )
+{
+    HRESULT hr = S_OK;
+    ULARGE_INTEGER uliOffset = { };
+    OVERLAPPED overlapped = { };
+    DWORD cbRead = 0;
+
+    if (pSection->pbEngineView)
+    {
+        hr = SectionReadView(pSection->pbEngineView, pSection->cbEngineView, qwOffset, pvBuffer, cbBuffer);
+        ExitFunction();
+    }
+
+    // Reads past the end fail the same way as they do from the view, including offsets
+    // too large for ReadFile() such as a negative e_lfanew.
+    if (static_cast<DWORD64>(MAXLONGLONG) < qwOffset)
+    {
+        ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "Failed to read past the end of the bundle.");
+    }
+
+    uliOffset.QuadPart = qwOffset;
+    overlapped.Offset = uliOffset.LowPart;
+    overlapped.OffsetHigh = uliOffset.HighPart;
+
+    if (!::ReadFile(pSection->hEngineFile, pvBuffer, cbBuffer, &cbRead, &overlapped))
+    {
+        ExitWithLastError(hr, "Failed to read engine file.");
+    }
+    else if (cbBuffer > cbRead)
+    {
+        ExitWithRootFailure(hr, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "Failed to read complete data from engine file.");
+    }
+
+LExit:
+    return hr;
+}
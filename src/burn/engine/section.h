@@ -14,6 +14,14 @@ typedef struct _BURN_SECTION
     HANDLE hEngineFile;
     HANDLE hSourceEngineFile;
 
+    // Read-only views of the whole files, NULL when a file is read through its handle instead.
+    HANDLE hEngineMapping;
+    const BYTE* pbEngineView;
+    DWORD64 cbEngineView;
+    HANDLE hSourceEngineMapping; // NULL when the source engine view is the engine view.
+    const BYTE* pbSourceEngineView;
+    DWORD64 cbSourceEngineView;
+
     DWORD cbStub;
     DWORD cbEngineSize;     // stub + UX container + original certficiate
     DWORD64 qwBundleSize;   // stub + UX container + original certificate [+ attached containers* + final certificate]
@@ -37,6 +45,10 @@ HRESULT SectionInitialize(
     __in HANDLE hEngineFile,
     __in HANDLE hSourceEngineFile
     );
+// Reads the PE headers and the Burn section info of the engine file, from its view when it has one.
+HRESULT SectionReadHeaders(
+    __in BURN_SECTION* pSection
+    );
 void SectionUninitialize(
     __in BURN_SECTION* pSection
     );
@@ -48,6 +60,13 @@ HRESULT SectionGetAttachedContainerInfo(
     __out DWORD64* pqwSize,
     __out BOOL* pfPresent
     );
+HRESULT SectionReadView(
+    __in_bcount(cbView) const BYTE* pbView,
+    __in DWORD64 cbView,
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) LPVOID pvBuffer,
+    __in DWORD cbBuffer
+    );
 
 #if defined(__cplusplus)
 }
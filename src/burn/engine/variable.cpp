@@ -24,6 +24,8 @@ typedef const struct _WELL_KNOWN_VARIABLE_DECLARATION
 // constants
 
 const DWORD GROW_VARIABLE_ARRAY = 3;
+const DWORD BURN_VARIABLE_FORMAT_TEMPLATE_CACHE_MAX = 1024;
+const DWORD BURN_VARIABLE_PREWARM_THREADS_MAX = 4;
 
 enum OS_INFO_VARIABLE
 {
@@ -61,13 +63,66 @@ static HRESULT FormatString(
     __out_z_opt LPWSTR* psczOut,
     __out_opt SIZE_T* pcchOut,
     __in BOOL fObfuscateHiddenVariables,
-    __out BOOL* pfContainsHiddenVariable
+    __out BOOL* pfContainsHiddenVariable,
+    __in BOOL fCacheable,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
+static HRESULT CompileFormatTemplate(
+    __in_z LPCWSTR wzIn,
+    __out BURN_VARIABLE_FORMAT_TEMPLATE** ppTemplate
+    );
+static HRESULT AddFormatSegment(
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate,
+    __in BURN_VARIABLE_FORMAT_SEGMENT_TYPE type,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    );
+static HRESULT AddFormatTemplate(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate
+    );
+static HRESULT EvaluateFormatTemplate(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate,
+    __in BOOL fObfuscateHiddenVariables,
+    __out_z LPWSTR* psczOut,
+    __out SIZE_T* pcchOut,
+    __inout BOOL* pfContainsHiddenVariable,
+    __in BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
+static HRESULT AddFormatDependency(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies,
+    __in_z LPCWSTR wzVariable
+    );
+static HRESULT MergeFormatDependencies(
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pTarget,
+    __in const BURN_VARIABLE_FORMAT_DEPENDENCIES* pSource
+    );
+static BOOL IsFormatMemoCurrent(
+    __in BURN_VARIABLES* pVariables,
+    __in const BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
+static void ReleaseFormatTemplateMemo(
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate
+    );
+static void UninitializeFormatTemplate(
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate
+    );
+static HRESULT AppendFormattedString(
+    __in BOOL fZeroOnRealloc,
+    __deref_inout_ecount_part(*pcchBuffer, *pcchUsed + 1) LPWSTR* psczBuffer,
+    __inout SIZE_T* pcchBuffer,
+    __inout SIZE_T* pcchUsed,
+    __in_ecount(cchValue) LPCWSTR wzValue,
+    __in SIZE_T cchValue
     );
 static HRESULT GetFormatted(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
     __out_z LPWSTR* psczValue,
-    __out BOOL* pfContainsHiddenVariable
+    __out BOOL* pfContainsHiddenVariable,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
     );
 static HRESULT AddBuiltInVariable(
     __in BURN_VARIABLES* pVariables,
@@ -87,6 +142,34 @@ static HRESULT GetVariable(
     __in_z LPCWSTR wzVariable,
     __out BURN_VARIABLE** ppVariable
     );
+static HRESULT IsVariableHidden(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __out BOOL* pfHidden
+    );
+static void PublishBuiltInValue(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE* pVariable,
+    __in BURN_VARIANT* pValue,
+    __in DWORD64 qwInitializeMicroseconds,
+    __in BOOL fInitializedInBackground
+    );
+static BOOL IsPrewarmedBuiltIn(
+    __in PFN_INITIALIZEVARIABLE pfnInitialize
+    );
+static DWORD WINAPI PrewarmThreadProc(
+    __in LPVOID lpThreadParameter
+    );
+static void PrewarmVariable(
+    __in BURN_VARIABLES* pVariables,
+    __in DWORD iVariable
+    );
+static void StopPrewarm(
+    __in BURN_VARIABLES* pVariables
+    );
+static DWORD64 GetElapsedMicroseconds(
+    __in const LARGE_INTEGER* pliStart
+    );
 static HRESULT FindVariableIndexByName(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
@@ -95,12 +178,28 @@ static HRESULT FindVariableIndexByName(
 static HRESULT InsertUserVariable(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
-    __in DWORD iPosition
+    __out DWORD* piVariable
     );
 static HRESULT InsertVariable(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
-    __in DWORD iPosition
+    __out DWORD* piVariable
+    );
+static HRESULT EnsureSortedVariables(
+    __in BURN_VARIABLES* pVariables
+    );
+static __callback int __cdecl CompareVariableIndices(
+    __in void* pvContext,
+    __in const void* pvLeft,
+    __in const void* pvRight
+    );
+static HRESULT SerializeVariables(
+    __in BURN_VARIABLES* pVariables,
+    __in BOOL fPersisting,
+    __in DWORD64 qwChangedSince,
+    __in DWORD64 qwChangedUntil,
+    __inout BYTE** ppbBuffer,
+    __inout SIZE_T* piBuffer
     );
 static HRESULT SetVariableValue(
     __in BURN_VARIABLES* pVariables,
@@ -109,6 +208,13 @@ static HRESULT SetVariableValue(
     __in SET_VARIABLE setBuiltin,
     __in BOOL fLog
     );
+static HRESULT UpdateVariableValue(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __in BURN_VARIANT* pVariant,
+    __in SET_VARIABLE setBuiltin,
+    __in BOOL fLog
+    );
 static HRESULT InitializeVariableVersionNT(
     __in DWORD_PTR dwpData,
     __inout BURN_VARIANT* pValue
@@ -225,8 +331,10 @@ extern "C" HRESULT VariableInitialize(
     )
 {
     HRESULT hr = S_OK;
+    DWORD dwPrewarmThreads = 0;
 
-    ::InitializeCriticalSection(&pVariables->csAccess);
+    ::InitializeSRWLock(&pVariables->srwAccess);
+    ::InitializeCriticalSection(&pVariables->csCache);
 
     const BUILT_IN_VARIABLE_DECLARATION vrgBuiltInVariables[] = {
         {L"AdminToolsFolder", InitializeVariableCsidlFolder, CSIDL_ADMINTOOLS},
@@ -337,6 +445,71 @@ extern "C" HRESULT VariableInitialize(
         ExitOnFailure(hr, "Failed to add well-known variable: %ls.", pWellKnownVariable->wzVariable);
     }
 
+    // Policy can opt in to resolving the expensive built-in variables while the manifest and BA load.
+    PolcReadNumber(POLICY_BURN_REGISTRY_PATH, L"PrewarmVariableThreads", 0, &dwPrewarmThreads);
+
+    if (dwPrewarmThreads)
+    {
+        hr = VariablePrewarm(pVariables, dwPrewarmThreads);
+        ExitOnFailure(hr, "Failed to start initializing built-in variables in the background.");
+    }
+
+LExit:
+    return hr;
+}
+
+extern "C" HRESULT VariablePrewarm(
+    __in BURN_VARIABLES* pVariables,
+    __in DWORD cThreads
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_VARIABLE* pVariable = NULL;
+
+    if (pVariables->rghPrewarmThreads)
+    {
+        ExitFunction(); // already started.
+    }
+
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+
+    pVariables->cPrewarmVariables = 0;
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pVariables->rgdwPrewarmVariables), pVariables->cVariables, sizeof(DWORD), 0);
+    if (SUCCEEDED(hr))
+    {
+        for (DWORD i = 0; i < pVariables->cVariables; ++i)
+        {
+            pVariable = pVariables->rgVariables + i;
+
+            if (BURN_VARIABLE_INTERNAL_TYPE_NORMAL < pVariable->internalType && BURN_VARIANT_TYPE_NONE == pVariable->Value.Type && IsPrewarmedBuiltIn(pVariable->pfnInitialize))
+            {
+                pVariables->rgdwPrewarmVariables[pVariables->cPrewarmVariables] = i;
+                ++pVariables->cPrewarmVariables;
+            }
+        }
+    }
+
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+    ExitOnFailure(hr, "Failed to allocate built-in variables to initialize.");
+
+    cThreads = min(cThreads, min(BURN_VARIABLE_PREWARM_THREADS_MAX, pVariables->cPrewarmVariables));
+    if (!cThreads)
+    {
+        ExitFunction();
+    }
+
+    pVariables->rghPrewarmThreads = static_cast<HANDLE*>(MemAlloc(sizeof(HANDLE) * cThreads, TRUE));
+    ExitOnNull(pVariables->rghPrewarmThreads, hr, E_OUTOFMEMORY, "Failed to allocate built-in variable initialization threads.");
+
+    for (DWORD i = 0; i < cThreads; ++i)
+    {
+        pVariables->rghPrewarmThreads[i] = ::CreateThread(NULL, 0, PrewarmThreadProc, pVariables, 0, NULL);
+        ExitOnNullWithLastError(pVariables->rghPrewarmThreads[i], hr, "Failed to create built-in variable initialization thread.");
+
+        ++pVariables->cPrewarmThreads;
+    }
+
 LExit:
     return hr;
 }
@@ -359,7 +532,7 @@ extern "C" HRESULT VariablesParseFromXml(
     BOOL fPersisted = FALSE;
     DWORD iVariable = 0;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockExclusive(&pVariables->srwAccess);
 
     // select variable nodes
     hr = XmlSelectNodes(pixnBundle, L"Variable", &pixnNodes);
@@ -463,7 +636,7 @@ extern "C" HRESULT VariablesParseFromXml(
         // insert element if not found
         if (S_FALSE == hr)
         {
-            hr = InsertUserVariable(pVariables, sczId, iVariable);
+            hr = InsertUserVariable(pVariables, sczId, &iVariable);
             ExitOnFailure(hr, "Failed to insert variable '%ls'.", sczId);
         }
         else if (BURN_VARIABLE_INTERNAL_TYPE_NORMAL < pVariables->rgVariables[iVariable].internalType)
@@ -482,6 +655,8 @@ extern "C" HRESULT VariablesParseFromXml(
         hr = BVariantSetValue(&pVariables->rgVariables[iVariable].Value, &value);
         ExitOnFailure(hr, "Failed to set value of variable: %ls", sczId);
 
+        pVariables->rgVariables[iVariable].qwGeneration = ++pVariables->qwGeneration;
+
         // prepare next iteration
         ReleaseNullObject(pixnNode);
         BVariantUninitialize(&value);
@@ -489,7 +664,7 @@ extern "C" HRESULT VariablesParseFromXml(
     }
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockExclusive(&pVariables->srwAccess);
 
     ReleaseObject(pixnNodes);
     ReleaseObject(pixnNode);
@@ -504,7 +679,9 @@ extern "C" void VariablesUninitialize(
     __in BURN_VARIABLES* pVariables
     )
 {
-    ::DeleteCriticalSection(&pVariables->csAccess);
+    StopPrewarm(pVariables);
+
+    ::DeleteCriticalSection(&pVariables->csCache);
 
     if (pVariables->rgVariables)
     {
@@ -519,6 +696,24 @@ extern "C" void VariablesUninitialize(
         }
         MemFree(pVariables->rgVariables);
     }
+
+    ReleaseDict(pVariables->sdhVariables);
+    ReleaseMem(pVariables->rgdwSortedVariables);
+
+    if (pVariables->rgpFormatTemplates)
+    {
+        for (DWORD i = 0; i < pVariables->cFormatTemplates; ++i)
+        {
+            UninitializeFormatTemplate(pVariables->rgpFormatTemplates[i]);
+            MemFree(pVariables->rgpFormatTemplates[i]);
+        }
+        MemFree(pVariables->rgpFormatTemplates);
+    }
+
+    ReleaseDict(pVariables->sdhFormatTemplates);
+    ReleaseMem(pVariables->rgdwPrewarmVariables);
+
+    ConditionUninitializeCache(pVariables);
 }
 
 extern "C" void VariablesDump(
@@ -528,22 +723,24 @@ extern "C" void VariablesDump(
     HRESULT hr = S_OK;
     LPWSTR sczValue = NULL;
 
-    for (DWORD i = 0; i < pVariables->cVariables; ++i)
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+
+    hr = EnsureSortedVariables(pVariables);
+    if (FAILED(hr))
+    {
+        ExitFunction();
+    }
+
+    for (DWORD i = 0; i < pVariables->cSortedVariables; ++i)
     {
-        BURN_VARIABLE* pVariable = &pVariables->rgVariables[i];
+        BURN_VARIABLE* pVariable = &pVariables->rgVariables[pVariables->rgdwSortedVariables[i]];
         if (pVariable && BURN_VARIANT_TYPE_NONE != pVariable->Value.Type)
         {
             hr = StrAllocFormatted(&sczValue, L"%ls = [%ls]", pVariable->sczName, pVariable->sczName);
             if (SUCCEEDED(hr))
             {
-                if (pVariable->fHidden)
-                {
-                    hr = VariableFormatStringObfuscated(pVariables, sczValue, &sczValue, NULL);
-                }
-                else
-                {
-                    hr = VariableFormatString(pVariables, sczValue, &sczValue, NULL);
-                }
+                // each of these strings is only formatted once so keep them out of the template cache
+                hr = FormatString(pVariables, sczValue, &sczValue, NULL, pVariable->fHidden, NULL, FALSE, NULL);
             }
 
             if (FAILED(hr))
@@ -558,6 +755,14 @@ extern "C" void VariablesDump(
         }
     }
 
+    ::EnterCriticalSection(&pVariables->csCache);
+    LogStringLine(REPORT_VERBOSE, "Variable format cache: %u templates, %u hits, %u misses, %u memoized values reused", pVariables->cFormatTemplates, pVariables->cFormatTemplateHits, pVariables->cFormatTemplateMisses, pVariables->cFormatMemoHits);
+    LogStringLine(REPORT_VERBOSE, "Condition cache: %u conditions, %u hits, %u misses, %u memoized results reused", pVariables->cConditions, pVariables->cConditionHits, pVariables->cConditionMisses, pVariables->cConditionMemoHits);
+    ::LeaveCriticalSection(&pVariables->csCache);
+
+LExit:
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
     StrSecureZeroFreeString(sczValue);
 }
 
@@ -570,7 +775,7 @@ extern "C" HRESULT VariableGetNumeric(
     HRESULT hr = S_OK;
     BURN_VARIABLE* pVariable = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
     hr = GetVariable(pVariables, wzVariable, &pVariable);
     if (SUCCEEDED(hr) && BURN_VARIANT_TYPE_NONE == pVariable->Value.Type)
@@ -587,7 +792,7 @@ extern "C" HRESULT VariableGetNumeric(
     ExitOnFailure(hr, "Failed to get value as numeric for variable: %ls", wzVariable);
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
     return hr;
 }
@@ -601,7 +806,7 @@ extern "C" HRESULT VariableGetString(
     HRESULT hr = S_OK;
     BURN_VARIABLE* pVariable = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
     hr = GetVariable(pVariables, wzVariable, &pVariable);
     if (SUCCEEDED(hr) && BURN_VARIANT_TYPE_NONE == pVariable->Value.Type)
@@ -618,7 +823,7 @@ extern "C" HRESULT VariableGetString(
     ExitOnFailure(hr, "Failed to get value as string for variable: %ls", wzVariable);
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
     return hr;
 }
@@ -632,7 +837,7 @@ extern "C" HRESULT VariableGetVersion(
     HRESULT hr = S_OK;
     BURN_VARIABLE* pVariable = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
     hr = GetVariable(pVariables, wzVariable, &pVariable);
     if (SUCCEEDED(hr) && BURN_VARIANT_TYPE_NONE == pVariable->Value.Type)
@@ -649,7 +854,7 @@ extern "C" HRESULT VariableGetVersion(
     ExitOnFailure(hr, "Failed to get value as version for variable: %ls", wzVariable);
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
     return hr;
 }
@@ -663,7 +868,7 @@ extern "C" HRESULT VariableGetVariant(
     HRESULT hr = S_OK;
     BURN_VARIABLE* pVariable = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
     hr = GetVariable(pVariables, wzVariable, &pVariable);
     if (E_NOTFOUND == hr)
@@ -676,11 +881,75 @@ extern "C" HRESULT VariableGetVariant(
     ExitOnFailure(hr, "Failed to copy value of variable: %ls", wzVariable);
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
+    return hr;
+}
+
+// Gets the value of a variable with formatted strings already formatted, a missing variable has
+// no value. The variables the value came from are added to pDependencies.
+extern "C" HRESULT VariableGetResolvedVariant(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __in BURN_VARIANT* pValue,
+    __out BOOL* pfHidden,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_VARIABLE* pVariable = NULL;
+    LPWSTR sczFormatted = NULL;
+
+    *pfHidden = FALSE;
+
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+
+    hr = GetVariable(pVariables, wzVariable, &pVariable);
+    if (E_NOTFOUND != hr)
+    {
+        ExitOnFailure(hr, "Failed to get value of variable: %ls", wzVariable);
+
+        *pfHidden = pVariable->fHidden;
+
+        if (BURN_VARIANT_TYPE_FORMATTED == pVariable->Value.Type)
+        {
+            hr = GetFormatted(pVariables, wzVariable, &sczFormatted, pfHidden, pDependencies);
+            ExitOnFailure(hr, "Failed to format value of variable: %ls", wzVariable);
+
+            hr = BVariantSetString(pValue, sczFormatted, 0, FALSE);
+            ExitOnFailure(hr, "Failed to store formatted value of variable: %ls", wzVariable);
+        }
+        else
+        {
+            hr = BVariantCopy(&pVariable->Value, pValue);
+            ExitOnFailure(hr, "Failed to copy value of variable: %ls", wzVariable);
+        }
+    }
+
+    // recorded after reading so a built-in initialized just now is stamped with its value
+    if (pDependencies)
+    {
+        hr = AddFormatDependency(pVariables, pDependencies, wzVariable);
+        ExitOnFailure(hr, "Failed to record dependency on variable: %ls", wzVariable);
+    }
+
+LExit:
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
+    StrSecureZeroFreeString(sczFormatted);
 
     return hr;
 }
 
+// The caller must share srwAccess.
+extern "C" BOOL VariableDependenciesCurrent(
+    __in BURN_VARIABLES* pVariables,
+    __in const BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    )
+{
+    return IsFormatMemoCurrent(pVariables, pDependencies);
+}
+
 extern "C" HRESULT VariableGetFormatted(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
@@ -695,7 +964,11 @@ extern "C" HRESULT VariableGetFormatted(
         *pfContainsHiddenVariable = FALSE;
     }
 
-    hr = GetFormatted(pVariables, wzVariable, psczValue, pfContainsHiddenVariable);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+
+    hr = GetFormatted(pVariables, wzVariable, psczValue, pfContainsHiddenVariable, NULL);
+
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
     return hr;
 }
@@ -762,7 +1035,15 @@ extern "C" HRESULT VariableFormatString(
     __out_opt SIZE_T* pcchOut
     )
 {
-    return FormatString(pVariables, wzIn, psczOut, pcchOut, FALSE, NULL);
+    HRESULT hr = S_OK;
+
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+
+    hr = FormatString(pVariables, wzIn, psczOut, pcchOut, FALSE, NULL, TRUE, NULL);
+
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
+    return hr;
 }
 
 extern "C" HRESULT VariableFormatStringObfuscated(
@@ -772,7 +1053,15 @@ extern "C" HRESULT VariableFormatStringObfuscated(
     __out_opt SIZE_T* pcchOut
     )
 {
-    return FormatString(pVariables, wzIn, psczOut, pcchOut, TRUE, NULL);
+    HRESULT hr = S_OK;
+
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+
+    hr = FormatString(pVariables, wzIn, psczOut, pcchOut, TRUE, NULL, TRUE, NULL);
+
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
+    return hr;
 }
 
 extern "C" HRESULT VariableEscapeString(
@@ -838,80 +1127,71 @@ extern "C" HRESULT VariableSerialize(
     )
 {
     HRESULT hr = S_OK;
-    BOOL fIncluded = FALSE;
-    LONGLONG ll = 0;
-    LPWSTR scz = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
-    // Write variable count.
-    hr = BuffWriteNumber(ppbBuffer, piBuffer, pVariables->cVariables);
-    ExitOnFailure(hr, "Failed to write variable count.");
+    hr = SerializeVariables(pVariables, fPersisting, 0, 0, ppbBuffer, piBuffer);
 
-    // Write variables.
-    for (DWORD i = 0; i < pVariables->cVariables; ++i)
-    {
-        BURN_VARIABLE* pVariable = &pVariables->rgVariables[i];
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
-        // If we aren't persisting, include only variables that aren't rejected by the elevated process.
-        // If we are persisting, include only variables that should be persisted.
-        fIncluded = (!fPersisting && BURN_VARIABLE_INTERNAL_TYPE_BUILTIN != pVariable->internalType) ||
-                    (fPersisting && pVariable->fPersisted);
+    return hr;
+}
 
-        // Write included flag.
-        hr = BuffWriteNumber(ppbBuffer, piBuffer, (DWORD)fIncluded);
-        ExitOnFailure(hr, "Failed to write included flag.");
+extern "C" HRESULT VariableSerializeChanges(
+    __in BURN_VARIABLES* pVariables,
+    __inout BYTE** ppbBuffer,
+    __inout SIZE_T* piBuffer,
+    __out DWORD64* pqwGeneration
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD64 qwChangedSince = 0;
+    DWORD64 qwGeneration = 0;
 
-        if (!fIncluded)
-        {
-            continue;
-        }
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
-        // Write variable name.
-        hr = BuffWriteString(ppbBuffer, piBuffer, pVariable->sczName);
-        ExitOnFailure(hr, "Failed to write variable name.");
+    // other readers may be initializing built-in variables, which bumps the generation under csCache.
+    ::EnterCriticalSection(&pVariables->csCache);
+    qwChangedSince = pVariables->qwSerializedGeneration;
+    qwGeneration = pVariables->qwGeneration;
+    ::LeaveCriticalSection(&pVariables->csCache);
 
-        // Write variable value type.
-        hr = BuffWriteNumber(ppbBuffer, piBuffer, (DWORD)pVariable->Value.Type);
-        ExitOnFailure(hr, "Failed to write variable value type.");
+    // The first time everything is sent, after that only what changed since the last committed call.
+    // The buffer has the same layout either way so VariableDeserialize() reads both.
+    hr = SerializeVariables(pVariables, FALSE, qwChangedSince, qwGeneration, ppbBuffer, piBuffer);
+    ExitOnFailure(hr, "Failed to serialize %ls variables.", qwChangedSince ? L"changed" : L"all");
 
-        // Write variable value.
-        switch (pVariable->Value.Type)
-        {
-        case BURN_VARIANT_TYPE_NONE:
-            break;
-        case BURN_VARIANT_TYPE_NUMERIC:
-            hr = BVariantGetNumeric(&pVariable->Value, &ll);
-            ExitOnFailure(hr, "Failed to get numeric.");
+    *pqwGeneration = qwGeneration;
 
-            hr = BuffWriteNumber64(ppbBuffer, piBuffer, static_cast<DWORD64>(ll));
-            ExitOnFailure(hr, "Failed to write variable value as number.");
+LExit:
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
-            SecureZeroMemory(&ll, sizeof(ll));
-            break;
-        case BURN_VARIANT_TYPE_VERSION: __fallthrough;
-        case BURN_VARIANT_TYPE_FORMATTED: __fallthrough;
-        case BURN_VARIANT_TYPE_STRING:
-            hr = BVariantGetString(&pVariable->Value, &scz);
-            ExitOnFailure(hr, "Failed to get string.");
+    return hr;
+}
 
-            hr = BuffWriteString(ppbBuffer, piBuffer, scz);
-            ExitOnFailure(hr, "Failed to write variable value as string.");
+extern "C" void VariableCommitSerializedChanges(
+    __in BURN_VARIABLES* pVariables,
+    __in DWORD64 qwGeneration
+    )
+{
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+    ::EnterCriticalSection(&pVariables->csCache);
 
-            ReleaseNullStrSecure(scz);
-            break;
-        default:
-            hr = E_INVALIDARG;
-            ExitOnFailure(hr, "Unsupported variable type.");
-        }
-    }
+    pVariables->qwSerializedGeneration = max(pVariables->qwSerializedGeneration, qwGeneration);
 
-LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
-    SecureZeroMemory(&ll, sizeof(ll));
-    StrSecureZeroFreeString(scz);
+    ::LeaveCriticalSection(&pVariables->csCache);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+}
 
-    return hr;
+extern "C" void VariableResetSerializedChanges(
+    __in BURN_VARIABLES* pVariables
+    )
+{
+    ::AcquireSRWLockExclusive(&pVariables->srwAccess);
+
+    pVariables->qwSerializedGeneration = 0;
+
+    ::ReleaseSRWLockExclusive(&pVariables->srwAccess);
 }
 
 extern "C" HRESULT VariableDeserialize(
@@ -931,7 +1211,7 @@ extern "C" HRESULT VariableDeserialize(
     DWORD64 qw = 0;
     VERUTIL_VERSION* pVersion = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockExclusive(&pVariables->srwAccess);
 
     // Read variable count.
     hr = BuffReadNumber(pbBuffer, cbBuffer, piBuffer, &cVariables);
@@ -999,7 +1279,7 @@ extern "C" HRESULT VariableDeserialize(
         }
 
         // Set variable.
-        hr = SetVariableValue(pVariables, sczName, &value, fWasPersisted ? SET_VARIABLE_OVERRIDE_PERSISTED_BUILTINS : SET_VARIABLE_ANY, FALSE);
+        hr = UpdateVariableValue(pVariables, sczName, &value, fWasPersisted ? SET_VARIABLE_OVERRIDE_PERSISTED_BUILTINS : SET_VARIABLE_ANY, FALSE);
         ExitOnFailure(hr, "Failed to set variable.");
 
         // Clean up.
@@ -1007,7 +1287,7 @@ extern "C" HRESULT VariableDeserialize(
     }
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockExclusive(&pVariables->srwAccess);
 
     ReleaseVerutilVersion(pVersion);
     ReleaseStr(sczName);
@@ -1111,24 +1391,12 @@ extern "C" HRESULT VariableIsHidden(
     )
 {
     HRESULT hr = S_OK;
-    BURN_VARIABLE* pVariable = NULL;
-
-    ::EnterCriticalSection(&pVariables->csAccess);
-
-    hr = GetVariable(pVariables, wzVariable, &pVariable);
-    if (E_NOTFOUND == hr)
-    {
-        // A missing variable does not need its data hidden.
-        *pfHidden = FALSE;
 
-        ExitFunction1(hr = S_OK);
-    }
-    ExitOnFailure(hr, "Failed to get visibility of variable: %ls", wzVariable);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
-    *pfHidden = pVariable->fHidden;
+    hr = IsVariableHidden(pVariables, wzVariable, pfHidden);
 
-LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
     return hr;
 }
@@ -1141,7 +1409,7 @@ extern "C" BOOL VariableIsHiddenCommandLine(
     BURN_VARIABLE* pVariable = NULL;
     BOOL fHidden = FALSE;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
     for (DWORD i = 0; i < pVariables->cVariables; ++i)
     {
@@ -1154,7 +1422,7 @@ extern "C" BOOL VariableIsHiddenCommandLine(
         }
     }
 
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
     return fHidden;
 }
@@ -1168,220 +1436,637 @@ static HRESULT FormatString(
     __out_z_opt LPWSTR* psczOut,
     __out_opt SIZE_T* pcchOut,
     __in BOOL fObfuscateHiddenVariables,
-    __out BOOL* pfContainsHiddenVariable
+    __out BOOL* pfContainsHiddenVariable,
+    __in BOOL fCacheable,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
     )
 {
     HRESULT hr = S_OK;
-    DWORD er = ERROR_SUCCESS;
-    LPWSTR sczUnformatted = NULL;
-    LPWSTR sczFormat = NULL;
-    LPCWSTR wzRead = NULL;
-    LPCWSTR wzOpen = NULL;
-    LPCWSTR wzClose = NULL;
-    LPWSTR scz = NULL;
-    LPWSTR* rgVariables = NULL;
-    DWORD cVariables = 0;
-    DWORD cch = 0;
-    size_t cchIn = 0;
-    BOOL fHidden = FALSE;
-    MSIHANDLE hRecord = NULL;
+    BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate = NULL;
+    BURN_VARIABLE_FORMAT_TEMPLATE* pUncachedTemplate = NULL;
+    BURN_VARIABLE_FORMAT_DEPENDENCIES dependencies = { };
+    LPWSTR sczFormatted = NULL;
+    SIZE_T cchFormatted = 0;
+    BOOL fInCache = FALSE;
+    BOOL fContainsHiddenVariable = FALSE;
+    BOOL fMemoized = FALSE;
+
+    // The caller shares srwAccess so no values change underneath us, the template cache is
+    // only held long enough to find the template and read or update its memoized value.
+    ::EnterCriticalSection(&pVariables->csCache);
+    fInCache = TRUE;
+
+    if (fCacheable && pVariables->sdhFormatTemplates)
+    {
+        hr = DictGetValue(pVariables->sdhFormatTemplates, wzIn, reinterpret_cast<void**>(&pTemplate));
+        if (E_NOTFOUND == hr)
+        {
+            pTemplate = NULL;
+            hr = S_OK;
+        }
+        ExitOnFailure(hr, "Failed to look up format template.");
+    }
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    if (pTemplate)
+    {
+        ++pVariables->cFormatTemplateHits;
+    }
+    else
+    {
+        ++pVariables->cFormatTemplateMisses;
 
-    // allocate buffer for format string
-    hr = ::StringCchLengthW(wzIn, STRSAFE_MAX_LENGTH, &cchIn);
-    ExitOnFailure(hr, "Failed to length of format string.");
+        hr = CompileFormatTemplate(wzIn, &pUncachedTemplate);
+        ExitOnFailure(hr, "Failed to compile format string.");
 
-    hr = StrAlloc(&sczFormat, cchIn + 1);
-    ExitOnFailure(hr, "Failed to allocate buffer for format string.");
+        pTemplate = pUncachedTemplate;
 
-    // read out variables from the unformatted string and build a format string
-    wzRead = wzIn;
-    for (;;)
+        if (fCacheable && BURN_VARIABLE_FORMAT_TEMPLATE_CACHE_MAX > pVariables->cFormatTemplates)
+        {
+            hr = AddFormatTemplate(pVariables, pTemplate);
+            ExitOnFailure(hr, "Failed to cache format template.");
+
+            pUncachedTemplate = NULL;
+        }
+    }
+
+    // Obfuscated strings are only used for logging so they are never memoized.
+    if (!fObfuscateHiddenVariables && pTemplate->fMemoized && IsFormatMemoCurrent(pVariables, &pTemplate->memoDependencies))
     {
-        // scan for opening '['
-        wzOpen = wcschr(wzRead, L'[');
-        if (!wzOpen)
+        ++pVariables->cFormatMemoHits;
+
+        hr = StrAllocStringSecure(&sczFormatted, pTemplate->sczMemoizedValue, pTemplate->cchMemoizedValue);
+        ExitOnFailure(hr, "Failed to copy memoized formatted string.");
+
+        cchFormatted = pTemplate->cchMemoizedValue;
+
+        hr = MergeFormatDependencies(pDependencies, &pTemplate->memoDependencies);
+        ExitOnFailure(hr, "Failed to merge memoized format dependencies.");
+
+        fMemoized = TRUE;
+    }
+
+    // Cached templates are never modified or freed while the variables are alive, so evaluation
+    // (which may recurse back in here for formatted variables) happens outside the cache lock.
+    ::LeaveCriticalSection(&pVariables->csCache);
+    fInCache = FALSE;
+
+    if (!fMemoized)
+    {
+        hr = EvaluateFormatTemplate(pVariables, pTemplate, fObfuscateHiddenVariables, &sczFormatted, &cchFormatted, &fContainsHiddenVariable, &dependencies);
+        ExitOnFailure(hr, "Failed to format string.");
+
+        hr = MergeFormatDependencies(pDependencies, &dependencies);
+        ExitOnFailure(hr, "Failed to merge format dependencies.");
+
+        // Values that include hidden variables are never kept around.
+        if (!fObfuscateHiddenVariables && !fContainsHiddenVariable && !pUncachedTemplate)
         {
-            // end reached, append the remainder of the string and end loop
-            hr = VariableStrAllocConcat(!fObfuscateHiddenVariables, &sczFormat, wzRead, 0);
-            ExitOnFailure(hr, "Failed to append string.");
-            break;
+            ::EnterCriticalSection(&pVariables->csCache);
+            fInCache = TRUE;
+
+            // another reader may have got here first with the same value, last one wins.
+            ReleaseFormatTemplateMemo(pTemplate);
+
+            hr = StrAllocStringSecure(&pTemplate->sczMemoizedValue, sczFormatted, cchFormatted);
+            ExitOnFailure(hr, "Failed to memoize formatted string.");
+
+            pTemplate->cchMemoizedValue = cchFormatted;
+            pTemplate->memoDependencies = dependencies;
+            memset(&dependencies, 0, sizeof(dependencies));
+            pTemplate->fMemoized = TRUE;
+
+            ::LeaveCriticalSection(&pVariables->csCache);
+            fInCache = FALSE;
         }
+    }
 
-        // scan for closing ']'
-        wzClose = wcschr(wzOpen + 1, L']');
-        if (!wzClose)
+    if (pfContainsHiddenVariable)
+    {
+        *pfContainsHiddenVariable |= fContainsHiddenVariable;
+    }
+
+    // return formatted string
+    if (psczOut)
+    {
+        if (*psczOut)
         {
-            // end reached, treat unterminated expander as literal
-            hr = VariableStrAllocConcat(!fObfuscateHiddenVariables, &sczFormat, wzRead, 0);
-            ExitOnFailure(hr, "Failed to append string.");
+            StrSecureZeroFreeString(*psczOut);
+        }
+
+        *psczOut = sczFormatted;
+        sczFormatted = NULL;
+    }
+
+    // return character count
+    if (pcchOut)
+    {
+        *pcchOut = cchFormatted;
+    }
+
+LExit:
+    if (fInCache)
+    {
+        ::LeaveCriticalSection(&pVariables->csCache);
+    }
+
+    if (pUncachedTemplate)
+    {
+        UninitializeFormatTemplate(pUncachedTemplate);
+        MemFree(pUncachedTemplate);
+    }
+
+    ReleaseMem(dependencies.rgDependencies);
+    StrSecureZeroFreeString(sczFormatted);
+
+    return hr;
+}
+
+static HRESULT CompileFormatTemplate(
+    __in_z LPCWSTR wzIn,
+    __out BURN_VARIABLE_FORMAT_TEMPLATE** ppTemplate
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate = NULL;
+    LPCWSTR wzRead = NULL;
+    LPCWSTR wzSpecial = NULL;
+    LPCWSTR wzClose = NULL;
+    SIZE_T cch = 0;
+    BOOL fInGroup = FALSE;
+    BOOL fGroupHasExpanders = FALSE;
+    DWORD iGroupBegin = 0;
+
+    pTemplate = static_cast<BURN_VARIABLE_FORMAT_TEMPLATE*>(MemAlloc(sizeof(BURN_VARIABLE_FORMAT_TEMPLATE), TRUE));
+    ExitOnNull(pTemplate, hr, E_OUTOFMEMORY, "Failed to allocate format template.");
+
+    hr = StrAllocStringSecure(&pTemplate->sczTemplate, wzIn, 0);
+    ExitOnFailure(hr, "Failed to copy format string.");
+
+    // Split the string into segments. This matches what MsiFormatRecord did with the [n] format
+    // string the engine used to build: expanders are replaced by their values, [\x] by x, [] and
+    // an unterminated [ are literal, and a {...} group with expanders in it loses its braces or is
+    // removed entirely when any of those expanders is blank.
+    wzRead = pTemplate->sczTemplate;
+    for (;;)
+    {
+        // scan for next character of interest
+        wzSpecial = wcspbrk(wzRead, L"[{}");
+        if (!wzSpecial)
+        {
+            // end reached, the remainder of the string is literal
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL, wzRead, wcslen(wzRead));
+            ExitOnFailure(hr, "Failed to add literal segment.");
             break;
         }
-        cch = (DWORD)(wzClose - wzOpen - 1);
 
-        if (0 == cch)
+        // text preceding the special character is literal
+        if (wzSpecial > wzRead)
         {
-            // blank, copy all text including the terminator
-            hr = VariableStrAllocConcat(!fObfuscateHiddenVariables, &sczFormat, wzRead, (DWORD_PTR)(wzClose - wzRead) + 1);
-            ExitOnFailure(hr, "Failed to append string.");
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL, wzRead, wzSpecial - wzRead);
+            ExitOnFailure(hr, "Failed to add literal segment.");
         }
-        else
+
+        if (L'{' == *wzSpecial)
         {
-            // append text preceding expander
-            if (wzOpen > wzRead)
+            // an earlier unclosed '{' stays literal, only the innermost group is considered
+            if (fInGroup)
             {
-                hr = VariableStrAllocConcat(!fObfuscateHiddenVariables, &sczFormat, wzRead, (DWORD_PTR)(wzOpen - wzRead));
-                ExitOnFailure(hr, "Failed to append string.");
+                pTemplate->rgSegments[iGroupBegin].type = BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL;
             }
 
-            // get variable name
-            hr = VariableStrAllocString(!fObfuscateHiddenVariables, &scz, wzOpen + 1, cch);
-            ExitOnFailure(hr, "Failed to get variable name.");
+            fInGroup = TRUE;
+            fGroupHasExpanders = FALSE;
+            iGroupBegin = pTemplate->cSegments;
 
-            // allocate space in variable array
-            if (rgVariables)
-            {
-                LPVOID pv = MemReAlloc(rgVariables, sizeof(LPWSTR) * (cVariables + 1), TRUE);
-                ExitOnNull(pv, hr, E_OUTOFMEMORY, "Failed to reallocate variable array.");
-                rgVariables = (LPWSTR*)pv;
-            }
-            else
-            {
-                rgVariables = (LPWSTR*)MemAlloc(sizeof(LPWSTR) * (cVariables + 1), TRUE);
-                ExitOnNull(rgVariables, hr, E_OUTOFMEMORY, "Failed to allocate variable array.");
-            }
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_GROUP_BEGIN, wzSpecial, 1);
+            ExitOnFailure(hr, "Failed to add group segment.");
 
-            // set variable value
-            if (2 <= cch && L'\\' == wzOpen[1])
+            wzRead = wzSpecial + 1;
+            continue;
+        }
+        else if (L'}' == *wzSpecial)
+        {
+            if (fInGroup && fGroupHasExpanders)
             {
-                // escape sequence, copy character
-                hr = VariableStrAllocString(!fObfuscateHiddenVariables, &rgVariables[cVariables], &wzOpen[2], 1);
+                hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_GROUP_END, wzSpecial, 1);
+                ExitOnFailure(hr, "Failed to add group segment.");
             }
             else
             {
-                hr = VariableIsHidden(pVariables, scz, &fHidden);
-                ExitOnFailure(hr, "Failed to determine variable visibility: '%ls'.", scz);
-
-                if (pfContainsHiddenVariable)
+                // no group or a group without expanders, keep the braces
+                if (fInGroup)
                 {
-                    *pfContainsHiddenVariable |= fHidden;
+                    pTemplate->rgSegments[iGroupBegin].type = BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL;
                 }
 
-                if (fObfuscateHiddenVariables && fHidden)
-                {
-                    hr = StrAllocString(&rgVariables[cVariables], L"*****", 0);
-                }
-                else
-                {
-                    // get formatted variable value
-                    hr = GetFormatted(pVariables, scz, &rgVariables[cVariables], pfContainsHiddenVariable);
-                    if (E_NOTFOUND == hr) // variable not found
-                    {
-                        hr = StrAllocStringSecure(&rgVariables[cVariables], L"", 0);
-                    }
-                }
+                hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL, wzSpecial, 1);
+                ExitOnFailure(hr, "Failed to add literal segment.");
             }
-            ExitOnFailure(hr, "Failed to set variable value.");
-            ++cVariables;
 
-            // append placeholder to format string
-            hr = VariableStrAllocFormatted(!fObfuscateHiddenVariables, &scz, L"[%d]", cVariables);
-            ExitOnFailure(hr, "Failed to format placeholder string.");
+            fInGroup = FALSE;
+            wzRead = wzSpecial + 1;
+            continue;
+        }
+
+        // scan for closing ']'
+        wzClose = wcschr(wzSpecial + 1, L']');
+        if (!wzClose)
+        {
+            // end reached, treat unterminated expander as literal
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL, wzSpecial, wcslen(wzSpecial));
+            ExitOnFailure(hr, "Failed to add literal segment.");
+            break;
+        }
+        cch = wzClose - wzSpecial - 1;
+
+        if (0 == cch)
+        {
+            // blank, keep the brackets
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL, wzSpecial, 2);
+            ExitOnFailure(hr, "Failed to add literal segment.");
+        }
+        else if (2 <= cch && L'\\' == wzSpecial[1])
+        {
+            // escape sequence, copy character
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_ESCAPE, wzSpecial + 2, 1);
+            ExitOnFailure(hr, "Failed to add escape segment.");
+
+            fGroupHasExpanders = TRUE;
+        }
+        else
+        {
+            hr = AddFormatSegment(pTemplate, BURN_VARIABLE_FORMAT_SEGMENT_TYPE_VARIABLE, wzSpecial + 1, cch);
+            ExitOnFailure(hr, "Failed to add variable segment.");
+
+            hr = StrAllocStringSecure(&pTemplate->rgSegments[pTemplate->cSegments - 1].sczName, wzSpecial + 1, cch);
+            ExitOnFailure(hr, "Failed to get variable name.");
 
-            hr = VariableStrAllocConcat(!fObfuscateHiddenVariables, &sczFormat, scz, 0);
-            ExitOnFailure(hr, "Failed to append placeholder.");
+            fGroupHasExpanders = TRUE;
         }
 
         // update read pointer
         wzRead = wzClose + 1;
     }
 
-    // create record
-    hRecord = ::MsiCreateRecord(cVariables);
-    ExitOnNull(hRecord, hr, E_OUTOFMEMORY, "Failed to allocate record.");
+    // an unclosed '{' is literal
+    if (fInGroup)
+    {
+        pTemplate->rgSegments[iGroupBegin].type = BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL;
+    }
 
-    // set format string
-    er = ::MsiRecordSetStringW(hRecord, 0, sczFormat);
-    ExitOnWin32Error(er, hr, "Failed to set record format string.");
+    *ppTemplate = pTemplate;
+    pTemplate = NULL;
 
-    // copy record fields
-    for (DWORD i = 0; i < cVariables; ++i)
+LExit:
+    if (pTemplate)
     {
-        if (*rgVariables[i]) // not setting if blank
-        {
-            er = ::MsiRecordSetStringW(hRecord, i + 1, rgVariables[i]);
-            ExitOnWin32Error(er, hr, "Failed to set record string.");
-        }
+        UninitializeFormatTemplate(pTemplate);
+        MemFree(pTemplate);
     }
 
-    // get formatted character count
-    cch = 0;
-#pragma prefast(push)
-#pragma prefast(disable:6298)
-    er = ::MsiFormatRecordW(NULL, hRecord, L"", &cch);
-#pragma prefast(pop)
-    if (ERROR_MORE_DATA != er)
+    return hr;
+}
+
+static HRESULT AddFormatSegment(
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate,
+    __in BURN_VARIABLE_FORMAT_SEGMENT_TYPE type,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_VARIABLE_FORMAT_SEGMENT* pSegment = NULL;
+
+    if (!cch)
     {
-        ExitOnWin32Error(er, hr, "Failed to get formatted length.");
+        ExitFunction();
     }
 
-    // return formatted string
-    if (psczOut)
-    {
-        hr = VariableStrAlloc(!fObfuscateHiddenVariables, &scz, ++cch);
-        ExitOnFailure(hr, "Failed to allocate string.");
+    hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pTemplate->rgSegments), pTemplate->cSegments, 1, sizeof(BURN_VARIABLE_FORMAT_SEGMENT), 4);
+    ExitOnFailure(hr, "Failed to grow format segment array.");
 
-        er = ::MsiFormatRecordW(NULL, hRecord, scz, &cch);
-        ExitOnWin32Error(er, hr, "Failed to format record.");
+    pSegment = pTemplate->rgSegments + pTemplate->cSegments;
+    pSegment->type = type;
+    pSegment->wz = wz;
+    pSegment->cch = cch;
 
-        hr = VariableStrAllocString(!fObfuscateHiddenVariables, psczOut, scz, 0);
-        ExitOnFailure(hr, "Failed to copy string.");
-    }
+    ++pTemplate->cSegments;
 
-    // return character count
-    if (pcchOut)
+LExit:
+    return hr;
+}
+
+static HRESULT AddFormatTemplate(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!pVariables->sdhFormatTemplates)
     {
-        *pcchOut = cch;
+        hr = DictCreateWithEmbeddedKey(&pVariables->sdhFormatTemplates, 0, NULL, offsetof(BURN_VARIABLE_FORMAT_TEMPLATE, sczTemplate), DICT_FLAG_NONE);
+        ExitOnFailure(hr, "Failed to create format template dictionary.");
     }
 
+    hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pVariables->rgpFormatTemplates), pVariables->cFormatTemplates, 1, sizeof(BURN_VARIABLE_FORMAT_TEMPLATE*), 16);
+    ExitOnFailure(hr, "Failed to grow format template array.");
+
+    hr = DictAddValue(pVariables->sdhFormatTemplates, pTemplate);
+    ExitOnFailure(hr, "Failed to add format template to dictionary.");
+
+    pVariables->rgpFormatTemplates[pVariables->cFormatTemplates] = pTemplate;
+    ++pVariables->cFormatTemplates;
+
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    return hr;
+}
+
+static HRESULT EvaluateFormatTemplate(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate,
+    __in BOOL fObfuscateHiddenVariables,
+    __out_z LPWSTR* psczOut,
+    __out SIZE_T* pcchOut,
+    __inout BOOL* pfContainsHiddenVariable,
+    __in BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczFormatted = NULL;
+    SIZE_T cchFormatted = 0;
+    SIZE_T cchFormattedUsed = 0;
+    size_t cchTemplate = 0;
+    LPWSTR sczValue = NULL;
+    BOOL fHidden = FALSE;
+    BOOL fGroupHasBlankExpander = FALSE;
+    SIZE_T iGroupStart = 0;
 
-    if (rgVariables)
+    // the formatted string usually ends up about the size of the input
+    hr = ::StringCchLengthW(pTemplate->sczTemplate, STRSAFE_MAX_LENGTH, &cchTemplate);
+    ExitOnFailure(hr, "Failed to length of format string.");
+
+    cchFormatted = cchTemplate + 1;
+
+    hr = VariableStrAlloc(!fObfuscateHiddenVariables, &sczFormatted, cchFormatted);
+    ExitOnFailure(hr, "Failed to allocate buffer for formatted string.");
+
+    *sczFormatted = L'\0';
+
+    for (DWORD i = 0; i < pTemplate->cSegments; ++i)
     {
-        for (DWORD i = 0; i < cVariables; ++i)
+        BURN_VARIABLE_FORMAT_SEGMENT* pSegment = pTemplate->rgSegments + i;
+
+        switch (pSegment->type)
         {
-            if (fObfuscateHiddenVariables)
+        case BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL: __fallthrough;
+        case BURN_VARIABLE_FORMAT_SEGMENT_TYPE_ESCAPE:
+            hr = AppendFormattedString(!fObfuscateHiddenVariables, &sczFormatted, &cchFormatted, &cchFormattedUsed, pSegment->wz, pSegment->cch);
+            ExitOnFailure(hr, "Failed to append string.");
+            break;
+
+        case BURN_VARIABLE_FORMAT_SEGMENT_TYPE_VARIABLE:
+            hr = IsVariableHidden(pVariables, pSegment->sczName, &fHidden);
+            ExitOnFailure(hr, "Failed to determine variable visibility: '%ls'.", pSegment->sczName);
+
+            *pfContainsHiddenVariable |= fHidden;
+
+            if (fObfuscateHiddenVariables && fHidden)
+            {
+                hr = StrAllocString(&sczValue, L"*****", 0);
+            }
+            else
+            {
+                // get formatted variable value
+                hr = GetFormatted(pVariables, pSegment->sczName, &sczValue, pfContainsHiddenVariable, pDependencies);
+                if (E_NOTFOUND == hr) // variable not found
+                {
+                    hr = StrAllocStringSecure(&sczValue, L"", 0);
+                }
+            }
+            ExitOnFailure(hr, "Failed to set variable value.");
+
+            hr = AddFormatDependency(pVariables, pDependencies, pSegment->sczName);
+            ExitOnFailure(hr, "Failed to record format dependency.");
+
+            if (!*sczValue)
             {
-                ReleaseStr(rgVariables[i]);
+                fGroupHasBlankExpander = TRUE;
             }
             else
             {
-                StrSecureZeroFreeString(rgVariables[i]);
+                hr = AppendFormattedString(!fObfuscateHiddenVariables, &sczFormatted, &cchFormatted, &cchFormattedUsed, sczValue, wcslen(sczValue));
+                ExitOnFailure(hr, "Failed to append variable value.");
+            }
+            break;
+
+        case BURN_VARIABLE_FORMAT_SEGMENT_TYPE_GROUP_BEGIN:
+            fGroupHasBlankExpander = FALSE;
+            iGroupStart = cchFormattedUsed;
+            break;
+
+        case BURN_VARIABLE_FORMAT_SEGMENT_TYPE_GROUP_END:
+            if (fGroupHasBlankExpander)
+            {
+                // remove the whole group
+                SecureZeroMemory(sczFormatted + iGroupStart, sizeof(WCHAR) * (cchFormattedUsed - iGroupStart));
+                cchFormattedUsed = iGroupStart;
             }
+            break;
         }
-        MemFree(rgVariables);
     }
 
-    if (hRecord)
+    *psczOut = sczFormatted;
+    sczFormatted = NULL;
+    *pcchOut = cchFormattedUsed;
+
+LExit:
+    if (fObfuscateHiddenVariables)
+    {
+        ReleaseStr(sczFormatted);
+        ReleaseStr(sczValue);
+    }
+    else
     {
-        ::MsiCloseHandle(hRecord);
+        StrSecureZeroFreeString(sczFormatted);
+        StrSecureZeroFreeString(sczValue);
     }
 
-    if (fObfuscateHiddenVariables)
+    return hr;
+}
+
+static HRESULT AddFormatDependency(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies,
+    __in_z LPCWSTR wzVariable
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iVariable = 0;
+    BURN_VARIABLE_FORMAT_DEPENDENCY dependency = { };
+    BURN_VARIABLE_FORMAT_DEPENDENCIES dependencies = { };
+
+    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
+    ExitOnFailure(hr, "Failed to find variable: %ls", wzVariable);
+
+    if (S_FALSE == hr)
     {
-        ReleaseStr(sczUnformatted);
-        ReleaseStr(sczFormat);
-        ReleaseStr(scz);
+        dependencies.fMissingVariable = TRUE;
+        dependencies.cVariables = pVariables->cVariables;
     }
     else
     {
-        StrSecureZeroFreeString(sczUnformatted);
-        StrSecureZeroFreeString(sczFormat);
-        StrSecureZeroFreeString(scz);
+        dependency.iVariable = iVariable;
+        dependency.qwGeneration = pVariables->rgVariables[iVariable].qwGeneration;
+
+        dependencies.rgDependencies = &dependency;
+        dependencies.cDependencies = 1;
+    }
+
+    hr = MergeFormatDependencies(pDependencies, &dependencies);
+
+LExit:
+    return hr;
+}
+
+static HRESULT MergeFormatDependencies(
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pTarget,
+    __in const BURN_VARIABLE_FORMAT_DEPENDENCIES* pSource
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fFound = FALSE;
+
+    if (!pTarget)
+    {
+        ExitFunction();
     }
 
+    if (pSource->fMissingVariable)
+    {
+        pTarget->fMissingVariable = TRUE;
+        pTarget->cVariables = pSource->cVariables;
+    }
+
+    for (DWORD i = 0; i < pSource->cDependencies; ++i)
+    {
+        fFound = FALSE;
+
+        for (DWORD j = 0; j < pTarget->cDependencies; ++j)
+        {
+            if (pTarget->rgDependencies[j].iVariable == pSource->rgDependencies[i].iVariable)
+            {
+                fFound = TRUE;
+                break;
+            }
+        }
+
+        if (!fFound)
+        {
+            hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pTarget->rgDependencies), pTarget->cDependencies, 1, sizeof(BURN_VARIABLE_FORMAT_DEPENDENCY), 4);
+            ExitOnFailure(hr, "Failed to grow format dependency array.");
+
+            pTarget->rgDependencies[pTarget->cDependencies] = pSource->rgDependencies[i];
+            ++pTarget->cDependencies;
+        }
+    }
+
+LExit:
+    return hr;
+}
+
+static BOOL IsFormatMemoCurrent(
+    __in BURN_VARIABLES* pVariables,
+    __in const BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    )
+{
+    // a variable that was missing may have been added since
+    if (pDependencies->fMissingVariable && pDependencies->cVariables != pVariables->cVariables)
+    {
+        return FALSE;
+    }
+
+    for (DWORD i = 0; i < pDependencies->cDependencies; ++i)
+    {
+        const BURN_VARIABLE_FORMAT_DEPENDENCY* pDependency = pDependencies->rgDependencies + i;
+
+        if (pVariables->rgVariables[pDependency->iVariable].qwGeneration != pDependency->qwGeneration)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void ReleaseFormatTemplateMemo(
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate
+    )
+{
+    StrSecureZeroFreeString(pTemplate->sczMemoizedValue);
+    ReleaseMem(pTemplate->memoDependencies.rgDependencies);
+
+    pTemplate->fMemoized = FALSE;
+    pTemplate->sczMemoizedValue = NULL;
+    pTemplate->cchMemoizedValue = 0;
+    memset(&pTemplate->memoDependencies, 0, sizeof(pTemplate->memoDependencies));
+}
+
+static void UninitializeFormatTemplate(
+    __in BURN_VARIABLE_FORMAT_TEMPLATE* pTemplate
+    )
+{
+    ReleaseFormatTemplateMemo(pTemplate);
+
+    for (DWORD i = 0; i < pTemplate->cSegments; ++i)
+    {
+        StrSecureZeroFreeString(pTemplate->rgSegments[i].sczName);
+    }
+
+    ReleaseMem(pTemplate->rgSegments);
+    StrSecureZeroFreeString(pTemplate->sczTemplate);
+
+    memset(pTemplate, 0, sizeof(BURN_VARIABLE_FORMAT_TEMPLATE));
+}
+
+static HRESULT AppendFormattedString(
+    __in BOOL fZeroOnRealloc,
+    __deref_inout_ecount_part(*pcchBuffer, *pcchUsed + 1) LPWSTR* psczBuffer,
+    __inout SIZE_T* pcchBuffer,
+    __inout SIZE_T* pcchUsed,
+    __in_ecount(cchValue) LPCWSTR wzValue,
+    __in SIZE_T cchValue
+    )
+{
+    HRESULT hr = S_OK;
+    SIZE_T cchRequired = 0;
+    SIZE_T cchNew = 0;
+
+    hr = ::SIZETAdd(*pcchUsed, cchValue, &cchRequired);
+    ExitOnRootFailure(hr, "Overflow while calculating size of formatted string.");
+
+    hr = ::SIZETAdd(cchRequired, 1, &cchRequired);
+    ExitOnRootFailure(hr, "Overflow while calculating size of formatted string.");
+
+    if (*pcchBuffer < cchRequired)
+    {
+        // grow geometrically so building a long string stays linear
+        hr = ::SIZETMult(*pcchBuffer, 2, &cchNew);
+        ExitOnRootFailure(hr, "Overflow while growing formatted string.");
+
+        cchNew = max(cchNew, cchRequired);
+
+        hr = VariableStrAlloc(fZeroOnRealloc, psczBuffer, cchNew);
+        ExitOnFailure(hr, "Failed to grow formatted string.");
+
+        *pcchBuffer = cchNew;
+    }
+
+    memcpy(*psczBuffer + *pcchUsed, wzValue, sizeof(WCHAR) * cchValue);
+    *pcchUsed += cchValue;
+    (*psczBuffer)[*pcchUsed] = L'\0';
+
+LExit:
     return hr;
 }
 
@@ -1389,15 +2074,14 @@ static HRESULT GetFormatted(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
     __out_z LPWSTR* psczValue,
-    __out BOOL* pfContainsHiddenVariable
+    __out BOOL* pfContainsHiddenVariable,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
     )
 {
     HRESULT hr = S_OK;
     BURN_VARIABLE* pVariable = NULL;
     LPWSTR scz = NULL;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
-
     hr = GetVariable(pVariables, wzVariable, &pVariable);
     if (SUCCEEDED(hr) && BURN_VARIANT_TYPE_NONE == pVariable->Value.Type)
     {
@@ -1419,7 +2103,8 @@ static HRESULT GetFormatted(
         hr = BVariantGetString(&pVariable->Value, &scz);
         ExitOnFailure(hr, "Failed to get unformatted string.");
 
-        hr = FormatString(pVariables, scz, psczValue, NULL, FALSE, pfContainsHiddenVariable);
+        // the values of hidden variables are not kept in the format template cache
+        hr = FormatString(pVariables, scz, psczValue, NULL, FALSE, pfContainsHiddenVariable, !pVariable->fHidden, pDependencies);
         ExitOnFailure(hr, "Failed to format value '%ls' of variable: %ls", pVariable->fHidden ? L"*****" : pVariable->Value.sczValue, wzVariable);
     }
     else
@@ -1429,118 +2114,314 @@ static HRESULT GetFormatted(
     }
 
 LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
     StrSecureZeroFreeString(scz);
 
     return hr;
 }
 
-static HRESULT AddBuiltInVariable(
-    __in BURN_VARIABLES* pVariables,
-    __in LPCWSTR wzVariable,
-    __in PFN_INITIALIZEVARIABLE pfnInitialize,
-    __in DWORD_PTR dwpInitializeData,
-    __in BOOL fPersist,
-    __in BOOL fOverridable
+static HRESULT AddBuiltInVariable(
+    __in BURN_VARIABLES* pVariables,
+    __in LPCWSTR wzVariable,
+    __in PFN_INITIALIZEVARIABLE pfnInitialize,
+    __in DWORD_PTR dwpInitializeData,
+    __in BOOL fPersist,
+    __in BOOL fOverridable
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iVariable = 0;
+    BURN_VARIABLE* pVariable = NULL;
+
+    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
+    ExitOnFailure(hr, "Failed to find variable value.");
+
+    // insert element if not found
+    if (S_FALSE == hr)
+    {
+        hr = InsertVariable(pVariables, wzVariable, &iVariable);
+        ExitOnFailure(hr, "Failed to insert variable.");
+    }
+    else
+    {
+        ExitWithRootFailure(hr, E_INVALIDSTATE, "Attempted to add built-in variable again: %ls", wzVariable);
+    }
+
+    // set variable details
+    pVariable = &pVariables->rgVariables[iVariable];
+    pVariable->fPersisted = fPersist;
+    pVariable->internalType = fOverridable ? BURN_VARIABLE_INTERNAL_TYPE_OVERRIDABLE_BUILTIN : BURN_VARIABLE_INTERNAL_TYPE_BUILTIN;
+    pVariable->pfnInitialize = pfnInitialize;
+    pVariable->dwpInitializeData = dwpInitializeData;
+
+LExit:
+    return hr;
+}
+
+static HRESULT AddWellKnownVariable(
+    __in BURN_VARIABLES* pVariables,
+    __in LPCWSTR wzVariable,
+    __in BOOL fPersisted
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iVariable = 0;
+    BURN_VARIABLE* pVariable = NULL;
+
+    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
+    ExitOnFailure(hr, "Failed to find variable value.");
+
+    // insert element if not found
+    if (S_FALSE == hr)
+    {
+        hr = InsertVariable(pVariables, wzVariable, &iVariable);
+        ExitOnFailure(hr, "Failed to insert variable.");
+    }
+    else if (BURN_VARIABLE_INTERNAL_TYPE_NORMAL != pVariables->rgVariables[iVariable].internalType)
+    {
+        ExitWithRootFailure(hr, E_INVALIDSTATE, "Attempted to add built-in variable as a well-known variable: %ls", wzVariable);
+    }
+    else
+    {
+        ExitWithRootFailure(hr, E_INVALIDSTATE, "Attempted to add well-known variable again: %ls", wzVariable);
+    }
+
+    // set variable details
+    pVariable = &pVariables->rgVariables[iVariable];
+    pVariable->fPersisted = fPersisted;
+    pVariable->internalType = BURN_VARIABLE_INTERNAL_TYPE_NORMAL;
+
+LExit:
+    return hr;
+}
+
+static HRESULT GetVariable(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __out BURN_VARIABLE** ppVariable
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iVariable = 0;
+    BURN_VARIABLE* pVariable = NULL;
+    BURN_VARIANT value = { };
+    BOOL fInCache = FALSE;
+    LARGE_INTEGER liStart = { };
+
+    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
+    ExitOnFailure(hr, "Failed to find variable value '%ls'.", wzVariable);
+
+    if (S_FALSE == hr)
+    {
+        ExitFunction1(hr = E_NOTFOUND);
+    }
+
+    pVariable = &pVariables->rgVariables[iVariable];
+
+    // initialize built-in variable, the type is published last so other readers sharing
+    // srwAccess either see no value or the complete one.
+    if (BURN_VARIANT_TYPE_NONE == static_cast<BURN_VARIANT_TYPE>(::ReadAcquire(reinterpret_cast<LONG volatile*>(&pVariable->Value.Type))) && BURN_VARIABLE_INTERNAL_TYPE_NORMAL < pVariable->internalType)
+    {
+        ::EnterCriticalSection(&pVariables->csCache);
+        fInCache = TRUE;
+
+        if (BURN_VARIANT_TYPE_NONE == pVariable->Value.Type)
+        {
+            ::QueryPerformanceCounter(&liStart);
+
+            hr = pVariable->pfnInitialize(pVariable->dwpInitializeData, &value);
+            ExitOnFailure(hr, "Failed to initialize built-in variable value '%ls'.", wzVariable);
+
+            PublishBuiltInValue(pVariables, pVariable, &value, GetElapsedMicroseconds(&liStart), FALSE);
+
+            LogStringLine(REPORT_DEBUG, "Initialized built-in variable '%ls' in %I64u microseconds.", wzVariable, pVariable->qwInitializeMicroseconds);
+        }
+    }
+
+    *ppVariable = pVariable;
+
+LExit:
+    if (fInCache)
+    {
+        ::LeaveCriticalSection(&pVariables->csCache);
+    }
+
+    BVariantUninitialize(&value);
+
+    return hr;
+}
+
+static HRESULT IsVariableHidden(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __out BOOL* pfHidden
+    )
+{
+    HRESULT hr = S_OK;
+    BURN_VARIABLE* pVariable = NULL;
+
+    hr = GetVariable(pVariables, wzVariable, &pVariable);
+    if (E_NOTFOUND == hr)
+    {
+        // A missing variable does not need its data hidden.
+        *pfHidden = FALSE;
+
+        ExitFunction1(hr = S_OK);
+    }
+    ExitOnFailure(hr, "Failed to get visibility of variable: %ls", wzVariable);
+
+    *pfHidden = pVariable->fHidden;
+
+LExit:
+    return hr;
+}
+
+static void PublishBuiltInValue(
+    __in BURN_VARIABLES* pVariables,
+    __in BURN_VARIABLE* pVariable,
+    __in BURN_VARIANT* pValue,
+    __in DWORD64 qwInitializeMicroseconds,
+    __in BOOL fInitializedInBackground
+    )
+{
+    // Caller holds csCache and shares srwAccess. Everything else is in place before the type is
+    // published so readers that see the type also see the value it describes.
+    pVariable->qwGeneration = ++pVariables->qwGeneration;
+    pVariable->qwInitializeMicroseconds = qwInitializeMicroseconds;
+    pVariable->fInitializedInBackground = fInitializedInBackground;
+    pVariable->Value.llValue = pValue->llValue;
+    ::WriteRelease(reinterpret_cast<LONG volatile*>(&pVariable->Value.Type), pValue->Type);
+
+    // the variable owns the value now
+    memset(pValue, 0, sizeof(BURN_VARIANT));
+}
+
+static BOOL IsPrewarmedBuiltIn(
+    __in PFN_INITIALIZEVARIABLE pfnInitialize
     )
 {
-    HRESULT hr = S_OK;
-    DWORD iVariable = 0;
-    BURN_VARIABLE* pVariable = NULL;
+    // these query the OS, the shell or Windows Installer and regularly take milliseconds each.
+    return InitializeVariableOsInfo == pfnInitialize ||
+           InitializeVariableCsidlFolder == pfnInitialize ||
+           InitializeVariable6432Folder == pfnInitialize ||
+#if !defined(_WIN64)
+           InitializeVariableRegistryFolder == pfnInitialize ||
+#endif
+           InitializeVariableComputerName == pfnInitialize ||
+           InitializeVariableVersionMsi == pfnInitialize;
+}
 
-    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
-    ExitOnFailure(hr, "Failed to find variable value.");
+static DWORD WINAPI PrewarmThreadProc(
+    __in LPVOID lpThreadParameter
+    )
+{
+    BURN_VARIABLES* pVariables = static_cast<BURN_VARIABLES*>(lpThreadParameter);
+    LONG iPrewarm = 0;
 
-    // insert element if not found
-    if (S_FALSE == hr)
-    {
-        hr = InsertVariable(pVariables, wzVariable, iVariable);
-        ExitOnFailure(hr, "Failed to insert variable.");
-    }
-    else
+    for (;;)
     {
-        ExitWithRootFailure(hr, E_INVALIDSTATE, "Attempted to add built-in variable again: %ls", wzVariable);
-    }
+        iPrewarm = ::InterlockedIncrement(&pVariables->iNextPrewarmVariable) - 1;
+        if (iPrewarm >= static_cast<LONG>(pVariables->cPrewarmVariables))
+        {
+            break;
+        }
 
-    // set variable details
-    pVariable = &pVariables->rgVariables[iVariable];
-    pVariable->fPersisted = fPersist;
-    pVariable->internalType = fOverridable ? BURN_VARIABLE_INTERNAL_TYPE_OVERRIDABLE_BUILTIN : BURN_VARIABLE_INTERNAL_TYPE_BUILTIN;
-    pVariable->pfnInitialize = pfnInitialize;
-    pVariable->dwpInitializeData = dwpInitializeData;
+        PrewarmVariable(pVariables, pVariables->rgdwPrewarmVariables[iPrewarm]);
+    }
 
-LExit:
-    return hr;
+    return 0;
 }
 
-static HRESULT AddWellKnownVariable(
+static void PrewarmVariable(
     __in BURN_VARIABLES* pVariables,
-    __in LPCWSTR wzVariable,
-    __in BOOL fPersisted
+    __in DWORD iVariable
     )
 {
     HRESULT hr = S_OK;
-    DWORD iVariable = 0;
     BURN_VARIABLE* pVariable = NULL;
+    PFN_INITIALIZEVARIABLE pfnInitialize = NULL;
+    DWORD_PTR dwpInitializeData = 0;
+    BOOL fInitialized = FALSE;
+    BURN_VARIANT value = { };
+    LARGE_INTEGER liStart = { };
+    DWORD64 qwMicroseconds = 0;
 
-    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
-    ExitOnFailure(hr, "Failed to find variable value.");
+    // rgVariables may move when variables are added so only touch it while sharing srwAccess.
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
 
-    // insert element if not found
-    if (S_FALSE == hr)
+    pVariable = pVariables->rgVariables + iVariable;
+    pfnInitialize = pVariable->pfnInitialize;
+    dwpInitializeData = pVariable->dwpInitializeData;
+    fInitialized = BURN_VARIANT_TYPE_NONE != static_cast<BURN_VARIANT_TYPE>(::ReadAcquire(reinterpret_cast<LONG volatile*>(&pVariable->Value.Type)));
+
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
+
+    if (fInitialized)
     {
-        hr = InsertVariable(pVariables, wzVariable, iVariable);
-        ExitOnFailure(hr, "Failed to insert variable.");
+        ExitFunction(); // already needed by someone, or overridden.
     }
-    else if (BURN_VARIABLE_INTERNAL_TYPE_NORMAL != pVariables->rgVariables[iVariable].internalType)
+
+    ::QueryPerformanceCounter(&liStart);
+
+    hr = pfnInitialize(dwpInitializeData, &value);
+    if (FAILED(hr))
     {
-        ExitWithRootFailure(hr, E_INVALIDSTATE, "Attempted to add built-in variable as a well-known variable: %ls", wzVariable);
+        ExitFunction(); // the variable is initialized on first use instead, which reports the failure.
     }
-    else
+
+    qwMicroseconds = GetElapsedMicroseconds(&liStart);
+
+    ::AcquireSRWLockShared(&pVariables->srwAccess);
+    ::EnterCriticalSection(&pVariables->csCache);
+
+    pVariable = pVariables->rgVariables + iVariable;
+
+    // Only publish if nobody initialized or set the variable while we were busy.
+    if (BURN_VARIANT_TYPE_NONE == pVariable->Value.Type)
     {
-        ExitWithRootFailure(hr, E_INVALIDSTATE, "Attempted to add well-known variable again: %ls", wzVariable);
+        PublishBuiltInValue(pVariables, pVariable, &value, qwMicroseconds, TRUE);
+
+        LogStringLine(REPORT_DEBUG, "Initialized built-in variable '%ls' in the background in %I64u microseconds.", pVariable->sczName, qwMicroseconds);
     }
 
-    // set variable details
-    pVariable = &pVariables->rgVariables[iVariable];
-    pVariable->fPersisted = fPersisted;
-    pVariable->internalType = BURN_VARIABLE_INTERNAL_TYPE_NORMAL;
+    ::LeaveCriticalSection(&pVariables->csCache);
+    ::ReleaseSRWLockShared(&pVariables->srwAccess);
 
 LExit:
-    return hr;
+    BVariantUninitialize(&value);
 }
 
-static HRESULT GetVariable(
-    __in BURN_VARIABLES* pVariables,
-    __in_z LPCWSTR wzVariable,
-    __out BURN_VARIABLE** ppVariable
+static void StopPrewarm(
+    __in BURN_VARIABLES* pVariables
     )
 {
-    HRESULT hr = S_OK;
-    DWORD iVariable = 0;
-    BURN_VARIABLE* pVariable = NULL;
-
-    hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
-    ExitOnFailure(hr, "Failed to find variable value '%ls'.", wzVariable);
-
-    if (S_FALSE == hr)
+    if (pVariables->rghPrewarmThreads)
     {
-        ExitFunction1(hr = E_NOTFOUND);
-    }
+        // skip whatever has not been started yet and wait for the rest
+        ::InterlockedExchange(&pVariables->iNextPrewarmVariable, static_cast<LONG>(pVariables->cPrewarmVariables));
 
-    pVariable = &pVariables->rgVariables[iVariable];
+        for (DWORD i = 0; i < pVariables->cPrewarmThreads; ++i)
+        {
+            ::WaitForSingleObject(pVariables->rghPrewarmThreads[i], INFINITE);
+            ReleaseHandle(pVariables->rghPrewarmThreads[i]);
+        }
 
-    // initialize built-in variable
-    if (BURN_VARIANT_TYPE_NONE == pVariable->Value.Type && BURN_VARIABLE_INTERNAL_TYPE_NORMAL < pVariable->internalType)
-    {
-        hr = pVariable->pfnInitialize(pVariable->dwpInitializeData, &pVariable->Value);
-        ExitOnFailure(hr, "Failed to initialize built-in variable value '%ls'.", wzVariable);
+        MemFree(pVariables->rghPrewarmThreads);
+        pVariables->rghPrewarmThreads = NULL;
+        pVariables->cPrewarmThreads = 0;
     }
+}
 
-    *ppVariable = pVariable;
+static DWORD64 GetElapsedMicroseconds(
+    __in const LARGE_INTEGER* pliStart
+    )
+{
+    LARGE_INTEGER liNow = { };
+    LARGE_INTEGER liFrequency = { };
 
-LExit:
-    return hr;
+    ::QueryPerformanceCounter(&liNow);
+    ::QueryPerformanceFrequency(&liFrequency);
+
+    return static_cast<DWORD64>((liNow.QuadPart - pliStart->QuadPart) * 1000000 / liFrequency.QuadPart);
 }
 
 static HRESULT FindVariableIndexByName(
@@ -1550,37 +2431,21 @@ static HRESULT FindVariableIndexByName(
     )
 {
     HRESULT hr = S_OK;
-    DWORD iRangeFirst = 0;
-    DWORD cRangeLength = pVariables->cVariables;
+    BURN_VARIABLE* pVariable = NULL;
 
-    while (cRangeLength)
+    if (!pVariables->sdhVariables)
     {
-        // get variable in middle of range
-        DWORD iPosition = cRangeLength / 2;
-        BURN_VARIABLE* pVariable = &pVariables->rgVariables[iRangeFirst + iPosition];
+        ExitFunction1(hr = S_FALSE); // no variables have been added yet.
+    }
 
-        switch (::CompareStringOrdinal(wzVariable, -1, pVariable->sczName, -1, FALSE))
-        {
-        case CSTR_LESS_THAN:
-            // restrict range to elements before the current
-            cRangeLength = iPosition;
-            break;
-        case CSTR_EQUAL:
-            // variable found
-            *piVariable = iRangeFirst + iPosition;
-            ExitFunction1(hr = S_OK);
-        case CSTR_GREATER_THAN:
-            // restrict range to elements after the current
-            iRangeFirst += iPosition + 1;
-            cRangeLength -= iPosition + 1;
-            break;
-        default:
-            ExitWithLastError(hr, "Failed to compare strings.");
-        }
+    hr = DictGetValue(pVariables->sdhVariables, wzVariable, reinterpret_cast<void**>(&pVariable));
+    if (E_NOTFOUND == hr)
+    {
+        ExitFunction1(hr = S_FALSE); // variable not found
     }
+    ExitOnFailure(hr, "Failed to look up variable: %ls", wzVariable);
 
-    *piVariable = iRangeFirst;
-    hr = S_FALSE; // variable not found
+    *piVariable = static_cast<DWORD>(pVariable - pVariables->rgVariables);
 
 LExit:
     return hr;
@@ -1589,7 +2454,7 @@ LExit:
 static HRESULT InsertUserVariable(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
-    __in DWORD iPosition
+    __out DWORD* piVariable
     )
 {
     HRESULT hr = S_OK;
@@ -1599,7 +2464,7 @@ static HRESULT InsertUserVariable(
         ExitWithRootFailure(hr, E_INVALIDARG, "Attempted to insert variable with reserved prefix: %ls", wzVariable);
     }
 
-    hr = InsertVariable(pVariables, wzVariable, iPosition);
+    hr = InsertVariable(pVariables, wzVariable, piVariable);
 
 LExit:
     return hr;
@@ -1608,16 +2473,25 @@ LExit:
 static HRESULT InsertVariable(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
-    __in DWORD iPosition
+    __out DWORD* piVariable
     )
 {
     HRESULT hr = S_OK;
     size_t cbAllocSize = 0;
+    DWORD iVariable = pVariables->cVariables;
+    BURN_VARIABLE* pVariable = NULL;
+
+    if (!pVariables->sdhVariables)
+    {
+        // The dictionary stores offsets into rgVariables so it survives the array being reallocated.
+        hr = DictCreateWithEmbeddedKey(&pVariables->sdhVariables, 0, reinterpret_cast<void**>(&pVariables->rgVariables), offsetof(BURN_VARIABLE, sczName), DICT_FLAG_NONE);
+        ExitOnFailure(hr, "Failed to create variable dictionary.");
+    }
 
-    // ensure there is room in the variable array
+    // ensure there is room in the variable array, growing geometrically so bulk inserts stay linear
     if (pVariables->cVariables == pVariables->dwMaxVariables)
     {
-        hr = ::DWordAdd(pVariables->dwMaxVariables, GROW_VARIABLE_ARRAY, &(pVariables->dwMaxVariables));
+        hr = ::DWordAdd(pVariables->dwMaxVariables, max(GROW_VARIABLE_ARRAY, pVariables->dwMaxVariables), &(pVariables->dwMaxVariables));
         ExitOnRootFailure(hr, "Overflow while growing variable array size");
 
         if (pVariables->rgVariables)
@@ -1645,20 +2519,185 @@ static HRESULT InsertVariable(
         }
     }
 
-    // move variables
-    if (0 < pVariables->cVariables - iPosition)
+    pVariable = &pVariables->rgVariables[iVariable];
+
+    // allocate name
+    hr = StrAllocString(&pVariable->sczName, wzVariable, 0);
+    ExitOnFailure(hr, "Failed to copy variable name.");
+
+    hr = DictAddValue(pVariables->sdhVariables, pVariable);
+    ExitOnFailure(hr, "Failed to add variable to dictionary: %ls", wzVariable);
+
+    ++pVariables->cVariables;
+
+    *piVariable = iVariable;
+
+LExit:
+    if (FAILED(hr) && pVariable)
     {
-        memmove(&pVariables->rgVariables[iPosition + 1], &pVariables->rgVariables[iPosition], sizeof(BURN_VARIABLE) * (pVariables->cVariables - iPosition));
-        memset(&pVariables->rgVariables[iPosition], 0, sizeof(BURN_VARIABLE));
+        ReleaseNullStr(pVariable->sczName);
     }
 
-    ++pVariables->cVariables;
+    return hr;
+}
 
-    // allocate name
-    hr = StrAllocString(&pVariables->rgVariables[iPosition].sczName, wzVariable, 0);
-    ExitOnFailure(hr, "Failed to copy variable name.");
+static HRESULT EnsureSortedVariables(
+    __in BURN_VARIABLES* pVariables
+    )
+{
+    HRESULT hr = S_OK;
+
+    // readers sharing srwAccess may get here together, the first one sorts
+    ::EnterCriticalSection(&pVariables->csCache);
+
+    if (pVariables->cSortedVariables == pVariables->cVariables)
+    {
+        ExitFunction();
+    }
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pVariables->rgdwSortedVariables), pVariables->cVariables, sizeof(DWORD), 0);
+    ExitOnFailure(hr, "Failed to allocate sorted variable index.");
+
+    // variables are only ever appended, so add the new ones and sort the whole index again
+    for (DWORD i = pVariables->cSortedVariables; i < pVariables->cVariables; ++i)
+    {
+        pVariables->rgdwSortedVariables[i] = i;
+    }
+
+    qsort_s(pVariables->rgdwSortedVariables, pVariables->cVariables, sizeof(DWORD), CompareVariableIndices, pVariables);
+
+    pVariables->cSortedVariables = pVariables->cVariables;
+
+LExit:
+    ::LeaveCriticalSection(&pVariables->csCache);
+
+    return hr;
+}
+
+static __callback int __cdecl CompareVariableIndices(
+    __in void* pvContext,
+    __in const void* pvLeft,
+    __in const void* pvRight
+    )
+{
+    BURN_VARIABLES* pVariables = static_cast<BURN_VARIABLES*>(pvContext);
+    LPCWSTR wzLeft = pVariables->rgVariables[*static_cast<const DWORD*>(pvLeft)].sczName;
+    LPCWSTR wzRight = pVariables->rgVariables[*static_cast<const DWORD*>(pvRight)].sczName;
+
+    // CSTR_LESS_THAN, CSTR_EQUAL and CSTR_GREATER_THAN are 1, 2 and 3.
+    return ::CompareStringOrdinal(wzLeft, -1, wzRight, -1, FALSE) - CSTR_EQUAL;
+}
+
+static HRESULT SerializeVariables(
+    __in BURN_VARIABLES* pVariables,
+    __in BOOL fPersisting,
+    __in DWORD64 qwChangedSince,
+    __in DWORD64 qwChangedUntil,
+    __inout BYTE** ppbBuffer,
+    __inout SIZE_T* piBuffer
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fIncluded = FALSE;
+    LONGLONG ll = 0;
+    LPWSTR scz = NULL;
+    DWORD cVariables = 0;
+
+    hr = EnsureSortedVariables(pVariables);
+    ExitOnFailure(hr, "Failed to sort variables.");
+
+    // When only sending changes, unchanged variables are left out entirely instead of being
+    // marked as not included so the count covers just the variables that follow. Other readers
+    // may initialize built-in variables meanwhile so changes are capped at qwChangedUntil to
+    // keep the count and the variables written in agreement.
+    if (qwChangedSince)
+    {
+        for (DWORD i = 0; i < pVariables->cSortedVariables; ++i)
+        {
+            BURN_VARIABLE* pVariable = &pVariables->rgVariables[pVariables->rgdwSortedVariables[i]];
+
+            if (BURN_VARIABLE_INTERNAL_TYPE_BUILTIN != pVariable->internalType && qwChangedSince < pVariable->qwGeneration && qwChangedUntil >= pVariable->qwGeneration)
+            {
+                ++cVariables;
+            }
+        }
+    }
+    else
+    {
+        cVariables = pVariables->cSortedVariables;
+    }
+
+    // Write variable count.
+    hr = BuffWriteNumber(ppbBuffer, piBuffer, cVariables);
+    ExitOnFailure(hr, "Failed to write variable count.");
+
+    // Write variables in name order.
+    for (DWORD i = 0; i < pVariables->cSortedVariables; ++i)
+    {
+        BURN_VARIABLE* pVariable = &pVariables->rgVariables[pVariables->rgdwSortedVariables[i]];
+
+        // If we aren't persisting, include only variables that aren't rejected by the elevated process.
+        // If we are persisting, include only variables that should be persisted.
+        fIncluded = (!fPersisting && BURN_VARIABLE_INTERNAL_TYPE_BUILTIN != pVariable->internalType) ||
+                    (fPersisting && pVariable->fPersisted);
+
+        if (qwChangedSince && (!fIncluded || qwChangedSince >= pVariable->qwGeneration || qwChangedUntil < pVariable->qwGeneration))
+        {
+            continue;
+        }
+
+        // Write included flag.
+        hr = BuffWriteNumber(ppbBuffer, piBuffer, (DWORD)fIncluded);
+        ExitOnFailure(hr, "Failed to write included flag.");
+
+        if (!fIncluded)
+        {
+            continue;
+        }
+
+        // Write variable name.
+        hr = BuffWriteString(ppbBuffer, piBuffer, pVariable->sczName);
+        ExitOnFailure(hr, "Failed to write variable name.");
+
+        // Write variable value type.
+        hr = BuffWriteNumber(ppbBuffer, piBuffer, (DWORD)pVariable->Value.Type);
+        ExitOnFailure(hr, "Failed to write variable value type.");
+
+        // Write variable value.
+        switch (pVariable->Value.Type)
+        {
+        case BURN_VARIANT_TYPE_NONE:
+            break;
+        case BURN_VARIANT_TYPE_NUMERIC:
+            hr = BVariantGetNumeric(&pVariable->Value, &ll);
+            ExitOnFailure(hr, "Failed to get numeric.");
+
+            hr = BuffWriteNumber64(ppbBuffer, piBuffer, static_cast<DWORD64>(ll));
+            ExitOnFailure(hr, "Failed to write variable value as number.");
+
+            SecureZeroMemory(&ll, sizeof(ll));
+            break;
+        case BURN_VARIANT_TYPE_VERSION: __fallthrough;
+        case BURN_VARIANT_TYPE_FORMATTED: __fallthrough;
+        case BURN_VARIANT_TYPE_STRING:
+            hr = BVariantGetString(&pVariable->Value, &scz);
+            ExitOnFailure(hr, "Failed to get string.");
+
+            hr = BuffWriteString(ppbBuffer, piBuffer, scz);
+            ExitOnFailure(hr, "Failed to write variable value as string.");
+
+            ReleaseNullStrSecure(scz);
+            break;
+        default:
+            hr = E_INVALIDARG;
+            ExitOnFailure(hr, "Unsupported variable type.");
+        }
+    }
 
 LExit:
+    SecureZeroMemory(&ll, sizeof(ll));
+    StrSecureZeroFreeString(scz);
+
     return hr;
 }
 
@@ -1671,9 +2710,26 @@ static HRESULT SetVariableValue(
     )
 {
     HRESULT hr = S_OK;
-    DWORD iVariable = 0;
 
-    ::EnterCriticalSection(&pVariables->csAccess);
+    ::AcquireSRWLockExclusive(&pVariables->srwAccess);
+
+    hr = UpdateVariableValue(pVariables, wzVariable, pVariant, setBuiltin, fLog);
+
+    ::ReleaseSRWLockExclusive(&pVariables->srwAccess);
+
+    return hr;
+}
+
+static HRESULT UpdateVariableValue(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __in BURN_VARIANT* pVariant,
+    __in SET_VARIABLE setBuiltin,
+    __in BOOL fLog
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iVariable = 0;
 
     hr = FindVariableIndexByName(pVariables, wzVariable, &iVariable);
     ExitOnFailure(hr, "Failed to find variable value '%ls'.", wzVariable);
@@ -1684,7 +2740,7 @@ static HRESULT SetVariableValue(
         // Not possible from external callers so just assert.
         AssertSz(SET_VARIABLE_OVERRIDE_BUILTIN != setBuiltin, "Intent to set missing built-in variable.");
 
-        hr = InsertVariable(pVariables, wzVariable, iVariable);
+        hr = InsertVariable(pVariables, wzVariable, &iVariable);
         ExitOnFailure(hr, "Failed to insert variable '%ls'.", wzVariable);
     }
     else if (BURN_VARIABLE_INTERNAL_TYPE_NORMAL < pVariables->rgVariables[iVariable].internalType) // built-in variables must be overridden.
@@ -1768,9 +2824,10 @@ static HRESULT SetVariableValue(
     hr = BVariantSetValue(&pVariables->rgVariables[iVariable].Value, pVariant);
     ExitOnFailure(hr, "Failed to set value of variable: %ls", wzVariable);
 
-LExit:
-    ::LeaveCriticalSection(&pVariables->csAccess);
+    // Invalidate anything formatted from the old value.
+    pVariables->rgVariables[iVariable].qwGeneration = ++pVariables->qwGeneration;
 
+LExit:
     if (FAILED(hr) && fLog)
     {
         LogStringLine(REPORT_STANDARD, "Setting variable failed: ID '%ls', HRESULT 0x%x", wzVariable, hr);
@@ -34,9 +34,20 @@ enum BURN_VARIABLE_INTERNAL_TYPE
     BURN_VARIABLE_INTERNAL_TYPE_BUILTIN, // the BA can't set this variable, and the unelevated process can't serialize it to the elevated process.
 };
 
+enum BURN_VARIABLE_FORMAT_SEGMENT_TYPE
+{
+    BURN_VARIABLE_FORMAT_SEGMENT_TYPE_LITERAL,
+    BURN_VARIABLE_FORMAT_SEGMENT_TYPE_ESCAPE, // [\x], expands to x.
+    BURN_VARIABLE_FORMAT_SEGMENT_TYPE_VARIABLE, // [Name], expands to the formatted value of the variable.
+    BURN_VARIABLE_FORMAT_SEGMENT_TYPE_GROUP_BEGIN, // {, only when the group contains expanders.
+    BURN_VARIABLE_FORMAT_SEGMENT_TYPE_GROUP_END, // }, the group is removed if any of its variables was blank.
+};
+
 
 // structs
 
+struct _BURN_CONDITION_PROGRAM; // see condition.cpp
+
 typedef struct _BURN_VARIABLE
 {
     LPWSTR sczName;
@@ -48,14 +59,93 @@ typedef struct _BURN_VARIABLE
     BURN_VARIABLE_INTERNAL_TYPE internalType;
     PFN_INITIALIZEVARIABLE pfnInitialize;
     DWORD_PTR dwpInitializeData;
+    DWORD64 qwInitializeMicroseconds; // how long pfnInitialize took.
+    BOOL fInitializedInBackground;
+
+    // stamped from BURN_VARIABLES::qwGeneration every time the value changes.
+    DWORD64 qwGeneration;
 } BURN_VARIABLE;
 
+typedef struct _BURN_VARIABLE_FORMAT_SEGMENT
+{
+    BURN_VARIABLE_FORMAT_SEGMENT_TYPE type;
+    LPCWSTR wz; // points into the template string, not null terminated.
+    SIZE_T cch;
+    LPWSTR sczName; // variable name for BURN_VARIABLE_FORMAT_SEGMENT_TYPE_VARIABLE.
+} BURN_VARIABLE_FORMAT_SEGMENT;
+
+typedef struct _BURN_VARIABLE_FORMAT_DEPENDENCY
+{
+    DWORD iVariable;
+    DWORD64 qwGeneration;
+} BURN_VARIABLE_FORMAT_DEPENDENCY;
+
+typedef struct _BURN_VARIABLE_FORMAT_DEPENDENCIES
+{
+    BURN_VARIABLE_FORMAT_DEPENDENCY* rgDependencies;
+    DWORD cDependencies;
+
+    // set when a referenced variable did not exist, cVariables is the variable count at that time.
+    BOOL fMissingVariable;
+    DWORD cVariables;
+} BURN_VARIABLE_FORMAT_DEPENDENCIES;
+
+typedef struct _BURN_VARIABLE_FORMAT_TEMPLATE
+{
+    LPWSTR sczTemplate;
+    BURN_VARIABLE_FORMAT_SEGMENT* rgSegments;
+    DWORD cSegments;
+
+    // last formatted value, valid until one of the variables it depends on changes.
+    BOOL fMemoized;
+    LPWSTR sczMemoizedValue;
+    SIZE_T cchMemoizedValue;
+    BURN_VARIABLE_FORMAT_DEPENDENCIES memoDependencies;
+} BURN_VARIABLE_FORMAT_TEMPLATE;
+
 typedef struct _BURN_VARIABLES
 {
-    CRITICAL_SECTION csAccess;
+    // readers share access to the variables, anything that changes a value takes it exclusively.
+    SRWLOCK srwAccess;
+
+    // guards what readers fill in lazily while sharing srwAccess: built-in variable values,
+    // the sorted index and the format template cache.
+    CRITICAL_SECTION csCache;
+
     DWORD dwMaxVariables;
     DWORD cVariables;
-    BURN_VARIABLE* rgVariables;
+    BURN_VARIABLE* rgVariables; // in insertion order, reallocated as it grows so only indices stay valid across an insert.
+    STRINGDICT_HANDLE sdhVariables; // name index into rgVariables.
+
+    // indices into rgVariables ordered by name, rebuilt on demand when variables were added.
+    DWORD* rgdwSortedVariables;
+    DWORD cSortedVariables;
+
+    DWORD64 qwGeneration; // bumped every time any variable value changes.
+    DWORD64 qwSerializedGeneration; // qwGeneration as of the last VariableCommitSerializedChanges(), zero when the next sync must send everything.
+
+    // compiled format strings, keyed by the unformatted string.
+    STRINGDICT_HANDLE sdhFormatTemplates;
+    BURN_VARIABLE_FORMAT_TEMPLATE** rgpFormatTemplates;
+    DWORD cFormatTemplates;
+    DWORD cFormatTemplateHits;
+    DWORD cFormatTemplateMisses;
+    DWORD cFormatMemoHits;
+
+    // compiled conditions, keyed by the condition string, see ConditionEvaluate().
+    STRINGDICT_HANDLE sdhConditions;
+    struct _BURN_CONDITION_PROGRAM** rgpConditions;
+    DWORD cConditions;
+    DWORD cConditionHits;
+    DWORD cConditionMisses;
+    DWORD cConditionMemoHits;
+
+    // expensive built-in variables being initialized on worker threads, see VariablePrewarm().
+    DWORD* rgdwPrewarmVariables;
+    DWORD cPrewarmVariables;
+    LONG volatile iNextPrewarmVariable;
+    HANDLE* rghPrewarmThreads;
+    DWORD cPrewarmThreads;
 } BURN_VARIABLES;
 
 
@@ -64,6 +154,10 @@ typedef struct _BURN_VARIABLES
 HRESULT VariableInitialize(
     __in BURN_VARIABLES* pVariables
     );
+HRESULT VariablePrewarm(
+    __in BURN_VARIABLES* pVariables,
+    __in DWORD cThreads
+    );
 HRESULT VariablesParseFromXml(
     __in BURN_VARIABLES* pVariables,
     __in IXMLDOMNode* pixnBundle
@@ -94,6 +188,17 @@ HRESULT VariableGetVariant(
     __in_z LPCWSTR wzVariable,
     __in BURN_VARIANT* pValue
     );
+HRESULT VariableGetResolvedVariant(
+    __in BURN_VARIABLES* pVariables,
+    __in_z LPCWSTR wzVariable,
+    __in BURN_VARIANT* pValue,
+    __out BOOL* pfHidden,
+    __in_opt BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
+BOOL VariableDependenciesCurrent(
+    __in BURN_VARIABLES* pVariables,
+    __in const BURN_VARIABLE_FORMAT_DEPENDENCIES* pDependencies
+    );
 HRESULT VariableGetFormatted(
     __in BURN_VARIABLES* pVariables,
     __in_z LPCWSTR wzVariable,
@@ -146,6 +251,22 @@ HRESULT VariableSerialize(
     __inout BYTE** ppbBuffer,
     __inout SIZE_T* piBuffer
     );
+// Sends only the variables changed since the last committed sync. Variables the receiver changed itself
+// keep its value until the sender changes them too or VariableResetSerializedChanges() is called.
+HRESULT VariableSerializeChanges(
+    __in BURN_VARIABLES* pVariables,
+    __inout BYTE** ppbBuffer,
+    __inout SIZE_T* piBuffer,
+    __out DWORD64* pqwGeneration
+    );
+// Called with the generation from VariableSerializeChanges() once the receiver applied the buffer.
+void VariableCommitSerializedChanges(
+    __in BURN_VARIABLES* pVariables,
+    __in DWORD64 qwGeneration
+    );
+void VariableResetSerializedChanges(
+    __in BURN_VARIABLES* pVariables
+    );
 HRESULT VariableDeserialize(
     __in BURN_VARIABLES* pVariables,
     __in BOOL fWasPersisted,
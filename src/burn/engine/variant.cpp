@@ -115,6 +115,50 @@ extern "C" HRESULT BVariantGetVersionSilent(
     return GetVersionInternal(pVariant, FALSE, fSilent, ppValue);
 }
 
+// Like BVariantGetVersionHidden but without copying: version values are returned as-is and
+// anything else is parsed into pStorage, which the caller releases with VerUninitializeVersionStorage.
+extern "C" HRESULT BVariantGetVersionInPlace(
+    __in BURN_VARIANT* pVariant,
+    __in BOOL fHidden,
+    __in VERUTIL_VERSION_STORAGE* pStorage,
+    __out VERUTIL_VERSION** ppValue
+    )
+{
+    HRESULT hr = S_OK;
+
+    switch (pVariant->Type)
+    {
+    case BURN_VARIANT_TYPE_NUMERIC:
+        hr = VerVersionFromQwordInPlace(pVariant->llValue, pStorage);
+        if (SUCCEEDED(hr))
+        {
+            *ppValue = &pStorage->version;
+        }
+        break;
+    case BURN_VARIANT_TYPE_FORMATTED: __fallthrough;
+    case BURN_VARIANT_TYPE_STRING:
+        hr = VerParseVersionInPlace(pVariant->sczValue, 0, FALSE, pStorage);
+        if (SUCCEEDED(hr))
+        {
+            *ppValue = &pStorage->version;
+
+            if (pStorage->version.fInvalid)
+            {
+                LogId(REPORT_WARNING, MSG_INVALID_VERSION_COERSION, fHidden ? L"*****" : pVariant->sczValue);
+            }
+        }
+        break;
+    case BURN_VARIANT_TYPE_VERSION:
+        *ppValue = pVariant->pValue;
+        break;
+    default:
+        hr = E_INVALIDARG;
+        break;
+    }
+
+    return hr;
+}
+
 static HRESULT GetVersionInternal(
     __in BURN_VARIANT* pVariant,
     __in BOOL fHidden,
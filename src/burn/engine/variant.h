@@ -60,6 +60,12 @@ HRESULT BVariantGetVersionSilent(
     __in BOOL fSilent,
     __out VERUTIL_VERSION** ppValue
     );
+HRESULT BVariantGetVersionInPlace(
+    __in BURN_VARIANT* pVariant,
+    __in BOOL fHidden,
+    __in VERUTIL_VERSION_STORAGE* pStorage,
+    __out VERUTIL_VERSION** ppValue
+    );
 HRESULT BVariantSetNumeric(
     __in BURN_VARIANT* pVariant,
     __in LONGLONG llValue
@@ -0,0 +1,516 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+#include "precomp.h"
+
+typedef struct _CAB_READER_TEST_FILE
+{
+    LPCWSTR wzName;
+    DWORD cbFile;
+    LPCWSTR wzHash; // SHA-512
+} CAB_READER_TEST_FILE;
+
+// A stored folder followed by an MSZIP folder whose files span several blocks.
+static const CAB_READER_TEST_FILE vrgMsZipFiles[] =
+{
+    { L"stored.txt", 1000, L"4d385f1c2e2c5b281984cba31e3567af366991449e6da24a02c5e656020c4194bf6b4d2bfb44bfc2a1471461b864b5ca47da09c0f4215d2983c319539758f93f" },
+    { L"empty.txt", 0, L"cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+    { L"mszip1.txt", 170690, L"1a809a1707c625e5ac2cd6be24403d16fc2cb1fadabe9ed97079b500ff67eda3cada7bd2e08acc26bb0379e63a8119570850cde5dec5cf021bd9d98661418df7" },
+    { L"mszip2.bin", 40000, L"ed14015b6d5ff0d5984e32507653aca77c5b9ef60bf5a0a6b6873f87daf94c19e13617903759c600972861ccc78707208e88c956c983467c7948638926ef2261" },
+    { L"mszip3.txt", 50000, L"567d601f1ce7734685c78cc70441e07f5f46b5c70a8ec3d1d463c476bcc3e4b3f0ade6a67a329bc19584dcadebf102d2ffe3c934ba837e064616ae9a584c128b" },
+};
+
+// The UX container of a bundle, as built by the WiX toolset.
+static const CAB_READER_TEST_FILE vrgLzxFiles[] =
+{
+    { L"0", 3663, L"d0490ea25c31a091fee21a2bea84c2795e987bbf0264a1a108e869805138b85dd6d109a7e1627ba5d0af690d1d6e33c85dbf82458ea47c99b27214b1a0ae163d" },
+    { L"u0", 20, L"e081cf1e9d72653d20bd923f4a060be3257afab8c456b7627047c554b914c997e4fcf70fb62aefbfda3d52338cb938db56c66ad652e8ac8126782898ff1e226f" },
+    { L"u1", 2752, L"552f21e3421f22abf5a51914ca1ec849c94eaedf89bf544420a244dd8a8fc49933c262d80987bc5f1740eddbe6891024266d1ccbd3508e0c4cd5a1e96d511d65" },
+    { L"u2", 252, L"1845b25697fed6d694428f53b2d1b2abf1acf8a09e8e49a536759822ad5b1a75d51bc7ae4d73e435b7bbc23ac34c9aed76f17414d218b54da546c908f9a5182c" },
+};
+
+// A bundle's attached container as built by the WiX toolset, larger than the LZX window with
+// verbatim and aligned blocks. u0, u1, u2 and u30 are PE files.
+static const CAB_READER_TEST_FILE vrgLzxLargeFiles[] =
+{
+    { L"0", 21861, L"e0cba8db96e49e32e1704983598544921400c33f7b6bbea6a9d8a04e37e03e9b76206109c9d799cce46e0480672b0946fcf214061f700aa4a7a2ed7064b86fa5" },
+    { L"u0", 126896, L"ce8b5197ae92861fc152623ed83beaa4255cda9661ee7f4d622fe0b5772b0a2e62cb402af332857a11cdea13ae91c89f47eabac4647e9c6317b9f01876309714" },
+    { L"u1", 90032, L"e3a82e7407f21f84f7119f3b993e62d621399434b4b17ebb5ce9f81b38e21aaa8889ed3689c2bbd6a5b6d1c70a28a2a8bdb75e65276bfea9d035b3e6a57ba922" },
+    { L"u2", 192944, L"a59f4e5ca73044545ba5112f80e838c41b01729a7582f1cbbd17daa87366295950f03840a4518404d07ed3f590ac0950ebbd4166b8930cdde9c910c0a8e10d48" },
+    { L"u3", 3915, L"47f34a9f416d223dcbf071e7292a05554af3d27cde67fc8c161c1bed564c6e7fc448c2f482e05f33149c782e09c681bd65730ca00cf9ec68b284128214b75529" },
+    { L"u4", 797, L"a0f7836aefa1747f481c116f6b085f503b5c09b3a1dd97cd2189f7ce4e6e7ea98f1f66503cba2e6a83e873248cc7507328710dfa670aa5763df8aedcc560285e" },
+    { L"u5", 2464, L"ae791c1f05821167f1d2e1d07dbf95fe7e72b35b3e4b1e22720006c7a672b1330b748414792392b0e806f111aa4efc1c424f4479ebde349e3f079792dbb3bf47" },
+    { L"u6", 2025, L"c6ccb188281f161debf02dcdde24b77d8d14943deed8852e77e5afb18f3f62683ab1ae06dceb1e09d53804a76df6400a360712d8e7e228b7f971054bb4fb2496" },
+    { L"u7", 2458, L"a4b19ebc8bb0d88aba7d3d5783e28f8b6e0960582a540059bc71076b1203bf43bca15ea726272d15395c7b4e431046ada1cbb9d55072bbc5dbe7729c4599f0e0" },
+    { L"u8", 2286, L"2a02415a3e5f073f4530fd87c97b685d95b8c0e1b15efd185cc5cb046fcf1d0dce28db9889ad52588b96fe01841a7a61f6b7d6d2f669eab10a8926c46b8e93d1" },
+    { L"u9", 2442, L"fd7e8896f9414f0db7a88f926f55ee24e0591da676f330200bc6bb829eb32648d90d3094e0011bfe36c7ba8be41dfd74b12d444afea0d2866801258da4fa16e8" },
+    { L"u10", 3400, L"28dac36516bcc76bcc598c6e7abde359695f85ab7a830d6adbc844eb240d9fa372cb5a5ce4dbe21e250408c6b246d371d3cdd656d2178fb0ec22dac7d39cbd9f" },
+    { L"u11", 2235, L"f7be923dc2856e0941d0669e2de5a5c307c98dc7eba0a1b68728eb29c95b4625145c2ad3ac6f6b6d82f062887ea349e2187f1f91785dde5a5083bc1150e56326" },
+    { L"u12", 2306, L"78e201f369e65535e25722dfc0efe99edf641f7c14eff1526dc1cc047ff11640079f1e3d25c9072cf25f4804195891be006fc5ed313063afcb91fb5700120b88" },
+    { L"u13", 2392, L"d05008d37143a1cc031f4b6268490a5a10fbb686c86984d20db94843bdc4624ef9651d158dcb5b660fc239c3c3e8d087eb5d23fffb8c4681910cbc376148f0f0" },
+    { L"u14", 2304, L"bbd9794181eec95d6be7a1b7ba83fd61af2b2df61d9da8dda2788b61bec53c30fcefe5222edf134166532b36d3ab6ce8996f2d670dc6907c1864af881a21ea40" },
+    { L"u15", 2545, L"589522bd4a26bf54ccf3564e392e41bbba4e7b3fd1ed74e7f4f6ad6f2e65cde11fff32d0c5f3bcd09052fe5110fdc361d1926e220fd0bad2d38cac21bbe93211" },
+    { L"u16", 2236, L"a350eaf9e7aeafab1163d7c0b8d014afe07ee98bae3915cbdd3c26282e345a0838e853c89bae8943474758dcbcfd0bb0724a0c75cbf969f321fab4944e8704fd" },
+    { L"u17", 2312, L"7bc7d3e6e19ecf865b2cabfc46c75d516561d5a8a81a8ed55b4edba41a13a7110f474473740200afb035b9597a2511d08c2a2e7a9ade2c2ab4d3f168944b8328" },
+    { L"u18", 2171, L"40e311eada299996e32a7d35223ca678a03c869d63c023d59bc97a7b2049b0252aa9d0a7ec8558d5acb73bd14c7bfa913097e65abee7455658db7e35bbda8ae1" },
+    { L"u19", 2368, L"964f73e572bdcb1ad946c770e6a2fb4a1ce54af4b5bb072f64256083ba27a223f4dad4a95b9d2a646180806d1f977726147970b06aac35eed75aec6ca89ed337" },
+    { L"u20", 2147, L"f2826be203e767d09ff0d7677e1cf5b13113b773d529166dae02a1f5db2dc58e0856a34901df70011ebabb6e964fab7acf38590e650bd629d4e4dc4cb36c8d45" },
+    { L"u21", 2880, L"5e87ee3838e3595adbd7eaba6e3e33cdfea5e15ed716fbccdbd55235b3e53e1e41ea5a907f425e96c35167543c7f75ac5214b5aee177d299fc2464a68b22851e" },
+    { L"u22", 2334, L"310c85b27e1ecf4c6729e88051037150cfba0234a0138666c26662b3d665ff38b74e95abcaddeef6cbebb23e3357fac487e6ee5eb8fe158c269d77672191b042" },
+    { L"u23", 2132, L"9e4ba81a145574818dd6a1f1d0ec38ea1629c7771919c35923f440e31ea9912e1630d94fcdb82b71104ebd61d0321dcdf935ba20d69988ee6e9b22259186af0c" },
+    { L"u24", 2303, L"8bdcf7533a6bcfa231b42a7ef845a70c7535fbf607d62ff6404928d5941ba6afbf139450a1a1b58c65facf88dc0785aec4abefbcc803466a58b1930f7c468cdd" },
+    { L"u25", 2200, L"640a79d6a756e591ad02ddccc53bc43f855c5148b8cbb5ce6c1caf5419ca02f7b2aff89cca4c056356814d3899ef79bf038b4e8b4b79eb85138a3cedcce93e5b" },
+    { L"u26", 1980, L"0f1d7bc4fd64e18eeec488cdce01fb6bfa5cd3bff614a8d03e388d39f569b8341e74302946877eb25ba1eb17aec137499189605e251fafb6b20051744cb463b1" },
+    { L"u27", 2211, L"88275c1136ffb15ab04d315e8601be2de77387f3e00f17e9807e415a9dfc4a73e2cd3b5710e4ca58006f91e18180d7cfaeef4e8319c624e1b81397f9cb9eca92" },
+    { L"u28", 2400, L"77e6dd332104c0461b7c5a08469161af3f1dc51d3b55585d39dd9fc9e2088da036bdf2278cfb96ca702fd26ce073c6c6f66611313270700b9e7a76600c1c8e38" },
+    { L"u29", 858, L"dec41c46078c8bde6c1690cdaab65ea9025a5a7bad84a1d56d18ef373189eed7b4cf942f85386567aed4c860b366dbbb55a4945e104e3d1bf852b9d91bb11677" },
+    { L"u30", 86016, L"af579e6550f4cba09e586485d9e76b35c241f33de751633aa3a235ccf98c4bca500d1993cd97a92abba8f14e27d9c91705446549cadfa087b054f87a89ed22ca" },
+    { L"u31", 3369, L"9b855456b16da9460074d6d58088bd5725aa78d96025c0c74efadd1240c6e1b374b4050f395287707fff056d2aabe94bd799cdde5e944c6faa68726ca9780535" },
+    { L"u32", 15766, L"896273948c3278c1999bc833ce07249346192d7525310ad0505c4dae0fb312cea6bd827a281c97378b636c678a00f94d4f2a3cb3786d99120caf397e33669a26" },
+};
+
+// An MSI's cabinet whose single LZX block is stored uncompressed.
+static const CAB_READER_TEST_FILE vrgLzxUncompressedFiles[] =
+{
+    { L"filcV1yrx0x8wJWj4qMzcH21jwkPko", 17, L"07cc1474600a3fd2b959733d2a8ffc82e91c925f299014853e4c583f1c23f7641595a11a9ce081db4b6a68911e4fb86f7b8086b8b6b064b938028b6ebdb5e665" },
+};
+
+// Two stored folders, the middle file of the first one spans whole data blocks. The empty file
+// that follows it is followed by a file inside those blocks.
+static const CAB_READER_TEST_FILE vrgStoredFiles[] =
+{
+    { L"first.txt", 20000, L"d1be41a7d92d972f776c714532b56700ee8741734d639ecf519d5737c9960df1e79b992412b288eb17d1276400b7489a6226d9ecc5582270f10db50b6f9c8424" },
+    { L"middle.txt", 50000, L"77a035af78325e1b8dd711baa29357fda20368f34c04439c82828c00984c8a06c8da1cae9e5404432e3634cc9ec0442373d751157ab87359b9bbd7f7f273b9b6" },
+    { L"empty.txt", 0, L"cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+    { L"again.txt", 100, L"837c603c477fc15a9a2d3fb464ab74bcbcf33c0812de1e19ea12fe0007d039886fb1a20aff392912eae6d3c4b7fdf13b699f648afa94107cba326ded46967670" },
+    { L"last.txt", 10, L"912c86a267b7c3387b3bc36a0a93f066af31a5056c35dfa6afd6ad781482cfc48286e32179a6143889fd29d58f3dc16b155ad1a5a532ef88974b017c20a52d74" },
+    { L"other.txt", 3000, L"524670c13f1b531ab428d5447ceb961d72790b32dcca5dd139a3a872ad3eff67d2f3ad8d05e0efb6a4a08ecc762cd7cc1b3146ce31f8a7bf39a843e9aded97f0" },
+};
+
+typedef struct _CAB_READER_TEST_SOURCE
+{
+    HANDLE hFile;
+    DWORD64 qwAvailable;    // reads past this fail as if the cabinet was truncated.
+    DWORD64 qwCorrupt;      // offset of the byte that is flipped, or -1.
+    DWORD64* rgqwChecksums; // offsets of CFDATA checksums that are zeroed so the corruption reaches the decoder.
+    DWORD cChecksums;
+} CAB_READER_TEST_SOURCE;
+
+static HRESULT CALLBACK CabReaderTestRead(
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) BYTE* pbBuffer,
+    __in DWORD cbBuffer,
+    __in_opt LPVOID pvContext
+    );
+static HRESULT CALLBACK CabReaderTestWrite(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+static HRESULT CALLBACK CabReaderTestCount(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+
+namespace WixToolset
+{
+namespace Test
+{
+namespace Bootstrapper
+{
+    using namespace System;
+    using namespace System::IO;
+    using namespace Xunit;
+
+    public ref class CabReaderTest : BurnUnitTest
+    {
+    public:
+        CabReaderTest(BurnTestFixture^ fixture) : BurnUnitTest(fixture)
+        {
+        }
+
+        [Fact]
+        void CabReaderMsZipTest()
+        {
+            VerifyCabinet(L"TestData\\CabReaderTest\\MsZip.cab", vrgMsZipFiles, countof(vrgMsZipFiles), 0);
+        }
+
+        [Fact]
+        void CabReaderLzxTest()
+        {
+            VerifyCabinet(L"TestData\\CabReaderTest\\Lzx.cab", vrgLzxFiles, countof(vrgLzxFiles), 0);
+        }
+
+        [Fact]
+        void CabReaderLzxLargeTest()
+        {
+            VerifyCabinet(L"TestData\\CabReaderTest\\LzxLarge.cab", vrgLzxLargeFiles, countof(vrgLzxLargeFiles), 0);
+        }
+
+        [Fact]
+        void CabReaderLzxUncompressedTest()
+        {
+            VerifyCabinet(L"TestData\\CabReaderTest\\LzxUncompressed.cab", vrgLzxUncompressedFiles, countof(vrgLzxUncompressedFiles), 0);
+        }
+
+        [Fact]
+        void CabReaderSkipTest()
+        {
+            // Skipped files still have to be decoded up to the next file read from the same folder.
+            VerifyCabinet(L"TestData\\CabReaderTest\\MsZip.cab", vrgMsZipFiles, countof(vrgMsZipFiles), 0x0A);
+            VerifyCabinet(L"TestData\\CabReaderTest\\MsZip.cab", vrgMsZipFiles, countof(vrgMsZipFiles), 0x04);
+            VerifyCabinet(L"TestData\\CabReaderTest\\Lzx.cab", vrgLzxFiles, countof(vrgLzxFiles), 0x0A);
+
+            // Skipping the PE files decodes blocks that reach back past the start of the window.
+            VerifyCabinet(L"TestData\\CabReaderTest\\LzxLarge.cab", vrgLzxLargeFiles, countof(vrgLzxLargeFiles), 0x0E);
+            VerifyCabinet(L"TestData\\CabReaderTest\\LzxLarge.cab", vrgLzxLargeFiles, countof(vrgLzxLargeFiles), 0x1FFFFFFFEull);
+        }
+
+        [Fact]
+        void CabReaderStoredSkipTest()
+        {
+            // Skipped stored blocks are stepped over without being read, a later file inside them restarts the folder.
+            VerifyCabinet(L"TestData\\CabReaderTest\\Stored.cab", vrgStoredFiles, countof(vrgStoredFiles), 0);
+            VerifyCabinet(L"TestData\\CabReaderTest\\Stored.cab", vrgStoredFiles, countof(vrgStoredFiles), 0x02);
+            VerifyCabinet(L"TestData\\CabReaderTest\\Stored.cab", vrgStoredFiles, countof(vrgStoredFiles), 0x14);
+        }
+
+        [Fact]
+        void CabReaderTruncatedTest()
+        {
+            VerifyTruncatedCabinet(L"TestData\\CabReaderTest\\MsZip.cab");
+            VerifyTruncatedCabinet(L"TestData\\CabReaderTest\\Lzx.cab");
+            VerifyTruncatedCabinet(L"TestData\\CabReaderTest\\LzxLarge.cab");
+            VerifyTruncatedCabinet(L"TestData\\CabReaderTest\\LzxUncompressed.cab");
+            VerifyTruncatedCabinet(L"TestData\\CabReaderTest\\Stored.cab");
+        }
+
+        [Fact]
+        void CabReaderCorruptTest()
+        {
+            VerifyCorruptCabinet(L"TestData\\CabReaderTest\\MsZip.cab");
+            VerifyCorruptCabinet(L"TestData\\CabReaderTest\\Lzx.cab");
+            VerifyCorruptCabinet(L"TestData\\CabReaderTest\\LzxLarge.cab");
+            VerifyCorruptCabinet(L"TestData\\CabReaderTest\\LzxUncompressed.cab");
+            VerifyCorruptCabinet(L"TestData\\CabReaderTest\\Stored.cab");
+        }
+
+    private:
+        void VerifyTruncatedCabinet(LPCWSTR wzCabinet)
+        {
+            CAB_READER_TEST_SOURCE source = { INVALID_HANDLE_VALUE };
+            DWORD64 qwSize = 0;
+
+            try
+            {
+                OpenTestCabinet(wzCabinet, &source, &qwSize);
+
+                // The cabinet claims its full size but every read past the cut fails.
+                for (DWORD64 qwAvailable = 0; qwAvailable < qwSize; qwAvailable += TestStride(qwSize))
+                {
+                    source.qwAvailable = qwAvailable;
+
+                    HRESULT hr = ReadCorruptCabinet(&source, qwSize);
+                    Assert::Equal(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), hr);
+                }
+            }
+            finally
+            {
+                ReleaseFileHandle(source.hFile);
+            }
+        }
+
+        void VerifyCorruptCabinet(LPCWSTR wzCabinet)
+        {
+            HRESULT hr = S_OK;
+            CAB_READER_TEST_SOURCE source = { INVALID_HANDLE_VALUE };
+            DWORD64 qwSize = 0;
+            CAB_READER reader = { };
+            DWORD64 qwDataStart = 0;
+            DWORD cChecksums = 0;
+            BYTE rgbHeader[8] = { };
+
+            try
+            {
+                OpenTestCabinet(wzCabinet, &source, &qwSize);
+
+                hr = CabReaderOpen(&reader, CabReaderTestRead, &source, qwSize);
+                NativeAssert::Succeeded(hr, "Failed to open cabinet: {0}", wzCabinet);
+
+                qwDataStart = qwSize;
+
+                for (DWORD i = 0; i < reader.cFolders; ++i)
+                {
+                    const CAB_READER_FOLDER* pFolder = reader.rgFolders + i;
+                    DWORD64 qwData = pFolder->dwDataOffset;
+
+                    qwDataStart = min(qwDataStart, qwData);
+
+                    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&source.rgqwChecksums), cChecksums + pFolder->cData, sizeof(DWORD64), 16);
+                    NativeAssert::Succeeded(hr, "Failed to grow checksum offsets.");
+
+                    for (DWORD iData = 0; iData < pFolder->cData; ++iData)
+                    {
+                        hr = CabReaderTestRead(qwData, rgbHeader, sizeof(rgbHeader), &source);
+                        NativeAssert::Succeeded(hr, "Failed to read data block header.");
+
+                        source.rgqwChecksums[cChecksums] = qwData;
+                        ++cChecksums;
+
+                        qwData += sizeof(rgbHeader) + reader.cbDataReserve + MAKEWORD(rgbHeader[4], rgbHeader[5]);
+                    }
+                }
+
+                CabReaderClose(&reader);
+
+                // Flipped bytes anywhere must not make the reader write more than a file holds.
+                for (DWORD64 qwCorrupt = 0; qwCorrupt < qwSize; qwCorrupt += TestStride(qwSize))
+                {
+                    source.qwCorrupt = qwCorrupt;
+
+                    ReadCorruptCabinet(&source, qwSize);
+                }
+
+                // Flipped compressed data fails the checksum of its block, a flipped block size may fail before that.
+                for (DWORD64 qwCorrupt = qwDataStart; qwCorrupt < qwSize; qwCorrupt += TestStride(qwSize - qwDataStart))
+                {
+                    BOOL fHeader = FALSE;
+
+                    for (DWORD i = 0; !fHeader && i < cChecksums; ++i)
+                    {
+                        fHeader = qwCorrupt >= source.rgqwChecksums[i] && qwCorrupt < source.rgqwChecksums[i] + sizeof(rgbHeader);
+                    }
+
+                    source.qwCorrupt = qwCorrupt;
+
+                    hr = ReadCorruptCabinet(&source, qwSize);
+                    if (fHeader)
+                    {
+                        Assert::True(FAILED(hr));
+                    }
+                    else
+                    {
+                        Assert::Equal(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT), hr);
+                    }
+                }
+
+                // Without checksums the decoder sees the corruption, it may fail or produce wrong data but never too much.
+                for (DWORD64 qwCorrupt = qwDataStart; qwCorrupt < qwSize; qwCorrupt += TestStride(qwSize - qwDataStart))
+                {
+                    source.qwCorrupt = qwCorrupt;
+                    source.cChecksums = cChecksums;
+
+                    ReadCorruptCabinet(&source, qwSize);
+                }
+            }
+            finally
+            {
+                CabReaderClose(&reader);
+                ReleaseMem(source.rgqwChecksums);
+                ReleaseFileHandle(source.hFile);
+            }
+        }
+
+        HRESULT ReadCorruptCabinet(CAB_READER_TEST_SOURCE* pSource, DWORD64 qwSize)
+        {
+            HRESULT hr = S_OK;
+            CAB_READER reader = { };
+            const CAB_READER_FILE* pFile = NULL;
+            DWORD64 qwWritten = 0;
+
+            try
+            {
+                hr = CabReaderOpen(&reader, CabReaderTestRead, pSource, qwSize);
+
+                while (SUCCEEDED(hr) && S_OK == (hr = CabReaderNextFile(&reader, &pFile)))
+                {
+                    qwWritten = 0;
+
+                    hr = CabReaderReadFile(&reader, CabReaderTestCount, &qwWritten);
+                    Assert::True(qwWritten <= pFile->cbFile, "Wrote past the end of the file.");
+                    Assert::True(FAILED(hr) || qwWritten == pFile->cbFile, "Succeeded without writing the whole file.");
+                }
+            }
+            finally
+            {
+                CabReaderClose(&reader);
+            }
+
+            return E_NOMOREITEMS == hr ? S_OK : hr;
+        }
+
+        void OpenTestCabinet(LPCWSTR wzCabinet, CAB_READER_TEST_SOURCE* pSource, DWORD64* pqwSize)
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczPath = NULL;
+            LARGE_INTEGER liSize = { };
+
+            try
+            {
+                pin_ptr<const wchar_t> dataDirectory = PtrToStringChars(this->TestContext->TestDirectory);
+                hr = PathConcat(dataDirectory, wzCabinet, &sczPath);
+                NativeAssert::Succeeded(hr, "Failed to get path to test cabinet.");
+
+                pSource->hFile = ::CreateFileW(sczPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                Assert::True(INVALID_HANDLE_VALUE != pSource->hFile);
+                Assert::True(::GetFileSizeEx(pSource->hFile, &liSize));
+
+                pSource->qwAvailable = liSize.QuadPart;
+                pSource->qwCorrupt = static_cast<DWORD64>(-1);
+                *pqwSize = liSize.QuadPart;
+            }
+            finally
+            {
+                ReleaseStr(sczPath);
+            }
+        }
+
+        // Roughly 250 cuts or flips per cabinet keeps the larger cabinets fast.
+        static DWORD64 TestStride(DWORD64 qwRange)
+        {
+            return max(1, qwRange / 250);
+        }
+
+        void VerifyCabinet(LPCWSTR wzCabinet, const CAB_READER_TEST_FILE* rgExpected, DWORD cExpected, DWORD64 qwSkipMask)
+        {
+            HRESULT hr = S_OK;
+            CAB_READER_TEST_SOURCE source = { INVALID_HANDLE_VALUE };
+            DWORD64 qwSize = 0;
+            CAB_READER reader = { };
+            const CAB_READER_FILE* pFile = NULL;
+            CRYP_HASH_HANDLE hHash = NULL;
+            BYTE rgbHash[64] = { };
+            BYTE* pbExpectedHash = NULL;
+            DWORD cbExpectedHash = 0;
+            DWORD64 qwHashed = 0;
+            DWORD cFiles = 0;
+
+            try
+            {
+                OpenTestCabinet(wzCabinet, &source, &qwSize);
+
+                hr = CabReaderOpen(&reader, CabReaderTestRead, &source, qwSize);
+                NativeAssert::Succeeded(hr, "Failed to open cabinet: {0}", wzCabinet);
+
+                while (S_OK == (hr = CabReaderNextFile(&reader, &pFile)))
+                {
+                    Assert::True(cFiles < cExpected);
+
+                    const CAB_READER_TEST_FILE* pExpected = rgExpected + cFiles;
+                    DWORD64 qwFileBit = 1ull << cFiles;
+                    ++cFiles;
+
+                    NativeAssert::StringEqual(pExpected->wzName, pFile->sczName);
+                    Assert::Equal<DWORD>(pExpected->cbFile, pFile->cbFile);
+
+                    // Each set bit of the mask skips the file at that index.
+                    if (qwSkipMask & qwFileBit)
+                    {
+                        continue;
+                    }
+
+                    hr = CrypHashCreate(PROV_RSA_AES, CALG_SHA_512, &hHash);
+                    NativeAssert::Succeeded(hr, "Failed to create hash.");
+
+                    hr = CabReaderReadFile(&reader, CabReaderTestWrite, hHash);
+                    NativeAssert::Succeeded(hr, "Failed to read file: {0}", pExpected->wzName);
+
+                    hr = CrypHashGetValue(hHash, rgbHash, sizeof(rgbHash), &qwHashed);
+                    NativeAssert::Succeeded(hr, "Failed to get hash value.");
+                    Assert::Equal<DWORD64>(pExpected->cbFile, qwHashed);
+
+                    hr = StrAllocHexDecode(pExpected->wzHash, &pbExpectedHash, &cbExpectedHash);
+                    NativeAssert::Succeeded(hr, "Failed to decode expected hash.");
+                    Assert::Equal<DWORD>(sizeof(rgbHash), cbExpectedHash);
+                    Assert::True(0 == memcmp(pbExpectedHash, rgbHash, sizeof(rgbHash)), "Hash mismatch.");
+
+                    ReleaseNullMem(pbExpectedHash);
+                    ReleaseNullCrypHash(hHash);
+                }
+
+                Assert::Equal(E_NOMOREITEMS, hr);
+                Assert::Equal<DWORD>(cExpected, cFiles);
+            }
+            finally
+            {
+                ReleaseMem(pbExpectedHash);
+                ReleaseCrypHash(hHash);
+                CabReaderClose(&reader);
+                ReleaseFileHandle(source.hFile);
+            }
+        }
+    };
+}
+}
+}
+
+static HRESULT CALLBACK CabReaderTestRead(
+    __in DWORD64 qwOffset,
+    __out_bcount(cbBuffer) BYTE* pbBuffer,
+    __in DWORD cbBuffer,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    CAB_READER_TEST_SOURCE* pSource = static_cast<CAB_READER_TEST_SOURCE*>(pvContext);
+    ULARGE_INTEGER uliOffset = { };
+    OVERLAPPED overlapped = { };
+    DWORD cbRead = 0;
+
+    if (qwOffset > pSource->qwAvailable || cbBuffer > pSource->qwAvailable - qwOffset)
+    {
+        ExitFunction1(hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+    }
+
+    uliOffset.QuadPart = qwOffset;
+    overlapped.Offset = uliOffset.LowPart;
+    overlapped.OffsetHigh = uliOffset.HighPart;
+
+    if (!::ReadFile(pSource->hFile, pbBuffer, cbBuffer, &cbRead, &overlapped))
+    {
+        ExitFunction1(hr = HRESULT_FROM_WIN32(::GetLastError()));
+    }
+    else if (cbRead != cbBuffer)
+    {
+        ExitFunction1(hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+    }
+
+    if (pSource->qwCorrupt >= qwOffset && pSource->qwCorrupt < qwOffset + cbBuffer)
+    {
+        pbBuffer[pSource->qwCorrupt - qwOffset] ^= 0x10;
+    }
+
+    for (DWORD i = 0; i < pSource->cChecksums; ++i)
+    {
+        for (DWORD64 qw = pSource->rgqwChecksums[i]; qw < pSource->rgqwChecksums[i] + sizeof(DWORD); ++qw)
+        {
+            if (qw >= qwOffset && qw < qwOffset + cbBuffer)
+            {
+                pbBuffer[qw - qwOffset] = 0;
+            }
+        }
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT CALLBACK CabReaderTestWrite(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    return CrypHashUpdate(static_cast<CRYP_HASH_HANDLE>(pvContext), pbData, cbData);
+}
+
+static HRESULT CALLBACK CabReaderTestCount(
+    __in_bcount(cbData) const BYTE* /*pbData*/,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    *static_cast<DWORD64*>(pvContext) += cbData;
+
+    return S_OK;
+}
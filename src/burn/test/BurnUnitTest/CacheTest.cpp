@@ -19,6 +19,14 @@ static DWORD CALLBACK CacheTestProgressRoutine(
     __in_opt LPVOID lpData
     );
 
+static HRESULT CreateTestCertificate(
+    __in HCRYPTPROV hProv,
+    __in_z LPCWSTR wzSubject,
+    __in_opt SYSTEMTIME* pStartTime,
+    __in_opt SYSTEMTIME* pEndTime,
+    __out PCCERT_CONTEXT* ppCertContext
+    );
+
 typedef struct _CACHE_TEST_CONTEXT
 {
 } CACHE_TEST_CONTEXT;
@@ -184,6 +192,534 @@ namespace Bootstrapper
                 CacheUninitialize(&cache);
             }
         }
+
+        [Fact]
+        void CacheVerifiedSignerTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_CACHE cache = { };
+            BURN_PAYLOAD payload = { };
+            BURN_PAYLOAD otherRootPayload = { };
+            BYTE rgbRootPublicKeyIdentifier[SHA1_HASH_LEN] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20 };
+            BYTE rgbOtherRootPublicKeyIdentifier[SHA1_HASH_LEN] = { 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+            HCRYPTPROV hProv = NULL;
+            HCRYPTKEY hKey = NULL;
+            PCCERT_CONTEXT pSignerCert = NULL;
+            PCCERT_CONTEXT pOtherSignerCert = NULL;
+            PCCERT_CONTEXT pExpiredSignerCert = NULL;
+            SYSTEMTIME stExpiredStart = { 2000, 1, 0, 1 };
+            SYSTEMTIME stExpiredEnd = { 2001, 1, 0, 1 };
+
+            try
+            {
+                payload.pbCertificateRootPublicKeyIdentifier = rgbRootPublicKeyIdentifier;
+                payload.cbCertificateRootPublicKeyIdentifier = sizeof(rgbRootPublicKeyIdentifier);
+                otherRootPayload.pbCertificateRootPublicKeyIdentifier = rgbOtherRootPublicKeyIdentifier;
+                otherRootPayload.cbCertificateRootPublicKeyIdentifier = sizeof(rgbOtherRootPublicKeyIdentifier);
+
+                // Self-signed certificates with an in-memory key stand in for the signers of payloads.
+                Assert::True(::CryptAcquireContextW(&hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT));
+                Assert::True(::CryptGenKey(hProv, AT_SIGNATURE, 2048 << 16, &hKey));
+
+                hr = CreateTestCertificate(hProv, L"CN=Burn Cache Test Signer", NULL, NULL, &pSignerCert);
+                NativeAssert::Succeeded(hr, "Failed to create signer certificate.");
+
+                hr = CreateTestCertificate(hProv, L"CN=Burn Cache Test Other Signer", NULL, NULL, &pOtherSignerCert);
+                NativeAssert::Succeeded(hr, "Failed to create other signer certificate.");
+
+                hr = CreateTestCertificate(hProv, L"CN=Burn Cache Test Signer", &stExpiredStart, &stExpiredEnd, &pExpiredSignerCert);
+                NativeAssert::Succeeded(hr, "Failed to create expired signer certificate.");
+
+                // Nothing is reused before a chain was verified.
+                Assert::False(CacheIsVerifiedSigner(&cache, &payload, pSignerCert));
+
+                hr = CacheRecordVerifiedSigner(&cache, &payload, pSignerCert);
+                NativeAssert::Succeeded(hr, "Failed to record verified signer.");
+                Assert::Equal<DWORD>(1, cache.cVerifiedSigners);
+
+                hr = CacheRecordVerifiedSigner(&cache, &payload, pSignerCert);
+                NativeAssert::Succeeded(hr, "Failed to record verified signer again.");
+                Assert::Equal<DWORD>(1, cache.cVerifiedSigners);
+
+                Assert::True(CacheIsVerifiedSigner(&cache, &payload, pSignerCert));
+
+                // A different signer, or the same signer with different expectations, gets the full verification.
+                Assert::False(CacheIsVerifiedSigner(&cache, &payload, pOtherSignerCert));
+                Assert::False(CacheIsVerifiedSigner(&cache, &otherRootPayload, pSignerCert));
+
+                // An expired certificate gets the full verification even when its chain was verified before,
+                // since only the full verification looks at the timestamp of the file.
+                hr = CacheRecordVerifiedSigner(&cache, &payload, pExpiredSignerCert);
+                NativeAssert::Succeeded(hr, "Failed to record expired verified signer.");
+                Assert::Equal<DWORD>(2, cache.cVerifiedSigners);
+
+                Assert::False(CacheIsVerifiedSigner(&cache, &payload, pExpiredSignerCert));
+                Assert::Equal<DWORD>(0, cache.cVerifiedSignerHits);
+            }
+            finally
+            {
+                if (pExpiredSignerCert)
+                {
+                    ::CertFreeCertificateContext(pExpiredSignerCert);
+                }
+
+                if (pOtherSignerCert)
+                {
+                    ::CertFreeCertificateContext(pOtherSignerCert);
+                }
+
+                if (pSignerCert)
+                {
+                    ::CertFreeCertificateContext(pSignerCert);
+                }
+
+                if (hKey)
+                {
+                    ::CryptDestroyKey(hKey);
+                }
+
+                if (hProv)
+                {
+                    ::CryptReleaseContext(hProv, 0);
+                }
+
+                ReleaseMem(cache.rgVerifiedSigners);
+            }
+        }
+
+        [Fact]
+        void CacheVerifiedIndexTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_CACHE cache = { };
+            BURN_ENGINE_COMMAND internalCommand = { };
+            BURN_PACKAGE package = { };
+            BURN_PAYLOAD payload = { };
+            LPWSTR sczPayloadPath = NULL;
+            LPWSTR sczCacheFolder = NULL;
+            LPWSTR sczCachedPath = NULL;
+            LPWSTR sczStoreFolder = NULL;
+            LPWSTR sczStorePath = NULL;
+            BYTE* pb = NULL;
+            DWORD cb = NULL;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            FILETIME ftLastWrite = { };
+            HKEY hkBurnPolicy = NULL;
+            CACHE_TEST_CONTEXT context = { };
+
+            try
+            {
+                this->testRegistry->SetUp();
+
+                pin_ptr<const wchar_t> dataDirectory = PtrToStringChars(this->TestContext->TestDirectory);
+                hr = PathConcat(dataDirectory, L"TestData\\CacheTest\\CacheSignatureTest.File", &sczPayloadPath);
+                Assert::True(S_OK == hr, "Failed to get path to test file.");
+
+                hr = StrAllocHexDecode(L"25e61cd83485062b70713aebddd3fe4992826cb121466fddc8de3eacb1e42f39d4bdd8455d95eec8c9529ced4c0296ab861931fe2c86df2f2b4e8d259a6d9223", &pb, &cb);
+                Assert::Equal(S_OK, hr);
+
+                package.scope = BOOTSTRAPPER_PACKAGE_SCOPE_PER_USER;
+                package.sczCacheId = L"Bootstrapper.CacheTest.CacheVerifiedIndexTest";
+                payload.sczKey = L"CacheVerifiedIndexTest.PayloadKey";
+                payload.sczFilePath = L"CacheSignatureTest.File";
+                payload.pbHash = pb;
+                payload.cbHash = cb;
+                payload.qwFileSize = 27;
+                payload.verification = BURN_PAYLOAD_VERIFICATION_HASH;
+
+                hr = CacheInitialize(&cache, &internalCommand);
+                TestThrowOnFailure(hr, L"Failed initialize cache.");
+
+                // Caching the payload records it in the index.
+                hr = CacheCompletePayload(&cache, package.fPerMachine, &payload, package.sczCacheId, sczPayloadPath, FALSE, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+                Assert::True(cache.userVerifiedIndex.fLoaded);
+
+                hr = CacheGetCompletedPath(&cache, package.fPerMachine, package.sczCacheId, &sczCacheFolder);
+                NativeAssert::Succeeded(hr, "Failed to get completed path.");
+
+                // An unchanged payload is verified from the index.
+                DWORD cHits = cache.userVerifiedIndex.cHits;
+                hr = CacheVerifyPayload(&cache, package.fPerMachine, &payload, sczCacheFolder, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(cHits + 1, cache.userVerifiedIndex.cHits);
+
+                // A new last write time forces a rehash, which updates the index again.
+                hr = PathConcat(sczCacheFolder, payload.sczFilePath, &sczCachedPath);
+                NativeAssert::Succeeded(hr, "Failed to get cached path.");
+
+                hFile = ::CreateFileW(sczCachedPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                Assert::True(INVALID_HANDLE_VALUE != hFile);
+
+                ::GetSystemTimeAsFileTime(&ftLastWrite);
+                ftLastWrite.dwHighDateTime += 1;
+                Assert::True(::SetFileTime(hFile, NULL, NULL, &ftLastWrite));
+                ReleaseFileHandle(hFile);
+
+                hr = CacheVerifyPayload(&cache, package.fPerMachine, &payload, sczCacheFolder, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(cHits + 1, cache.userVerifiedIndex.cHits);
+
+                hr = CacheVerifyPayload(&cache, package.fPerMachine, &payload, sczCacheFolder, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(cHits + 2, cache.userVerifiedIndex.cHits);
+
+                // The index is only written once the apply is done.
+                Assert::True(cache.userVerifiedIndex.fDirty);
+                CacheSaveVerifiedIndexes(&cache);
+                Assert::False(cache.userVerifiedIndex.fDirty);
+
+                // Removing the package forgets its payload once the content store no longer links to it.
+                hr = CacheGetCompletedPath(&cache, package.fPerMachine, L".content", &sczStoreFolder);
+                NativeAssert::Succeeded(hr, "Failed to get content store path.");
+
+                hr = PathConcat(sczStoreFolder, L"25e61cd83485062b70713aebddd3fe4992826cb121466fddc8de3eacb1e42f39d4bdd8455d95eec8c9529ced4c0296ab861931fe2c86df2f2b4e8d259a6d9223", &sczStorePath);
+                NativeAssert::Succeeded(hr, "Failed to get content store path.");
+
+                FileEnsureDelete(sczStorePath);
+
+                DWORD cEntries = cache.userVerifiedIndex.cEntries;
+                hr = CacheRemovePackage(&cache, package.fPerMachine, package.sczCacheId, package.sczCacheId);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(cEntries - 1, cache.userVerifiedIndex.cEntries);
+                Assert::True(cache.userVerifiedIndex.fDirty);
+                Assert::True(cache.userVerifiedIndex.fPackageRemoved);
+
+                // Cache it again for the policy check below, the root is still in use so the index is kept.
+                hr = CacheCompletePayload(&cache, package.fPerMachine, &payload, package.sczCacheId, sczPayloadPath, FALSE, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+
+                CacheSaveVerifiedIndexes(&cache);
+                Assert::False(cache.userVerifiedIndex.fPackageRemoved);
+                Assert::False(cache.userVerifiedIndex.fDirty);
+                Assert::Equal<DWORD>(cEntries, cache.userVerifiedIndex.cEntries);
+
+                CacheUninitialize(&cache);
+
+                // Policy disables the index entirely.
+                hr = RegCreate(HKEY_LOCAL_MACHINE, L"SOFTWARE\\Policies\\WiX\\Burn", GENERIC_WRITE, &hkBurnPolicy);
+                NativeAssert::Succeeded(hr, "Failed to create Burn policy key.");
+
+                hr = RegWriteNumber(hkBurnPolicy, L"FullCacheVerification", 1);
+                NativeAssert::Succeeded(hr, "Failed to write FullCacheVerification Burn policy value.");
+
+                hr = CacheInitialize(&cache, &internalCommand);
+                TestThrowOnFailure(hr, L"Failed initialize cache.");
+                Assert::True(cache.fFullVerification);
+
+                hr = CacheVerifyPayload(&cache, package.fPerMachine, &payload, sczCacheFolder, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+                Assert::False(cache.userVerifiedIndex.fLoaded);
+            }
+            finally
+            {
+                ReleaseFileHandle(hFile);
+                ReleaseRegKey(hkBurnPolicy);
+                ReleaseMem(pb);
+                ReleaseStr(sczStorePath);
+                ReleaseStr(sczStoreFolder);
+                ReleaseStr(sczCachedPath);
+                ReleaseStr(sczCacheFolder);
+                ReleaseStr(sczPayloadPath);
+
+                String^ filePath = Path::Combine(Environment::GetFolderPath(Environment::SpecialFolder::LocalApplicationData), "Package Cache\\Bootstrapper.CacheTest.CacheVerifiedIndexTest\\CacheSignatureTest.File");
+                if (File::Exists(filePath))
+                {
+                    File::SetAttributes(filePath, FileAttributes::Normal);
+                    File::Delete(filePath);
+                }
+
+                CacheUninitialize(&cache);
+
+                this->testRegistry->TearDown();
+            }
+        }
+
+        [Fact]
+        void CacheQueuePayloadHashTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_CACHE cache = { };
+            BURN_ENGINE_COMMAND internalCommand = { };
+            BURN_PACKAGE package = { };
+            BURN_PAYLOAD payload = { };
+            LPWSTR sczSourcePath = NULL;
+            LPWSTR sczWorkingPath = NULL;
+            BYTE* pb = NULL;
+            DWORD cb = NULL;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            CACHE_TEST_CONTEXT context = { };
+
+            try
+            {
+                pin_ptr<const wchar_t> dataDirectory = PtrToStringChars(this->TestContext->TestDirectory);
+                hr = PathConcat(dataDirectory, L"TestData\\CacheTest\\CacheSignatureTest.File", &sczSourcePath);
+                Assert::True(S_OK == hr, "Failed to get path to test file.");
+
+                hr = PathConcat(dataDirectory, L"CacheQueuePayloadHashTest.File", &sczWorkingPath);
+                Assert::True(S_OK == hr, "Failed to get working path.");
+
+                Assert::True(::CopyFileW(sczSourcePath, sczWorkingPath, FALSE));
+
+                hr = StrAllocHexDecode(L"25e61cd83485062b70713aebddd3fe4992826cb121466fddc8de3eacb1e42f39d4bdd8455d95eec8c9529ced4c0296ab861931fe2c86df2f2b4e8d259a6d9223", &pb, &cb);
+                Assert::Equal(S_OK, hr);
+
+                package.scope = BOOTSTRAPPER_PACKAGE_SCOPE_PER_USER;
+                package.sczCacheId = L"Bootstrapper.CacheTest.CacheQueuePayloadHashTest";
+                payload.sczKey = L"CacheQueuePayloadHashTest.PayloadKey";
+                payload.sczFilePath = L"CacheSignatureTest.File";
+                payload.pbHash = pb;
+                payload.cbHash = cb;
+                payload.qwFileSize = 27;
+                payload.verification = BURN_PAYLOAD_VERIFICATION_HASH;
+
+                hr = CacheInitialize(&cache, &internalCommand);
+                TestThrowOnFailure(hr, L"Failed initialize cache.");
+
+                hr = CacheQueuePayloadHash(&cache, &payload, sczWorkingPath);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(1, cache.hashPool.cJobs);
+
+                // Queuing the same payload again replaces its job.
+                hr = CacheQueuePayloadHash(&cache, &payload, sczWorkingPath);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(1, cache.hashPool.cJobs);
+
+                // The queued file cannot be changed until the job is released.
+                hFile = ::CreateFileW(sczWorkingPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                DWORD dwError = ::GetLastError();
+                Assert::True(INVALID_HANDLE_VALUE == hFile);
+                Assert::Equal<DWORD>(ERROR_SHARING_VIOLATION, dwError);
+
+                // Completing the payload takes its job.
+                hr = CacheCompletePayload(&cache, package.fPerMachine, &payload, package.sczCacheId, sczWorkingPath, TRUE, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                Assert::Equal(S_OK, hr);
+                Assert::Equal<DWORD>(0, cache.hashPool.cJobs);
+
+                // Released jobs let go of their files.
+                Assert::True(::CopyFileW(sczSourcePath, sczWorkingPath, FALSE));
+
+                hr = CacheQueuePayloadHash(&cache, &payload, sczWorkingPath);
+                Assert::Equal(S_OK, hr);
+
+                CacheReleasePayloadHashes(&cache);
+                Assert::Equal<DWORD>(0, cache.hashPool.cJobs);
+
+                hFile = ::CreateFileW(sczWorkingPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                Assert::True(INVALID_HANDLE_VALUE != hFile);
+            }
+            finally
+            {
+                ReleaseFileHandle(hFile);
+                CacheUninitialize(&cache);
+
+                if (sczWorkingPath)
+                {
+                    ::DeleteFileW(sczWorkingPath);
+                }
+
+                ReleaseMem(pb);
+                ReleaseStr(sczWorkingPath);
+                ReleaseStr(sczSourcePath);
+
+                String^ filePath = Path::Combine(Environment::GetFolderPath(Environment::SpecialFolder::LocalApplicationData), "Package Cache\\Bootstrapper.CacheTest.CacheQueuePayloadHashTest\\CacheSignatureTest.File");
+                if (File::Exists(filePath))
+                {
+                    File::SetAttributes(filePath, FileAttributes::Normal);
+                    File::Delete(filePath);
+                }
+            }
+        }
+
+        [Fact]
+        void CacheContentStoreTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_CACHE cache = { };
+            BURN_ENGINE_COMMAND internalCommand = { };
+            BURN_PAYLOAD payload = { };
+            LPCWSTR rgwzCacheIds[] = { L"Bootstrapper.CacheTest.CacheContentStoreTest.First", L"Bootstrapper.CacheTest.CacheContentStoreTest.Second" };
+            LPWSTR rgsczCachedPaths[countof(rgwzCacheIds)] = { };
+            LPWSTR sczPayloadPath = NULL;
+            LPWSTR sczCacheFolder = NULL;
+            LPWSTR sczStoreFolder = NULL;
+            LPWSTR sczHash = NULL;
+            LPWSTR sczStorePath = NULL;
+            BYTE* pb = NULL;
+            DWORD cb = NULL;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            BY_HANDLE_FILE_INFORMATION rgFileInformation[countof(rgwzCacheIds)] = { };
+            CACHE_TEST_CONTEXT context = { };
+
+            try
+            {
+                pin_ptr<const wchar_t> dataDirectory = PtrToStringChars(this->TestContext->TestDirectory);
+                hr = PathConcat(dataDirectory, L"TestData\\CacheTest\\CacheSignatureTest.File", &sczPayloadPath);
+                Assert::True(S_OK == hr, "Failed to get path to test file.");
+
+                hr = StrAllocHexDecode(L"25e61cd83485062b70713aebddd3fe4992826cb121466fddc8de3eacb1e42f39d4bdd8455d95eec8c9529ced4c0296ab861931fe2c86df2f2b4e8d259a6d9223", &pb, &cb);
+                Assert::Equal(S_OK, hr);
+
+                payload.sczKey = L"CacheContentStoreTest.PayloadKey";
+                payload.sczFilePath = L"CacheSignatureTest.File";
+                payload.pbHash = pb;
+                payload.cbHash = cb;
+                payload.qwFileSize = 27;
+                payload.verification = BURN_PAYLOAD_VERIFICATION_HASH;
+
+                hr = CacheInitialize(&cache, &internalCommand);
+                TestThrowOnFailure(hr, L"Failed initialize cache.");
+
+                hr = CacheGetCompletedPath(&cache, FALSE, L".content", &sczStoreFolder);
+                NativeAssert::Succeeded(hr, "Failed to get content store folder.");
+
+                hr = StrAllocHexEncode(pb, cb, &sczHash);
+                NativeAssert::Succeeded(hr, "Failed to encode hash.");
+
+                hr = PathConcat(sczStoreFolder, sczHash, &sczStorePath);
+                NativeAssert::Succeeded(hr, "Failed to get content store path.");
+
+                // Both packages end up with the same file on disk.
+                for (DWORD i = 0; i < countof(rgwzCacheIds); ++i)
+                {
+                    hr = CacheCompletePayload(&cache, FALSE, &payload, rgwzCacheIds[i], sczPayloadPath, FALSE, CacheTestEventRoutine, CacheTestProgressRoutine, &context);
+                    Assert::Equal(S_OK, hr);
+                    Assert::True(FileExistsEx(sczStorePath, NULL));
+
+                    hr = CacheGetCompletedPath(&cache, FALSE, rgwzCacheIds[i], &sczCacheFolder);
+                    NativeAssert::Succeeded(hr, "Failed to get completed path.");
+
+                    hr = PathConcat(sczCacheFolder, payload.sczFilePath, &rgsczCachedPaths[i]);
+                    NativeAssert::Succeeded(hr, "Failed to get cached path.");
+
+                    hFile = ::CreateFileW(rgsczCachedPaths[i], FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                    Assert::True(INVALID_HANDLE_VALUE != hFile);
+                    Assert::True(::GetFileInformationByHandle(hFile, &rgFileInformation[i]));
+                    ReleaseFileHandle(hFile);
+                }
+
+                Assert::Equal<DWORD>(rgFileInformation[0].nFileIndexHigh, rgFileInformation[1].nFileIndexHigh);
+                Assert::Equal<DWORD>(rgFileInformation[0].nFileIndexLow, rgFileInformation[1].nFileIndexLow);
+                Assert::True(3 <= rgFileInformation[1].nNumberOfLinks);
+
+                // The store entry stays while any package still references it.
+                hr = CacheRemovePackage(&cache, FALSE, rgwzCacheIds[0], rgwzCacheIds[0]);
+                Assert::Equal(S_OK, hr);
+                Assert::False(FileExistsEx(rgsczCachedPaths[0], NULL));
+                Assert::True(FileExistsEx(sczStorePath, NULL));
+
+                hr = CacheRemovePackage(&cache, FALSE, rgwzCacheIds[1], rgwzCacheIds[1]);
+                Assert::Equal(S_OK, hr);
+
+                // Removed folders are deleted in the background, which is finished by uninitializing the cache.
+                CacheUninitialize(&cache);
+                Assert::False(FileExistsEx(sczStorePath, NULL));
+            }
+            finally
+            {
+                ReleaseFileHandle(hFile);
+
+                for (DWORD i = 0; i < countof(rgwzCacheIds); ++i)
+                {
+                    if (rgsczCachedPaths[i])
+                    {
+                        ::DeleteFileW(rgsczCachedPaths[i]);
+                    }
+
+                    ReleaseStr(rgsczCachedPaths[i]);
+                }
+
+                if (sczStorePath)
+                {
+                    ::DeleteFileW(sczStorePath);
+                }
+
+                ReleaseMem(pb);
+                ReleaseStr(sczStorePath);
+                ReleaseStr(sczHash);
+                ReleaseStr(sczStoreFolder);
+                ReleaseStr(sczCacheFolder);
+                ReleaseStr(sczPayloadPath);
+
+                CacheUninitialize(&cache);
+            }
+        }
+
+        [Fact]
+        void CacheDeletionQueueTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_CACHE cache = { };
+            BURN_ENGINE_COMMAND internalCommand = { };
+            LPCWSTR wzCacheId = L"Bootstrapper.CacheTest.CacheDeletionQueueTest";
+            LPWSTR sczCacheFolder = NULL;
+            LPWSTR sczTombstoneFolder = NULL;
+            LPWSTR sczStaleTombstone = NULL;
+            LPWSTR sczFile = NULL;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+
+            try
+            {
+                hr = CacheInitialize(&cache, &internalCommand);
+                TestThrowOnFailure(hr, L"Failed initialize cache.");
+
+                hr = CacheGetCompletedPath(&cache, FALSE, wzCacheId, &sczCacheFolder);
+                NativeAssert::Succeeded(hr, "Failed to get completed path.");
+
+                hr = CacheGetCompletedPath(&cache, FALSE, L".tombstones", &sczTombstoneFolder);
+                NativeAssert::Succeeded(hr, "Failed to get tombstone folder.");
+
+                hr = PathConcat(sczTombstoneFolder, L"CacheDeletionQueueTest.Stale", &sczStaleTombstone);
+                NativeAssert::Succeeded(hr, "Failed to get stale tombstone path.");
+
+                // A package folder, and a tombstone an earlier engine did not get to.
+                LPCWSTR rgwzFolders[] = { sczCacheFolder, sczStaleTombstone };
+                for (DWORD i = 0; i < countof(rgwzFolders); ++i)
+                {
+                    hr = DirEnsureExists(rgwzFolders[i], NULL);
+                    NativeAssert::Succeeded(hr, "Failed to create folder.");
+
+                    hr = PathConcat(rgwzFolders[i], L"CacheDeletionQueueTest.File", &sczFile);
+                    NativeAssert::Succeeded(hr, "Failed to get file path.");
+
+                    hFile = ::CreateFileW(sczFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+                    Assert::True(INVALID_HANDLE_VALUE != hFile);
+                    ReleaseFileHandle(hFile);
+                }
+
+                // The package folder is gone as soon as the removal returns.
+                hr = CacheRemovePackage(&cache, FALSE, wzCacheId, wzCacheId);
+                Assert::Equal(S_OK, hr);
+                Assert::False(DirExists(sczCacheFolder, NULL));
+                Assert::True(cache.deletionQueue.fInitialized);
+                Assert::True(cache.deletionQueue.fUserRecovered);
+
+                // Uninitializing waits for the queued and recovered tombstones to be deleted.
+                CacheUninitialize(&cache);
+                Assert::False(DirExists(sczStaleTombstone, NULL));
+            }
+            finally
+            {
+                ReleaseFileHandle(hFile);
+
+                if (sczStaleTombstone)
+                {
+                    DirEnsureDeleteEx(sczStaleTombstone, DIR_DELETE_FILES | DIR_DELETE_RECURSE);
+                }
+
+                if (sczCacheFolder)
+                {
+                    DirEnsureDeleteEx(sczCacheFolder, DIR_DELETE_FILES | DIR_DELETE_RECURSE);
+                }
+
+                ReleaseStr(sczFile);
+                ReleaseStr(sczStaleTombstone);
+                ReleaseStr(sczTombstoneFolder);
+                ReleaseStr(sczCacheFolder);
+
+                CacheUninitialize(&cache);
+            }
+        }
     };
 }
 }
@@ -211,3 +747,41 @@ static DWORD CALLBACK CacheTestProgressRoutine(
 {
     return PROGRESS_QUIET;
 }
+
+static HRESULT CreateTestCertificate(
+    __in HCRYPTPROV hProv,
+    __in_z LPCWSTR wzSubject,
+    __in_opt SYSTEMTIME* pStartTime,
+    __in_opt SYSTEMTIME* pEndTime,
+    __out PCCERT_CONTEXT* ppCertContext
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE* pbName = NULL;
+    DWORD cbName = 0;
+    CERT_NAME_BLOB subject = { };
+
+    if (!::CertStrToNameW(X509_ASN_ENCODING, wzSubject, CERT_X500_NAME_STR, NULL, NULL, &cbName, NULL))
+    {
+        ExitWithLastError(hr, "Failed to get size of certificate subject: %ls", wzSubject);
+    }
+
+    pbName = static_cast<BYTE*>(MemAlloc(cbName, TRUE));
+    ExitOnNull(pbName, hr, E_OUTOFMEMORY, "Failed to allocate certificate subject.");
+
+    if (!::CertStrToNameW(X509_ASN_ENCODING, wzSubject, CERT_X500_NAME_STR, NULL, pbName, &cbName, NULL))
+    {
+        ExitWithLastError(hr, "Failed to encode certificate subject: %ls", wzSubject);
+    }
+
+    subject.pbData = pbName;
+    subject.cbData = cbName;
+
+    *ppCertContext = ::CertCreateSelfSignCertificate(hProv, &subject, CERT_CREATE_SELFSIGN_NO_KEY_INFO, NULL, NULL, pStartTime, pEndTime, NULL);
+    ExitOnNullWithLastError(*ppCertContext, hr, "Failed to create self-signed certificate: %ls", wzSubject);
+
+LExit:
+    ReleaseMem(pbName);
+
+    return hr;
+}
@@ -84,6 +84,87 @@ namespace Bootstrapper
                 BurnPipeConnectionUninitialize(pConnection);
             }
         }
+
+        [Fact]
+        void ElevationVariableSyncTest()
+        {
+            HRESULT hr = S_OK;
+            BYTE* pbData = NULL;
+            SIZE_T cbData = 0;
+            SIZE_T iData = 0;
+            DWORD64 qwGeneration = 0;
+            BURN_VARIABLES parentVariables = { };
+            BURN_VARIABLES childVariables = { };
+
+            try
+            {
+                hr = VariableInitialize(&parentVariables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                hr = VariableInitialize(&childVariables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&parentVariables, L"ChangedByParent", L"parent", FALSE);
+                VariableSetStringHelper(&parentVariables, L"ChangedByChild", L"parent", FALSE);
+
+                // the first message sends everything
+                hr = VariableSerializeChanges(&parentVariables, &pbData, &cbData, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                hr = VariableDeserialize(&childVariables, FALSE, pbData, cbData, &iData);
+                TestThrowOnFailure(hr, L"Failed to deserialize variables.");
+
+                VariableCommitSerializedChanges(&parentVariables, qwGeneration);
+
+                // the elevated process changes a variable itself while the parent changes another one
+                VariableSetStringHelper(&childVariables, L"ChangedByChild", L"child", FALSE);
+                VariableSetStringHelper(&parentVariables, L"ChangedByParent", L"parent-changed", FALSE);
+
+                // the message carrying the change fails, so it is not committed
+                ReleaseNullMem(pbData);
+                cbData = 0;
+
+                hr = VariableSerializeChanges(&parentVariables, &pbData, &cbData, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize changed variables.");
+
+                // the next message sends the change again, and only what the parent changed
+                ReleaseNullMem(pbData);
+                cbData = 0;
+
+                hr = VariableSerializeChanges(&parentVariables, &pbData, &cbData, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize changed variables.");
+
+                iData = 0;
+                hr = VariableDeserialize(&childVariables, FALSE, pbData, cbData, &iData);
+                TestThrowOnFailure(hr, L"Failed to deserialize changed variables.");
+
+                VariableCommitSerializedChanges(&parentVariables, qwGeneration);
+
+                Assert::Equal<String^>(gcnew String(L"parent-changed"), VariableGetStringHelper(&childVariables, L"ChangedByParent"));
+                Assert::Equal<String^>(gcnew String(L"child"), VariableGetStringHelper(&childVariables, L"ChangedByChild"));
+
+                // a new elevated process gets everything again, including the parent's value of the child's change
+                VariableResetSerializedChanges(&parentVariables);
+
+                ReleaseNullMem(pbData);
+                cbData = 0;
+
+                hr = VariableSerializeChanges(&parentVariables, &pbData, &cbData, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                iData = 0;
+                hr = VariableDeserialize(&childVariables, FALSE, pbData, cbData, &iData);
+                TestThrowOnFailure(hr, L"Failed to deserialize variables.");
+
+                Assert::Equal<String^>(gcnew String(L"parent"), VariableGetStringHelper(&childVariables, L"ChangedByChild"));
+            }
+            finally
+            {
+                ReleaseMem(pbData);
+                VariablesUninitialize(&parentVariables);
+                VariablesUninitialize(&childVariables);
+            }
+        }
     };
 }
 }
@@ -0,0 +1,215 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+#include "precomp.h"
+
+// Layout of the engine file written by CreateTestEngine(), a DOS header, the NT headers,
+// one section header and the Burn section info.
+static const DWORD SECTION_TEST_NT_HEADERS_OFFSET = sizeof(IMAGE_DOS_HEADER);
+static const DWORD SECTION_TEST_SECTION_HEADER_OFFSET = SECTION_TEST_NT_HEADERS_OFFSET + sizeof(IMAGE_NT_HEADERS);
+static const DWORD SECTION_TEST_SECTION_INFO_OFFSET = SECTION_TEST_SECTION_HEADER_OFFSET + sizeof(IMAGE_SECTION_HEADER);
+static const DWORD SECTION_TEST_SECTION_INFO_SIZE = 64;
+static const DWORD SECTION_TEST_ENGINE_SIZE = SECTION_TEST_SECTION_INFO_OFFSET + SECTION_TEST_SECTION_INFO_SIZE;
+
+static void CreateTestEngine(
+    __out_bcount(SECTION_TEST_ENGINE_SIZE) BYTE* pbEngine
+    );
+static HRESULT ReadTestEngine(
+    __in_z LPCWSTR wzPath,
+    __in_bcount(cbEngine) const BYTE* pbEngine,
+    __in DWORD cbEngine,
+    __in BOOL fView
+    );
+
+namespace WixToolset
+{
+namespace Test
+{
+namespace Bootstrapper
+{
+    using namespace System;
+    using namespace System::IO;
+    using namespace Xunit;
+
+    public ref class SectionTest : BurnUnitTest
+    {
+    public:
+        SectionTest(BurnTestFixture^ fixture) : BurnUnitTest(fixture)
+        {
+        }
+
+        [Fact]
+        void SectionHeadersFromViewTest()
+        {
+            VerifyCorruptHeaders(TRUE);
+        }
+
+        [Fact]
+        void SectionHeadersFromHandleTest()
+        {
+            VerifyCorruptHeaders(FALSE);
+        }
+
+        [Fact]
+        void SectionUnmappableFileTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczPath = NULL;
+            BYTE rgbEngine[1] = { };
+
+            try
+            {
+                pin_ptr<const wchar_t> testDirectory = PtrToStringChars(this->TestContext->TestDirectory);
+                hr = PathConcat(testDirectory, L"SectionUnmappableFileTest.exe", &sczPath);
+                NativeAssert::Succeeded(hr, "Failed to get path to test engine.");
+
+                // An empty file cannot be mapped, so it is read through its handle.
+                hr = ReadTestEngine(sczPath, rgbEngine, 0, TRUE);
+                NativeAssert::SpecificReturnCode(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), hr, "Expected an empty engine file to fail at its end.");
+            }
+            finally
+            {
+                if (sczPath)
+                {
+                    FileEnsureDelete(sczPath);
+                }
+
+                ReleaseStr(sczPath);
+            }
+        }
+
+    private:
+        void VerifyCorruptHeaders(BOOL fView)
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczPath = NULL;
+            BYTE rgbEngine[SECTION_TEST_ENGINE_SIZE] = { };
+            PIMAGE_DOS_HEADER pDosHeader = reinterpret_cast<PIMAGE_DOS_HEADER>(rgbEngine);
+            PIMAGE_NT_HEADERS pNtHeaders = reinterpret_cast<PIMAGE_NT_HEADERS>(rgbEngine + SECTION_TEST_NT_HEADERS_OFFSET);
+            PIMAGE_SECTION_HEADER pSectionHeader = reinterpret_cast<PIMAGE_SECTION_HEADER>(rgbEngine + SECTION_TEST_SECTION_HEADER_OFFSET);
+
+            try
+            {
+                pin_ptr<const wchar_t> testDirectory = PtrToStringChars(this->TestContext->TestDirectory);
+                hr = PathConcat(testDirectory, fView ? L"SectionHeadersFromViewTest.exe" : L"SectionHeadersFromHandleTest.exe", &sczPath);
+                NativeAssert::Succeeded(hr, "Failed to get path to test engine.");
+
+                // The test host is not a bundle, so an intact engine gets all the way to comparing with the process' own section.
+                CreateTestEngine(rgbEngine);
+                hr = ReadTestEngine(sczPath, rgbEngine, sizeof(rgbEngine), fView);
+                NativeAssert::SpecificReturnCode(E_INVALIDDATA, hr, "Expected the intact engine to only fail to match the test host.");
+
+                // NT headers past the end, before the start, and cut off by the end of the file.
+                CreateTestEngine(rgbEngine);
+                pDosHeader->e_lfanew = sizeof(rgbEngine);
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(rgbEngine), fView, "e_lfanew past the end");
+
+                pDosHeader->e_lfanew = -1;
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(rgbEngine), fView, "negative e_lfanew");
+
+                pDosHeader->e_lfanew = sizeof(rgbEngine) - sizeof(DWORD);
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(rgbEngine), fView, "e_lfanew at the end");
+
+                // Section table past the end.
+                CreateTestEngine(rgbEngine);
+                pNtHeaders->FileHeader.SizeOfOptionalHeader = MAXWORD;
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(rgbEngine), fView, "SizeOfOptionalHeader too large");
+
+                // Section info past the end and cut off by the end of the file.
+                CreateTestEngine(rgbEngine);
+                pSectionHeader->PointerToRawData = MAXDWORD - SECTION_TEST_SECTION_INFO_SIZE;
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(rgbEngine), fView, "PointerToRawData past the end");
+
+                pSectionHeader->PointerToRawData = SECTION_TEST_SECTION_INFO_OFFSET + 1;
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(rgbEngine), fView, "PointerToRawData at the end");
+
+                // Files truncated in the middle of each header.
+                CreateTestEngine(rgbEngine);
+                VerifyEndOfFile(sczPath, rgbEngine, sizeof(IMAGE_DOS_HEADER) - 1, fView, "truncated DOS header");
+                VerifyEndOfFile(sczPath, rgbEngine, SECTION_TEST_NT_HEADERS_OFFSET + sizeof(IMAGE_FILE_HEADER), fView, "truncated NT headers");
+                VerifyEndOfFile(sczPath, rgbEngine, SECTION_TEST_SECTION_HEADER_OFFSET + 1, fView, "truncated section header");
+                VerifyEndOfFile(sczPath, rgbEngine, SECTION_TEST_ENGINE_SIZE - 1, fView, "truncated section info");
+            }
+            finally
+            {
+                if (sczPath)
+                {
+                    FileEnsureDelete(sczPath);
+                }
+
+                ReleaseStr(sczPath);
+            }
+        }
+
+        void VerifyEndOfFile(LPCWSTR wzPath, const BYTE* pbEngine, DWORD cbEngine, BOOL fView, LPCSTR szCase)
+        {
+            HRESULT hr = ReadTestEngine(wzPath, pbEngine, cbEngine, fView);
+            NativeAssert::SpecificReturnCode(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), hr, "Expected the end of the file for: {0}", szCase);
+        }
+    };
+}
+}
+}
+
+static void CreateTestEngine(
+    __out_bcount(SECTION_TEST_ENGINE_SIZE) BYTE* pbEngine
+    )
+{
+    PIMAGE_DOS_HEADER pDosHeader = reinterpret_cast<PIMAGE_DOS_HEADER>(pbEngine);
+    PIMAGE_NT_HEADERS pNtHeaders = reinterpret_cast<PIMAGE_NT_HEADERS>(pbEngine + SECTION_TEST_NT_HEADERS_OFFSET);
+    PIMAGE_SECTION_HEADER pSectionHeader = reinterpret_cast<PIMAGE_SECTION_HEADER>(pbEngine + SECTION_TEST_SECTION_HEADER_OFFSET);
+    DWORD* pdwSectionInfo = reinterpret_cast<DWORD*>(pbEngine + SECTION_TEST_SECTION_INFO_OFFSET);
+
+    memset(pbEngine, 0, SECTION_TEST_ENGINE_SIZE);
+
+    pDosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+    pDosHeader->e_lfanew = SECTION_TEST_NT_HEADERS_OFFSET;
+
+    pNtHeaders->Signature = IMAGE_NT_SIGNATURE;
+    pNtHeaders->FileHeader.NumberOfSections = 1;
+    pNtHeaders->FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER);
+
+    memcpy(pSectionHeader->Name, BURN_SECTION_NAME, sizeof(pSectionHeader->Name));
+    pSectionHeader->PointerToRawData = SECTION_TEST_SECTION_INFO_OFFSET;
+    pSectionHeader->SizeOfRawData = SECTION_TEST_SECTION_INFO_SIZE;
+
+    pdwSectionInfo[0] = BURN_SECTION_MAGIC;
+    pdwSectionInfo[1] = BURN_SECTION_VERSION;
+    pdwSectionInfo[11] = 1; // cContainers, just the UX container.
+}
+
+static HRESULT ReadTestEngine(
+    __in_z LPCWSTR wzPath,
+    __in_bcount(cbEngine) const BYTE* pbEngine,
+    __in DWORD cbEngine,
+    __in BOOL fView
+    )
+{
+    HRESULT hr = S_OK;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    BURN_SECTION section = { };
+
+    hr = FileWrite(wzPath, FILE_ATTRIBUTE_NORMAL, pbEngine, cbEngine, NULL);
+    ExitOnFailure(hr, "Failed to write test engine: %ls", wzPath);
+
+    hFile = ::CreateFileW(wzPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    ExitOnInvalidHandleWithLastError(hFile, hr, "Failed to open test engine: %ls", wzPath);
+
+    if (fView)
+    {
+        hr = SectionInitialize(&section, hFile, INVALID_HANDLE_VALUE);
+    }
+    else
+    {
+        // Without a view, everything is read through the handle.
+        section.hEngineFile = hFile;
+        section.hSourceEngineFile = hFile;
+
+        hr = SectionReadHeaders(&section);
+    }
+
+LExit:
+    SectionUninitialize(&section);
+    ReleaseFileHandle(hFile);
+
+    return hr;
+}
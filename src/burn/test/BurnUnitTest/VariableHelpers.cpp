@@ -128,6 +128,160 @@ namespace Bootstrapper
         }
     }
 
+    String^ VariableFormatStringObfuscatedHelper(BURN_VARIABLES* pVariables, LPCWSTR wzIn)
+    {
+        HRESULT hr = S_OK;
+        LPWSTR scz = NULL;
+        try
+        {
+            hr = VariableFormatStringObfuscated(pVariables, wzIn, &scz, NULL);
+            TestThrowOnFailure1(hr, L"Failed to format string: '%s'", wzIn);
+
+            return gcnew String(scz);
+        }
+        finally
+        {
+            ReleaseStr(scz);
+        }
+    }
+
+    // Formats the way the engine used to, by building a [n] format string and handing it to MsiFormatRecord.
+    String^ VariableFormatStringMsiHelper(BURN_VARIABLES* pVariables, LPCWSTR wzIn, BOOL fObfuscateHiddenVariables)
+    {
+        HRESULT hr = S_OK;
+        DWORD er = ERROR_SUCCESS;
+        LPWSTR sczFormat = NULL;
+        LPWSTR sczName = NULL;
+        LPWSTR sczValue = NULL;
+        LPCWSTR wzRead = wzIn;
+        MSIHANDLE hRecord = NULL;
+        BURN_VARIANT value = { };
+        BOOL fHidden = FALSE;
+        DWORD cch = 0;
+        System::Collections::Generic::List<String^>^ values = gcnew System::Collections::Generic::List<String^>();
+
+        try
+        {
+            hr = StrAllocString(&sczFormat, L"", 0);
+            TestThrowOnFailure(hr, L"Failed to allocate format string.");
+
+            for (;;)
+            {
+                LPCWSTR wzOpen = wcschr(wzRead, L'[');
+                LPCWSTR wzClose = wzOpen ? wcschr(wzOpen + 1, L']') : NULL;
+                if (!wzClose)
+                {
+                    hr = StrAllocConcat(&sczFormat, wzRead, 0);
+                    TestThrowOnFailure(hr, L"Failed to append string.");
+                    break;
+                }
+
+                DWORD cchName = (DWORD)(wzClose - wzOpen - 1);
+                if (0 == cchName)
+                {
+                    hr = StrAllocConcat(&sczFormat, wzRead, (DWORD_PTR)(wzClose - wzRead) + 1);
+                    TestThrowOnFailure(hr, L"Failed to append string.");
+                }
+                else
+                {
+                    if (wzOpen > wzRead)
+                    {
+                        hr = StrAllocConcat(&sczFormat, wzRead, (DWORD_PTR)(wzOpen - wzRead));
+                        TestThrowOnFailure(hr, L"Failed to append string.");
+                    }
+
+                    if (2 <= cchName && L'\\' == wzOpen[1])
+                    {
+                        values->Add(gcnew String(wzOpen + 2, 0, 1));
+                    }
+                    else
+                    {
+                        hr = StrAllocString(&sczName, wzOpen + 1, cchName);
+                        TestThrowOnFailure(hr, L"Failed to copy variable name.");
+
+                        hr = VariableIsHidden(pVariables, sczName, &fHidden);
+                        TestThrowOnFailure1(hr, L"Failed to get visibility of: %s", sczName);
+
+                        hr = VariableGetVariant(pVariables, sczName, &value);
+                        if (fObfuscateHiddenVariables && fHidden)
+                        {
+                            values->Add(gcnew String(L"*****"));
+                        }
+                        else if (E_NOTFOUND == hr || BURN_VARIANT_TYPE_NONE == value.Type)
+                        {
+                            values->Add(String::Empty);
+                        }
+                        else
+                        {
+                            TestThrowOnFailure1(hr, L"Failed to get: %s", sczName);
+
+                            hr = BVariantGetString(&value, &sczValue);
+                            TestThrowOnFailure1(hr, L"Failed to get value of: %s", sczName);
+
+                            if (BURN_VARIANT_TYPE_FORMATTED == value.Type)
+                            {
+                                values->Add(VariableFormatStringMsiHelper(pVariables, sczValue, FALSE));
+                            }
+                            else
+                            {
+                                values->Add(gcnew String(sczValue));
+                            }
+                        }
+
+                        BVariantUninitialize(&value);
+                    }
+
+                    hr = StrAllocConcatFormatted(&sczFormat, L"[%d]", values->Count);
+                    TestThrowOnFailure(hr, L"Failed to append placeholder.");
+                }
+
+                wzRead = wzClose + 1;
+            }
+
+            hRecord = ::MsiCreateRecord(values->Count);
+            TestThrowOnFailure(hRecord ? S_OK : E_OUTOFMEMORY, L"Failed to create record.");
+
+            er = ::MsiRecordSetStringW(hRecord, 0, sczFormat);
+            TestThrowOnFailure(HRESULT_FROM_WIN32(er), L"Failed to set format string.");
+
+            for (int i = 0; i < values->Count; ++i)
+            {
+                if (values[i]->Length) // not setting if blank
+                {
+                    pin_ptr<const WCHAR> wzValue = PtrToStringChars(values[i]);
+                    er = ::MsiRecordSetStringW(hRecord, i + 1, wzValue);
+                    TestThrowOnFailure(HRESULT_FROM_WIN32(er), L"Failed to set record string.");
+                }
+            }
+
+            er = ::MsiFormatRecordW(NULL, hRecord, L"", &cch);
+            if (ERROR_MORE_DATA != er)
+            {
+                TestThrowOnFailure(HRESULT_FROM_WIN32(er), L"Failed to get formatted length.");
+            }
+
+            hr = StrAlloc(&sczValue, ++cch);
+            TestThrowOnFailure(hr, L"Failed to allocate string.");
+
+            er = ::MsiFormatRecordW(NULL, hRecord, sczValue, &cch);
+            TestThrowOnFailure(HRESULT_FROM_WIN32(er), L"Failed to format record.");
+
+            return gcnew String(sczValue);
+        }
+        finally
+        {
+            if (hRecord)
+            {
+                ::MsiCloseHandle(hRecord);
+            }
+
+            BVariantUninitialize(&value);
+            ReleaseStr(sczFormat);
+            ReleaseStr(sczName);
+            ReleaseStr(sczValue);
+        }
+    }
+
     String^ VariableEscapeStringHelper(LPCWSTR wzIn)
     {
         HRESULT hr = S_OK;
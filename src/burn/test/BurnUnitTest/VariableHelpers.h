@@ -18,6 +18,8 @@ __int64 VariableGetNumericHelper(BURN_VARIABLES* pVariables, LPCWSTR wzVariable)
 System::String^ VariableGetVersionHelper(BURN_VARIABLES* pVariables, LPCWSTR wzVariable);
 System::String^ VariableGetFormattedHelper(BURN_VARIABLES* pVariables, LPCWSTR wzVariable, BOOL* pfContainsHiddenVariable);
 System::String^ VariableFormatStringHelper(BURN_VARIABLES* pVariables, LPCWSTR wzIn);
+System::String^ VariableFormatStringObfuscatedHelper(BURN_VARIABLES* pVariables, LPCWSTR wzIn);
+System::String^ VariableFormatStringMsiHelper(BURN_VARIABLES* pVariables, LPCWSTR wzIn, BOOL fObfuscateHiddenVariables);
 System::String^ VariableEscapeStringHelper(LPCWSTR wzIn);
 bool EvaluateConditionHelper(BURN_VARIABLES* pVariables, LPCWSTR wzCondition);
 bool EvaluateFailureConditionHelper(BURN_VARIABLES* pVariables, LPCWSTR wzCondition);
@@ -13,6 +13,22 @@ namespace Bootstrapper
     using namespace System;
     using namespace Xunit;
 
+struct VARIABLE_CONTENTION_CONTEXT
+{
+    BURN_VARIABLES* pVariables;
+    LPCWSTR wzFormat;
+    LPCWSTR wzExpected;
+    DWORD iThread;
+    DWORD cIterations;
+    DWORD dwWritePercent;
+    HANDLE hStartEvent;
+    HRESULT hr;
+};
+
+static DWORD CALLBACK VariableTest_ContentionThreadProc(
+    __in LPVOID lpThreadParameter
+    );
+
     public ref class VariableTest : BurnUnitTest
     {
     public:
@@ -257,6 +273,219 @@ namespace Bootstrapper
             }
         }
 
+        [Fact]
+        void VariablesFormatMatchesMsiTest()
+        {
+            HRESULT hr = S_OK;
+            IXMLDOMElement* pixeBundle = NULL;
+            BURN_VARIABLES variables = { };
+            LPCWSTR rgwzInputs[] =
+            {
+                L"",
+                L"NOPROP",
+                L"[PROP1]",
+                L"PRE [PROP1] MID [PROP2] POST",
+                L"[PROP1][PROP2][PROP3]",
+                L"[NONE]",
+                L"[prop1]",
+                L"[\\[]",
+                L"[\\]]",
+                L"[\\{][\\}]",
+                L"[]",
+                L"[][PROP1][]",
+                L"[NONE",
+                L"PRE [PROP1] [NONE",
+                L"]PROP1[",
+                L"[[PROP1]]",
+                L"[PROP4]",
+                L"[PROP6]",
+                L"[PROP7] and [HIDDEN]",
+                L"[NESTEDHIDDEN]",
+                L"[EMPTY]",
+                L"{12345678-1234-1234-1234-123456789012}",
+                L"/x {12345678-1234-1234-1234-123456789012} [PROP1]",
+                L"{[PROP1]}",
+                L"{[NONE]}",
+                L"{pre [PROP1] post}",
+                L"{pre [NONE] post}",
+                L"{pre [PROP1] [NONE] post}",
+                L"{[EMPTY]}",
+                L"{[HIDDEN]}",
+                L"{[\\[]}",
+                L"A{[PROP1]}B{[NONE]}C",
+                L"}[PROP1]{",
+                L"{[PROP1]",
+                L"[PROP1]}",
+                L"{}",
+            };
+            try
+            {
+                hr = VariableInitialize(&variables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables, L"PROP1", L"VAL1", FALSE);
+                VariableSetStringHelper(&variables, L"PROP2", L"VAL2", FALSE);
+                VariableSetNumericHelper(&variables, L"PROP3", 3);
+                VariableSetStringHelper(&variables, L"PROP4", L"[PROP1]", FALSE);
+                VariableSetStringHelper(&variables, L"PROP6", L"[PROP4] [PROP2]", TRUE);
+                VariableSetStringHelper(&variables, L"PROP7", L"{[PROP1]}{[NONE]}", TRUE);
+                VariableSetStringHelper(&variables, L"EMPTY", L"", FALSE);
+
+                LoadBundleXmlHelper(L"<Bundle><Variable Id='HIDDEN' Type='string' Value='secret' Hidden='yes' Persisted='no' /></Bundle>", &pixeBundle);
+
+                hr = VariablesParseFromXml(&variables, pixeBundle);
+                TestThrowOnFailure(hr, L"Failed to parse variables from XML.");
+
+                VariableSetStringHelper(&variables, L"NESTEDHIDDEN", L"[HIDDEN]", TRUE);
+
+                for (DWORD i = 0; i < countof(rgwzInputs); ++i)
+                {
+                    Assert::Equal<String^>(VariableFormatStringMsiHelper(&variables, rgwzInputs[i], FALSE), VariableFormatStringHelper(&variables, rgwzInputs[i]));
+                    Assert::Equal<String^>(VariableFormatStringMsiHelper(&variables, rgwzInputs[i], TRUE), VariableFormatStringObfuscatedHelper(&variables, rgwzInputs[i]));
+                }
+
+                Assert::Equal<String^>(gcnew String(L"VAL1 and *****"), VariableFormatStringObfuscatedHelper(&variables, L"[PROP7] and [HIDDEN]"));
+            }
+            finally
+            {
+                ReleaseObject(pixeBundle);
+                VariablesUninitialize(&variables);
+            }
+        }
+
+        [Fact]
+        void VariablesFormatCacheTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_VARIABLES variables = { };
+            try
+            {
+                hr = VariableInitialize(&variables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables, L"PROP1", L"VAL1", FALSE);
+                VariableSetStringHelper(&variables, L"PROP2", L"[PROP1]", TRUE);
+
+                Assert::Equal<String^>(gcnew String(L"A VAL1 B"), VariableFormatStringHelper(&variables, L"A [PROP2] B"));
+                Assert::Equal<DWORD>(0, variables.cFormatMemoHits);
+
+                // unchanged inputs reuse the memoized value
+                Assert::Equal<String^>(gcnew String(L"A VAL1 B"), VariableFormatStringHelper(&variables, L"A [PROP2] B"));
+                Assert::Equal<DWORD>(1, variables.cFormatMemoHits);
+
+                // changing a variable referenced through a formatted variable invalidates the value
+                VariableSetStringHelper(&variables, L"PROP1", L"NEW1", FALSE);
+                Assert::Equal<String^>(gcnew String(L"A NEW1 B"), VariableFormatStringHelper(&variables, L"A [PROP2] B"));
+                Assert::Equal<DWORD>(1, variables.cFormatMemoHits);
+
+                // adding a variable that was missing invalidates the value
+                Assert::Equal<String^>(gcnew String(L"C"), VariableFormatStringHelper(&variables, L"C{ [PROP3]}"));
+                VariableSetStringHelper(&variables, L"PROP3", L"VAL3", FALSE);
+                Assert::Equal<String^>(gcnew String(L"C VAL3"), VariableFormatStringHelper(&variables, L"C{ [PROP3]}"));
+
+                // unrelated changes don't
+                VariableSetStringHelper(&variables, L"PROP4", L"VAL4", FALSE);
+                Assert::Equal<String^>(gcnew String(L"A NEW1 B"), VariableFormatStringHelper(&variables, L"A [PROP2] B"));
+                Assert::Equal<DWORD>(2, variables.cFormatMemoHits);
+
+                Assert::Equal<DWORD>(3, variables.cFormatTemplates);
+                Assert::True(variables.cFormatTemplateHits > variables.cFormatTemplateMisses);
+            }
+            finally
+            {
+                VariablesUninitialize(&variables);
+            }
+        }
+
+        [Fact]
+        void VariablesFormatCommandLineTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_VARIABLES variables = { };
+            LPWSTR scz = NULL;
+            LPCWSTR wzCommandLine = L"\"[PackageFolder]setup.exe\" /install /quiet /norestart /log \"[LogFolder]\\[PackageName].log\" INSTALLDIR=\"[InstallFolder]\" {[OptionalFeature]}";
+            try
+            {
+                hr = VariableInitialize(&variables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables, L"PackageFolder", L"C:\\ProgramData\\Package Cache\\{12345678-1234-1234-1234-123456789012}v1.0.0\\", FALSE);
+                VariableSetStringHelper(&variables, L"LogFolder", L"[TempFolder]", TRUE);
+                VariableSetStringHelper(&variables, L"PackageName", L"PackageA", FALSE);
+                VariableSetStringHelper(&variables, L"InstallFolder", L"[ProgramFilesFolder]Example\\", TRUE);
+
+                hr = VariableFormatString(&variables, wzCommandLine, &scz, NULL);
+                TestThrowOnFailure(hr, L"Failed to format string.");
+
+                Assert::Equal<String^>(VariableFormatStringMsiHelper(&variables, wzCommandLine, FALSE), gcnew String(scz));
+            }
+            finally
+            {
+                ReleaseStr(scz);
+                VariablesUninitialize(&variables);
+            }
+        }
+
+        [Fact]
+        void VariablesContentionTest()
+        {
+            // mostly readers, as during detect and plan
+            VariablesContentionHelper(8, 5);
+
+            // heavier writing, as during apply
+            VariablesContentionHelper(8, 25);
+        }
+
+        [Fact]
+        void VariablesPrewarmTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_VARIABLES variables1 = { };
+            BURN_VARIABLES variables2 = { };
+            LPWSTR sczLazy = NULL;
+            LPWSTR sczPrewarmed = NULL;
+            LPCWSTR wzFormat = L"[ProgramFilesFolder]|[CommonAppDataFolder]|[LocalAppDataFolder]|[ProgramFiles6432Folder]|[WindowsFolder]|[ComputerName]|[VersionMsi]|[NTProductType]|[TerminalServer]";
+            try
+            {
+                hr = VariableInitialize(&variables1);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                hr = VariableInitialize(&variables2);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                hr = VariablePrewarm(&variables2, 4);
+                TestThrowOnFailure(hr, L"Failed to start pre-warming variables.");
+
+                Assert::NotEqual<DWORD>(0, variables2.cPrewarmVariables);
+                Assert::NotEqual<DWORD>(0, variables2.cPrewarmThreads);
+
+                ::WaitForMultipleObjects(variables2.cPrewarmThreads, variables2.rghPrewarmThreads, TRUE, INFINITE);
+
+                for (DWORD i = 0; i < variables2.cPrewarmVariables; ++i)
+                {
+                    BURN_VARIABLE* pVariable = variables2.rgVariables + variables2.rgdwPrewarmVariables[i];
+
+                    Assert::NotEqual((int)BURN_VARIANT_TYPE_NONE, (int)pVariable->Value.Type);
+                    Assert::True(pVariable->fInitializedInBackground);
+                }
+
+                hr = VariableFormatString(&variables1, wzFormat, &sczLazy, NULL);
+                TestThrowOnFailure(hr, L"Failed to format string.");
+
+                hr = VariableFormatString(&variables2, wzFormat, &sczPrewarmed, NULL);
+                TestThrowOnFailure(hr, L"Failed to format string.");
+
+                Assert::Equal<String^>(gcnew String(sczLazy), gcnew String(sczPrewarmed));
+            }
+            finally
+            {
+                ReleaseStr(sczLazy);
+                ReleaseStr(sczPrewarmed);
+                VariablesUninitialize(&variables1);
+                VariablesUninitialize(&variables2);
+            }
+        }
+
         [Fact]
         void VariablesEscapeTest()
         {
@@ -457,6 +686,132 @@ namespace Bootstrapper
             }
         }
 
+        [Fact]
+        void VariablesConditionCacheTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_VARIABLES variables = { };
+            LPWSTR* rgsczConditions = NULL;
+            BOOL* rgfColdResults = NULL;
+            BOOL f = FALSE;
+            const DWORD cConditions = 100;
+            const DWORD cPasses = 2;
+            try
+            {
+                hr = VariableInitialize(&variables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables, L"PROP1", L"VAL1", FALSE);
+                VariableSetNumericHelper(&variables, L"PROP2", 2);
+                VariableSetVersionHelper(&variables, L"PROP3", L"1.2.3.4");
+                VariableSetStringHelper(&variables, L"PROP4", L"[PROP1]", TRUE);
+
+                rgsczConditions = static_cast<LPWSTR*>(MemAlloc(sizeof(LPWSTR) * cConditions, TRUE));
+                TestThrowOnFailure(rgsczConditions ? S_OK : E_OUTOFMEMORY, L"Failed to allocate conditions.");
+
+                rgfColdResults = static_cast<BOOL*>(MemAlloc(sizeof(BOOL) * cConditions, TRUE));
+                TestThrowOnFailure(rgfColdResults ? S_OK : E_OUTOFMEMORY, L"Failed to allocate results.");
+
+                for (DWORD i = 0; i < cConditions; ++i)
+                {
+                    hr = StrAllocFormatted(&rgsczConditions[i], L"(PROP1 = \"VAL%u\" OR PROP2 >< %u) AND PROP3 >= v1.%u.0 AND NOT PROP4 ~<> \"val1\" OR MISSING%u", i % 7, i % 4, i % 5, i);
+                    TestThrowOnFailure(hr, L"Failed to format condition.");
+                }
+
+                // cold: every condition is parsed on its first evaluation
+                for (DWORD i = 0; i < cConditions; ++i)
+                {
+                    hr = ConditionEvaluate(&variables, rgsczConditions[i], &rgfColdResults[i]);
+                    TestThrowOnFailure1(hr, L"Failed to evaluate condition: %s", rgsczConditions[i]);
+                }
+
+                Assert::Equal<DWORD>(cConditions, variables.cConditions);
+
+                // warm: every condition is already compiled
+                variables.cConditionHits = 0;
+
+                for (DWORD iPass = 0; iPass < cPasses; ++iPass)
+                {
+                    for (DWORD i = 0; i < cConditions; ++i)
+                    {
+                        hr = ConditionEvaluate(&variables, rgsczConditions[i], &f);
+                        TestThrowOnFailure1(hr, L"Failed to evaluate condition: %s", rgsczConditions[i]);
+
+                        Assert::Equal<BOOL>(rgfColdResults[i], f);
+                    }
+                }
+
+                Assert::Equal<DWORD>(cConditions * cPasses, variables.cConditionHits);
+
+                // compiled conditions read the current values
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP2 = 2"));
+                VariableSetNumericHelper(&variables, L"PROP2", 3);
+                Assert::False(EvaluateConditionHelper(&variables, L"PROP2 = 2"));
+            }
+            finally
+            {
+                if (rgsczConditions)
+                {
+                    for (DWORD i = 0; i < cConditions; ++i)
+                    {
+                        ReleaseStr(rgsczConditions[i]);
+                    }
+                    MemFree(rgsczConditions);
+                }
+                ReleaseMem(rgfColdResults);
+                VariablesUninitialize(&variables);
+            }
+        }
+
+        [Fact]
+        void VariablesConditionMemoTest()
+        {
+            HRESULT hr = S_OK;
+            BURN_VARIABLES variables = { };
+            try
+            {
+                hr = VariableInitialize(&variables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables, L"PROP1", L"VAL1", FALSE);
+                VariableSetNumericHelper(&variables, L"PROP2", 2);
+                VariableSetStringHelper(&variables, L"PROP3", L"[PROP1]", TRUE);
+                VariableSetStringHelper(&variables, L"UNRELATED", L"A", FALSE);
+
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP1 = \"VAL1\" AND PROP2 = 2"));
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP1 = \"VAL1\" AND PROP2 = 2"));
+                Assert::Equal<DWORD>(1, variables.cConditionMemoHits);
+
+                // changing a variable the condition does not read keeps the result
+                VariableSetStringHelper(&variables, L"UNRELATED", L"B", FALSE);
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP1 = \"VAL1\" AND PROP2 = 2"));
+                Assert::Equal<DWORD>(2, variables.cConditionMemoHits);
+
+                // changing one it does read throws the result away
+                VariableSetNumericHelper(&variables, L"PROP2", 3);
+                Assert::False(EvaluateConditionHelper(&variables, L"PROP1 = \"VAL1\" AND PROP2 = 2"));
+                Assert::Equal<DWORD>(2, variables.cConditionMemoHits);
+                Assert::False(EvaluateConditionHelper(&variables, L"PROP1 = \"VAL1\" AND PROP2 = 2"));
+                Assert::Equal<DWORD>(3, variables.cConditionMemoHits);
+
+                // formatted variables depend on the variables they reference
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP3 = \"VAL1\""));
+                VariableSetStringHelper(&variables, L"PROP1", L"VAL2", FALSE);
+                Assert::False(EvaluateConditionHelper(&variables, L"PROP3 = \"VAL1\""));
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP3 = \"VAL2\""));
+
+                // a missing variable may be added later
+                Assert::False(EvaluateConditionHelper(&variables, L"PROP4"));
+                Assert::False(EvaluateConditionHelper(&variables, L"PROP4"));
+                VariableSetNumericHelper(&variables, L"PROP4", 1);
+                Assert::True(EvaluateConditionHelper(&variables, L"PROP4"));
+            }
+            finally
+            {
+                VariablesUninitialize(&variables);
+            }
+        }
+
         [Fact]
         void VariablesSerializationTest()
         {
@@ -514,6 +869,286 @@ namespace Bootstrapper
             }
         }
 
+        [Fact]
+        void VariablesSerializeChangesTest()
+        {
+            HRESULT hr = S_OK;
+            BYTE* pbFull = NULL;
+            SIZE_T cbFull = 0;
+            BYTE* pbDelta = NULL;
+            SIZE_T cbDelta = 0;
+            BYTE* pbExpected = NULL;
+            SIZE_T cbExpected = 0;
+            BYTE* pbActual = NULL;
+            SIZE_T cbActual = 0;
+            SIZE_T iBuffer = 0;
+            DWORD cVariables = 0;
+            DWORD64 qwGeneration = 0;
+            WCHAR wzName[32];
+            BURN_VARIABLES variables1 = { };
+            BURN_VARIABLES variables2 = { };
+            BURN_VARIABLES variables3 = { };
+            try
+            {
+                hr = VariableInitialize(&variables1);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                hr = VariableInitialize(&variables2);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                hr = VariableInitialize(&variables3);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables1, L"PROP1", L"VAL1", FALSE);
+                VariableSetNumericHelper(&variables1, L"PROP2", 2);
+                VariableSetVersionHelper(&variables1, L"PROP3", L"1.1.1.1");
+                VariableSetStringHelper(&variables1, L"PROP4", L"VAL4", FALSE);
+                VariableSetStringHelper(&variables1, L"PROP5", L"[PROP1]", TRUE);
+
+                for (DWORD i = 0; i < 200; ++i)
+                {
+                    hr = ::StringCchPrintfW(wzName, countof(wzName), L"Unchanged%u", i);
+                    TestThrowOnFailure(hr, L"Failed to format variable name.");
+
+                    VariableSetNumericHelper(&variables1, wzName, i);
+                }
+
+                // the first sync sends everything, exactly like a full serialization
+                hr = VariableSerializeChanges(&variables1, &pbFull, &cbFull, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                VariableCommitSerializedChanges(&variables1, qwGeneration);
+
+                hr = VariableSerialize(&variables1, FALSE, &pbExpected, &cbExpected);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                Assert::Equal(cbExpected, cbFull);
+                Assert::Equal(0, memcmp(pbExpected, pbFull, cbFull));
+
+                hr = VariableDeserialize(&variables2, FALSE, pbFull, cbFull, &iBuffer);
+                TestThrowOnFailure(hr, L"Failed to deserialize variables.");
+
+                // change, unset and add a few variables
+                VariableSetStringHelper(&variables1, L"PROP1", L"VAL1-changed", FALSE);
+                VariableSetNumericHelper(&variables1, L"PROP2", 22);
+
+                hr = VariableSetString(&variables1, L"PROP4", NULL, FALSE, FALSE);
+                TestThrowOnFailure(hr, L"Failed to unset variable.");
+
+                VariableSetStringHelper(&variables1, L"PROP6", L"[PROP2]", TRUE);
+
+                hr = VariableSerializeChanges(&variables1, &pbDelta, &cbDelta, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize changed variables.");
+
+                // changes that were not committed, because sending them failed, are sent again
+                ReleaseNullMem(pbActual);
+                cbActual = 0;
+
+                hr = VariableSerializeChanges(&variables1, &pbActual, &cbActual, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize changed variables.");
+
+                Assert::Equal(cbDelta, cbActual);
+                Assert::Equal(0, memcmp(pbDelta, pbActual, cbActual));
+
+                ReleaseNullMem(pbActual);
+                cbActual = 0;
+
+                VariableCommitSerializedChanges(&variables1, qwGeneration);
+
+                iBuffer = 0;
+                hr = BuffReadNumber(pbDelta, cbDelta, &iBuffer, &cVariables);
+                TestThrowOnFailure(hr, L"Failed to read variable count.");
+
+                Assert::Equal<DWORD>(4, cVariables);
+                Assert::True(cbDelta < cbFull);
+
+                LogStringLine(REPORT_STANDARD, "Full variable sync was %Iu bytes, sync of changes was %Iu bytes.", cbFull, cbDelta);
+
+                iBuffer = 0;
+                hr = VariableDeserialize(&variables2, FALSE, pbDelta, cbDelta, &iBuffer);
+                TestThrowOnFailure(hr, L"Failed to deserialize changed variables.");
+
+                // a full sync of the current state must give the same result as the full + delta syncs
+                ReleaseNullMem(pbExpected);
+                cbExpected = 0;
+
+                hr = VariableSerialize(&variables1, FALSE, &pbExpected, &cbExpected);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                iBuffer = 0;
+                hr = VariableDeserialize(&variables3, FALSE, pbExpected, cbExpected, &iBuffer);
+                TestThrowOnFailure(hr, L"Failed to deserialize variables.");
+
+                ReleaseNullMem(pbExpected);
+                cbExpected = 0;
+
+                hr = VariableSerialize(&variables3, FALSE, &pbExpected, &cbExpected);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                hr = VariableSerialize(&variables2, FALSE, &pbActual, &cbActual);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                Assert::Equal(cbExpected, cbActual);
+                Assert::Equal(0, memcmp(pbExpected, pbActual, cbActual));
+
+                Assert::Equal<String^>(gcnew String(L"VAL1-changed"), VariableGetStringHelper(&variables2, L"PROP1"));
+                Assert::Equal<String^>(gcnew String(L"22"), VariableGetFormattedHelper(&variables2, L"PROP6", NULL));
+                Assert::False(EvaluateConditionHelper(&variables2, L"PROP4"));
+
+                // nothing changed since the last sync
+                ReleaseNullMem(pbDelta);
+                cbDelta = 0;
+
+                hr = VariableSerializeChanges(&variables1, &pbDelta, &cbDelta, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize changed variables.");
+
+                Assert::Equal(sizeof(DWORD), cbDelta);
+
+                // after a reset everything is sent again
+                VariableResetSerializedChanges(&variables1);
+
+                ReleaseNullMem(pbDelta);
+                cbDelta = 0;
+
+                hr = VariableSerializeChanges(&variables1, &pbDelta, &cbDelta, &qwGeneration);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                ReleaseNullMem(pbExpected);
+                cbExpected = 0;
+
+                hr = VariableSerialize(&variables1, FALSE, &pbExpected, &cbExpected);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                Assert::Equal(cbExpected, cbDelta);
+                Assert::Equal(0, memcmp(pbExpected, pbDelta, cbDelta));
+            }
+            finally
+            {
+                ReleaseMem(pbFull);
+                ReleaseMem(pbDelta);
+                ReleaseMem(pbExpected);
+                ReleaseMem(pbActual);
+                VariablesUninitialize(&variables1);
+                VariablesUninitialize(&variables2);
+                VariablesUninitialize(&variables3);
+            }
+        }
+
+        [Fact]
+        void VariablesLargeCountTest()
+        {
+            HRESULT hr = S_OK;
+            const DWORD cVariables = 300;
+            BYTE* pbBuffer = NULL;
+            SIZE_T cbBuffer = 0;
+            SIZE_T iBuffer = 0;
+            DWORD cSerialized = 0;
+            WCHAR wzName[32] = { };
+            LPWSTR sczName = NULL;
+            LPWSTR sczValue = NULL;
+            LPWSTR sczPrevious = NULL;
+            BURN_VARIABLES variables1 = { };
+            BURN_VARIABLES variables2 = { };
+            try
+            {
+                hr = VariableInitialize(&variables1);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                // insert in a scattered order so the names don't arrive sorted
+                for (DWORD i = 0; i < cVariables; ++i)
+                {
+                    DWORD dwId = (DWORD)((i * 7919ull) % cVariables);
+
+                    hr = ::StringCchPrintfW(wzName, countof(wzName), L"Var%u", dwId);
+                    TestThrowOnFailure(hr, L"Failed to format variable name.");
+
+                    hr = VariableSetNumeric(&variables1, wzName, dwId, FALSE);
+                    TestThrowOnFailure1(hr, L"Failed to set variable: %s", wzName);
+                }
+
+                for (DWORD i = 0; i < cVariables; ++i)
+                {
+                    LONGLONG llValue = 0;
+
+                    hr = ::StringCchPrintfW(wzName, countof(wzName), L"Var%u", i);
+                    TestThrowOnFailure(hr, L"Failed to format variable name.");
+
+                    hr = VariableGetNumeric(&variables1, wzName, &llValue);
+                    TestThrowOnFailure1(hr, L"Failed to get variable: %s", wzName);
+                    Assert::Equal((LONGLONG)i, llValue);
+                }
+
+                hr = VariableSerialize(&variables1, FALSE, &pbBuffer, &cbBuffer);
+                TestThrowOnFailure(hr, L"Failed to serialize variables.");
+
+                hr = VariableInitialize(&variables2);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                hr = VariableDeserialize(&variables2, FALSE, pbBuffer, cbBuffer, &iBuffer);
+                TestThrowOnFailure(hr, L"Failed to deserialize variables.");
+
+                hr = ::StringCchPrintfW(wzName, countof(wzName), L"Var%u", cVariables - 1);
+                TestThrowOnFailure(hr, L"Failed to format variable name.");
+
+                Assert::Equal(0ll, VariableGetNumericHelper(&variables2, L"Var0"));
+                Assert::Equal((LONGLONG)(cVariables - 1), VariableGetNumericHelper(&variables2, wzName));
+
+                // variables are serialized in name order regardless of insertion order
+                iBuffer = 0;
+
+                hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &cSerialized);
+                TestThrowOnFailure(hr, L"Failed to read variable count.");
+
+                for (DWORD i = 0; i < cSerialized; ++i)
+                {
+                    DWORD dwIncluded = 0;
+                    DWORD dwType = 0;
+                    DWORD64 qw = 0;
+
+                    hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &dwIncluded);
+                    TestThrowOnFailure(hr, L"Failed to read included flag.");
+
+                    if (!dwIncluded)
+                    {
+                        continue;
+                    }
+
+                    hr = BuffReadString(pbBuffer, cbBuffer, &iBuffer, &sczName);
+                    TestThrowOnFailure(hr, L"Failed to read variable name.");
+
+                    if (sczPrevious)
+                    {
+                        Assert::Equal(CSTR_LESS_THAN, ::CompareStringOrdinal(sczPrevious, -1, sczName, -1, FALSE));
+                    }
+
+                    hr = BuffReadNumber(pbBuffer, cbBuffer, &iBuffer, &dwType);
+                    TestThrowOnFailure(hr, L"Failed to read variable type.");
+
+                    if (BURN_VARIANT_TYPE_NUMERIC == dwType)
+                    {
+                        hr = BuffReadNumber64(pbBuffer, cbBuffer, &iBuffer, &qw);
+                    }
+                    else if (BURN_VARIANT_TYPE_NONE != dwType)
+                    {
+                        hr = BuffReadString(pbBuffer, cbBuffer, &iBuffer, &sczValue);
+                    }
+                    TestThrowOnFailure(hr, L"Failed to read variable value.");
+
+                    hr = StrAllocString(&sczPrevious, sczName, 0);
+                    TestThrowOnFailure(hr, L"Failed to copy variable name.");
+                }
+            }
+            finally
+            {
+                ReleaseStr(sczName);
+                ReleaseStr(sczValue);
+                ReleaseStr(sczPrevious);
+                ReleaseMem(pbBuffer);
+                VariablesUninitialize(&variables1);
+                VariablesUninitialize(&variables2);
+            }
+        }
+
         [Fact]
         void VariablesBuiltInTest()
         {
@@ -610,7 +1245,167 @@ namespace Bootstrapper
                 VariablesUninitialize(&variables);
             }
         }
+
+    private:
+        void VariablesContentionHelper(DWORD cThreads, DWORD dwWritePercent)
+        {
+            HRESULT hr = S_OK;
+            BURN_VARIABLES variables = { };
+            BURN_VARIABLES expectedVariables = { };
+            VARIABLE_CONTENTION_CONTEXT* rgContexts = NULL;
+            HANDLE* rghThreads = NULL;
+            HANDLE hStartEvent = NULL;
+            LPWSTR sczExpected = NULL;
+            LPWSTR sczName = NULL;
+            LONGLONG llValue = 0;
+            LPCWSTR wzFormat = L"\"[InstallFolder]setup.exe\" /log \"[LogFolder]\\[PackageName].log\" VERSION=[VersionNT]";
+            const DWORD cIterations = 1000;
+            try
+            {
+                hr = VariableInitialize(&variables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&variables, L"InstallFolder", L"[ProgramFilesFolder]Example\\", TRUE);
+                VariableSetStringHelper(&variables, L"LogFolder", L"[TempFolder]", TRUE);
+                VariableSetStringHelper(&variables, L"PackageName", L"PackageA", FALSE);
+
+                for (DWORD i = 0; i < cThreads; ++i)
+                {
+                    hr = StrAllocFormatted(&sczName, L"Counter%u", i);
+                    TestThrowOnFailure(hr, L"Failed to format variable name.");
+
+                    VariableSetNumericHelper(&variables, sczName, 0);
+                }
+
+                // format the expected value from a copy so the threads race to fill in a cold template cache
+                hr = VariableInitialize(&expectedVariables);
+                TestThrowOnFailure(hr, L"Failed to initialize variables.");
+
+                VariableSetStringHelper(&expectedVariables, L"InstallFolder", L"[ProgramFilesFolder]Example\\", TRUE);
+                VariableSetStringHelper(&expectedVariables, L"LogFolder", L"[TempFolder]", TRUE);
+                VariableSetStringHelper(&expectedVariables, L"PackageName", L"PackageA", FALSE);
+
+                hr = VariableFormatString(&expectedVariables, wzFormat, &sczExpected, NULL);
+                TestThrowOnFailure(hr, L"Failed to format expected string.");
+
+                hStartEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+                TestThrowOnFailure(hStartEvent ? S_OK : HRESULT_FROM_WIN32(::GetLastError()), L"Failed to create start event.");
+
+                rgContexts = static_cast<VARIABLE_CONTENTION_CONTEXT*>(MemAlloc(sizeof(VARIABLE_CONTENTION_CONTEXT) * cThreads, TRUE));
+                TestThrowOnFailure(rgContexts ? S_OK : E_OUTOFMEMORY, L"Failed to allocate thread contexts.");
+
+                rghThreads = static_cast<HANDLE*>(MemAlloc(sizeof(HANDLE) * cThreads, TRUE));
+                TestThrowOnFailure(rghThreads ? S_OK : E_OUTOFMEMORY, L"Failed to allocate thread handles.");
+
+                for (DWORD i = 0; i < cThreads; ++i)
+                {
+                    rgContexts[i].pVariables = &variables;
+                    rgContexts[i].wzFormat = wzFormat;
+                    rgContexts[i].wzExpected = sczExpected;
+                    rgContexts[i].iThread = i;
+                    rgContexts[i].cIterations = cIterations;
+                    rgContexts[i].dwWritePercent = dwWritePercent;
+                    rgContexts[i].hStartEvent = hStartEvent;
+
+                    rghThreads[i] = ::CreateThread(NULL, 0, VariableTest_ContentionThreadProc, rgContexts + i, 0, NULL);
+                    TestThrowOnFailure(rghThreads[i] ? S_OK : HRESULT_FROM_WIN32(::GetLastError()), L"Failed to create thread.");
+                }
+
+                ::SetEvent(hStartEvent);
+
+                for (DWORD i = 0; i < cThreads; ++i)
+                {
+                    ::WaitForSingleObject(rghThreads[i], INFINITE);
+                }
+
+                for (DWORD i = 0; i < cThreads; ++i)
+                {
+                    TestThrowOnFailure(rgContexts[i].hr, L"Contention thread failed.");
+
+                    hr = StrAllocFormatted(&sczName, L"Counter%u", i);
+                    TestThrowOnFailure(hr, L"Failed to format variable name.");
+
+                    // every thread's last write lands in its own counter
+                    hr = VariableGetNumeric(&variables, sczName, &llValue);
+                    TestThrowOnFailure(hr, L"Failed to read counter.");
+
+                    Assert::Equal(static_cast<LONGLONG>(cIterations - 100 + dwWritePercent - 1), llValue);
+                }
+            }
+            finally
+            {
+                if (rghThreads)
+                {
+                    // make sure no thread is left touching the variables when a test step failed
+                    ::SetEvent(hStartEvent);
+
+                    for (DWORD i = 0; i < cThreads; ++i)
+                    {
+                        if (rghThreads[i])
+                        {
+                            ::WaitForSingleObject(rghThreads[i], INFINITE);
+                            ReleaseHandle(rghThreads[i]);
+                        }
+                    }
+                    MemFree(rghThreads);
+                }
+                ReleaseMem(rgContexts);
+                ReleaseHandle(hStartEvent);
+                ReleaseStr(sczExpected);
+                ReleaseStr(sczName);
+                VariablesUninitialize(&variables);
+                VariablesUninitialize(&expectedVariables);
+            }
+        }
     };
+
+static DWORD CALLBACK VariableTest_ContentionThreadProc(
+    __in LPVOID lpThreadParameter
+    )
+{
+    HRESULT hr = S_OK;
+    VARIABLE_CONTENTION_CONTEXT* pContext = static_cast<VARIABLE_CONTENTION_CONTEXT*>(lpThreadParameter);
+    LPWSTR sczName = NULL;
+    LPWSTR sczValue = NULL;
+    LONGLONG llValue = 0;
+
+    hr = StrAllocFormatted(&sczName, L"Counter%u", pContext->iThread);
+    ExitOnFailure(hr, "Failed to format variable name.");
+
+    ::WaitForSingleObject(pContext->hStartEvent, INFINITE);
+
+    for (DWORD i = 0; i < pContext->cIterations; ++i)
+    {
+        if (i % 100 < pContext->dwWritePercent)
+        {
+            hr = VariableSetNumeric(pContext->pVariables, sczName, i, FALSE);
+            ExitOnFailure(hr, "Failed to set counter.");
+        }
+        else if (i % 2)
+        {
+            hr = VariableGetNumeric(pContext->pVariables, sczName, &llValue);
+            ExitOnFailure(hr, "Failed to get counter.");
+        }
+        else
+        {
+            hr = VariableFormatString(pContext->pVariables, pContext->wzFormat, &sczValue, NULL);
+            ExitOnFailure(hr, "Failed to format string.");
+
+            if (CSTR_EQUAL != ::CompareStringOrdinal(sczValue, -1, pContext->wzExpected, -1, FALSE))
+            {
+                ExitWithRootFailure(hr, E_UNEXPECTED, "Unexpected formatted string: %ls", sczValue);
+            }
+        }
+    }
+
+LExit:
+    pContext->hr = hr;
+
+    ReleaseStr(sczName);
+    ReleaseStr(sczValue);
+
+    return SUCCEEDED(hr) ? ERROR_SUCCESS : 1;
+}
 }
 }
 }
@@ -26,6 +26,37 @@ static HMODULE vhAdvApi32Dll = NULL;
 static HMODULE vhCrypt32Dll = NULL;
 static BOOL vfCrypInitialized = FALSE;
 
+typedef struct _CRYP_HASH_FILE_READER
+{
+    HANDLE hFile;
+    DWORD cbBlock;
+    BYTE* rgpbBlocks[2];
+    DWORD rgcbBlocks[2];
+
+    HANDLE rghFilled[2]; // signaled by the reader thread when the block holds data (or the read failed).
+    HANDLE rghEmptied[2]; // signaled by the hashing thread when the block can be read into again.
+
+    HRESULT hrRead;
+    LONG volatile fCancel;
+} CRYP_HASH_FILE_READER;
+
+typedef struct _CRYP_HASH
+{
+    HCRYPTPROV hProv;
+    HCRYPTHASH hHash;
+    DWORD64 qwBytesHashed;
+} CRYP_HASH;
+
+static HRESULT HashFileBlocks(
+    __in HANDLE hFile,
+    __in HCRYPTHASH hHash,
+    __in DWORD cbBlock,
+    __in DWORD64 qwFileSize
+    );
+static DWORD WINAPI HashFileReaderThread(
+    __in LPVOID pvContext
+    );
+
 // function definitions
 
 /********************************************************************
@@ -212,14 +243,57 @@ extern "C" HRESULT DAPI CrypHashFileHandle(
     __in DWORD cbHash,
     __out_opt DWORD64* pqwBytesHashed
     )
+{
+    return CrypHashFileHandleEx(hFile, dwProvType, algid, CRYP_HASH_FILE_DEFAULT_BLOCK_SIZE, pbHash, cbHash, pqwBytesHashed);
+}
+
+
+/********************************************************************
+ CrypHashFileHandleEx - hashes the rest of the file in blocks of cbBlock
+                        bytes (0 for CRYP_HASH_FILE_DEFAULT_BLOCK_SIZE).
+
+ NOTE: files larger than one block are read on a separate thread while
+       the previous block is hashed, so hFile must not be used by anyone
+       else until this returns.
+*********************************************************************/
+extern "C" HRESULT DAPI CrypHashFileHandleEx(
+    __in HANDLE hFile,
+    __in DWORD dwProvType,
+    __in ALG_ID algid,
+    __in DWORD cbBlock,
+    __out_bcount(cbHash) BYTE* pbHash,
+    __in DWORD cbHash,
+    __out_opt DWORD64* pqwBytesHashed
+    )
 {
     HRESULT hr = S_OK;
     HCRYPTPROV hProv = NULL;
     HCRYPTHASH hHash = NULL;
-    DWORD cbRead = 0;
-    BYTE rgbBuffer[4096] = { };
+    LARGE_INTEGER liFileSize = { };
+    LARGE_INTEGER liPosition = { };
+    DWORD64 qwRemaining = 0;
     const LARGE_INTEGER liZero = { };
 
+    if (!cbBlock)
+    {
+        cbBlock = CRYP_HASH_FILE_DEFAULT_BLOCK_SIZE;
+    }
+    else if (CRYP_HASH_FILE_MAX_BLOCK_SIZE < cbBlock)
+    {
+        cbBlock = CRYP_HASH_FILE_MAX_BLOCK_SIZE;
+    }
+
+    // Only the part of the file after the current position is hashed. If the size is unknown
+    // (e.g. not a disk file) fall back to reading until the end.
+    if (::GetFileSizeEx(hFile, &liFileSize) && ::SetFilePointerEx(hFile, liZero, &liPosition, FILE_CURRENT) && liPosition.QuadPart <= liFileSize.QuadPart)
+    {
+        qwRemaining = liFileSize.QuadPart - liPosition.QuadPart;
+    }
+    else
+    {
+        qwRemaining = MAXDWORD64;
+    }
+
     // get handle to the crypto provider
     if (!::CryptAcquireContextW(&hProv, NULL, NULL, dwProvType, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
     {
@@ -232,53 +306,316 @@ extern "C" HRESULT DAPI CrypHashFileHandle(
         CrypExitWithLastError(hr, "Failed to initiate hash.");
     }
 
+    hr = HashFileBlocks(hFile, hHash, cbBlock, qwRemaining);
+    CrypExitOnFailure(hr, "Failed to hash file data.");
+
+    // get hash value
+    if (!::CryptGetHashParam(hHash, HP_HASHVAL, pbHash, &cbHash, 0))
+    {
+        CrypExitWithLastError(hr, "Failed to get hash value.");
+    }
+
+    if (pqwBytesHashed)
+    {
+        if (!::SetFilePointerEx(hFile, liZero, (LARGE_INTEGER*)pqwBytesHashed, FILE_CURRENT))
+        {
+            CrypExitWithLastError(hr, "Failed to get file pointer.");
+        }
+    }
+
+LExit:
+    if (hHash)
+    {
+        ::CryptDestroyHash(hHash);
+    }
+    if (hProv)
+    {
+        ::CryptReleaseContext(hProv, 0);
+    }
+
+    return hr;
+}
+
+// Reads the file into page aligned blocks and hashes them. When more than one block is needed a
+// reader thread fills one block while the other one is hashed.
+static HRESULT HashFileBlocks(
+    __in HANDLE hFile,
+    __in HCRYPTHASH hHash,
+    __in DWORD cbBlock,
+    __in DWORD64 qwFileSize
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH_FILE_READER reader = { };
+    HANDLE hReaderThread = NULL;
+    DWORD cbRead = 0;
+    DWORD iBlock = 0;
+    DWORD dwWait = 0;
+    BOOL fSingleBlock = qwFileSize < cbBlock;
+
+    // Don't allocate more than a small file needs.
+    if (fSingleBlock)
+    {
+        cbBlock = static_cast<DWORD>(qwFileSize) + 1; // one extra byte so the read that finds the end of file is not empty.
+    }
+
+    reader.hFile = hFile;
+    reader.cbBlock = cbBlock;
+
+    for (DWORD i = 0; i < (fSingleBlock ? 1 : countof(reader.rgpbBlocks)); ++i)
+    {
+        reader.rgpbBlocks[i] = static_cast<BYTE*>(::VirtualAlloc(NULL, cbBlock, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+        CrypExitOnNullWithLastError(reader.rgpbBlocks[i], hr, "Failed to allocate block to hash file.");
+    }
+
+    if (fSingleBlock)
+    {
+        for (;;)
+        {
+            if (!::ReadFile(hFile, reader.rgpbBlocks[0], cbBlock, &cbRead, NULL))
+            {
+                CrypExitWithLastError(hr, "Failed to read data block.");
+            }
+
+            if (!cbRead)
+            {
+                break; // end of file
+            }
+
+            if (!::CryptHashData(hHash, reader.rgpbBlocks[0], cbRead, 0))
+            {
+                CrypExitWithLastError(hr, "Failed to hash data block.");
+            }
+        }
+
+        ExitFunction();
+    }
+
+    for (DWORD i = 0; i < countof(reader.rgpbBlocks); ++i)
+    {
+        reader.rghFilled[i] = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        CrypExitOnNullWithLastError(reader.rghFilled[i], hr, "Failed to create block filled event.");
+
+        reader.rghEmptied[i] = ::CreateEventW(NULL, FALSE, TRUE, NULL);
+        CrypExitOnNullWithLastError(reader.rghEmptied[i], hr, "Failed to create block emptied event.");
+    }
+
+    hReaderThread = ::CreateThread(NULL, 0, HashFileReaderThread, &reader, 0, NULL);
+    CrypExitOnNullWithLastError(hReaderThread, hr, "Failed to create thread to read file to hash.");
+
     for (;;)
     {
-        // read data block
-        if (!::ReadFile(hFile, rgbBuffer, sizeof(rgbBuffer), &cbRead, NULL))
+        dwWait = ::WaitForSingleObject(reader.rghFilled[iBlock], INFINITE);
+        if (WAIT_OBJECT_0 != dwWait)
         {
-            CrypExitWithLastError(hr, "Failed to read data block.");
+            CrypExitWithLastError(hr, "Failed to wait for data block.");
         }
 
+        cbRead = reader.rgcbBlocks[iBlock];
         if (!cbRead)
         {
+            hr = reader.hrRead;
+            CrypExitOnFailure(hr, "Failed to read data block.");
+
             break; // end of file
         }
 
-        // hash data block
-        if (!::CryptHashData(hHash, rgbBuffer, cbRead, 0))
+        if (!::CryptHashData(hHash, reader.rgpbBlocks[iBlock], cbRead, 0))
         {
             CrypExitWithLastError(hr, "Failed to hash data block.");
         }
+
+        if (!::SetEvent(reader.rghEmptied[iBlock]))
+        {
+            CrypExitWithLastError(hr, "Failed to release data block.");
+        }
+
+        iBlock = (iBlock + 1) % countof(reader.rgpbBlocks);
     }
 
-    // get hash value
-    if (!::CryptGetHashParam(hHash, HP_HASHVAL, pbHash, &cbHash, 0))
+LExit:
+    if (hReaderThread)
     {
-        CrypExitWithLastError(hr, "Failed to get hash value.");
+        // Wake the reader up in case it is waiting for a block so it sees the cancel.
+        ::InterlockedExchange(&reader.fCancel, TRUE);
+
+        for (DWORD i = 0; i < countof(reader.rghEmptied); ++i)
+        {
+            ::SetEvent(reader.rghEmptied[i]);
+        }
+
+        ::WaitForSingleObject(hReaderThread, INFINITE);
+        ReleaseHandle(hReaderThread);
     }
 
-    if (pqwBytesHashed)
+    for (DWORD i = 0; i < countof(reader.rgpbBlocks); ++i)
     {
-        if (!::SetFilePointerEx(hFile, liZero, (LARGE_INTEGER*)pqwBytesHashed, FILE_CURRENT))
+        ReleaseHandle(reader.rghFilled[i]);
+        ReleaseHandle(reader.rghEmptied[i]);
+
+        if (reader.rgpbBlocks[i])
         {
-            CrypExitWithLastError(hr, "Failed to get file pointer.");
+            ::VirtualFree(reader.rgpbBlocks[i], 0, MEM_RELEASE);
         }
     }
 
+    return hr;
+}
+
+static DWORD WINAPI HashFileReaderThread(
+    __in LPVOID pvContext
+    )
+{
+    CRYP_HASH_FILE_READER* pReader = static_cast<CRYP_HASH_FILE_READER*>(pvContext);
+    HRESULT hr = S_OK;
+    DWORD iBlock = 0;
+    DWORD cbRead = 0;
+
+    for (;;)
+    {
+        if (WAIT_OBJECT_0 != ::WaitForSingleObject(pReader->rghEmptied[iBlock], INFINITE))
+        {
+            CrypExitWithLastError(hr, "Failed to wait for an empty data block.");
+        }
+
+        if (pReader->fCancel)
+        {
+            break;
+        }
+
+        if (!::ReadFile(pReader->hFile, pReader->rgpbBlocks[iBlock], pReader->cbBlock, &cbRead, NULL))
+        {
+            CrypExitWithLastError(hr, "Failed to read data block.");
+        }
+
+        pReader->rgcbBlocks[iBlock] = cbRead;
+        ::SetEvent(pReader->rghFilled[iBlock]);
+
+        if (!cbRead)
+        {
+            break; // end of file
+        }
+
+        iBlock = (iBlock + 1) % countof(pReader->rgpbBlocks);
+    }
+
 LExit:
-    if (hHash)
+    if (FAILED(hr))
     {
-        ::CryptDestroyHash(hHash);
+        // An empty block with a failure tells the hashing thread to stop.
+        pReader->hrRead = hr;
+        pReader->rgcbBlocks[iBlock] = 0;
+        ::SetEvent(pReader->rghFilled[iBlock]);
     }
-    if (hProv)
+
+    return hr;
+}
+
+/********************************************************************
+ CrypHashCreate - starts a hash that is fed with CrypHashUpdate.
+                  Release with ReleaseCrypHash.
+
+*********************************************************************/
+extern "C" HRESULT DAPI CrypHashCreate(
+    __in DWORD dwProvType,
+    __in ALG_ID algid,
+    __out CRYP_HASH_HANDLE* phHash
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH* pHash = NULL;
+
+    pHash = static_cast<CRYP_HASH*>(MemAlloc(sizeof(CRYP_HASH), TRUE));
+    CrypExitOnNull(pHash, hr, E_OUTOFMEMORY, "Failed to allocate hash.");
+
+    if (!::CryptAcquireContextW(&pHash->hProv, NULL, NULL, dwProvType, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
     {
-        ::CryptReleaseContext(hProv, 0);
+        CrypExitWithLastError(hr, "Failed to acquire crypto context.");
     }
 
+    if (!::CryptCreateHash(pHash->hProv, algid, 0, 0, &pHash->hHash))
+    {
+        CrypExitWithLastError(hr, "Failed to initiate hash.");
+    }
+
+    *phHash = pHash;
+    pHash = NULL;
+
+LExit:
+    ReleaseCrypHash(pHash);
+
+    return hr;
+}
+
+extern "C" HRESULT DAPI CrypHashUpdate(
+    __in CRYP_HASH_HANDLE hHash,
+    __in_bcount(cbData) const BYTE* pbData,
+    __in SIZE_T cbData
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH* pHash = static_cast<CRYP_HASH*>(hHash);
+    DWORD cbDataHashed = 0;
+
+    while (cbData)
+    {
+        cbDataHashed = (DWORD)min(DWORD_MAX, cbData);
+        if (!::CryptHashData(pHash->hHash, pbData, cbDataHashed, 0))
+        {
+            CrypExitWithLastError(hr, "Failed to hash data.");
+        }
+
+        pbData += cbDataHashed;
+        cbData -= cbDataHashed;
+        pHash->qwBytesHashed += cbDataHashed;
+    }
+
+LExit:
+    return hr;
+}
+
+extern "C" HRESULT DAPI CrypHashGetValue(
+    __in CRYP_HASH_HANDLE hHash,
+    __out_bcount(cbHash) BYTE* pbHash,
+    __in DWORD cbHash,
+    __out_opt DWORD64* pqwBytesHashed
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH* pHash = static_cast<CRYP_HASH*>(hHash);
+
+    if (!::CryptGetHashParam(pHash->hHash, HP_HASHVAL, pbHash, &cbHash, 0))
+    {
+        CrypExitWithLastError(hr, "Failed to get hash value.");
+    }
+
+    if (pqwBytesHashed)
+    {
+        *pqwBytesHashed = pHash->qwBytesHashed;
+    }
+
+LExit:
     return hr;
 }
 
+extern "C" void DAPI CrypHashRelease(
+    __in CRYP_HASH_HANDLE hHash
+    )
+{
+    CRYP_HASH* pHash = static_cast<CRYP_HASH*>(hHash);
+
+    if (pHash->hHash)
+    {
+        ::CryptDestroyHash(pHash->hHash);
+    }
+    if (pHash->hProv)
+    {
+        ::CryptReleaseContext(pHash->hProv, 0);
+    }
+
+    MemFree(pHash);
+}
+
 HRESULT DAPI CrypHashBuffer(
     __in_bcount(cbBuffer) const BYTE* pbBuffer,
     __in SIZE_T cbBuffer,
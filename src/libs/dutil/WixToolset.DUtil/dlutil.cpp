@@ -51,7 +51,8 @@ static HRESULT DownloadResource(
     __in DWORD64 dw64ResumeOffset,
     __in HANDLE hResumeFile,
     __in_opt DOWNLOAD_CACHE_CALLBACK* pCache,
-    __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate
+    __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate,
+    __inout_opt DOWNLOAD_HASH* pHash
     );
 static HRESULT AllocateRangeRequestHeader(
     __in DWORD64 dw64ResumeOffset,
@@ -66,6 +67,7 @@ static HRESULT WriteToFile(
     __in DWORD64 dw64ResourceLength,
     __in LPBYTE pbData,
     __in DWORD cbData,
+    __inout CRYP_HASH_HANDLE* phHash,
     __in_opt DOWNLOAD_CACHE_CALLBACK* pCallback
     );
 static HRESULT UpdateResumeOffset(
@@ -73,6 +75,19 @@ static HRESULT UpdateResumeOffset(
     __in HANDLE hResumeFile,
     __in DWORD cbData
     );
+static HRESULT StartDownloadHash(
+    __in DOWNLOAD_HASH* pHash,
+    __in HANDLE hPayloadFile,
+    __in DWORD64 dw64ResumeOffset,
+    __in LPBYTE pbData,
+    __in DWORD cbData,
+    __out CRYP_HASH_HANDLE* phHash
+    );
+static HRESULT FinishDownloadHash(
+    __in DOWNLOAD_HASH* pHash,
+    __in HANDLE hPayloadFile,
+    __in CRYP_HASH_HANDLE hHash
+    );
 static HRESULT MakeRequest(
     __in HINTERNET hSession,
     __inout_z LPWSTR* psczSourceUrl,
@@ -127,6 +142,18 @@ extern "C" HRESULT DAPI DownloadUrl(
     __in_opt DOWNLOAD_CACHE_CALLBACK* pCache,
     __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate
     )
+{
+    return DownloadUrlEx(pDownloadSource, dw64AuthoredDownloadSize, wzDestinationPath, pCache, pAuthenticate, NULL);
+}
+
+extern "C" HRESULT DAPI DownloadUrlEx(
+    __in DOWNLOAD_SOURCE* pDownloadSource,
+    __in DWORD64 dw64AuthoredDownloadSize,
+    __in LPCWSTR wzDestinationPath,
+    __in_opt DOWNLOAD_CACHE_CALLBACK* pCache,
+    __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate,
+    __inout_opt DOWNLOAD_HASH* pHash
+    )
 {
     HRESULT hr = S_OK;
     LPWSTR sczUrl = NULL;
@@ -138,6 +165,11 @@ extern "C" HRESULT DAPI DownloadUrl(
     DWORD64 dw64Size = 0;
     FILETIME ftCreated = { };
 
+    if (pHash)
+    {
+        pHash->fHashed = FALSE;
+    }
+
     // Copy the download source into a working variable to handle redirects then
     // open the internet session.
     hr = StrAllocString(&sczUrl, pDownloadSource->sczUrl, 0);
@@ -167,7 +199,7 @@ extern "C" HRESULT DAPI DownloadUrl(
     // download.
     InitializeResume(wzDestinationPath, &sczResumePath, &hResumeFile, &dw64ResumeOffset);
 
-    hr = DownloadResource(hSession, &sczUrl, pDownloadSource->sczUser, pDownloadSource->sczPassword, wzDestinationPath, dw64AuthoredDownloadSize, dw64Size, dw64ResumeOffset, hResumeFile, pCache, pAuthenticate);
+    hr = DownloadResource(hSession, &sczUrl, pDownloadSource->sczUser, pDownloadSource->sczPassword, wzDestinationPath, dw64AuthoredDownloadSize, dw64Size, dw64ResumeOffset, hResumeFile, pCache, pAuthenticate, pHash);
     DlExitOnFailure(hr, "Failed to download URL: %ls", sczUrl);
 
     // Cleanup the resume file because we successfully downloaded the whole file.
@@ -288,7 +320,8 @@ static HRESULT DownloadResource(
     __in DWORD64 dw64ResumeOffset,
     __in HANDLE hResumeFile,
     __in_opt DOWNLOAD_CACHE_CALLBACK* pCache,
-    __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate
+    __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate,
+    __inout_opt DOWNLOAD_HASH* pHash
     )
 {
     HRESULT hr = S_OK;
@@ -303,6 +336,10 @@ static HRESULT DownloadResource(
     HINTERNET hConnect = NULL;
     HINTERNET hUrl = NULL;
     LONGLONG llLength = 0;
+    CRYP_HASH_HANDLE hHash = NULL;
+    DWORD64 dw64Hashed = 0;
+    BOOL fHashFailed = FALSE;
+    BOOL fPreallocated = FALSE;
 
     hPayloadFile = ::CreateFileW(wzDestinationPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
     if (INVALID_HANDLE_VALUE == hPayloadFile)
@@ -379,16 +416,61 @@ static HRESULT DownloadResource(
             continue;
         }
 
-        hr = WriteToFile(hUrl, hPayloadFile, &dw64ResumeOffset, hResumeFile, dw64ResourceLength, pbData, cbMaxData, pCache);
+        // Reserve the whole file once its size is known so a large download is not grown a block
+        // at a time. The end of file is left alone so resuming and short responses work as before.
+        if (!fPreallocated && dw64ResourceLength)
+        {
+            fPreallocated = TRUE;
+
+            hr = FileSetAllocationSize(hPayloadFile, dw64ResourceLength);
+            if (FAILED(hr))
+            {
+                LogStringLine(REPORT_VERBOSE, "Ignoring failure to preallocate %I64u bytes for download of URL: %ls (error 0x%x)", dw64ResourceLength, *psczUrl, hr);
+                hr = S_OK;
+            }
+        }
+
+        // The hash has to cover everything before the offset, so start over whenever the download
+        // does not pick up where the hash left off (resumed from a previous attempt or restarted).
+        if (pHash && !fHashFailed && (!hHash || dw64Hashed != dw64ResumeOffset))
+        {
+            ReleaseNullCrypHash(hHash);
+
+            hr = StartDownloadHash(pHash, hPayloadFile, dw64ResumeOffset, pbData, cbMaxData, &hHash);
+            if (FAILED(hr))
+            {
+                LogStringLine(REPORT_VERBOSE, "Ignoring failure to hash download of URL: %ls (error 0x%x)", *psczUrl, hr);
+
+                fHashFailed = TRUE;
+                hr = S_OK;
+            }
+        }
+
+        hr = WriteToFile(hUrl, hPayloadFile, &dw64ResumeOffset, hResumeFile, dw64ResourceLength, pbData, cbMaxData, &hHash, pCache);
         DlExitOnFailure(hr, "Failed while reading from internet and writing to: %ls", wzDestinationPath);
 
+        // A hash that failed to update was released, don't start another one.
+        fHashFailed = fHashFailed || !hHash;
+        dw64Hashed = dw64ResumeOffset;
+
         if (!fUseRangeRequest || dw64ResumeOffset >= dw64ResourceLength)
         {
             break;
         }
     }
 
+    if (hHash)
+    {
+        hr = FinishDownloadHash(pHash, hPayloadFile, hHash);
+        if (FAILED(hr))
+        {
+            LogStringLine(REPORT_VERBOSE, "Ignoring failure to hash download of URL: %ls (error 0x%x)", *psczUrl, hr);
+            hr = S_OK;
+        }
+    }
+
 LExit:
+    ReleaseCrypHash(hHash);
     ReleaseInternet(hUrl);
     ReleaseInternet(hConnect);
     ReleaseStr(sczRangeRequestHeader);
@@ -443,6 +525,7 @@ static HRESULT WriteToFile(
     __in DWORD64 dw64ResourceLength,
     __in LPBYTE pbData,
     __in DWORD cbData,
+    __inout CRYP_HASH_HANDLE* phHash,
     __in_opt DOWNLOAD_CACHE_CALLBACK* pCallback
     )
 {
@@ -475,6 +558,19 @@ static HRESULT WriteToFile(
                 cbTotalWritten += cbWritten;
             } while (cbWritten && cbTotalWritten < cbReadData);
 
+            // Ignore failure to hash the data, the downloaded file is read again when it is verified.
+            if (*phHash)
+            {
+                hr = CrypHashUpdate(*phHash, pbData, cbTotalWritten);
+                if (FAILED(hr))
+                {
+                    LogStringLine(REPORT_VERBOSE, "Ignoring failure to hash data from internet (error 0x%x)", hr);
+
+                    ReleaseNullCrypHash(*phHash);
+                    hr = S_OK;
+                }
+            }
+
             // Ignore failure from updating resume file as this doesn't mean the download cannot succeed.
             UpdateResumeOffset(pdw64ResumeOffset, hResumeFile, cbTotalWritten);
 
@@ -524,6 +620,102 @@ LExit:
     return hr;
 }
 
+static HRESULT StartDownloadHash(
+    __in DOWNLOAD_HASH* pHash,
+    __in HANDLE hPayloadFile,
+    __in DWORD64 dw64ResumeOffset,
+    __in LPBYTE pbData,
+    __in DWORD cbData,
+    __out CRYP_HASH_HANDLE* phHash
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH_HANDLE hHash = NULL;
+    DWORD64 dw64Remaining = dw64ResumeOffset;
+    DWORD cbReadData = 0;
+
+    hr = CrypHashCreate(pHash->dwProvType, pHash->algid, &hHash);
+    DlExitOnFailure(hr, "Failed to create download hash.");
+
+    // The hash state cannot be saved with the resume offset, so a resumed download rehashes
+    // what was already downloaded.
+    if (dw64Remaining)
+    {
+        hr = FileSetPointer(hPayloadFile, 0, NULL, FILE_BEGIN);
+        DlExitOnFailure(hr, "Failed to seek to start of file.");
+
+        while (dw64Remaining)
+        {
+            if (!::ReadFile(hPayloadFile, pbData, static_cast<DWORD>(min(dw64Remaining, cbData)), &cbReadData, NULL))
+            {
+                DlExitWithLastError(hr, "Failed to read previously downloaded data.");
+            }
+            else if (!cbReadData)
+            {
+                DlExitOnRootFailure(hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), "File is shorter than the resume offset.");
+            }
+
+            hr = CrypHashUpdate(hHash, pbData, cbReadData);
+            if (FAILED(hr))
+            {
+                LogStringLine(REPORT_VERBOSE, "Ignoring failure to hash previously downloaded data (error 0x%x)", hr);
+
+                ReleaseNullCrypHash(hHash);
+                ExitFunction1(hr = S_OK);
+            }
+
+            dw64Remaining -= cbReadData;
+        }
+    }
+
+    *phHash = hHash;
+    hHash = NULL;
+
+LExit:
+    ReleaseCrypHash(hHash);
+
+    return hr;
+}
+
+static HRESULT FinishDownloadHash(
+    __in DOWNLOAD_HASH* pHash,
+    __in HANDLE hPayloadFile,
+    __in CRYP_HASH_HANDLE hHash
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD64 qwHashed = 0;
+    FILETIME ftNow = { };
+    BY_HANDLE_FILE_INFORMATION fileInformation = { };
+
+    hr = CrypHashGetValue(hHash, pHash->pbHash, pHash->cbHash, &qwHashed);
+    DlExitOnFailure(hr, "Failed to get download hash value.");
+
+    // Set the last write time explicitly so closing the handle does not change it afterwards.
+    ::GetSystemTimeAsFileTime(&ftNow);
+    if (!::SetFileTime(hPayloadFile, NULL, NULL, &ftNow))
+    {
+        DlExitWithLastError(hr, "Failed to set last write time of downloaded file.");
+    }
+
+    if (!::GetFileInformationByHandle(hPayloadFile, &fileInformation))
+    {
+        DlExitWithLastError(hr, "Failed to get information for downloaded file.");
+    }
+
+    // A file that was already there may have been longer than what was downloaded.
+    if (qwHashed != ((static_cast<DWORD64>(fileInformation.nFileSizeHigh) << 32) | fileInformation.nFileSizeLow))
+    {
+        DlExitOnRootFailure(hr = E_UNEXPECTED, "Downloaded file size does not match the hashed size.");
+    }
+
+    pHash->fileInformation = fileInformation;
+    pHash->fHashed = TRUE;
+
+LExit:
+    return hr;
+}
+
 static HRESULT MakeRequest(
     __in HINTERNET hSession,
     __inout_z LPWSTR* psczSourceUrl,
@@ -496,6 +496,32 @@ LExit:
 }
 
 
+/*******************************************************************
+ FileSetAllocationSize - reserves disk space for a file that is about to
+                         be written without changing its end of file, so
+                         a large file is not grown a few blocks at a time.
+
+*******************************************************************/
+extern "C" HRESULT DAPI FileSetAllocationSize(
+    __in HANDLE hFile,
+    __in DWORD64 qwAllocationSize
+    )
+{
+    HRESULT hr = S_OK;
+    FILE_ALLOCATION_INFO allocationInfo = { };
+
+    allocationInfo.AllocationSize.QuadPart = qwAllocationSize;
+
+    if (!::SetFileInformationByHandle(hFile, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)))
+    {
+        FileExitWithLastError(hr, "Failed to set allocation size of file.");
+    }
+
+LExit:
+    return hr;
+}
+
+
 /*******************************************************************
  FileExistsEx
 
@@ -884,10 +910,33 @@ extern "C" HRESULT DAPI FileCopyUsingHandlesWithProgress(
     __in_opt LPPROGRESS_ROUTINE lpProgressRoutine,
     __in_opt LPVOID lpData
     )
+{
+    return FileCopyUsingHandlesWithProgressEx(hSource, hTarget, cbCopy, 0, NULL, NULL, lpProgressRoutine, lpData);
+}
+
+/*******************************************************************
+ FileCopyUsingHandlesWithProgressEx - like FileCopyUsingHandlesWithProgress
+                                      but copies in blocks of cbBlock bytes
+                                      (0 for FILE_COPY_DEFAULT_BLOCK_SIZE)
+                                      and hands every block that was copied
+                                      to pfnCopyData, e.g. to hash the file
+                                      without reading it again.
+
+*******************************************************************/
+extern "C" HRESULT DAPI FileCopyUsingHandlesWithProgressEx(
+    __in HANDLE hSource,
+    __in HANDLE hTarget,
+    __in DWORD64 cbCopy,
+    __in DWORD cbBlock,
+    __in_opt PFN_FILECOPYDATA pfnCopyData,
+    __in_opt LPVOID pvCopyDataContext,
+    __in_opt LPPROGRESS_ROUTINE lpProgressRoutine,
+    __in_opt LPVOID lpData
+    )
 {
     HRESULT hr = S_OK;
     DWORD64 cbTotalCopied = 0;
-    BYTE rgbData[64 * 1024] = { };
+    BYTE* pbData = NULL;
     DWORD cbRead = 0;
 
     LARGE_INTEGER liSourceSize = { };
@@ -923,6 +972,25 @@ extern "C" HRESULT DAPI FileCopyUsingHandlesWithProgress(
         }
     }
 
+    if (!cbBlock)
+    {
+        cbBlock = FILE_COPY_DEFAULT_BLOCK_SIZE;
+    }
+    else if (FILE_COPY_MAX_BLOCK_SIZE < cbBlock)
+    {
+        cbBlock = FILE_COPY_MAX_BLOCK_SIZE;
+    }
+
+    // No need for a block bigger than the copy.
+    if (liSourceSize.QuadPart < cbBlock)
+    {
+        cbBlock = liSourceSize.QuadPart < 4096 ? 4096 : static_cast<DWORD>(liSourceSize.QuadPart);
+    }
+
+    // Large page aligned blocks mean far fewer reads and writes for big files.
+    pbData = static_cast<BYTE*>(::VirtualAlloc(NULL, cbBlock, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    FileExitOnNullWithLastError(pbData, hr, "Failed to allocate copy buffer.");
+
     // Set size of the target file.
     ::SetFilePointerEx(hTarget, liSourceSize, NULL, FILE_BEGIN);
 
@@ -939,17 +1007,23 @@ extern "C" HRESULT DAPI FileCopyUsingHandlesWithProgress(
     // Copy with progress.
     while (0 == cbCopy || cbTotalCopied < cbCopy)
     {
-        cbRead = static_cast<DWORD>((0 == cbCopy) ? countof(rgbData) : min(countof(rgbData), cbCopy - cbTotalCopied));
-        if (!::ReadFile(hSource, rgbData, cbRead, &cbRead, NULL))
+        cbRead = static_cast<DWORD>((0 == cbCopy) ? cbBlock : min(cbBlock, cbCopy - cbTotalCopied));
+        if (!::ReadFile(hSource, pbData, cbRead, &cbRead, NULL))
         {
             FileExitWithLastError(hr, "Failed to read from source.");
         }
 
         if (cbRead)
         {
-            hr = FileWriteHandle(hTarget, rgbData, cbRead);
+            hr = FileWriteHandle(hTarget, pbData, cbRead);
             FileExitOnFailure(hr, "Failed to write to target.");
 
+            if (pfnCopyData)
+            {
+                hr = pfnCopyData(pbData, cbRead, pvCopyDataContext);
+                FileExitOnFailure(hr, "Failed to process copied data.");
+            }
+
             cbTotalCopied += cbRead;
 
             if (lpProgressRoutine)
@@ -980,6 +1054,11 @@ extern "C" HRESULT DAPI FileCopyUsingHandlesWithProgress(
     }
 
 LExit:
+    if (pbData)
+    {
+        ::VirtualFree(pbData, 0, MEM_RELEASE);
+    }
+
     return hr;
 }
 
@@ -3,6 +3,8 @@
 
 
 #define ReleaseCryptMsg(p) if (p) { ::CryptMsgClose(p); p = NULL; }
+#define ReleaseCrypHash(p) if (p) { CrypHashRelease(p); }
+#define ReleaseNullCrypHash(p) if (p) { CrypHashRelease(p); p = NULL; }
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +18,14 @@ extern "C" {
 #define SHA256_HASH_LEN 32
 #define SHA512_HASH_LEN 64
 
+// Block sizes for CrypHashFileHandleEx. Files larger than one block are read on a separate thread
+// into two alternating blocks so reading the next block overlaps hashing the current one.
+#define CRYP_HASH_FILE_DEFAULT_BLOCK_SIZE (1 * 1024 * 1024)
+#define CRYP_HASH_FILE_MAX_BLOCK_SIZE (8 * 1024 * 1024)
+
+// A hash that is fed incrementally, see CrypHashCreate.
+typedef void* CRYP_HASH_HANDLE;
+
 typedef NTSTATUS (APIENTRY *PFN_RTLENCRYPTMEMORY)(
     __inout PVOID Memory,
     __in ULONG MemoryLength,
@@ -80,6 +90,39 @@ HRESULT DAPI CrypHashFileHandle(
     __out_opt DWORD64* pqwBytesHashed
     );
 
+HRESULT DAPI CrypHashFileHandleEx(
+    __in HANDLE hFile,
+    __in DWORD dwProvType,
+    __in ALG_ID algid,
+    __in DWORD cbBlock,
+    __out_bcount(cbHash) BYTE* pbHash,
+    __in DWORD cbHash,
+    __out_opt DWORD64* pqwBytesHashed
+    );
+
+HRESULT DAPI CrypHashCreate(
+    __in DWORD dwProvType,
+    __in ALG_ID algid,
+    __out CRYP_HASH_HANDLE* phHash
+    );
+
+HRESULT DAPI CrypHashUpdate(
+    __in CRYP_HASH_HANDLE hHash,
+    __in_bcount(cbData) const BYTE* pbData,
+    __in SIZE_T cbData
+    );
+
+HRESULT DAPI CrypHashGetValue(
+    __in CRYP_HASH_HANDLE hHash,
+    __out_bcount(cbHash) BYTE* pbHash,
+    __in DWORD cbHash,
+    __out_opt DWORD64* pqwBytesHashed
+    );
+
+void DAPI CrypHashRelease(
+    __in CRYP_HASH_HANDLE hHash
+    );
+
 HRESULT DAPI CrypHashBuffer(
     __in_bcount(cbBuffer) const BYTE* pbBuffer,
     __in SIZE_T cbBuffer,
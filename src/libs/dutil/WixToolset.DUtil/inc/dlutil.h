@@ -43,6 +43,18 @@ typedef struct _DOWNLOAD_AUTHENTICATION_CALLBACK
     LPVOID pv;
 } DOWNLOAD_AUTHENTICATION_CALLBACK;
 
+typedef struct _DOWNLOAD_HASH
+{
+    DWORD dwProvType;
+    ALG_ID algid;
+    BYTE* pbHash; // receives the hash of the downloaded file.
+    DWORD cbHash;
+
+    // set when pbHash was filled, fileInformation is the destination file as of that moment.
+    BOOL fHashed;
+    BY_HANDLE_FILE_INFORMATION fileInformation;
+} DOWNLOAD_HASH;
+
 
 // functions
 
@@ -54,6 +66,15 @@ HRESULT DAPI DownloadUrl(
     __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate
     );
 
+HRESULT DAPI DownloadUrlEx(
+    __in DOWNLOAD_SOURCE* pDownloadSource,
+    __in DWORD64 dw64AuthoredDownloadSize,
+    __in LPCWSTR wzDestinationPath,
+    __in_opt DOWNLOAD_CACHE_CALLBACK* pCache,
+    __in_opt DOWNLOAD_AUTHENTICATION_CALLBACK* pAuthenticate,
+    __inout_opt DOWNLOAD_HASH* pHash
+    );
+
 
 #ifdef __cplusplus
 }
@@ -15,6 +15,9 @@ extern "C" {
                                                                           | (static_cast<DWORD64>(build & 0xFFFF) << 16) \
                                                                           | (static_cast<DWORD64>(revision & 0xFFFF)))
 
+#define FILE_COPY_DEFAULT_BLOCK_SIZE (1 * 1024 * 1024)
+#define FILE_COPY_MAX_BLOCK_SIZE (8 * 1024 * 1024)
+
 typedef enum FILE_ARCHITECTURE
 {
     FILE_ARCHITECTURE_UNKNOWN,
@@ -33,6 +36,13 @@ typedef enum FILE_ENCODING
     FILE_ENCODING_UTF16_WITH_BOM,
 } FILE_ENCODING;
 
+// Called by FileCopyUsingHandlesWithProgressEx with each block after it was written to the target.
+typedef HRESULT (CALLBACK *PFN_FILECOPYDATA)(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+
 
 HRESULT DAPI FileStripExtension(
     __in_z LPCWSTR wzFileName,
@@ -76,6 +86,10 @@ HRESULT DAPI FileSizeByHandle(
     __in HANDLE hFile,
     __out LONGLONG* pllSize
     );
+HRESULT DAPI FileSetAllocationSize(
+    __in HANDLE hFile,
+    __in DWORD64 qwAllocationSize
+    );
 BOOL DAPI FileExistsEx(
     __in_z LPCWSTR wzPath,
     __out_opt DWORD *pdwAttributes
@@ -153,6 +167,16 @@ HRESULT DAPI FileCopyUsingHandlesWithProgress(
     __in_opt LPPROGRESS_ROUTINE lpProgressRoutine,
     __in_opt LPVOID lpData
     );
+HRESULT DAPI FileCopyUsingHandlesWithProgressEx(
+    __in HANDLE hSource,
+    __in HANDLE hTarget,
+    __in DWORD64 cbCopy,
+    __in DWORD cbBlock,
+    __in_opt PFN_FILECOPYDATA pfnCopyData,
+    __in_opt LPVOID pvCopyDataContext,
+    __in_opt LPPROGRESS_ROUTINE lpProgressRoutine,
+    __in_opt LPVOID lpData
+    );
 HRESULT DAPI FileEnsureCopy(
     __in_z LPCWSTR wzSource,
     __in_z LPCWSTR wzTarget,
@@ -8,6 +8,10 @@ extern "C" {
 
 #define ReleaseVerutilVersion(p) if (p) { VerFreeVersion(p); p = NULL; }
 
+#define VERUTIL_VERSION_KEY_SIZE 40
+#define VERUTIL_VERSION_INLINE_RELEASE_LABELS 4
+#define VERUTIL_VERSION_INLINE_CCH 48
+
 typedef struct _VERUTIL_VERSION_RELEASE_LABEL
 {
     BOOL fNumeric;
@@ -32,10 +36,25 @@ typedef struct _VERUTIL_VERSION
     BOOL fHasMinor;
     BOOL fHasPatch;
     BOOL fHasRevision;
+
+    // Valid versions whose release labels fit are also packed into rgbKey so that
+    // memcmp orders them the same way VerCompareParsedVersions does.
+    BOOL fHasKey;
+    BYTE rgbKey[VERUTIL_VERSION_KEY_SIZE];
 } VERUTIL_VERSION;
 
+// Caller-owned storage for a version, see VerParseVersionInPlace. The version points into the
+// inline buffers so the storage must not be moved or copied while the version is in use.
+typedef struct _VERUTIL_VERSION_STORAGE
+{
+    VERUTIL_VERSION version;
+    VERUTIL_VERSION_RELEASE_LABEL rgInlineReleaseLabels[VERUTIL_VERSION_INLINE_RELEASE_LABELS];
+    WCHAR wzInlineVersion[VERUTIL_VERSION_INLINE_CCH];
+} VERUTIL_VERSION_STORAGE;
+
 /*******************************************************************
  VerCompareParsedVersions - compares the Verutil versions.
+                            Uses the packed keys when both versions have one.
 
 *******************************************************************/
 HRESULT DAPI VerCompareParsedVersions(
@@ -84,6 +103,30 @@ HRESULT DAPI VerParseVersion(
     __out VERUTIL_VERSION** ppVersion
     );
 
+/*******************************************************************
+ VerParseVersionInPlace - parses the string into caller-owned storage.
+                          Nothing is allocated unless the version has more
+                          than VERUTIL_VERSION_INLINE_RELEASE_LABELS release
+                          labels or VERUTIL_VERSION_INLINE_CCH characters.
+                          Release with VerUninitializeVersionStorage.
+
+*******************************************************************/
+HRESULT DAPI VerParseVersionInPlace(
+    __in_z LPCWSTR wzVersion,
+    __in SIZE_T cchVersion,
+    __in BOOL fStrict,
+    __out VERUTIL_VERSION_STORAGE* pStorage
+    );
+
+/*******************************************************************
+ VerUninitializeVersionStorage - frees anything VerParseVersionInPlace or
+                                 VerVersionFromQwordInPlace had to allocate.
+
+*******************************************************************/
+void DAPI VerUninitializeVersionStorage(
+    __in VERUTIL_VERSION_STORAGE* pStorage
+    );
+
 /*******************************************************************
  VerParseVersion - parses the QWORD into a Verutil version.
 
@@ -93,6 +136,17 @@ HRESULT DAPI VerVersionFromQword(
     __out VERUTIL_VERSION** ppVersion
     );
 
+/*******************************************************************
+ VerVersionFromQwordInPlace - creates a Verutil version from the QWORD in
+                              caller-owned storage without allocating.
+                              Release with VerUninitializeVersionStorage.
+
+*******************************************************************/
+HRESULT DAPI VerVersionFromQwordInPlace(
+    __in DWORD64 qwVersion,
+    __out VERUTIL_VERSION_STORAGE* pStorage
+    );
+
 #ifdef __cplusplus
 }
 #endif
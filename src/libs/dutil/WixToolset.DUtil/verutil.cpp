@@ -18,6 +18,15 @@
 // constants
 const DWORD GROW_RELEASE_LABELS = 3;
 
+// Packed key layout: major, minor, patch and revision as big-endian DWORDs followed by either
+// VERUTIL_KEY_NO_RELEASE_LABELS, or each release label (tag then big-endian value or upper-cased
+// text and VERUTIL_KEY_END) and VERUTIL_KEY_END. The tags are ordered so that no labels sorts
+// after any labels, fewer labels before more and numeric labels before alphanumeric ones.
+const BYTE VERUTIL_KEY_END = 0x00;
+const BYTE VERUTIL_KEY_NUMERIC_LABEL = 0x01;
+const BYTE VERUTIL_KEY_ALPHANUMERIC_LABEL = 0x02;
+const BYTE VERUTIL_KEY_NO_RELEASE_LABELS = 0x03;
+
 // Forward declarations.
 static int CompareDword(
     __in const DWORD& dw1,
@@ -37,6 +46,36 @@ static HRESULT CompareVersionSubstring(
     __in int cchCount2,
     __out int* pnResult
     );
+static HRESULT ParseVersion(
+    __in_z LPCWSTR wzVersion,
+    __in SIZE_T cchVersion,
+    __in BOOL fStrict,
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage
+    );
+static HRESULT VersionFromQword(
+    __in DWORD64 qwVersion,
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage
+    );
+static HRESULT AddReleaseLabel(
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage,
+    __out VERUTIL_VERSION_RELEASE_LABEL** ppReleaseLabel
+    );
+static HRESULT SetVersionString(
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    );
+static void PackVersionKey(
+    __in VERUTIL_VERSION* pVersion
+    );
+static void PackDword(
+    __in DWORD dw,
+    __inout BYTE** ppb
+    );
 
 
 DAPI_(HRESULT) VerCompareParsedVersions(
@@ -69,6 +108,12 @@ DAPI_(HRESULT) VerCompareParsedVersions(
         ExitFunction1(nResult = -1);
     }
 
+    if (pVersion1->fHasKey && pVersion2->fHasKey)
+    {
+        nResult = memcmp(pVersion1->rgbKey, pVersion2->rgbKey, sizeof(pVersion1->rgbKey));
+        ExitFunction1(nResult = 0 < nResult ? 1 : 0 > nResult ? -1 : 0);
+    }
+
     nResult = CompareDword(pVersion1->dwMajor, pVersion2->dwMajor);
     if (0 != nResult)
     {
@@ -226,6 +271,9 @@ DAPI_(HRESULT) VerCopyVersion(
     pCopy->cchMetadataOffset = pSource->cchMetadataOffset;
     pCopy->fInvalid = pSource->fInvalid;
 
+    pCopy->fHasKey = pSource->fHasKey;
+    memcpy_s(pCopy->rgbKey, sizeof(pCopy->rgbKey), pSource->rgbKey, sizeof(pSource->rgbKey));
+
     *ppVersion = pCopy;
     pCopy = NULL;
 
@@ -256,6 +304,223 @@ DAPI_(HRESULT) VerParseVersion(
 {
     HRESULT hr = S_OK;
     VERUTIL_VERSION* pVersion = NULL;
+
+    if (!wzVersion || !ppVersion)
+    {
+        ExitFunction1(hr = E_INVALIDARG);
+    }
+
+    pVersion = reinterpret_cast<VERUTIL_VERSION*>(MemAlloc(sizeof(VERUTIL_VERSION), TRUE));
+    VerExitOnNull(pVersion, hr, E_OUTOFMEMORY, "Failed to allocate memory for Verutil version '%ls'.", wzVersion);
+
+    hr = ParseVersion(wzVersion, cchVersion, fStrict, pVersion, NULL);
+    if (FAILED(hr))
+    {
+        ExitFunction();
+    }
+
+    *ppVersion = pVersion;
+    pVersion = NULL;
+
+LExit:
+    ReleaseVerutilVersion(pVersion);
+
+    return hr;
+}
+
+DAPI_(HRESULT) VerParseVersionInPlace(
+    __in_z LPCWSTR wzVersion,
+    __in SIZE_T cchVersion,
+    __in BOOL fStrict,
+    __out VERUTIL_VERSION_STORAGE* pStorage
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!wzVersion || !pStorage)
+    {
+        ExitFunction1(hr = E_INVALIDARG);
+    }
+
+    memset(pStorage, 0, sizeof(VERUTIL_VERSION_STORAGE));
+
+    hr = ParseVersion(wzVersion, cchVersion, fStrict, &pStorage->version, pStorage);
+    if (FAILED(hr))
+    {
+        VerUninitializeVersionStorage(pStorage);
+    }
+
+LExit:
+    return hr;
+}
+
+DAPI_(void) VerUninitializeVersionStorage(
+    __in VERUTIL_VERSION_STORAGE* pStorage
+    )
+{
+    if (pStorage->version.sczVersion != pStorage->wzInlineVersion)
+    {
+        ReleaseStr(pStorage->version.sczVersion);
+    }
+
+    if (pStorage->version.rgReleaseLabels != pStorage->rgInlineReleaseLabels)
+    {
+        ReleaseMem(pStorage->version.rgReleaseLabels);
+    }
+
+    memset(pStorage, 0, sizeof(VERUTIL_VERSION_STORAGE));
+}
+
+DAPI_(HRESULT) VerVersionFromQword(
+    __in DWORD64 qwVersion,
+    __out VERUTIL_VERSION** ppVersion
+    )
+{
+    HRESULT hr = S_OK;
+    VERUTIL_VERSION* pVersion = NULL;
+
+    pVersion = reinterpret_cast<VERUTIL_VERSION*>(MemAlloc(sizeof(VERUTIL_VERSION), TRUE));
+    VerExitOnNull(pVersion, hr, E_OUTOFMEMORY, "Failed to allocate memory for Verutil version from QWORD.");
+
+    hr = VersionFromQword(qwVersion, pVersion, NULL);
+    VerExitOnFailure(hr, "Failed to create version from QWORD.");
+
+    *ppVersion = pVersion;
+    pVersion = NULL;
+
+LExit:
+    ReleaseVerutilVersion(pVersion);
+
+    return hr;
+}
+
+DAPI_(HRESULT) VerVersionFromQwordInPlace(
+    __in DWORD64 qwVersion,
+    __out VERUTIL_VERSION_STORAGE* pStorage
+    )
+{
+    HRESULT hr = S_OK;
+
+    memset(pStorage, 0, sizeof(VERUTIL_VERSION_STORAGE));
+
+    hr = VersionFromQword(qwVersion, &pStorage->version, pStorage);
+    if (FAILED(hr))
+    {
+        VerUninitializeVersionStorage(pStorage);
+    }
+
+    return hr;
+}
+
+
+static int CompareDword(
+    __in const DWORD& dw1,
+    __in const DWORD& dw2
+    )
+{
+    int nResult = 0;
+
+    if (dw1 > dw2)
+    {
+        nResult = 1;
+    }
+    else if (dw1 < dw2)
+    {
+        nResult = -1;
+    }
+
+    return nResult;
+}
+
+static HRESULT CompareReleaseLabel(
+    __in const VERUTIL_VERSION_RELEASE_LABEL* p1,
+    __in LPCWSTR wzVersion1,
+    __in const VERUTIL_VERSION_RELEASE_LABEL* p2,
+    __in LPCWSTR wzVersion2,
+    __out int* pnResult
+    )
+{
+    HRESULT hr = S_OK;
+    int nResult = 0;
+
+    if (p1 == p2)
+    {
+        ExitFunction();
+    }
+    else if (p1 && !p2)
+    {
+        ExitFunction1(nResult = 1);
+    }
+    else if (!p1 && p2)
+    {
+        ExitFunction1(nResult = -1);
+    }
+
+    if (p1->fNumeric)
+    {
+        if (p2->fNumeric)
+        {
+            nResult = CompareDword(p1->dwValue, p2->dwValue);
+        }
+        else
+        {
+            nResult = -1;
+        }
+    }
+    else
+    {
+        if (p2->fNumeric)
+        {
+            nResult = 1;
+        }
+        else
+        {
+            hr = CompareVersionSubstring(wzVersion1 + p1->cchLabelOffset, p1->cchLabel, wzVersion2 + p2->cchLabelOffset, p2->cchLabel, &nResult);
+        }
+    }
+
+LExit:
+    *pnResult = nResult;
+
+    return hr;
+}
+
+static HRESULT CompareVersionSubstring(
+    __in LPCWSTR wzString1,
+    __in int cchCount1,
+    __in LPCWSTR wzString2,
+    __in int cchCount2,
+    __out int* pnResult
+    )
+{
+    HRESULT hr = S_OK;
+    int nResult = 0;
+
+    nResult = ::CompareStringOrdinal(wzString1, cchCount1, wzString2, cchCount2, TRUE);
+    if (!nResult)
+    {
+        VerExitOnLastError(hr, "Failed to compare version substrings");
+    }
+
+LExit:
+    *pnResult = nResult - 2;
+
+    return hr;
+}
+
+//
+// ParseVersion - parses the string into a zeroed version, using the inline buffers of pStorage when provided.
+//                On failure the caller frees whatever was allocated.
+//
+static HRESULT ParseVersion(
+    __in_z LPCWSTR wzVersion,
+    __in SIZE_T cchVersion,
+    __in BOOL fStrict,
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage
+    )
+{
+    HRESULT hr = S_OK;
     LPCWSTR wzString = NULL;
     LPCWSTR wzEnd = NULL;
     LPCWSTR wzPartBegin = NULL;
@@ -267,11 +532,6 @@ DAPI_(HRESULT) VerParseVersion(
     BOOL fExpectedReleaseLabels = FALSE;
     DWORD iPart = 0;
 
-    if (!wzVersion || !ppVersion)
-    {
-        ExitFunction1(hr = E_INVALIDARG);
-    }
-
     // Get string length if not provided.
     if (!cchVersion)
     {
@@ -283,9 +543,6 @@ DAPI_(HRESULT) VerParseVersion(
         VerExitOnRootFailure(hr = E_INVALIDARG, "Version string is too long: %Iu", cchVersion);
     }
 
-    pVersion = reinterpret_cast<VERUTIL_VERSION*>(MemAlloc(sizeof(VERUTIL_VERSION), TRUE));
-    VerExitOnNull(pVersion, hr, E_OUTOFMEMORY, "Failed to allocate memory for Verutil version '%ls'.", wzVersion);
-
     wzString = wzVersion;
 
     if (L'v' == *wzString || L'V' == *wzString)
@@ -468,12 +725,10 @@ DAPI_(HRESULT) VerParseVersion(
             break;
         }
 
-        hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pVersion->rgReleaseLabels), pVersion->cReleaseLabels, 1, sizeof(VERUTIL_VERSION_RELEASE_LABEL), GROW_RELEASE_LABELS);
+        VERUTIL_VERSION_RELEASE_LABEL* pReleaseLabel = NULL;
+        hr = AddReleaseLabel(pVersion, pStorage, &pReleaseLabel);
         VerExitOnFailure(hr, "Failed to allocate memory for Verutil version release labels '%ls'", wzVersion);
 
-        VERUTIL_VERSION_RELEASE_LABEL* pReleaseLabel = pVersion->rgReleaseLabels + pVersion->cReleaseLabels;
-        ++pVersion->cReleaseLabels;
-
         // Try to parse as number.
         UINT uLabel = 0;
         hr = StrStringToUInt32(wzPartBegin, cchLabel, &uLabel);
@@ -528,29 +783,26 @@ DAPI_(HRESULT) VerParseVersion(
         ++cchVersion;
     }
 
-    hr = StrAllocString(&pVersion->sczVersion, wzString, cchVersion);
+    hr = SetVersionString(pVersion, pStorage, wzString, cchVersion);
     VerExitOnFailure(hr, "Failed to copy Verutil version string '%ls'.", wzVersion);
 
-    *ppVersion = pVersion;
-    pVersion = NULL;
+    PackVersionKey(pVersion);
+
     hr = S_OK;
 
 LExit:
-    ReleaseVerutilVersion(pVersion);
-
     return hr;
 }
 
-DAPI_(HRESULT) VerVersionFromQword(
+static HRESULT VersionFromQword(
     __in DWORD64 qwVersion,
-    __out VERUTIL_VERSION** ppVersion
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage
     )
 {
     HRESULT hr = S_OK;
-    VERUTIL_VERSION* pVersion = NULL;
-
-    pVersion = reinterpret_cast<VERUTIL_VERSION*>(MemAlloc(sizeof(VERUTIL_VERSION), TRUE));
-    VerExitOnNull(pVersion, hr, E_OUTOFMEMORY, "Failed to allocate memory for Verutil version from QWORD.");
+    WCHAR wzVersion[24] = { }; // "65535.65535.65535.65535"
+    SIZE_T cchVersion = 0;
 
     pVersion->dwMajor = (WORD)(qwVersion >> 48 & 0xffff);
     pVersion->dwMinor = (WORD)(qwVersion >> 32 & 0xffff);
@@ -562,112 +814,182 @@ DAPI_(HRESULT) VerVersionFromQword(
     pVersion->fHasPatch = TRUE;
     pVersion->fHasRevision = TRUE;
 
-    hr = StrAllocFormatted(&pVersion->sczVersion, L"%lu.%lu.%lu.%lu", pVersion->dwMajor, pVersion->dwMinor, pVersion->dwPatch, pVersion->dwRevision);
-    ExitOnFailure(hr, "Failed to allocate and format the version string.");
+    hr = ::StringCchPrintfW(wzVersion, countof(wzVersion), L"%lu.%lu.%lu.%lu", pVersion->dwMajor, pVersion->dwMinor, pVersion->dwPatch, pVersion->dwRevision);
+    VerExitOnFailure(hr, "Failed to format the version string.");
 
-    pVersion->cchMetadataOffset = lstrlenW(pVersion->sczVersion);
+    hr = ::StringCchLengthW(wzVersion, countof(wzVersion), reinterpret_cast<size_t*>(&cchVersion));
+    VerExitOnFailure(hr, "Failed to get length of the version string.");
 
-    *ppVersion = pVersion;
-    pVersion = NULL;
+    hr = SetVersionString(pVersion, pStorage, wzVersion, cchVersion);
+    VerExitOnFailure(hr, "Failed to copy the version string.");
 
-LExit:
-    ReleaseVerutilVersion(pVersion);
+    pVersion->cchMetadataOffset = cchVersion;
+
+    PackVersionKey(pVersion);
 
+LExit:
     return hr;
 }
 
-
-static int CompareDword(
-    __in const DWORD& dw1,
-    __in const DWORD& dw2
+static HRESULT AddReleaseLabel(
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage,
+    __out VERUTIL_VERSION_RELEASE_LABEL** ppReleaseLabel
     )
 {
-    int nResult = 0;
+    HRESULT hr = S_OK;
+    VERUTIL_VERSION_RELEASE_LABEL* rgReleaseLabels = NULL;
 
-    if (dw1 > dw2)
+    if (pStorage && (!pVersion->rgReleaseLabels || pStorage->rgInlineReleaseLabels == pVersion->rgReleaseLabels))
     {
-        nResult = 1;
+        if (countof(pStorage->rgInlineReleaseLabels) > pVersion->cReleaseLabels)
+        {
+            pVersion->rgReleaseLabels = pStorage->rgInlineReleaseLabels;
+        }
+        else
+        {
+            // Too many labels to keep inline, move them to the heap.
+            hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&rgReleaseLabels), 0, pVersion->cReleaseLabels + 1, sizeof(VERUTIL_VERSION_RELEASE_LABEL), GROW_RELEASE_LABELS);
+            VerExitOnFailure(hr, "Failed to allocate memory for release labels.");
+
+            memcpy_s(rgReleaseLabels, sizeof(VERUTIL_VERSION_RELEASE_LABEL) * pVersion->cReleaseLabels, pStorage->rgInlineReleaseLabels, sizeof(VERUTIL_VERSION_RELEASE_LABEL) * pVersion->cReleaseLabels);
+            pVersion->rgReleaseLabels = rgReleaseLabels;
+        }
     }
-    else if (dw1 < dw2)
+    else
     {
-        nResult = -1;
+        hr = MemEnsureArraySizeForNewItems(reinterpret_cast<LPVOID*>(&pVersion->rgReleaseLabels), pVersion->cReleaseLabels, 1, sizeof(VERUTIL_VERSION_RELEASE_LABEL), GROW_RELEASE_LABELS);
+        VerExitOnFailure(hr, "Failed to allocate memory for release labels.");
     }
 
-    return nResult;
+    *ppReleaseLabel = pVersion->rgReleaseLabels + pVersion->cReleaseLabels;
+    ++pVersion->cReleaseLabels;
+
+LExit:
+    return hr;
 }
 
-static HRESULT CompareReleaseLabel(
-    __in const VERUTIL_VERSION_RELEASE_LABEL* p1,
-    __in LPCWSTR wzVersion1,
-    __in const VERUTIL_VERSION_RELEASE_LABEL* p2,
-    __in LPCWSTR wzVersion2,
-    __out int* pnResult
+static HRESULT SetVersionString(
+    __in VERUTIL_VERSION* pVersion,
+    __in_opt VERUTIL_VERSION_STORAGE* pStorage,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
     )
 {
     HRESULT hr = S_OK;
-    int nResult = 0;
 
-    if (p1 == p2)
+    if (pStorage && countof(pStorage->wzInlineVersion) > cch)
     {
-        ExitFunction();
+        memcpy_s(pStorage->wzInlineVersion, sizeof(pStorage->wzInlineVersion), wz, sizeof(WCHAR) * cch);
+        pStorage->wzInlineVersion[cch] = L'\0';
+
+        pVersion->sczVersion = pStorage->wzInlineVersion;
     }
-    else if (p1 && !p2)
+    else
     {
-        ExitFunction1(nResult = 1);
+        hr = StrAllocString(&pVersion->sczVersion, wz, cch);
     }
-    else if (!p1 && p2)
+
+    return hr;
+}
+
+static void PackVersionKey(
+    __in VERUTIL_VERSION* pVersion
+    )
+{
+    BYTE* pb = pVersion->rgbKey;
+    const BYTE* pbEnd = pVersion->rgbKey + sizeof(pVersion->rgbKey);
+
+    pVersion->fHasKey = FALSE;
+    memset(pVersion->rgbKey, 0, sizeof(pVersion->rgbKey));
+
+    // Invalid versions compare their metadata so they always use the full comparison.
+    if (pVersion->fInvalid)
     {
-        ExitFunction1(nResult = -1);
+        ExitFunction();
     }
 
-    if (p1->fNumeric)
+    PackDword(pVersion->dwMajor, &pb);
+    PackDword(pVersion->dwMinor, &pb);
+    PackDword(pVersion->dwPatch, &pb);
+    PackDword(pVersion->dwRevision, &pb);
+
+    if (!pVersion->cReleaseLabels)
     {
-        if (p2->fNumeric)
-        {
-            nResult = CompareDword(p1->dwValue, p2->dwValue);
-        }
-        else
-        {
-            nResult = -1;
-        }
+        *pb = VERUTIL_KEY_NO_RELEASE_LABELS;
     }
     else
     {
-        if (p2->fNumeric)
+        for (DWORD i = 0; i < pVersion->cReleaseLabels; ++i)
         {
-            nResult = 1;
+            const VERUTIL_VERSION_RELEASE_LABEL* pReleaseLabel = pVersion->rgReleaseLabels + i;
+
+            if (pReleaseLabel->fNumeric)
+            {
+                if (pbEnd - pb < 1 + static_cast<int>(sizeof(DWORD)))
+                {
+                    ExitFunction();
+                }
+
+                *pb++ = VERUTIL_KEY_NUMERIC_LABEL;
+                PackDword(pReleaseLabel->dwValue, &pb);
+            }
+            else
+            {
+                LPCWSTR wzLabel = pVersion->sczVersion + pReleaseLabel->cchLabelOffset;
+
+                if (pbEnd - pb < 2 + pReleaseLabel->cchLabel)
+                {
+                    ExitFunction();
+                }
+
+                *pb++ = VERUTIL_KEY_ALPHANUMERIC_LABEL;
+
+                // Release labels only contain [0-9A-Za-z-] and are compared ignoring case.
+                for (int j = 0; j < pReleaseLabel->cchLabel; ++j)
+                {
+                    WCHAR wch = wzLabel[j];
+                    if (L'a' <= wch && L'z' >= wch)
+                    {
+                        wch = static_cast<WCHAR>(wch - (L'a' - L'A'));
+                    }
+                    else if (VERUTIL_KEY_NO_RELEASE_LABELS >= wch || 0x7F < wch)
+                    {
+                        ExitFunction();
+                    }
+
+                    *pb++ = static_cast<BYTE>(wch);
+                }
+
+                *pb++ = VERUTIL_KEY_END;
+            }
         }
-        else
+
+        if (pb >= pbEnd)
         {
-            hr = CompareVersionSubstring(wzVersion1 + p1->cchLabelOffset, p1->cchLabel, wzVersion2 + p2->cchLabelOffset, p2->cchLabel, &nResult);
+            ExitFunction();
         }
+
+        *pb = VERUTIL_KEY_END;
     }
 
-LExit:
-    *pnResult = nResult;
+    pVersion->fHasKey = TRUE;
 
-    return hr;
+LExit:
+    return;
 }
 
-static HRESULT CompareVersionSubstring(
-    __in LPCWSTR wzString1,
-    __in int cchCount1,
-    __in LPCWSTR wzString2,
-    __in int cchCount2,
-    __out int* pnResult
+static void PackDword(
+    __in DWORD dw,
+    __inout BYTE** ppb
     )
 {
-    HRESULT hr = S_OK;
-    int nResult = 0;
-
-    nResult = ::CompareStringOrdinal(wzString1, cchCount1, wzString2, cchCount2, TRUE);
-    if (!nResult)
-    {
-        VerExitOnLastError(hr, "Failed to compare version substrings");
-    }
+    BYTE* pb = *ppb;
 
-LExit:
-    *pnResult = nResult - 2;
+    pb[0] = static_cast<BYTE>(dw >> 24);
+    pb[1] = static_cast<BYTE>(dw >> 16);
+    pb[2] = static_cast<BYTE>(dw >> 8);
+    pb[3] = static_cast<BYTE>(dw);
 
-    return hr;
+    *ppb = pb + sizeof(DWORD);
 }
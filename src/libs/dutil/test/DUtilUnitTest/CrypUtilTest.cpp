@@ -0,0 +1,164 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+#include "precomp.h"
+
+using namespace System;
+using namespace Xunit;
+using namespace WixInternal::TestSupport;
+
+namespace DutilTests
+{
+    public ref class CrypUtil
+    {
+    public:
+        [Fact]
+        void CrypHashFileHandleExMatchesHashBuffer()
+        {
+            HRESULT hr = S_OK;
+            const DWORD rgcbFiles[] = { 0, 1, 4096, 64 * 1024 - 1, 3 * 1024 * 1024 + 17 };
+            const DWORD rgcbBlocks[] = { 0, 4096, 64 * 1024, CRYP_HASH_FILE_DEFAULT_BLOCK_SIZE, CRYP_HASH_FILE_MAX_BLOCK_SIZE, MAXDWORD };
+            BYTE* pbData = NULL;
+            LPWSTR sczFile = NULL;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            BYTE rgbExpected[SHA512_HASH_LEN] = { };
+            BYTE rgbActual[SHA512_HASH_LEN] = { };
+            DWORD64 qwBytesHashed = 0;
+
+            try
+            {
+                for (DWORD iFile = 0; iFile < countof(rgcbFiles); ++iFile)
+                {
+                    DWORD cbFile = rgcbFiles[iFile];
+
+                    hr = CreateTestFile(cbFile, &sczFile, &pbData);
+                    NativeAssert::Succeeded(hr, "Failed to create {0} byte test file.", cbFile);
+
+                    hr = CrypHashBuffer(pbData, cbFile, PROV_RSA_AES, CALG_SHA_512, rgbExpected, sizeof(rgbExpected));
+                    NativeAssert::Succeeded(hr, "Failed to hash {0} byte buffer.", cbFile);
+
+                    for (DWORD iBlock = 0; iBlock < countof(rgcbBlocks); ++iBlock)
+                    {
+                        hFile = ::CreateFileW(sczFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                        Assert::True(INVALID_HANDLE_VALUE != hFile);
+
+                        hr = CrypHashFileHandleEx(hFile, PROV_RSA_AES, CALG_SHA_512, rgcbBlocks[iBlock], rgbActual, sizeof(rgbActual), &qwBytesHashed);
+                        NativeAssert::Succeeded(hr, "Failed to hash {0} byte file with {1} byte blocks.", cbFile, rgcbBlocks[iBlock]);
+
+                        Assert::Equal<DWORD64>(cbFile, qwBytesHashed);
+                        Assert::True(0 == memcmp(rgbExpected, rgbActual, sizeof(rgbExpected)));
+
+                        ReleaseFileHandle(hFile);
+                    }
+
+                    ::DeleteFileW(sczFile);
+                    ReleaseNullStr(sczFile);
+                    ReleaseNullMem(pbData);
+                }
+            }
+            finally
+            {
+                ReleaseFileHandle(hFile);
+                if (sczFile)
+                {
+                    ::DeleteFileW(sczFile);
+                }
+                ReleaseStr(sczFile);
+                ReleaseMem(pbData);
+            }
+        }
+
+        [Fact]
+        void CrypHashUpdateInPiecesMatchesHashBuffer()
+        {
+            HRESULT hr = S_OK;
+            const DWORD cbData = 256 * 1024 + 7;
+            const DWORD rgcbPieces[] = { 1, 4096, 64 * 1024, cbData };
+            BYTE* pbData = NULL;
+            CRYP_HASH_HANDLE hHash = NULL;
+            BYTE rgbExpected[SHA512_HASH_LEN] = { };
+            BYTE rgbActual[SHA512_HASH_LEN] = { };
+            DWORD64 qwBytesHashed = 0;
+
+            try
+            {
+                pbData = static_cast<BYTE*>(MemAlloc(cbData, FALSE));
+                Assert::True(NULL != pbData);
+
+                for (DWORD i = 0; i < cbData; ++i)
+                {
+                    pbData[i] = static_cast<BYTE>(i * 7 + (i >> 8));
+                }
+
+                hr = CrypHashBuffer(pbData, cbData, PROV_RSA_AES, CALG_SHA_512, rgbExpected, sizeof(rgbExpected));
+                NativeAssert::Succeeded(hr, "Failed to hash buffer.");
+
+                for (DWORD iPiece = 0; iPiece < countof(rgcbPieces); ++iPiece)
+                {
+                    hr = CrypHashCreate(PROV_RSA_AES, CALG_SHA_512, &hHash);
+                    NativeAssert::Succeeded(hr, "Failed to create hash.");
+
+                    for (DWORD cbTotal = 0; cbTotal < cbData; cbTotal += rgcbPieces[iPiece])
+                    {
+                        DWORD cbPiece = cbData - cbTotal < rgcbPieces[iPiece] ? cbData - cbTotal : rgcbPieces[iPiece];
+
+                        hr = CrypHashUpdate(hHash, pbData + cbTotal, cbPiece);
+                        NativeAssert::Succeeded(hr, "Failed to hash {0} byte piece.", cbPiece);
+                    }
+
+                    hr = CrypHashGetValue(hHash, rgbActual, sizeof(rgbActual), &qwBytesHashed);
+                    NativeAssert::Succeeded(hr, "Failed to get hash value.");
+
+                    Assert::Equal<DWORD64>(cbData, qwBytesHashed);
+                    Assert::True(0 == memcmp(rgbExpected, rgbActual, sizeof(rgbExpected)));
+
+                    ReleaseNullCrypHash(hHash);
+                }
+            }
+            finally
+            {
+                ReleaseCrypHash(hHash);
+                ReleaseMem(pbData);
+            }
+        }
+
+    private:
+        HRESULT CreateTestFile(DWORD cbFile, LPWSTR* psczFile, BYTE** ppbData)
+        {
+            HRESULT hr = S_OK;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            BYTE* pbData = NULL;
+            DWORD cbWritten = 0;
+            const DWORD cbWriteChunk = 16 * 1024 * 1024;
+
+            pbData = static_cast<BYTE*>(MemAlloc(cbFile ? cbFile : 1, FALSE));
+            ExitOnNull(pbData, hr, E_OUTOFMEMORY, "Failed to allocate test data.");
+
+            for (DWORD i = 0; i < cbFile; ++i)
+            {
+                pbData[i] = static_cast<BYTE>(i * 31 + (i >> 12));
+            }
+
+            hr = FileCreateTemp(L"CRY", L"bin", psczFile, &hFile);
+            ExitOnFailure(hr, "Failed to create temp file.");
+
+            for (DWORD cbTotal = 0; cbTotal < cbFile; cbTotal += cbWritten)
+            {
+                DWORD cbWrite = cbFile - cbTotal < cbWriteChunk ? cbFile - cbTotal : cbWriteChunk;
+
+                if (!::WriteFile(hFile, pbData + cbTotal, cbWrite, &cbWritten, NULL))
+                {
+                    ExitWithLastError(hr, "Failed to write temp file.");
+                }
+            }
+
+            *ppbData = pbData;
+            pbData = NULL;
+
+        LExit:
+            ReleaseFileHandle(hFile);
+            ReleaseMem(pbData);
+
+            return hr;
+        }
+    };
+}
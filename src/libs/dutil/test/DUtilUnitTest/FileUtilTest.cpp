@@ -6,6 +6,12 @@ using namespace System;
 using namespace Xunit;
 using namespace WixInternal::TestSupport;
 
+static HRESULT CALLBACK CountCopiedData(
+    __in_bcount(cbData) const BYTE* pbData,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    );
+
 namespace DutilTests
 {
     public ref class FileUtil
@@ -49,7 +55,149 @@ namespace DutilTests
         //     }
         // }
 
+        [Fact]
+        void FileCopyUsingHandlesWithProgressExCopiesEveryBlock()
+        {
+            HRESULT hr = S_OK;
+            const DWORD rgcbFiles[] = { 0, 1, 4097, 3 * 1024 * 1024 + 17 };
+            const DWORD rgcbBlocks[] = { 0, 4096, 64 * 1024, FILE_COPY_MAX_BLOCK_SIZE + 1 };
+            BYTE* pbSource = NULL;
+            BYTE* pbTarget = NULL;
+            SIZE_T cbTarget = 0;
+            LPWSTR sczSource = NULL;
+            LPWSTR sczTarget = NULL;
+            HANDLE hSource = INVALID_HANDLE_VALUE;
+            HANDLE hTarget = INVALID_HANDLE_VALUE;
+            DWORD64 cbCopied = 0;
+
+            try
+            {
+                for (DWORD iFile = 0; iFile < countof(rgcbFiles); ++iFile)
+                {
+                    DWORD cbFile = rgcbFiles[iFile];
+
+                    hr = CreateTestFile(cbFile, &sczSource, &pbSource);
+                    NativeAssert::Succeeded(hr, "Failed to create {0} byte test file.", cbFile);
+
+                    for (DWORD iBlock = 0; iBlock < countof(rgcbBlocks); ++iBlock)
+                    {
+                        hSource = ::CreateFileW(sczSource, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                        Assert::True(INVALID_HANDLE_VALUE != hSource);
+
+                        hr = FileCreateTemp(L"FIL", L"bin", &sczTarget, &hTarget);
+                        NativeAssert::Succeeded(hr, "Failed to create target file.");
+
+                        cbCopied = 0;
+                        hr = FileCopyUsingHandlesWithProgressEx(hSource, hTarget, 0, rgcbBlocks[iBlock], CountCopiedData, &cbCopied, NULL, NULL);
+                        NativeAssert::Succeeded(hr, "Failed to copy {0} byte file with {1} byte blocks.", cbFile, rgcbBlocks[iBlock]);
+                        Assert::Equal<DWORD64>(cbFile, cbCopied);
+
+                        ReleaseFileHandle(hTarget);
+                        ReleaseFileHandle(hSource);
+
+                        hr = FileRead(&pbTarget, &cbTarget, sczTarget);
+                        NativeAssert::Succeeded(hr, "Failed to read copied file.");
+                        Assert::Equal<SIZE_T>(cbFile, cbTarget);
+                        Assert::True(0 == memcmp(pbSource, pbTarget, cbFile));
+
+                        ::DeleteFileW(sczTarget);
+                        ReleaseNullStr(sczTarget);
+                        ReleaseNullMem(pbTarget);
+                    }
+
+                    ::DeleteFileW(sczSource);
+                    ReleaseNullStr(sczSource);
+                    ReleaseNullMem(pbSource);
+                }
+            }
+            finally
+            {
+                ReleaseFileHandle(hTarget);
+                ReleaseFileHandle(hSource);
+                if (sczTarget)
+                {
+                    ::DeleteFileW(sczTarget);
+                }
+                if (sczSource)
+                {
+                    ::DeleteFileW(sczSource);
+                }
+                ReleaseStr(sczTarget);
+                ReleaseStr(sczSource);
+                ReleaseMem(pbTarget);
+                ReleaseMem(pbSource);
+            }
+        }
+
+        [Fact]
+        void FileSetAllocationSizeKeepsEndOfFile()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczFile = NULL;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            LONGLONG llSize = 0;
+
+            try
+            {
+                hr = FileCreateTemp(L"FIL", L"bin", &sczFile, &hFile);
+                NativeAssert::Succeeded(hr, "Failed to create temp file.");
+
+                hr = FileSetAllocationSize(hFile, 16 * 1024 * 1024);
+                NativeAssert::Succeeded(hr, "Failed to set allocation size.");
+
+                hr = FileSizeByHandle(hFile, &llSize);
+                NativeAssert::Succeeded(hr, "Failed to get file size.");
+                Assert::Equal<LONGLONG>(0, llSize);
+
+                hr = FileWriteHandle(hFile, reinterpret_cast<LPCBYTE>("preallocated"), 12);
+                NativeAssert::Succeeded(hr, "Failed to write to file.");
+
+                hr = FileSizeByHandle(hFile, &llSize);
+                NativeAssert::Succeeded(hr, "Failed to get file size.");
+                Assert::Equal<LONGLONG>(12, llSize);
+            }
+            finally
+            {
+                ReleaseFileHandle(hFile);
+                if (sczFile)
+                {
+                    ::DeleteFileW(sczFile);
+                }
+                ReleaseStr(sczFile);
+            }
+        }
+
     private:
+        HRESULT CreateTestFile(DWORD cbFile, LPWSTR* psczFile, BYTE** ppbData)
+        {
+            HRESULT hr = S_OK;
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            BYTE* pbData = NULL;
+
+            pbData = static_cast<BYTE*>(MemAlloc(cbFile ? cbFile : 1, FALSE));
+            ExitOnNull(pbData, hr, E_OUTOFMEMORY, "Failed to allocate test data.");
+
+            for (DWORD i = 0; i < cbFile; ++i)
+            {
+                pbData[i] = static_cast<BYTE>(i * 31 + (i >> 12));
+            }
+
+            hr = FileCreateTemp(L"FIL", L"bin", psczFile, &hFile);
+            ExitOnFailure(hr, "Failed to create temp file.");
+
+            hr = FileWriteHandle(hFile, pbData, cbFile);
+            ExitOnFailure(hr, "Failed to write temp file.");
+
+            *ppbData = pbData;
+            pbData = NULL;
+
+        LExit:
+            ReleaseFileHandle(hFile);
+            ReleaseMem(pbData);
+
+            return hr;
+        }
+
         void TestFile(LPWSTR wzDir, LPCWSTR wzTempDir, LPWSTR wzFileName, size_t cbExpectedStringLength, FILE_ENCODING feExpectedEncoding)
         {
             HRESULT hr = S_OK;
@@ -123,3 +271,13 @@ namespace DutilTests
         }
     };
 }
+
+static HRESULT CALLBACK CountCopiedData(
+    __in_bcount(cbData) const BYTE* /*pbData*/,
+    __in DWORD cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    *static_cast<DWORD64*>(pvContext) += cbData;
+    return S_OK;
+}
@@ -6,6 +6,56 @@ using namespace System;
 using namespace Xunit;
 using namespace WixInternal::TestSupport;
 
+static int __cdecl VerUtilTests_CompareVersionPointers(
+    __in void* pvContext,
+    __in const void* pvLeft,
+    __in const void* pvRight
+    );
+
+// the versions the tests below parse one at a time.
+static LPCWSTR rgwzVersionCorpus[] =
+{
+    L"",
+    L".",
+    L"0",
+    L"0-2",
+    L"0.0.1-a",
+    L"0.01-a.1",
+    L"0.1-a.b.0",
+    L"0.1.0-a.1",
+    L"0.1.0-a.b.000",
+    L"1-2",
+    L"1.",
+    L"1.0-19",
+    L"1.0-2.0",
+    L"1.2.3",
+    L"1.2.3+abc",
+    L"1.2.3+abcd",
+    L"1.2.3+xyz",
+    L"1.2.3.-abcd",
+    L"1.2.3.0",
+    L"1.2.3.4",
+    L"1.2.3.4+abc123",
+    L"1.2.3.abcd",
+    L"10-2",
+    L"10-4.@",
+    L"10.-2.0",
+    L"10.-4.0",
+    L"10.20.30.40",
+    L"2.1.",
+    L"3.2.1.",
+    L"4.3.2.1.",
+    L"4294967295.4294967295.4294967295.4294967295",
+    L"4294967296.4294967296.4294967296.4294967296",
+    L"5-.",
+    L"6-a.",
+    L"V10.20.30.40",
+    L"v1.2.3.4-a.b.c.d.5.+abc123",
+    L"v10.20.30.40",
+    L"v10.20.30.40-abc",
+    L"vvv",
+};
+
 namespace DutilTests
 {
     public ref class VerUtil
@@ -1159,6 +1209,234 @@ namespace DutilTests
             }
         }
 
+        [Fact]
+        void VerCompareVersionsPackedKeysMatchFullComparison()
+        {
+            HRESULT hr = S_OK;
+            const DWORD cVersions = 400;
+            VERUTIL_VERSION* rgpKeyed[cVersions] = { };
+            VERUTIL_VERSION* rgpUnkeyed[cVersions] = { };
+            LPWSTR sczVersion = NULL;
+            int nKeyed = 0;
+            int nUnkeyed = 0;
+            DWORD cKeyed = 0;
+
+            try
+            {
+                ::srand(0x5EED);
+
+                for (DWORD i = 0; i < cVersions; ++i)
+                {
+                    GenerateRandomVersion(&sczVersion);
+
+                    hr = VerParseVersion(sczVersion, 0, FALSE, &rgpKeyed[i]);
+                    NativeAssert::Succeeded(hr, "Failed to parse version '{0}'", sczVersion);
+
+                    hr = VerCopyVersion(rgpKeyed[i], &rgpUnkeyed[i]);
+                    NativeAssert::Succeeded(hr, "Failed to copy version '{0}'", sczVersion);
+
+                    rgpUnkeyed[i]->fHasKey = FALSE;
+
+                    if (rgpKeyed[i]->fHasKey)
+                    {
+                        ++cKeyed;
+                    }
+                }
+
+                // most of the generated versions should take the packed path
+                Assert::True(cKeyed > cVersions / 2);
+
+                for (DWORD i = 0; i < cVersions; ++i)
+                {
+                    for (DWORD j = 0; j < cVersions; ++j)
+                    {
+                        hr = VerCompareParsedVersions(rgpKeyed[i], rgpKeyed[j], &nKeyed);
+                        NativeAssert::Succeeded(hr, "Failed to compare versions '{0}' and '{1}'", rgpKeyed[i]->sczVersion, rgpKeyed[j]->sczVersion);
+
+                        hr = VerCompareParsedVersions(rgpUnkeyed[i], rgpUnkeyed[j], &nUnkeyed);
+                        NativeAssert::Succeeded(hr, "Failed to compare versions '{0}' and '{1}'", rgpUnkeyed[i]->sczVersion, rgpUnkeyed[j]->sczVersion);
+
+                        if (nKeyed != nUnkeyed)
+                        {
+                            Assert::True(false, String::Format("Packed comparison of '{0}' and '{1}' returned {2} instead of {3}", gcnew String(rgpKeyed[i]->sczVersion), gcnew String(rgpKeyed[j]->sczVersion), nKeyed, nUnkeyed));
+                        }
+                    }
+                }
+            }
+            finally
+            {
+                for (DWORD i = 0; i < cVersions; ++i)
+                {
+                    ReleaseVerutilVersion(rgpKeyed[i]);
+                    ReleaseVerutilVersion(rgpUnkeyed[i]);
+                }
+                ReleaseStr(sczVersion);
+            }
+        }
+
+        [Fact]
+        void VerCompareVersionsSortTest()
+        {
+            HRESULT hr = S_OK;
+            const DWORD cVersions = 1000;
+            VERUTIL_VERSION** rgpKeyed = NULL;
+            VERUTIL_VERSION** rgpUnkeyed = NULL;
+            LPWSTR sczVersion = NULL;
+            int nResult = 0;
+
+            try
+            {
+                rgpKeyed = static_cast<VERUTIL_VERSION**>(MemAlloc(sizeof(VERUTIL_VERSION*) * cVersions, TRUE));
+                Assert::True(NULL != rgpKeyed);
+
+                rgpUnkeyed = static_cast<VERUTIL_VERSION**>(MemAlloc(sizeof(VERUTIL_VERSION*) * cVersions, TRUE));
+                Assert::True(NULL != rgpUnkeyed);
+
+                ::srand(0xB3AC);
+
+                for (DWORD i = 0; i < cVersions; ++i)
+                {
+                    GenerateRandomVersion(&sczVersion);
+
+                    hr = VerParseVersion(sczVersion, 0, FALSE, &rgpKeyed[i]);
+                    NativeAssert::Succeeded(hr, "Failed to parse version '{0}'", sczVersion);
+
+                    hr = VerCopyVersion(rgpKeyed[i], &rgpUnkeyed[i]);
+                    NativeAssert::Succeeded(hr, "Failed to copy version '{0}'", sczVersion);
+
+                    rgpUnkeyed[i]->fHasKey = FALSE;
+                }
+
+                qsort_s(rgpUnkeyed, cVersions, sizeof(VERUTIL_VERSION*), VerUtilTests_CompareVersionPointers, NULL);
+                qsort_s(rgpKeyed, cVersions, sizeof(VERUTIL_VERSION*), VerUtilTests_CompareVersionPointers, NULL);
+
+                // both sorts must agree on the order, even if equal versions landed in a different order
+                for (DWORD i = 0; i < cVersions; ++i)
+                {
+                    hr = VerCompareParsedVersions(rgpKeyed[i], rgpUnkeyed[i], &nResult);
+                    NativeAssert::Succeeded(hr, "Failed to compare versions '{0}' and '{1}'", rgpKeyed[i]->sczVersion, rgpUnkeyed[i]->sczVersion);
+                    Assert::Equal(0, nResult);
+                }
+            }
+            finally
+            {
+                for (DWORD i = 0; i < cVersions; ++i)
+                {
+                    if (rgpKeyed)
+                    {
+                        ReleaseVerutilVersion(rgpKeyed[i]);
+                    }
+                    if (rgpUnkeyed)
+                    {
+                        ReleaseVerutilVersion(rgpUnkeyed[i]);
+                    }
+                }
+                ReleaseMem(rgpKeyed);
+                ReleaseMem(rgpUnkeyed);
+                ReleaseStr(sczVersion);
+            }
+        }
+
+        [Fact]
+        void VerParseVersionInPlaceMatchesHeapParse()
+        {
+            HRESULT hr = S_OK;
+            VERUTIL_VERSION* pVersion = NULL;
+            VERUTIL_VERSION_STORAGE storage = { };
+            int nResult = 0;
+
+            try
+            {
+                for (DWORD i = 0; i < countof(rgwzVersionCorpus); ++i)
+                {
+                    LPCWSTR wzVersion = rgwzVersionCorpus[i];
+
+                    hr = VerParseVersion(wzVersion, 0, FALSE, &pVersion);
+                    NativeAssert::Succeeded(hr, "Failed to parse version '{0}'", wzVersion);
+
+                    hr = VerParseVersionInPlace(wzVersion, 0, FALSE, &storage);
+                    NativeAssert::Succeeded(hr, "Failed to parse version '{0}' in place", wzVersion);
+
+                    NativeAssert::StringEqual(pVersion->sczVersion, storage.version.sczVersion);
+                    Assert::Equal<DWORD>(pVersion->dwMajor, storage.version.dwMajor);
+                    Assert::Equal<DWORD>(pVersion->dwMinor, storage.version.dwMinor);
+                    Assert::Equal<DWORD>(pVersion->dwPatch, storage.version.dwPatch);
+                    Assert::Equal<DWORD>(pVersion->dwRevision, storage.version.dwRevision);
+                    Assert::Equal<DWORD>(pVersion->cReleaseLabels, storage.version.cReleaseLabels);
+                    Assert::Equal<SIZE_T>(pVersion->cchMetadataOffset, storage.version.cchMetadataOffset);
+                    Assert::Equal<BOOL>(pVersion->fInvalid, storage.version.fInvalid);
+                    Assert::Equal<BOOL>(pVersion->fHasKey, storage.version.fHasKey);
+
+                    TestVerutilCompareParsedVersions(pVersion, &storage.version, 0);
+
+                    // nothing in the corpus is big enough to need the heap
+                    Assert::True(storage.version.sczVersion == storage.wzInlineVersion);
+                    Assert::True(!storage.version.rgReleaseLabels || storage.version.rgReleaseLabels == storage.rgInlineReleaseLabels);
+
+                    ReleaseVerutilVersion(pVersion);
+                    VerUninitializeVersionStorage(&storage);
+                }
+
+                // too many labels and too long a string move to the heap but still parse the same
+                LPCWSTR wzLong = L"1.2.3.4-a.b.c.d.e.f.g.h+metadata-that-does-not-fit-in-the-inline-buffer";
+
+                hr = VerParseVersion(wzLong, 0, FALSE, &pVersion);
+                NativeAssert::Succeeded(hr, "Failed to parse version '{0}'", wzLong);
+
+                hr = VerParseVersionInPlace(wzLong, 0, FALSE, &storage);
+                NativeAssert::Succeeded(hr, "Failed to parse version '{0}' in place", wzLong);
+
+                Assert::True(storage.version.sczVersion != storage.wzInlineVersion);
+                Assert::True(storage.version.rgReleaseLabels != storage.rgInlineReleaseLabels);
+                Assert::Equal<DWORD>(8, storage.version.cReleaseLabels);
+
+                hr = VerCompareParsedVersions(pVersion, &storage.version, &nResult);
+                NativeAssert::Succeeded(hr, "Failed to compare version '{0}'", wzLong);
+                Assert::Equal(0, nResult);
+
+                ReleaseVerutilVersion(pVersion);
+                VerUninitializeVersionStorage(&storage);
+
+                hr = VerVersionFromQwordInPlace(MAKEQWORDVERSION(65535, 65535, 65535, 65535), &storage);
+                NativeAssert::Succeeded(hr, "Failed to create version from QWORD in place");
+                NativeAssert::StringEqual(L"65535.65535.65535.65535", storage.version.sczVersion);
+                Assert::True(storage.version.sczVersion == storage.wzInlineVersion);
+                Assert::True(storage.version.fHasKey);
+            }
+            finally
+            {
+                ReleaseVerutilVersion(pVersion);
+                VerUninitializeVersionStorage(&storage);
+            }
+        }
+
+        [Fact]
+        void VerParseVersionInPlaceAllocationTest()
+        {
+            HRESULT hr = S_OK;
+            VERUTIL_VERSION_STORAGE storage = { };
+            DWORD cInPlaceAllocations = 0;
+
+            try
+            {
+                // the corpus fits the inline storage, so parsing in place leaves nothing on the heap
+                for (DWORD i = 0; i < countof(rgwzVersionCorpus); ++i)
+                {
+                    hr = VerParseVersionInPlace(rgwzVersionCorpus[i], 0, FALSE, &storage);
+                    NativeAssert::Succeeded(hr, "Failed to parse version '{0}' in place", rgwzVersionCorpus[i]);
+
+                    cInPlaceAllocations += (storage.version.sczVersion != storage.wzInlineVersion ? 1 : 0) + (storage.version.rgReleaseLabels && storage.version.rgReleaseLabels != storage.rgInlineReleaseLabels ? 1 : 0);
+                    VerUninitializeVersionStorage(&storage);
+                }
+
+                Assert::Equal<DWORD>(0, cInPlaceAllocations);
+            }
+            finally
+            {
+                VerUninitializeVersionStorage(&storage);
+            }
+        }
+
     private:
         void TestVerutilCompareParsedVersions(VERUTIL_VERSION* pVersion1, VERUTIL_VERSION* pVersion2, int nExpectedResult)
         {
@@ -1175,5 +1453,57 @@ namespace DutilTests
 
             Assert::Equal(nExpectedResult, -nResult);
         }
+
+        void GenerateRandomVersion(LPWSTR* psczVersion)
+        {
+            HRESULT hr = S_OK;
+            LPCWSTR rgwzParts[] = { L"0", L"1", L"2", L"01", L"10", L"65535", L"4294967295", L"4294967296" };
+            LPCWSTR rgwzLabels[] = { L"alpha", L"Alpha", L"beta", L"rc", L"RC", L"0", L"1", L"01", L"2", L"10", L"a-b", L"A-B", L"x", L"preview", L"99999999999", L"averyveryverylonglabel" };
+            LPCWSTR rgwzInvalid[] = { L"_", L".", L"..", L"-", L"+", L"*x" };
+            DWORD cParts = 1 + ::rand() % 4;
+            DWORD cLabels = ::rand() % 4 ? ::rand() % 4 : 0;
+
+            hr = StrAllocString(psczVersion, 0 == ::rand() % 8 ? L"v" : L"", 0);
+            NativeAssert::Succeeded(hr, "Failed to start version.");
+
+            for (DWORD i = 0; i < cParts; ++i)
+            {
+                hr = StrAllocConcatFormatted(psczVersion, L"%ls%ls", i ? L"." : L"", rgwzParts[::rand() % countof(rgwzParts)]);
+                NativeAssert::Succeeded(hr, "Failed to append version part.");
+            }
+
+            for (DWORD i = 0; i < cLabels; ++i)
+            {
+                hr = StrAllocConcatFormatted(psczVersion, L"%ls%ls", i ? L"." : L"-", rgwzLabels[::rand() % countof(rgwzLabels)]);
+                NativeAssert::Succeeded(hr, "Failed to append release label.");
+            }
+
+            if (0 == ::rand() % 4)
+            {
+                hr = StrAllocConcatFormatted(psczVersion, L"+meta%u", ::rand() % 3);
+                NativeAssert::Succeeded(hr, "Failed to append metadata.");
+            }
+
+            if (0 == ::rand() % 10)
+            {
+                hr = StrAllocConcatFormatted(psczVersion, L"%ls%u", rgwzInvalid[::rand() % countof(rgwzInvalid)], ::rand() % 3);
+                NativeAssert::Succeeded(hr, "Failed to append invalid content.");
+            }
+        }
     };
 }
+
+static int __cdecl VerUtilTests_CompareVersionPointers(
+    __in void* /*pvContext*/,
+    __in const void* pvLeft,
+    __in const void* pvRight
+    )
+{
+    VERUTIL_VERSION* pLeft = *static_cast<VERUTIL_VERSION* const*>(pvLeft);
+    VERUTIL_VERSION* pRight = *static_cast<VERUTIL_VERSION* const*>(pvRight);
+    int nResult = 0;
+
+    VerCompareParsedVersions(pLeft, pRight, &nResult);
+
+    return nResult;
+}
@@ -15,6 +15,7 @@
 #include <verutil.h>
 #include <apputil.h>
 #include <atomutil.h>
+#include <cryputil.h>
 #include <dictutil.h>
 #include <dirutil.h>
 #include <envutil.h>
@@ -2,6 +2,7 @@
 
 namespace WixToolsetTest.BurnE2E
 {
+    using Microsoft.Win32;
     using WixTestTools;
     using Xunit.Abstractions;
 
@@ -42,5 +43,87 @@ namespace WixToolsetTest.BurnE2E
             packageA.VerifyInstalled(true);
             packageB.VerifyInstalled(true);
         }
+
+        [RuntimeFact]
+        public void CanExtractMultipleContainersAtOnce()
+        {
+            var packageA = this.CreatePackageInstaller("PackageA");
+            var packageB = this.CreatePackageInstaller("PackageB");
+            var packageC = this.CreatePackageInstaller("PackageC");
+            var packageD = this.CreatePackageInstaller("PackageD");
+            var bundleC = this.CreateBundleInstaller("BundleC");
+            var policyPath = bundleC.GetFullBurnPolicyRegistryPath();
+
+            // Extract the containers one at a time first, then several at the same time.
+            this.InstallWithExtractionThreads(bundleC, policyPath, 0, packageA, packageB, packageC, packageD);
+            this.InstallWithExtractionThreads(bundleC, policyPath, null, packageA, packageB, packageC, packageD);
+        }
+
+        private void InstallWithExtractionThreads(BundleInstaller bundle, string policyPath, int? extractionThreads, params PackageInstaller[] packages)
+        {
+            var deletePolicyKey = false;
+            object originalPolicyValue = null;
+
+            foreach (var package in packages)
+            {
+                package.VerifyInstalled(false);
+            }
+
+            try
+            {
+                var policyKey = Registry.LocalMachine.OpenSubKey(policyPath, writable: true);
+                if (policyKey == null)
+                {
+                    policyKey = Registry.LocalMachine.CreateSubKey(policyPath, writable: true);
+                    deletePolicyKey = true;
+                }
+
+                using (policyKey)
+                {
+                    originalPolicyValue = policyKey.GetValue("CacheExtractionThreads");
+                    if (extractionThreads.HasValue)
+                    {
+                        policyKey.SetValue("CacheExtractionThreads", extractionThreads.Value, RegistryValueKind.DWord);
+                    }
+                    else if (originalPolicyValue != null)
+                    {
+                        policyKey.DeleteValue("CacheExtractionThreads");
+                    }
+                }
+
+                bundle.Install();
+
+                bundle.VerifyRegisteredAndInPackageCache();
+
+                foreach (var package in packages)
+                {
+                    package.VerifyInstalled(true);
+                }
+
+                bundle.Uninstall();
+                bundle.VerifyUnregisteredAndRemovedFromPackageCache();
+            }
+            finally
+            {
+                if (deletePolicyKey)
+                {
+                    Registry.LocalMachine.DeleteSubKeyTree(policyPath);
+                }
+                else
+                {
+                    using (var policyKey = Registry.LocalMachine.CreateSubKey(policyPath, writable: true))
+                    {
+                        if (originalPolicyValue != null)
+                        {
+                            policyKey.SetValue("CacheExtractionThreads", originalPolicyValue);
+                        }
+                        else
+                        {
+                            policyKey.DeleteValue("CacheExtractionThreads", false);
+                        }
+                    }
+                }
+            }
+        }
     }
 }